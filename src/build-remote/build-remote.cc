@@ -22,9 +22,6 @@
 using namespace nix;
 using std::cin;
 
-static void handleAlarm(int sig) {
-}
-
 std::string escapeUri(std::string uri)
 {
     std::replace(uri.begin(), uri.end(), '/', '_');
@@ -33,6 +30,46 @@ std::string escapeUri(std::string uri)
 
 static string currentLoad;
 
+/* Return, for each suitable machine, the number of bytes of the
+   closure of the inputs of `drvPath' that it doesn't have yet. */
+static std::map<std::string, uint64_t> getMissingInputBytes(
+    Store & store, const StorePath & drvPath, const std::vector<Machine *> & candidates)
+{
+    std::map<std::string, uint64_t> res;
+
+    StorePathSet inputs;
+    try {
+        auto drv = store.readDerivation(drvPath);
+        StorePathSet inputs2 = drv.inputSrcs;
+        for (auto & [inputDrv, wantedOutputs] : drv.inputDrvs)
+            for (auto & [outputName, outputPath] : store.queryPartialDerivationOutputMap(inputDrv))
+                if (outputPath && wantedOutputs.count(outputName))
+                    inputs2.insert(*outputPath);
+        store.computeFSClosure(inputs2, inputs);
+    } catch (Error & e) {
+        debug("cannot determine the inputs of '%s': %s", store.printStorePath(drvPath), e.msg());
+        return res;
+    }
+
+    for (auto m : candidates) {
+        if (!m->enabled) continue;
+        try {
+            auto remoteStore = m->openStore();
+            auto valid = remoteStore->queryValidPaths(inputs);
+            uint64_t bytes = 0;
+            for (auto & path : inputs)
+                if (!valid.count(path))
+                    bytes += store.queryPathInfo(path)->narSize;
+            debug("remote machine '%s' is missing %d bytes of inputs", m->storeUri, bytes);
+            res.insert_or_assign(m->storeUri, bytes);
+        } catch (Error & e) {
+            debug("cannot query inputs on '%s': %s", m->storeUri, e.msg());
+        }
+    }
+
+    return res;
+}
+
 static AutoCloseFD openSlotLock(const Machine & m, uint64_t slot)
 {
     return openLockFile(fmt("%s/%s-%d", currentLoad, escapeUri(m.storeUri), slot), true);
@@ -95,6 +132,8 @@ static int main_build_remote(int argc, char * * argv)
             return 0;
         }
 
+        MachineIndex machineIndex(machines);
+
         std::optional<StorePath> drvPath;
         string storeUri;
 
@@ -115,6 +154,20 @@ static int main_build_remote(int argc, char * * argv)
                      || settings.extraPlatforms.get().count(neededSystem) > 0)
                  &&  allSupportedLocally(*store, requiredFeatures);
 
+            auto & candidates = machineIndex.get(neededSystem, requiredFeatures);
+
+            /* Optionally prefer machines that already have most of the
+               inputs. Query this before taking the main lock, since it
+               requires connecting to every machine. */
+            std::map<std::string, uint64_t> missingInputBytes;
+            if (settings.buildersPreferLocality)
+                missingInputBytes = getMissingInputBytes(*store, *drvPath, candidates);
+
+            auto missingBytes = [&](const Machine & m) {
+                auto i = missingInputBytes.find(m.storeUri);
+                return i == missingInputBytes.end() ? std::numeric_limits<uint64_t>::max() : i->second;
+            };
+
             /* Error ignored here, will be caught later */
             mkdir(currentLoad.c_str(), 0777);
 
@@ -127,14 +180,11 @@ static int main_build_remote(int argc, char * * argv)
 
                 Machine * bestMachine = nullptr;
                 uint64_t bestLoad = 0;
-                for (auto & m : machines) {
+                for (auto mp : candidates) {
+                    auto & m(*mp);
                     debug("considering building on remote machine '%s'", m.storeUri);
 
-                    if (m.enabled && std::find(m.systemTypes.begin(),
-                            m.systemTypes.end(),
-                            neededSystem) != m.systemTypes.end() &&
-                        m.allSupported(requiredFeatures) &&
-                        m.mandatoryMet(requiredFeatures)) {
+                    if (m.enabled) {
                         rightType = true;
                         AutoCloseFD free;
                         uint64_t load = 0;
@@ -154,6 +204,8 @@ static int main_build_remote(int argc, char * * argv)
                         bool best = false;
                         if (!bestSlotLock) {
                             best = true;
+                        } else if (missingBytes(m) != missingBytes(*bestMachine)) {
+                            best = missingBytes(m) < missingBytes(*bestMachine);
                         } else if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
                             best = true;
                         } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
@@ -253,27 +305,32 @@ connected:
         auto inputs = readStrings<PathSet>(source);
         auto wantedOutputs = readStrings<StringSet>(source);
 
-        AutoCloseFD uploadLock = openLockFile(currentLoad + "/" + escapeUri(storeUri) + ".upload-lock", true);
-
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("waiting for the upload lock to '%s'", storeUri));
-
-            auto old = signal(SIGALRM, handleAlarm);
-            alarm(15 * 60);
-            if (!lockFile(uploadLock.get(), ltWrite, true))
-                printError("somebody is hogging the upload lock for '%s', continuing...");
-            alarm(0);
-            signal(SIGALRM, old);
-        }
-
         auto substitute = settings.buildersUseSubstitutes ? Substitute : NoSubstitute;
 
         {
             Activity act(*logger, lvlTalkative, actUnknown, fmt("copying dependencies to '%s'", storeUri));
-            copyPaths(store, ref<Store>(sshStore), store->parseStorePathSet(inputs), NoRepair, NoCheckSigs, substitute);
-        }
 
-        uploadLock = -1;
+            /* Lock the inputs that the remote machine doesn't have yet,
+               so that concurrent builds on the same machine don't upload
+               the same paths, while uploads of unrelated paths can
+               proceed in parallel. copyPaths() checks validity again
+               after we've acquired the locks. */
+            auto inputPaths = store->parseStorePathSet(inputs);
+            auto validPaths = sshStore->queryValidPaths(inputPaths);
+
+            Path uploadLockDir = currentLoad + "/" + escapeUri(storeUri) + "-upload";
+            createDirs(uploadLockDir);
+
+            PathSet lockPaths;
+            for (auto & path : inputPaths)
+                if (!validPaths.count(path))
+                    lockPaths.insert(uploadLockDir + "/" + std::string(path.hashPart()));
+
+            PathLocks uploadLocks(lockPaths, fmt("waiting for concurrent uploads to '%s'", storeUri));
+            uploadLocks.setDeletion(true);
+
+            copyPaths(store, ref<Store>(sshStore), inputPaths, NoRepair, NoCheckSigs, substitute);
+        }
 
         auto drv = store->readDerivation(*drvPath);
         auto outputHashes = staticOutputHashes(*store, drv);
@@ -0,0 +1,74 @@
+#include "build-queue.hh"
+#include "globals.hh"
+
+namespace nix {
+
+BuildQueue::BuildQueue(BuildFun build)
+    : build(std::move(build))
+    , builder([this]() { run(); })
+{
+}
+
+BuildQueue::~BuildQueue()
+{
+    if (!builder.joinable()) return;
+    {
+        auto state(state_.lock());
+        state->done = true;
+        state->pending.clear();
+    }
+    wakeup.notify_one();
+    builder.join();
+}
+
+void BuildQueue::run()
+{
+    while (true) {
+        std::vector<DerivedPath> batch;
+
+        {
+            auto state(state_.lock());
+            while (state->pending.empty() && !state->done)
+                state.wait(wakeup);
+            if (state->pending.empty()) return;
+            std::swap(batch, state->pending);
+        }
+
+        try {
+            build(batch);
+        } catch (...) {
+            auto state(state_.lock());
+            if (!state->exception)
+                state->exception = std::current_exception();
+            /* Without --keep-going, stop at the first failure, as a
+               single buildPaths() call would. */
+            if (!settings.keepGoing) return;
+        }
+    }
+}
+
+void BuildQueue::enqueue(const std::vector<DerivedPath> & paths)
+{
+    {
+        auto state(state_.lock());
+        if (state->exception && !settings.keepGoing) return;
+        state->pending.insert(state->pending.end(), paths.begin(), paths.end());
+    }
+    wakeup.notify_one();
+}
+
+void BuildQueue::finish()
+{
+    {
+        auto state(state_.lock());
+        state->done = true;
+    }
+    wakeup.notify_one();
+    builder.join();
+
+    auto state(state_.lock());
+    if (state->exception)
+        std::rethrow_exception(state->exception);
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "derived-path.hh"
+#include "sync.hh"
+
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+namespace nix {
+
+/* Builds paths on a background thread while the caller keeps
+   producing them, e.g. by evaluating more installables. Paths are
+   built in batches by calling 'build' (typically Store::buildPaths())
+   with everything that was enqueued while the previous batch was
+   building. */
+class BuildQueue
+{
+public:
+
+    typedef std::function<void(const std::vector<DerivedPath> & paths)> BuildFun;
+
+private:
+
+    BuildFun build;
+
+    struct State
+    {
+        std::vector<DerivedPath> pending;
+        bool done = false;
+        std::exception_ptr exception;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::thread builder;
+
+    void run();
+
+public:
+
+    BuildQueue(BuildFun build);
+
+    /* Waits for the builds in progress, but doesn't start new ones. */
+    ~BuildQueue();
+
+    void enqueue(const std::vector<DerivedPath> & paths);
+
+    /* Build everything that is still pending, and wait for it. Throws
+       the first build error, if any. */
+    void finish();
+};
+
+}
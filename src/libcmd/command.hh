@@ -284,10 +284,21 @@ void completeFlakeRefWithFragment(
 
 std::string showVersions(const std::set<std::string> & versions);
 
+/* Holds the last "after" closure computed by printClosureDiff(), so
+   that diffing a sequence of closures (as in 'nix profile
+   diff-closures') computes each closure only once. Owned by the
+   caller, so it never outlives the store it was computed against. */
+struct ClosureDiffCache
+{
+    struct Entry;
+    std::shared_ptr<Entry> last;
+};
+
 void printClosureDiff(
     ref<Store> store,
     const StorePath & beforePath,
     const StorePath & afterPath,
-    std::string_view indent);
+    std::string_view indent,
+    ClosureDiffCache * cache = nullptr);
 
 }
@@ -1,4 +1,5 @@
 #include "installables.hh"
+#include "build-queue.hh"
 #include "command.hh"
 #include "attr-path.hh"
 #include "common-eval-args.hh"
@@ -766,6 +767,19 @@ BuiltPaths build(ref<Store> store, Realise mode,
 
     std::vector<DerivedPath> pathsToBuild;
 
+    if (mode == Realise::Outputs && settings.buildWhileEvaluating && installables.size() > 1) {
+        BuildQueue queue([&](const std::vector<DerivedPath> & paths) {
+            store->buildPaths(paths, bMode);
+        });
+        for (auto & i : installables) {
+            auto b = i->toDerivedPaths();
+            queue.enqueue(b);
+            pathsToBuild.insert(pathsToBuild.end(), b.begin(), b.end());
+        }
+        queue.finish();
+        return getBuiltPaths(store, pathsToBuild);
+    }
+
     for (auto & i : installables) {
         auto b = i->toDerivedPaths();
         pathsToBuild.insert(pathsToBuild.end(), b.begin(), b.end());
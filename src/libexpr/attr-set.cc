@@ -27,6 +27,10 @@ void EvalState::mkAttrs(Value & v, size_t capacity)
     v.mkAttrs(allocBindings(capacity));
     nrAttrsets++;
     nrAttrsInAttrsets += capacity;
+    if (currentAllocSite) {
+        currentAllocSite->attrsets++;
+        currentAllocSite->bytes += sizeof(Bindings) + capacity * sizeof(Attr);
+    }
 }
 
 
@@ -50,6 +54,20 @@ Value * EvalState::allocAttr(Value & vAttrs, const std::string & name)
 void Bindings::sort()
 {
     std::sort(begin(), end());
+    index = nullptr;
+}
+
+
+void Bindings::buildIndex()
+{
+    auto n = indexSize();
+    auto mask = n - 1;
+    index = (uint32_t *) allocBytes(n * sizeof(uint32_t));
+    for (size_t i = 0; i < size_; ++i) {
+        auto h = hashSymbol(attrs[i].name, mask);
+        while (index[h]) h = (h + 1) & mask;
+        index[h] = i + 1;
+    }
 }
 
 
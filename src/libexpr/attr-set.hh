@@ -30,15 +30,29 @@ struct Attr
 /* Bindings contains all the attributes of an attribute set. It is defined
    by its size and its capacity, the capacity being the number of Attr
    elements allocated after this structure, while the size corresponds to
-   the number of elements already inserted in this structure. */
+   the number of elements already inserted in this structure.
+
+   Lookups do a binary search over the attributes, which are sorted by
+   symbol. For large sets (such as Nixpkgs), a hash index mapping
+   symbols to positions is built on the first lookup. Modifying the
+   attributes discards the index. */
 class Bindings
 {
 public:
     typedef uint32_t size_t;
     Pos *pos;
 
+    /* Minimum number of attributes for which a hash index is built. */
+    static constexpr size_t indexThreshold = 512;
+
 private:
     size_t size_, capacity_;
+
+    /* Open-addressing hash table of 1-based positions in 'attrs', or
+       nullptr if no index has been built. Its size is a power of two
+       and at least twice the number of attributes. */
+    uint32_t * index = nullptr;
+
     Attr attrs[0];
 
     Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
@@ -55,22 +69,35 @@ public:
     {
         assert(size_ < capacity_);
         attrs[size_++] = attr;
+        index = nullptr;
     }
 
     iterator find(const Symbol & name)
     {
+        if (size_ >= indexThreshold) return findIndexed(name);
         Attr key(name, 0);
         iterator i = std::lower_bound(begin(), end(), key);
         if (i != end() && i->name == name) return i;
         return end();
     }
 
+    /* Like find(), but first check whether the attribute is at
+       position 'hint', and remember its position in 'hint' otherwise.
+       Sets built by the same expression usually have the same layout,
+       so a per-expression hint mostly avoids the search. Since names
+       within a set are unique, a wrong hint is harmless. */
+    iterator find(const Symbol & name, uint32_t & hint)
+    {
+        if (hint < size_ && attrs[hint].name == name) return &attrs[hint];
+        auto i = find(name);
+        if (i != end()) hint = i - begin();
+        return i;
+    }
+
     Attr * get(const Symbol & name)
     {
-        Attr key(name, 0);
-        iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return &*i;
-        return nullptr;
+        auto i = find(name);
+        return i != end() ? &*i : nullptr;
     }
 
     Attr & need(const Symbol & name, const Pos & pos = noPos)
@@ -110,6 +137,38 @@ public:
         return res;
     }
 
+private:
+
+    static inline uint32_t hashSymbol(const Symbol & name, uint32_t mask)
+    {
+        /* Symbols are pointers to aligned strings, so mix the bits
+           to use the whole table. */
+        return (uint32_t) (((uintptr_t) &(const std::string &) name * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    }
+
+    uint32_t indexSize() const
+    {
+        uint32_t n = 1;
+        while (n < 2 * size_) n <<= 1;
+        return n;
+    }
+
+    void buildIndex();
+
+    iterator findIndexed(const Symbol & name)
+    {
+        /* SymbolTable::lookup() returns an unset symbol for strings
+           that were never interned, and no attribute has that name.
+           hashSymbol() can't be applied to it. */
+        if (!name.set()) return end();
+        if (!index) buildIndex();
+        auto mask = indexSize() - 1;
+        for (auto h = hashSymbol(name, mask); index[h]; h = (h + 1) & mask)
+            if (attrs[index[h] - 1].name == name)
+                return &attrs[index[h] - 1];
+        return end();
+    }
+
     friend class EvalState;
 };
 
@@ -4,6 +4,8 @@
 #include "eval-inline.hh"
 #include "store-api.hh"
 
+#include <thread>
+
 namespace nix::eval_cache {
 
 static const char * schema = R"sql(
@@ -28,11 +30,24 @@ struct AttrDb
         SQLiteStmt insertAttributeWithContext;
         SQLiteStmt queryAttribute;
         SQLiteStmt queryAttributes;
+        /* The current write transaction, if any. It is started by the
+           first write and committed by the committer thread shortly
+           after, so that the database's write lock is never held long
+           enough to stall other Nix processes populating the same
+           cache. */
         std::unique_ptr<SQLiteTxn> txn;
+        bool quit = false;
     };
 
     std::unique_ptr<Sync<State>> _state;
 
+    std::condition_variable wakeup;
+
+    std::thread committer;
+
+    /* How long writes are batched into one transaction. */
+    static constexpr std::chrono::milliseconds commitInterval{100};
+
     AttrDb(const Hash & fingerprint)
         : _state(std::make_unique<Sync<State>>())
     {
@@ -47,6 +62,10 @@ struct AttrDb
         state->db.isCache();
         state->db.exec(schema);
 
+        /* Serve lookups from a memory mapping of the database rather
+           than through read() calls. */
+        state->db.exec("pragma mmap_size = 268435456");
+
         state->insertAttribute.create(state->db,
             "insert or replace into Attributes(parent, name, type, value) values (?, ?, ?, ?)");
 
@@ -59,14 +78,18 @@ struct AttrDb
         state->queryAttributes.create(state->db,
             "select name from Attributes where parent = ?");
 
-        state->txn = std::make_unique<SQLiteTxn>(state->db);
+        committer = std::thread([this]() { commitLoop(); });
     }
 
     ~AttrDb()
     {
+        _state->lock()->quit = true;
+        wakeup.notify_one();
+        committer.join();
+
         try {
             auto state(_state->lock());
-            if (!failed)
+            if (state->txn && !failed)
                 state->txn->commit();
             state->txn.reset();
         } catch (...) {
@@ -74,6 +97,37 @@ struct AttrDb
         }
     }
 
+    void commitLoop()
+    {
+        auto state(_state->lock());
+        while (!state->quit) {
+            if (!state->txn) {
+                state.wait(wakeup);
+                continue;
+            }
+            /* Give subsequent writes a moment to join this
+               transaction. */
+            state.wait_for(wakeup, commitInterval, [&]() { return state->quit; });
+            if (state->quit) break;
+            try {
+                if (!failed)
+                    state->txn->commit();
+            } catch (SQLiteError &) {
+                ignoreException();
+                failed = true;
+            }
+            state->txn.reset();
+        }
+    }
+
+    /* Make sure that a write transaction is open. */
+    void beginWrite(State & state)
+    {
+        if (state.txn) return;
+        state.txn = std::make_unique<SQLiteTxn>(state.db);
+        wakeup.notify_one();
+    }
+
     template<typename F>
     AttrId doSQLite(F && fun)
     {
@@ -94,6 +148,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
+            beginWrite(*state);
 
             state->insertAttribute.use()
                 (key.first)
@@ -123,6 +178,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
+            beginWrite(*state);
 
             if (context) {
                 std::string ctx;
@@ -155,6 +211,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
+            beginWrite(*state);
 
             state->insertAttribute.use()
                 (key.first)
@@ -171,6 +228,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
+            beginWrite(*state);
 
             state->insertAttribute.use()
                 (key.first)
@@ -187,6 +245,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
+            beginWrite(*state);
 
             state->insertAttribute.use()
                 (key.first)
@@ -203,6 +262,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
+            beginWrite(*state);
 
             state->insertAttribute.use()
                 (key.first)
@@ -219,6 +279,7 @@ struct AttrDb
         return doSQLite([&]()
         {
             auto state(_state->lock());
+            beginWrite(*state);
 
             state->insertAttribute.use()
                 (key.first)
@@ -95,5 +95,19 @@ inline void * allocBytes(size_t n)
     return p;
 }
 
+/* Allocate an uninitialised buffer of 'n' bytes that contains no
+   pointers, e.g. for the contents of a string. */
+inline char * allocString(size_t n)
+{
+    char * p;
+#if HAVE_BOEHMGC
+    p = (char *) GC_MALLOC_ATOMIC(n);
+#else
+    p = (char *) malloc(n);
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
 
 }
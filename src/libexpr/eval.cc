@@ -8,8 +8,11 @@
 #include "filetransfer.hh"
 #include "json.hh"
 #include "function-trace.hh"
+#include "finally.hh"
+#include "cache.hh"
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cstring>
 #include <unistd.h>
@@ -17,6 +20,7 @@
 #include <sys/resource.h>
 #include <iostream>
 #include <fstream>
+#include <unordered_set>
 
 #include <sys/resource.h>
 
@@ -272,6 +276,45 @@ class BoehmGCStackAllocator : public StackAllocator {
 
 static BoehmGCStackAllocator boehmGCStackAllocator;
 
+/* Timings of garbage collections, reported by printStats(). The
+   callbacks below run with the GC lock held. */
+static struct
+{
+    uint64_t collections = 0;
+    std::chrono::nanoseconds totalTime{0}, maxPause{0};
+    uint64_t heapResizes = 0;
+    std::chrono::steady_clock::time_point start;
+} gcStats;
+
+static void onCollectionEvent(GC_EventType event)
+{
+    if (event == GC_EVENT_START)
+        gcStats.start = std::chrono::steady_clock::now();
+    else if (event == GC_EVENT_END) {
+        auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - gcStats.start);
+        gcStats.collections++;
+        gcStats.totalTime += pause;
+        gcStats.maxPause = std::max(gcStats.maxPause, pause);
+    }
+}
+
+/* If gc-deferred-heap-size is set, collection is disabled until the
+   heap reaches that size. The resize callback can't re-enable the
+   collector itself since it runs with the GC lock held, so it sets a
+   flag that allocFromCache() checks whenever it refills a cache. */
+static GC_word gcDeferredHeapSize = 0;
+static std::atomic<bool> gcDeferralExpired{false};
+
+static void onHeapResize(GC_word newSize)
+{
+    gcStats.heapResizes++;
+    if (gcDeferredHeapSize && newSize >= gcDeferredHeapSize) {
+        gcDeferredHeapSize = 0;
+        gcDeferralExpired = true;
+    }
+}
+
 #endif
 
 
@@ -305,38 +348,76 @@ void initGC()
        there. */
     GC_set_no_dls(1);
 
+    /* libgc reads the number of parallel mark threads from the
+       environment during initialisation. */
+    if (evalSettings.gcMarkers && !getEnv("GC_MARKERS"))
+        setenv("GC_MARKERS", std::to_string(evalSettings.gcMarkers).c_str(), 1);
+
     GC_INIT();
 
     GC_set_oom_fn(oomHandler);
 
+    GC_set_on_collection_event(onCollectionEvent);
+    GC_set_on_heap_resize(onHeapResize);
+
+    if (evalSettings.gcFreeSpaceDivisor)
+        GC_set_free_space_divisor(evalSettings.gcFreeSpaceDivisor);
+
+    if (evalSettings.gcMaxHeapSize)
+        GC_set_max_heap_size(evalSettings.gcMaxHeapSize);
+
+    if (evalSettings.gcIncremental)
+        GC_enable_incremental();
+
+    if (evalSettings.gcDeferredHeapSize) {
+        gcDeferredHeapSize = evalSettings.gcDeferredHeapSize;
+        GC_disable();
+    }
+
     StackAllocator::defaultAllocator = &boehmGCStackAllocator;
 
+#endif
+
+    gcInitialised = true;
+}
+
+
+/* Called when the first EvalState is created, so that commands that
+   don't evaluate anything don't pay for growing the heap. */
+static void initGCHeap()
+{
+#if HAVE_BOEHMGC
+    static bool done = false;
+    if (done) return;
+    done = true;
+
     /* Set the initial heap size to something fairly big (25% of
        physical RAM, up to a maximum of 384 MiB) so that in most cases
        we don't need to garbage collect at all.  (Collection has a
        fairly significant overhead.)  The heap size can be overridden
-       through libgc's GC_INITIAL_HEAP_SIZE environment variable.  We
-       should probably also provide a nix.conf setting for this.  Note
-       that GC_expand_hp() causes a lot of virtual, but not physical
-       (resident) memory to be allocated.  This might be a problem on
-       systems that don't overcommit. */
+       through libgc's GC_INITIAL_HEAP_SIZE environment variable or
+       the gc-initial-heap-size setting.  Note that GC_expand_hp()
+       causes a lot of virtual, but not physical (resident) memory to
+       be allocated.  This might be a problem on systems that don't
+       overcommit. */
     if (!getEnv("GC_INITIAL_HEAP_SIZE")) {
         size_t size = 32 * 1024 * 1024;
+        if (evalSettings.gcInitialHeapSize)
+            size = evalSettings.gcInitialHeapSize;
 #if HAVE_SYSCONF && defined(_SC_PAGESIZE) && defined(_SC_PHYS_PAGES)
-        size_t maxSize = 384 * 1024 * 1024;
-        long pageSize = sysconf(_SC_PAGESIZE);
-        long pages = sysconf(_SC_PHYS_PAGES);
-        if (pageSize != -1)
-            size = (pageSize * pages) / 4; // 25% of RAM
-        if (size > maxSize) size = maxSize;
+        else {
+            size_t maxSize = 384 * 1024 * 1024;
+            long pageSize = sysconf(_SC_PAGESIZE);
+            long pages = sysconf(_SC_PHYS_PAGES);
+            if (pageSize != -1)
+                size = (pageSize * pages) / 4; // 25% of RAM
+            if (size > maxSize) size = maxSize;
+        }
 #endif
         debug(format("setting initial heap size to %1% bytes") % size);
         GC_expand_hp(size);
     }
-
 #endif
-
-    gcInitialised = true;
 }
 
 
@@ -412,14 +493,25 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     , repair(NoRepair)
     , store(store)
     , regexCache(makeRegexCache())
+#if HAVE_BOEHMGC
+    , valueAllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
+    , env1AllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
+#endif
     , baseEnv(allocEnv(128))
     , staticBaseEnv(false, 0)
 {
     countCalls = getEnv("NIX_COUNT_CALLS").value_or("0") != "0";
+    countAllocs = getEnv("NIX_COUNT_ALLOCS").value_or("0") != "0";
+    if (countAllocs) currentAllocSite = &allocSites[nullptr];
+
+    if (evalSettings.evalProfileFile != "")
+        profiler = std::make_unique<FunctionCallProfiler>();
 
     assert(gcInitialised);
+    initGCHeap();
 
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
+    static_assert(sizeof(Value) <= 24, "value must be <= 24 bytes");
 
     /* Initialise the Nix expression search path. */
     if (!evalSettings.pureEval) {
@@ -458,6 +550,13 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
 
 EvalState::~EvalState()
 {
+    /* Make sure that the derivations written during evaluation are
+       actually in the store. */
+    try {
+        store->flushDeferredTexts();
+    } catch (...) {
+        ignoreException();
+    }
 }
 
 
@@ -723,6 +822,20 @@ LocalNoInline(void addErrorTrace(Error & e, const Pos & pos, const char * s, con
 }
 
 
+/* Context elements are store paths that are repeated across a large
+   number of strings (e.g. every string that refers to the same
+   derivation output), so keep a single copy of each of them. These
+   copies are never freed. Evaluation is single-threaded, so each
+   thread has its own pool and no locking is needed; the pools
+   themselves are never freed either, since values may outlive the
+   thread that created them. */
+static const char * internContextElem(const std::string & s)
+{
+    static thread_local auto pool = new std::unordered_set<std::string>;
+    return pool->insert(s).first->c_str();
+}
+
+
 void mkString(Value & v, const char * s)
 {
     v.mkString(dupString(s));
@@ -737,7 +850,7 @@ Value & mkString(Value & v, std::string_view s, const PathSet & context)
         v.string.context = (const char * *)
             allocBytes((context.size() + 1) * sizeof(char *));
         for (auto & i : context)
-            v.string.context[n++] = dupString(i.c_str());
+            v.string.context[n++] = internContextElem(i);
         v.string.context[n] = 0;
     }
     return v;
@@ -756,6 +869,8 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
 
     if (!var.fromWith) return env->values[var.displ];
 
+    bool innermost = true;
+
     while (1) {
         if (env->type == Env::HasWithExpr) {
             if (noEval) return 0;
@@ -764,11 +879,15 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
             env->values[0] = v;
             env->type = Env::HasWithAttrs;
         }
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
+        Bindings & attrs(*env->values[0]->attrs);
+        Bindings::iterator j = innermost
+            ? attrs.find(var.name, var.withPosHint)
+            : attrs.find(var.name);
+        if (j != attrs.end()) {
             if (countCalls && j->pos) attrSelects[*j->pos]++;
             return j->value;
         }
+        innermost = false;
         if (!env->prevWith)
             throwUndefinedVarError(var.pos, "undefined variable '%1%'", var.name);
         for (size_t l = env->prevWith; l; --l, env = env->up) ;
@@ -783,10 +902,42 @@ void finalizeValue(void * obj, void * data)
     nrValuesFreed++;
 }
 
+#if HAVE_BOEHMGC
+/* Take an object from a free list obtained from GC_malloc_many(),
+   refilling the list if it's empty. The objects in the list are
+   linked through their first word, which we have to clear
+   explicitly; the rest of the object has been cleared by the
+   allocator. Note that we can't carve objects out of larger chunks
+   ourselves, since we don't let the GC recognise interior
+   pointers. */
+static inline void * allocFromCache(void * & cache, size_t size)
+{
+    if (!cache) {
+        if (gcDeferralExpired && gcDeferralExpired.exchange(false))
+            GC_enable();
+        cache = GC_malloc_many(size);
+        if (!cache) throw std::bad_alloc();
+    }
+    void * p = cache;
+    cache = GC_NEXT(p);
+    GC_NEXT(p) = nullptr;
+    return p;
+}
+#endif
+
+
 Value * EvalState::allocValue()
 {
     nrValues++;
+    if (currentAllocSite) {
+        currentAllocSite->values++;
+        currentAllocSite->bytes += sizeof(Value);
+    }
+#if HAVE_BOEHMGC
+    auto v = (Value *) allocFromCache(*valueAllocCache, sizeof(Value));
+#else
     auto v = (Value *) allocBytes(sizeof(Value));
+#endif
     //GC_register_finalizer_no_order(v, finalizeValue, nullptr, nullptr, nullptr);
     return v;
 }
@@ -796,7 +947,17 @@ Env & EvalState::allocEnv(size_t size)
 {
     nrEnvs++;
     nrValuesInEnvs += size;
-    Env * env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
+    if (currentAllocSite) {
+        currentAllocSite->envs++;
+        currentAllocSite->bytes += sizeof(Env) + size * sizeof(Value *);
+    }
+    Env * env;
+#if HAVE_BOEHMGC
+    if (size == 1)
+        env = (Env *) allocFromCache(*env1AllocCache, sizeof(Env) + sizeof(Value *));
+    else
+#endif
+        env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
     env->type = Env::Plain;
 
     /* We assume that env->values has been cleared by the allocator; maybeThunk() and lookupVar fromWith expect this. */
@@ -811,6 +972,10 @@ void EvalState::mkList(Value & v, size_t size)
     if (size > 2)
         v.bigList.elems = (Value * *) allocBytes(size * sizeof(Value *));
     nrListElems += size;
+    if (currentAllocSite) {
+        currentAllocSite->listElems += size;
+        if (size > 2) currentAllocSite->bytes += size * sizeof(Value *);
+    }
 }
 
 
@@ -914,8 +1079,11 @@ void EvalState::evalFile(const Path & path_, Value & v, bool mustBeTrivial)
     if (j != fileParseCache.end())
         e = j->second;
 
-    if (!e)
+    if (!e) {
+        if (trackFileDependencies)
+            fileStamps.insert_or_assign(path2, getFileStamp(path2));
         e = parseExprFromFile(checkSourcePath(path2));
+    }
 
     fileParseCache[path2] = e;
 
@@ -927,7 +1095,8 @@ void EvalState::evalFile(const Path & path_, Value & v, bool mustBeTrivial)
             throw EvalError("file '%s' must be an attribute set", path);
         eval(e, v);
     } catch (Error & e) {
-        addErrorTrace(e, "while evaluating the file '%1%':", path2);
+        if (!traceDiscarded(e))
+            addErrorTrace(e, "while evaluating the file '%1%':", path2);
         throw;
     }
 
@@ -940,6 +1109,123 @@ void EvalState::resetFileCache()
 {
     fileEvalCache.clear();
     fileParseCache.clear();
+    fileStamps.clear();
+    fileImporters.clear();
+}
+
+
+static int64_t getMTimeNs(const struct stat & st)
+{
+#if __APPLE__
+    return (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+std::optional<EvalState::FileStamp> EvalState::getFileStamp(const Path & path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) {
+        if (errno == ENOENT || errno == ENOTDIR)
+            return FileStamp { .ino = 0, .size = 0, .mtime = 0, .missing = true };
+        return std::nullopt;
+    }
+    FileStamp stamp { .ino = st.st_ino, .size = st.st_size, .mtime = getMTimeNs(st) };
+    /* Some file systems only store timestamps in whole seconds (or
+       coarser), so a file that is modified again within the same
+       granule keeps its timestamp. For files modified in the last
+       few seconds, also remember their contents, like Git does for
+       "racily clean" files. */
+    if (S_ISREG(st.st_mode) && st.st_mtime + 2 >= time(nullptr)) {
+        try {
+            stamp.hash = hashFile(htSHA256, path).to_string(Base16, false);
+        } catch (SysError &) {
+            return std::nullopt;
+        }
+    }
+    return stamp;
+}
+
+bool EvalState::sameFileStamp(const Path & path, const FileStamp & stamp)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        return stamp.missing && (errno == ENOENT || errno == ENOTDIR);
+    if (stamp.missing) return false;
+    if (st.st_ino != stamp.ino || st.st_size != stamp.size || getMTimeNs(st) != stamp.mtime)
+        return false;
+    if (!stamp.hash) return true;
+    try {
+        return hashFile(htSHA256, path).to_string(Base16, false) == *stamp.hash;
+    } catch (SysError &) {
+        return false;
+    }
+}
+
+
+void EvalState::addFileDependency(const Path & importer, const Path & path)
+{
+    if (!trackFileDependencies || importer.empty()) return;
+    try {
+        addReadDependency(importer, resolveExprPath(path));
+    } catch (Error &) {
+        /* evalFile() will report this. */
+    }
+}
+
+
+void EvalState::addReadDependency(const Path & reader, const Path & path)
+{
+    if (!trackFileDependencies || reader.empty()) return;
+    fileImporters[path].insert(reader);
+    /* Files read by scopedImport or by primops don't go through
+       evalFile(). */
+    if (!fileStamps.count(path))
+        fileStamps.insert_or_assign(path, getFileStamp(path));
+}
+
+
+size_t EvalState::resetChangedFiles()
+{
+    std::set<Path> changed;
+    for (auto & i : fileParseCache)
+        if (!fileStamps.count(i.first))
+            changed.insert(i.first);
+    for (auto & [path, stamp] : fileStamps)
+        if (!stamp || !sameFileStamp(path, *stamp))
+            changed.insert(path);
+
+    for (auto & path : changed) {
+        fileParseCache.erase(path);
+        fileStamps.erase(path);
+    }
+
+    /* Values of unchanged files may contain thunks that have already
+       forced the values of changed files they import, so drop those
+       too. Their parse trees are still valid. */
+    auto stale = changed;
+    std::vector<Path> todo(changed.begin(), changed.end());
+    while (!todo.empty()) {
+        auto path = std::move(todo.back());
+        todo.pop_back();
+        auto i = fileImporters.find(path);
+        if (i == fileImporters.end()) continue;
+        for (auto & importer : i->second)
+            if (stale.insert(importer).second)
+                todo.push_back(importer);
+    }
+
+    /* Entries for unresolved paths (e.g. directories) are cheap to
+       recreate from the entry of the resolved path, so drop them
+       all. */
+    for (auto i = fileEvalCache.begin(); i != fileEvalCache.end(); )
+        if (stale.count(i->first) || !fileParseCache.count(i->first))
+            i = fileEvalCache.erase(i);
+        else
+            ++i;
+
+    return changed.size();
 }
 
 
@@ -1160,14 +1446,14 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
             if (def) {
                 state.forceValue(*vAttrs, pos);
                 if (vAttrs->type() != nAttrs ||
-                    (j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                    (j = vAttrs->attrs->find(name, i.posHint)) == vAttrs->attrs->end())
                 {
                     def->eval(state, env, v);
                     return;
                 }
             } else {
                 state.forceAttrs(*vAttrs, pos);
-                if ((j = vAttrs->attrs->find(name)) == vAttrs->attrs->end())
+                if ((j = vAttrs->attrs->find(name, i.posHint)) == vAttrs->attrs->end())
                     throwEvalError(pos, "attribute '%1%' missing", name);
             }
             vAttrs = j->value;
@@ -1178,7 +1464,7 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
         state.forceValue(*vAttrs, ( pos2 != NULL ? *pos2 : this->pos ) );
 
     } catch (Error & e) {
-        if (pos2 && pos2->file != state.sDerivationNix)
+        if (pos2 && pos2->file != state.sDerivationNix && !state.traceDiscarded(e))
             addErrorTrace(e, *pos2, "while evaluating the attribute '%1%'",
                 showAttrPath(state, env, attrPath));
         throw;
@@ -1254,6 +1540,7 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
         /* And call the primop. */
         nrPrimOpCalls++;
         if (countCalls) primOpCalls[primOp->primOp->name]++;
+        auto profile = profiler ? std::make_unique<ProfiledCall>(*profiler, primOp->primOp->name) : nullptr;
         primOp->primOp->fun(*this, pos, vArgs, v);
     } else {
         Value * fun2 = allocValue();
@@ -1342,17 +1629,31 @@ void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & po
     nrFunctionCalls++;
     if (countCalls) incrFunctionCall(&lambda);
 
+    std::optional<Finally> restoreAllocSite;
+    if (countAllocs) {
+        auto prevAllocSite = currentAllocSite;
+        currentAllocSite = &allocSites[&lambda];
+        restoreAllocSite.emplace([this, prevAllocSite]() { currentAllocSite = prevAllocSite; });
+    }
+
+    auto profile = profiler
+        ? std::make_unique<ProfiledCall>(*profiler, fmt("%s at %s",
+            lambda.name.set() ? (string) lambda.name : "anonymous lambda", lambda.pos))
+        : nullptr;
+
     /* Evaluate the body.  This is conditional on showTrace, because
        catching exceptions makes this function not tail-recursive. */
     if (loggerSettings.showTrace.get())
         try {
             lambda.body->eval(*this, env2, v);
         } catch (Error & e) {
-            addErrorTrace(e, lambda.pos, "while evaluating %s",
-              (lambda.name.set()
-                  ? "'" + (string) lambda.name + "'"
-                  : "anonymous lambda"));
-            addErrorTrace(e, pos, "from call site%s", "");
+            if (!traceDiscarded(e)) {
+                addErrorTrace(e, lambda.pos, "while evaluating %s",
+                  (lambda.name.set()
+                      ? "'" + (string) lambda.name + "'"
+                      : "anonymous lambda"));
+                addErrorTrace(e, pos, "from call site%s", "");
+            }
             throw;
         }
     else
@@ -1501,26 +1802,53 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     if (v1.attrs->size() == 0) { v = v2; return; }
     if (v2.attrs->size() == 0) { v = v1; return; }
 
-    state.mkAttrs(v, v1.attrs->size() + v2.attrs->size());
+    Bindings & b1(*v1.attrs), & b2(*v2.attrs);
+
+    if (b2.size() * 8 < b1.size()) {
+        /* The right-hand side is small, as in overlays of the form
+           `prev // { ... }'. Find where each of its attributes goes by
+           binary search and copy the runs of the left-hand side in
+           between without comparing them. Looking up the overridden
+           attributes first also lets us size the result exactly,
+           rather than for the sum of both sets. */
+        size_t overridden = 0;
+        for (auto & j : b2)
+            if (b1.find(j.name) != b1.end()) overridden++;
+
+        state.mkAttrs(v, b1.size() + b2.size() - overridden);
+
+        Bindings::iterator i = b1.begin();
+        for (auto & j : b2) {
+            auto k = std::lower_bound(i, b1.end(), j);
+            while (i != k) v.attrs->push_back(*i++);
+            v.attrs->push_back(j);
+            if (i != b1.end() && i->name == j.name) ++i;
+        }
+        while (i != b1.end()) v.attrs->push_back(*i++);
+    }
+
+    else {
+        state.mkAttrs(v, b1.size() + b2.size());
 
-    /* Merge the sets, preferring values from the second set.  Make
-       sure to keep the resulting vector in sorted order. */
-    Bindings::iterator i = v1.attrs->begin();
-    Bindings::iterator j = v2.attrs->begin();
+        /* Merge the sets, preferring values from the second set.  Make
+           sure to keep the resulting vector in sorted order. */
+        Bindings::iterator i = b1.begin();
+        Bindings::iterator j = b2.begin();
 
-    while (i != v1.attrs->end() && j != v2.attrs->end()) {
-        if (i->name == j->name) {
-            v.attrs->push_back(*j);
-            ++i; ++j;
+        while (i != b1.end() && j != b2.end()) {
+            if (i->name == j->name) {
+                v.attrs->push_back(*j);
+                ++i; ++j;
+            }
+            else if (i->name < j->name)
+                v.attrs->push_back(*i++);
+            else
+                v.attrs->push_back(*j++);
         }
-        else if (i->name < j->name)
-            v.attrs->push_back(*i++);
-        else
-            v.attrs->push_back(*j++);
-    }
 
-    while (i != v1.attrs->end()) v.attrs->push_back(*i++);
-    while (j != v2.attrs->end()) v.attrs->push_back(*j++);
+        while (i != b1.end()) v.attrs->push_back(*i++);
+        while (j != b2.end()) v.attrs->push_back(*j++);
+    }
 
     state.nrOpUpdateValuesCopied += v.attrs->size();
 }
@@ -1567,10 +1895,16 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
     PathSet context;
-    std::ostringstream s;
+    std::string s;
     NixInt n = 0;
     NixFloat nf = 0;
 
+    /* Concatenations such as `a + "\n" + b' mostly involve at most
+       one string with a context. Rather than copying its elements
+       into `context' and interning them again afterwards, the result
+       shares that string's (immutable) context array. */
+    const char * * sharedContext = nullptr;
+
     bool first = !forceString;
     ValueType firstType = nString;
 
@@ -1604,8 +1938,18 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
                 nf += vTmp.fpoint;
             } else
                 throwEvalError(pos, "cannot add %1% to a float", showType(vTmp));
+        } else if (firstType == nString && vTmp.type() == nString) {
+            /* Append strings in place; coerceToString() would return
+               a copy. */
+            s += vTmp.string.s;
+            if (vTmp.string.context && vTmp.string.context != sharedContext) {
+                if (!sharedContext)
+                    sharedContext = vTmp.string.context;
+                else
+                    copyContext(vTmp, context);
+            }
         } else
-            s << state.coerceToString(pos, vTmp, context, false, firstType == nString);
+            s += state.coerceToString(pos, vTmp, context, false, firstType == nString);
     }
 
     if (firstType == nInt)
@@ -1615,10 +1959,17 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
     else if (firstType == nPath) {
         if (!context.empty())
             throwEvalError(pos, "a string that refers to a store path cannot be appended to a path");
-        auto path = canonPath(s.str());
+        auto path = canonPath(s);
         mkPath(v, path.c_str());
-    } else
-        mkString(v, s.str(), context);
+    } else if (sharedContext && context.empty()) {
+        mkString(v, s);
+        v.string.context = sharedContext;
+    } else {
+        if (sharedContext)
+            for (auto p = sharedContext; *p; ++p)
+                context.insert(*p);
+        mkString(v, s, context);
+    }
 }
 
 
@@ -1644,7 +1995,8 @@ void EvalState::forceValueDeep(Value & v)
                 try {
                     recurse(*i.value);
                 } catch (Error & e) {
-                    addErrorTrace(e, *i.pos, "while evaluating the attribute '%1%'", i.name);
+                    if (!traceDiscarded(e))
+                        addErrorTrace(e, *i.pos, "while evaluating the attribute '%1%'", i.name);
                     throw;
                 }
         }
@@ -1861,9 +2213,14 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
     if (i != srcToStore.end())
         dstPath = store->printStorePath(i->second);
     else {
+        auto name = std::string(baseNameOf(path));
+        auto path2 = checkSourcePath(path);
+        auto add = [&]() {
+            return store->addToStore(name, path2, FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, repair);
+        };
         auto p = settings.readOnlyMode
-            ? store->computeStorePathForPath(std::string(baseNameOf(path)), checkSourcePath(path)).first
-            : store->addToStore(std::string(baseNameOf(path)), checkSourcePath(path), FileIngestionMethod::Recursive, htSHA256, defaultPathFilter, repair);
+            ? store->computeStorePathForPath(name, path2).first
+            : repair ? add() : fetchers::addSourceTreeCached(store, path2, name, add);
         dstPath = store->printStorePath(p);
         srcToStore.insert_or_assign(path, std::move(p));
         printMsg(lvlChatty, "copied source '%1%' -> '%2%'", path, dstPath);
@@ -1963,6 +2320,8 @@ bool EvalState::eqValues(Value & v1, Value & v2)
 
 void EvalState::printStats()
 {
+    if (profiler) profiler->write(evalSettings.evalProfileFile);
+
     bool showStats = getEnv("NIX_SHOW_STATS").value_or("0") != "0";
 
     struct rusage buf;
@@ -2032,6 +2391,10 @@ void EvalState::printStats()
             auto gc = topObj.object("gc");
             gc.attr("heapSize", heapSize);
             gc.attr("totalBytes", totalBytes);
+            gc.attr("collections", gcStats.collections);
+            gc.attr("time", std::chrono::duration<double>(gcStats.totalTime).count());
+            gc.attr("maxPause", std::chrono::duration<double>(gcStats.maxPause).count());
+            gc.attr("heapResizes", gcStats.heapResizes);
         }
 #endif
 
@@ -2071,6 +2434,35 @@ void EvalState::printStats()
             }
         }
 
+        if (countAllocs) {
+            /* Report the sites that allocated the most memory. */
+            std::vector<AllocSites::value_type *> sites;
+            for (auto & i : allocSites)
+                sites.push_back(&i);
+            std::sort(sites.begin(), sites.end(), [](auto a, auto b) {
+                return a->second.bytes > b->second.bytes;
+            });
+            if (sites.size() > 100) sites.resize(100);
+            auto list = topObj.list("allocations");
+            for (auto i : sites) {
+                auto obj = list.object();
+                if (i->first && i->first->name.set())
+                    obj.attr("name", (const string &) i->first->name);
+                else
+                    obj.attr("name", nullptr);
+                if (i->first && i->first->pos) {
+                    obj.attr("file", (const string &) i->first->pos.file);
+                    obj.attr("line", i->first->pos.line);
+                    obj.attr("column", i->first->pos.column);
+                }
+                obj.attr("values", i->second.values);
+                obj.attr("envs", i->second.envs);
+                obj.attr("listElems", i->second.listElems);
+                obj.attr("attrsets", i->second.attrsets);
+                obj.attr("bytes", i->second.bytes);
+            }
+        }
+
         if (getEnv("NIX_SHOW_SYMBOLS").value_or("0") != "0") {
             auto list = topObj.list("symbols");
             symbols.dump([&](const std::string & s) { list.elem(s); });
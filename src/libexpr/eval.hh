@@ -9,6 +9,7 @@
 #include <map>
 #include <optional>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 
 
@@ -65,6 +66,7 @@ void initGC();
 
 
 struct RegexCache;
+struct FunctionCallProfiler;
 
 std::shared_ptr<RegexCache> makeRegexCache();
 
@@ -96,6 +98,20 @@ public:
 
     const ref<Store> store;
 
+    /* The number of builtins.tryEval calls currently being
+       evaluated. */
+    unsigned int tryEvalDepth = 0;
+
+    /* Whether traces added to 'e' will never be shown, because 'e'
+       is an assertion or `throw' that an enclosing builtins.tryEval
+       will catch. This lets error paths skip building trace
+       messages, which matters when evaluating package sets that
+       contain many broken packages. */
+    bool traceDiscarded(const Error & e) const
+    {
+        return tryEvalDepth && dynamic_cast<const AssertionError *>(&e);
+    }
+
 
 private:
     SrcToStore srcToStore;
@@ -120,12 +136,44 @@ private:
 
     std::map<std::string, std::pair<bool, std::string>> searchPathResolved;
 
+    /* The identity of each file at the time it was read, and the
+       files that import each file. Only maintained if
+       'trackFileDependencies' is set. */
+    struct FileStamp
+    {
+        ino_t ino;
+        off_t size;
+        /* Modification time in nanoseconds. */
+        int64_t mtime;
+        /* Hash of the contents, if the file was modified so recently
+           that a change in the same timestamp granule could go
+           unnoticed. */
+        std::optional<std::string> hash;
+        /* Whether the file didn't exist (e.g. for pathExists). */
+        bool missing = false;
+    };
+    std::map<Path, std::optional<FileStamp>> fileStamps;
+    std::map<Path, std::set<Path>> fileImporters;
+
+    static std::optional<FileStamp> getFileStamp(const Path & path);
+
+    /* Whether the file at `path' still matches `stamp'. */
+    static bool sameFileStamp(const Path & path, const FileStamp & stamp);
+
     /* Cache used by checkSourcePath(). */
     std::unordered_map<Path, Path> resolvedPaths;
 
-    /* Cache used by prim_match(). */
+    /* Cache used by prim_match() and prim_split(). */
     std::shared_ptr<RegexCache> regexCache;
 
+#if HAVE_BOEHMGC
+    /* Allocation cache for GC'd Value objects. */
+    std::shared_ptr<void *> valueAllocCache;
+
+    /* Allocation cache for size-1 Env objects. */
+    std::shared_ptr<void *> env1AllocCache;
+#endif
+
 public:
 
     EvalState(const Strings & _searchPath, ref<Store> store);
@@ -165,6 +213,28 @@ public:
 
     void resetFileCache();
 
+    /* Whether to record which files import which, so that
+       resetChangedFiles() can keep the cache entries of files that
+       haven't changed. */
+    bool trackFileDependencies = false;
+
+    /* Record that the file 'importer' imports the file 'path'. */
+    void addFileDependency(const Path & importer, const Path & path);
+
+    /* Record that evaluating the file 'reader' looked at the file or
+       directory 'path' in some other way, e.g. with readFile,
+       readDir or pathExists. */
+    void addReadDependency(const Path & reader, const Path & path);
+
+    /* Drop the cached parse trees of files that have changed on disk
+       since they were read, and the cached values of those files and
+       of every file that (transitively) imports or reads one of
+       them. Other
+       cache entries are kept. Only meaningful if
+       'trackFileDependencies' was set before evaluating any file.
+       Returns the number of files that had changed. */
+    size_t resetChangedFiles();
+
     /* Look up a file in the search path. */
     Path findFile(const string & path);
     Path findFile(SearchPath & searchPath, const string & path, const Pos & pos = noPos);
@@ -271,7 +341,9 @@ private:
     friend struct ExprAttrs;
     friend struct ExprLet;
 
-    Expr * parse(const char * text, FileOrigin origin, const Path & path,
+    /* Parse 'text', which must be terminated by two NUL characters
+       (included in 'length') and may be modified during parsing. */
+    Expr * parse(char * text, size_t length, FileOrigin origin, const Path & path,
         const Path & basePath, StaticEnv & staticEnv);
 
 public:
@@ -308,10 +380,18 @@ public:
     /* Print statistics. */
     void printStats();
 
+    /* Ensure that the paths in `context' are valid, building the
+       derivation outputs among them. */
     void realiseContext(const PathSet & context);
 
 private:
 
+    /* Context elements that realiseContext() has already made valid,
+       so that expressions that read many files from the output of
+       the same derivation don't query the store (and start a
+       build) every time. */
+    std::unordered_set<std::string> realisedContext;
+
     unsigned long nrEnvs = 0;
     unsigned long nrValuesInEnvs = 0;
     unsigned long nrValues = 0;
@@ -326,6 +406,9 @@ private:
 
     bool countCalls;
 
+    /* Per-call-stack timings, if `eval-profile-file` is set. */
+    std::unique_ptr<FunctionCallProfiler> profiler;
+
     typedef std::map<Symbol, size_t> PrimOpCalls;
     PrimOpCalls primOpCalls;
 
@@ -337,11 +420,28 @@ private:
     typedef std::map<Pos, size_t> AttrSelects;
     AttrSelects attrSelects;
 
+    /* Allocations made while evaluating the body of each function,
+       enabled by NIX_COUNT_ALLOCS. Values are attributed to the
+       innermost function call in progress when they are allocated;
+       the null key denotes allocations outside of any function. */
+    bool countAllocs;
+
+    struct AllocCounts
+    {
+        size_t values = 0, envs = 0, listElems = 0, attrsets = 0;
+        uint64_t bytes = 0;
+    };
+
+    typedef std::map<ExprLambda *, AllocCounts> AllocSites;
+    AllocSites allocSites;
+    AllocCounts * currentAllocSite = nullptr;
+
     friend struct ExprOpUpdate;
     friend struct ExprOpConcatLists;
     friend struct ExprSelect;
     friend void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v);
     friend void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v);
+    friend void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v);
 };
 
 
@@ -426,8 +526,73 @@ struct EvalSettings : Config
           `flamegraph.pl`.
         )"};
 
+    Setting<Path> evalProfileFile{this, "", "eval-profile-file",
+        R"(
+          If set, the Nix evaluator records the time spent in every Nix
+          call stack (function and builtin calls), excluding time spent
+          in callees, and writes it to this file when evaluation
+          finishes. The file uses the "collapsed stack" format, with one
+          stack per line followed by its time in nanoseconds, and can be
+          fed directly to `flamegraph.pl`.
+        )"};
+
     Setting<bool> useEvalCache{this, true, "eval-cache",
         "Whether to use the flake evaluation cache."};
+
+    /* The garbage collector is initialised before the command line is
+       parsed, so the following settings only take effect when set in
+       a configuration file or through `NIX_CONFIG`. */
+
+    Setting<uint64_t> gcInitialHeapSize{this, 0, "gc-initial-heap-size",
+        R"(
+          The initial size in bytes of the evaluator's garbage-collected
+          heap. The default (`0`) uses 25% of physical memory, up to 384
+          MiB, so that small evaluations don't need to collect garbage
+          at all. libgc's `GC_INITIAL_HEAP_SIZE` environment variable
+          takes precedence over this setting.
+        )"};
+
+    Setting<uint64_t> gcMaxHeapSize{this, 0, "gc-max-heap-size",
+        R"(
+          The maximum size in bytes of the evaluator's garbage-collected
+          heap. Evaluation fails with an out-of-memory error when it
+          would need more. The default (`0`) means no limit.
+        )"};
+
+    Setting<unsigned int> gcFreeSpaceDivisor{this, 0, "gc-free-space-divisor",
+        R"(
+          Controls the trade-off between heap growth and time spent
+          collecting garbage: a collection is triggered after
+          allocating about 1/N of the heap. Lower values grow the heap
+          faster and collect less often. The default (`0`) keeps
+          libgc's own default of 3.
+        )"};
+
+    Setting<unsigned int> gcMarkers{this, 0, "gc-markers",
+        R"(
+          The number of threads the garbage collector uses to mark
+          reachable objects, if libgc was built with parallel marking.
+          The default (`0`) uses one marker per CPU. libgc's
+          `GC_MARKERS` environment variable takes precedence over this
+          setting.
+        )"};
+
+    Setting<uint64_t> gcDeferredHeapSize{this, 0, "gc-deferred-heap-size",
+        R"(
+          If set to a nonzero size in bytes, the evaluator doesn't collect
+          garbage at all until its heap has grown to this size, after
+          which it collects as usual. On machines with plenty of memory,
+          this can speed up commands such as `nix-instantiate` and `nix
+          eval` that exit right after evaluation. The default (`0`)
+          collects garbage from the start.
+        )"};
+
+    Setting<bool> gcIncremental{this, false, "gc-incremental",
+        R"(
+          Whether the garbage collector runs incrementally, interleaving
+          short marking steps with evaluation. This shortens pauses, but
+          usually increases the total time spent collecting garbage.
+        )"};
 };
 
 extern EvalSettings evalSettings;
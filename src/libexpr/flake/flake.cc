@@ -5,6 +5,7 @@
 #include "store-api.hh"
 #include "fetchers.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
 
 namespace nix {
 
@@ -31,6 +32,57 @@ static std::optional<FetchedFlake> lookupInFlakeCache(
     return std::nullopt;
 }
 
+/* Fetch the given flake references concurrently and add them to
+   'flakeCache', so that the sequential lock file computation that
+   follows doesn't wait for each of them in turn. Failures are ignored
+   here; they are reported when the input is fetched again. */
+static void prefetchFlakeRefs(
+    EvalState & state,
+    const std::vector<FlakeRef> & refs,
+    bool allowLookup,
+    FlakeCache & flakeCache)
+{
+    /* Pairs of original and resolved references. Registry lookups are
+       done here rather than in the worker threads. */
+    std::vector<std::pair<FlakeRef, FlakeRef>> todo;
+    for (auto & ref : refs) {
+        if (lookupInFlakeCache(flakeCache, ref)) continue;
+        if (ref.input.isDirect())
+            todo.emplace_back(ref, ref);
+        else if (allowLookup) {
+            try {
+                todo.emplace_back(ref, ref.resolve(state.store));
+            } catch (Error & e) {
+                debug("cannot resolve '%s': %s", ref, e.what());
+            }
+        }
+    }
+
+    if (todo.size() < 2) return;
+
+    std::vector<std::optional<FetchedFlake>> results(todo.size());
+
+    ThreadPool pool;
+    for (size_t n = 0; n < todo.size(); ++n)
+        pool.enqueue([&, n]() {
+            try {
+                results[n].emplace(todo[n].second.fetchTree(state.store));
+            } catch (Error & e) {
+                debug("prefetching '%s' failed: %s", todo[n].first, e.what());
+            }
+        });
+    pool.process();
+
+    /* Add the results in a deterministic order, the same way
+       fetchOrSubstituteTree() would. */
+    for (size_t n = 0; n < todo.size(); ++n) {
+        if (!results[n]) continue;
+        if (!(todo[n].first == todo[n].second))
+            flakeCache.push_back({todo[n].second, *results[n]});
+        flakeCache.push_back({todo[n].first, *results[n]});
+    }
+}
+
 static std::tuple<fetchers::Tree, FlakeRef, FlakeRef> fetchOrSubstituteTree(
     EvalState & state,
     const FlakeRef & originalRef,
@@ -350,6 +402,28 @@ LockedFlake lockFlake(
                 }
             }
 
+            /* Fetch the inputs that need a new lock file entry
+               concurrently. This mirrors the decisions made below;
+               path inputs are local and are skipped. */
+            {
+                std::vector<FlakeRef> toFetch;
+                for (auto & [id, input2] : flakeInputs) {
+                    auto inputPath(inputPathPrefix);
+                    inputPath.push_back(id);
+                    auto i = overrides.find(inputPath);
+                    bool hasOverride = i != overrides.end();
+                    auto & input = hasOverride ? i->second : input2;
+                    if (input.follows || !input.ref || input.ref->input.getType() == "path") continue;
+                    if (!hasOverride && oldNode && !lockFlags.inputUpdates.count(inputPath))
+                        if (auto oldLock = get(oldNode->inputs, id))
+                            if (auto oldLock2 = std::get_if<0>(&*oldLock))
+                                if ((*oldLock2)->originalRef == *input.ref) continue;
+                    if (!lockFlags.allowMutable && !input.ref->input.isImmutable()) continue;
+                    toFetch.push_back(*input.ref);
+                }
+                prefetchFlakeRefs(state, toFetch, lockFlags.useRegistries, flakeCache);
+            }
+
             /* Go over the flake inputs, resolve/fetch them if
                necessary (i.e. if they're new or the flakeref changed
                from what's in the lock file). */
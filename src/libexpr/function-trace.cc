@@ -1,6 +1,8 @@
 #include "function-trace.hh"
 #include "logging.hh"
 
+#include <fstream>
+
 namespace nix {
 
 FunctionCallTrace::FunctionCallTrace(const Pos & pos) : pos(pos) {
@@ -15,4 +17,32 @@ FunctionCallTrace::~FunctionCallTrace() {
     printMsg(lvlInfo, "function-trace exited %1% at %2%", pos, ns.count());
 }
 
+void FunctionCallProfiler::enter(std::string_view name)
+{
+    frames.push_back({stack.size(), Clock::now()});
+    if (!stack.empty()) stack += ';';
+    stack += name;
+}
+
+void FunctionCallProfiler::leave()
+{
+    assert(!frames.empty());
+    auto & frame(frames.back());
+    auto elapsed = Clock::now() - frame.start;
+    selfTime[stack] += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed - frame.children).count();
+    stack.resize(frame.prefixLen);
+    frames.pop_back();
+    if (!frames.empty())
+        frames.back().children += elapsed;
+}
+
+void FunctionCallProfiler::write(const Path & path)
+{
+    std::ofstream str(path);
+    if (!str) throw SysError("opening '%s'", path);
+    for (auto & i : selfTime)
+        str << i.first << " " << i.second << "\n";
+    if (!str) throw SysError("writing '%s'", path);
+}
+
 }
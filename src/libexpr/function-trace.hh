@@ -3,6 +3,7 @@
 #include "eval.hh"
 
 #include <chrono>
+#include <unordered_map>
 
 namespace nix {
 
@@ -12,4 +13,45 @@ struct FunctionCallTrace
     FunctionCallTrace(const Pos & pos);
     ~FunctionCallTrace();
 };
+
+/* Accumulates the time spent in each Nix call stack, excluding time
+   spent in callees, and writes it in the "collapsed stack" format
+   understood by flamegraph.pl and similar tools. */
+struct FunctionCallProfiler
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct Frame
+    {
+        size_t prefixLen;
+        Clock::time_point start;
+        Clock::duration children{0};
+    };
+
+    /* The current stack, as frame names separated by ';'. */
+    std::string stack;
+    std::vector<Frame> frames;
+
+    /* Self time in nanoseconds per stack. */
+    std::unordered_map<std::string, uint64_t> selfTime;
+
+    void enter(std::string_view name);
+    void leave();
+    void write(const Path & path);
+};
+
+struct ProfiledCall
+{
+    FunctionCallProfiler & profiler;
+    ProfiledCall(FunctionCallProfiler & profiler, std::string_view name)
+        : profiler(profiler)
+    {
+        profiler.enter(name);
+    }
+    ~ProfiledCall()
+    {
+        profiler.leave();
+    }
+};
+
 }
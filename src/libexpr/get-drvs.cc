@@ -5,7 +5,6 @@
 #include "path-with-outputs.hh"
 
 #include <cstring>
-#include <regex>
 
 
 namespace nix {
@@ -318,7 +317,19 @@ static string addToPath(const string & s1, const string & s2)
 }
 
 
-static std::regex attrRegex("[A-Za-z_][A-Za-z0-9-_+]*");
+/* Whether 'name' matches [A-Za-z_][A-Za-z0-9-_+]*. This is called
+   for every attribute of a package set, so avoid std::regex. */
+static bool isDrvAttrName(std::string_view name)
+{
+    if (name.empty()) return false;
+    for (size_t n = 0; n < name.size(); ++n) {
+        char c = name[n];
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_') continue;
+        if (n > 0 && ((c >= '0' && c <= '9') || c == '-' || c == '+')) continue;
+        return false;
+    }
+    return true;
+}
 
 
 static void getDerivations(EvalState & state, Value & vIn,
@@ -345,7 +356,7 @@ static void getDerivations(EvalState & state, Value & vIn,
            precedence). */
         for (auto & i : v.attrs->lexicographicOrder()) {
             debug("evaluating attribute '%1%'", i->name);
-            if (!std::regex_match(std::string(i->name), attrRegex))
+            if (!isDrvAttrName(i->name))
                 continue;
             string pathPrefix2 = addToPath(pathPrefix, i->name);
             if (combineChannels)
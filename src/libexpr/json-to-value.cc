@@ -13,19 +13,22 @@ class JSONSax : nlohmann::json_sax<json> {
     class JSONState {
     protected:
         std::unique_ptr<JSONState> parent;
+        /* The value currently being filled in. The root is allocated
+           once per state and re-pointed for every element, rather than
+           allocating a fresh root for each value. */
         RootValue v;
     public:
         virtual std::unique_ptr<JSONState> resolve(EvalState &)
         {
             throw std::logic_error("tried to close toplevel json parser state");
         }
-        explicit JSONState(std::unique_ptr<JSONState> && p) : parent(std::move(p)) {}
+        explicit JSONState(std::unique_ptr<JSONState> && p) : parent(std::move(p)), v(allocRootValue(nullptr)) {}
         explicit JSONState(Value * v) : v(allocRootValue(v)) {}
         JSONState(JSONState & p) = delete;
         Value & value(EvalState & state)
         {
-            if (!v)
-                v = allocRootValue(state.allocValue());
+            if (!*v)
+                *v = state.allocValue();
             return **v;
         }
         virtual ~JSONState() {}
@@ -33,21 +36,38 @@ class JSONSax : nlohmann::json_sax<json> {
     };
 
     class JSONObjectState : public JSONState {
-        using JSONState::JSONState;
-        ValueMap attrs;
+        /* Attributes in the order they appear in the input. They are
+           sorted once when the object is closed, which is cheaper than
+           maintaining a map while parsing. */
+#if HAVE_BOEHMGC
+        std::vector<Attr, traceable_allocator<Attr>> attrs;
+#else
+        std::vector<Attr> attrs;
+#endif
         std::unique_ptr<JSONState> resolve(EvalState & state) override
         {
+            /* Duplicate keys are allowed; the last one wins. */
+            std::stable_sort(attrs.begin(), attrs.end());
+            size_t unique = 0;
+            for (size_t n = 0; n < attrs.size(); ++n)
+                if (n + 1 == attrs.size() || attrs[n].name != attrs[n + 1].name)
+                    unique++;
             Value & v = parent->value(state);
-            state.mkAttrs(v, attrs.size());
-            for (auto & i : attrs)
-                v.attrs->push_back(Attr(i.first, i.second));
+            state.mkAttrs(v, unique);
+            for (size_t n = 0; n < attrs.size(); ++n)
+                if (n + 1 == attrs.size() || attrs[n].name != attrs[n + 1].name)
+                    v.attrs->push_back(attrs[n]);
             return std::move(parent);
         }
-        void add() override { v = nullptr; }
+        void add() override { *v = nullptr; }
     public:
+        JSONObjectState(std::unique_ptr<JSONState> && p, std::size_t reserve) : JSONState(std::move(p))
+        {
+            attrs.reserve(reserve);
+        }
         void key(string_t & name, EvalState & state)
         {
-            attrs.insert_or_assign(state.symbols.create(name), &value(state));
+            attrs.emplace_back(state.symbols.create(name), &value(state));
         }
     };
 
@@ -57,14 +77,12 @@ class JSONSax : nlohmann::json_sax<json> {
         {
             Value & v = parent->value(state);
             state.mkList(v, values.size());
-            for (size_t n = 0; n < values.size(); ++n) {
-                v.listElems()[n] = values[n];
-            }
+            std::copy(values.begin(), values.end(), v.listElems());
             return std::move(parent);
         }
         void add() override {
             values.push_back(*v);
-            v = nullptr;
+            *v = nullptr;
         }
     public:
         JSONListState(std::unique_ptr<JSONState> && p, std::size_t reserve) : JSONState(std::move(p))
@@ -126,7 +144,8 @@ public:
 
     bool start_object(std::size_t len)
     {
-        rs = std::make_unique<JSONObjectState>(std::move(rs));
+        rs = std::make_unique<JSONObjectState>(std::move(rs),
+            len != std::numeric_limits<size_t>::max() ? len : 16);
         return true;
     }
 
@@ -441,16 +441,4 @@ string ExprLambda::showNamePos() const
 }
 
 
-
-/* Symbol table. */
-
-size_t SymbolTable::totalSize() const
-{
-    size_t n = 0;
-    for (auto & i : symbols)
-        n += i.size();
-    return n;
-}
-
-
 }
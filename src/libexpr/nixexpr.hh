@@ -4,6 +4,7 @@
 #include "symbol-table.hh"
 #include "error.hh"
 
+#include <algorithm>
 #include <map>
 
 
@@ -23,14 +24,19 @@ MakeError(RestrictedPathError, Error);
 
 /* Position objects. */
 
+/* Every AST node carries a position, so keep this small: the origin
+   and column share a word, which makes a Pos 16 bytes rather than 24.
+   Columns beyond the 24-bit range are clamped. */
 struct Pos
 {
-    FileOrigin origin;
     Symbol file;
-    unsigned int line, column;
-    Pos() : origin(foString), line(0), column(0) { };
+    unsigned int line;
+    unsigned int column : 24;
+    FileOrigin origin : 8;
+    Pos() : line(0), column(0), origin(foString) { };
     Pos(FileOrigin origin, const Symbol & file, unsigned int line, unsigned int column)
-        : origin(origin), file(file), line(line), column(column) { };
+        : file(file), line(line), column(std::min(column, maxColumn)), origin(origin) { };
+    static constexpr unsigned int maxColumn = (1 << 24) - 1;
     operator bool() const
     {
         return line != 0;
@@ -64,6 +70,9 @@ struct AttrName
 {
     Symbol symbol;
     Expr * expr;
+    /* Position at which this attribute was last found by ExprSelect,
+       see Bindings::find(). */
+    uint32_t posHint = 0;
     AttrName(const Symbol & s) : symbol(s) {};
     AttrName(Expr * e) : expr(e) {};
 };
@@ -153,6 +162,11 @@ struct ExprVar : Expr
     unsigned int level;
     unsigned int displ;
 
+    /* For variables that come from a "with", the position in the
+       innermost "with" attribute set at which the variable was last
+       found, see Bindings::find(). */
+    mutable uint32_t withPosHint = 0;
+
     ExprVar(const Symbol & name) : name(name) { };
     ExprVar(const Pos & pos, const Symbol & name) : pos(pos), name(name) { };
     COMMON_METHODS
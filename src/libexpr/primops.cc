@@ -2,6 +2,7 @@
 #include "derivations.hh"
 #include "eval-inline.hh"
 #include "eval.hh"
+#include "finally.hh"
 #include "globals.hh"
 #include "json-to-value.hh"
 #include "names.hh"
@@ -38,8 +39,11 @@ InvalidPathError::InvalidPathError(const Path & path) :
 void EvalState::realiseContext(const PathSet & context)
 {
     std::vector<DerivedPath::Built> drvs;
+    std::vector<std::string> newContext;
 
     for (auto & i : context) {
+        if (realisedContext.count(i)) continue;
+        newContext.push_back(i);
         auto [ctxS, outputName] = decodeContext(i);
         auto ctx = store->parseStorePath(ctxS);
         if (!store->isValidPath(ctx))
@@ -49,7 +53,10 @@ void EvalState::realiseContext(const PathSet & context)
         }
     }
 
-    if (drvs.empty()) return;
+    if (drvs.empty()) {
+        realisedContext.insert(newContext.begin(), newContext.end());
+        return;
+    }
 
     if (!evalSettings.enableImportFromDerivation)
         throw EvalError("attempted to realize '%1%' during evaluation but 'allow-import-from-derivation' is false",
@@ -77,6 +84,8 @@ void EvalState::realiseContext(const PathSet & context)
             }
         }
     }
+
+    realisedContext.insert(newContext.begin(), newContext.end());
 }
 
 /* Add and attribute to the given attribute map from the output name to
@@ -129,6 +138,9 @@ static void import(EvalState & state, const Pos & pos, Value & vPath, Value * vS
 
     Path realPath = state.checkSourcePath(state.toRealPath(path, context));
 
+    if (pos.file.set())
+        state.addFileDependency(pos.file, realPath);
+
     // FIXME
     auto isValidDerivationInStore = [&]() -> std::optional<StorePath> {
         if (!state.store->isStorePath(path))
@@ -556,7 +568,7 @@ static Bindings::iterator getAttr(
     Bindings * attrSet,
     const Pos & pos)
 {
-    Bindings::iterator value = attrSet->find(state.symbols.create(attrName));
+    Bindings::iterator value = attrSet->find(state.symbols.lookup(attrName));
     if (value == attrSet->end()) {
         hintformat errorMsg = hintfmt(
             "attribute '%s' missing for call to '%s'",
@@ -759,6 +771,8 @@ static RegisterPrimOp primop_floor({
 static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.mkAttrs(v, 2);
+    state.tryEvalDepth++;
+    Finally decrement([&]() { state.tryEvalDepth--; });
     try {
         state.forceValue(*args[0], pos);
         v.attrs->push_back(Attr(state.sValue, args[0]));
@@ -1203,8 +1217,11 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
 
     }
 
-    /* Write the resulting term into the Nix store directory. */
-    auto drvPath = writeDerivation(*state.store, drv, state.repair);
+    /* Write the resulting term into the Nix store directory. Since
+       evaluation can produce many derivations, the store may batch
+       these writes; it sends the pending ones before any request
+       that could refer to them. */
+    auto drvPath = writeDerivation(*state.store, drv, state.repair, false, true);
     auto drvPathS = state.store->printStorePath(drvPath);
 
     printMsg(lvlChatty, "instantiated '%1%' -> '%2%'", drvName, drvPathS);
@@ -1348,7 +1365,10 @@ static void prim_pathExists(EvalState & state, const Pos & pos, Value * * args,
     }
 
     try {
-        mkBool(v, pathExists(state.checkSourcePath(path)));
+        auto realPath = state.checkSourcePath(path);
+        if (pos.file.set())
+            state.addReadDependency(pos.file, realPath);
+        mkBool(v, pathExists(realPath));
     } catch (SysError & e) {
         /* Don't give away info from errors while canonicalising
            ‘path’ in restricted mode. */
@@ -1421,10 +1441,61 @@ static void prim_readFile(EvalState & state, const Pos & pos, Value * * args, Va
             .errPos = pos
         });
     }
-    string s = readFile(state.checkSourcePath(state.toRealPath(path, context)));
-    if (s.find((char) 0) != string::npos)
+    auto realPath = state.checkSourcePath(state.toRealPath(path, context));
+
+    if (pos.file.set())
+        state.addReadDependency(pos.file, realPath);
+
+    AutoCloseFD fd = open(realPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening file '%1%'", realPath);
+
+    struct stat st;
+    if (fstat(fd.get(), &st))
+        throw SysError("statting file '%1%'", realPath);
+
+    /* For regular files, read the contents straight into the string
+       that becomes the value, rather than into a std::string that is
+       then copied. Other files (e.g. in /proc) may not report their
+       size. The file may also change size after fstat(), so read
+       until EOF rather than exactly st_size bytes. */
+    const char * s;
+    size_t size;
+    if (S_ISREG(st.st_mode)) {
+        size_t capacity = st.st_size;
+        auto buf = allocString(capacity + 1);
+        size = 0;
+        while (size < capacity) {
+            checkInterrupt();
+            ssize_t n = read(fd.get(), buf + size, capacity - size);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading file '%1%'", realPath);
+            }
+            if (n == 0) break;
+            size += n;
+        }
+        auto rest = drainFD(fd.get());
+        if (!rest.empty()) {
+            auto buf2 = allocString(size + rest.size() + 1);
+            memcpy(buf2, buf, size);
+            memcpy(buf2 + size, rest.data(), rest.size());
+            size += rest.size();
+            buf = buf2;
+        }
+        buf[size] = 0;
+        s = buf;
+    } else {
+        auto contents = readFile(fd.get());
+        size = contents.size();
+        auto buf = allocString(size + 1);
+        memcpy(buf, contents.c_str(), size + 1);
+        s = buf;
+    }
+
+    if (memchr(s, 0, size))
         throw Error("the contents of the file '%1%' cannot be represented as a Nix string", path);
-    mkString(v, s.c_str());
+    v.mkString(s);
 }
 
 static RegisterPrimOp primop_readFile({
@@ -1499,9 +1570,12 @@ static void prim_hashFile(EvalState & state, const Pos & pos, Value * * args, Va
       });
 
     PathSet context; // discarded
-    Path p = state.coerceToPath(pos, *args[1], context);
+    Path p = state.checkSourcePath(state.coerceToPath(pos, *args[1], context));
 
-    mkString(v, hashFile(*ht, state.checkSourcePath(p)).to_string(Base16, false), context);
+    if (pos.file.set())
+        state.addReadDependency(pos.file, p);
+
+    mkString(v, hashFile(*ht, p).to_string(Base16, false), context);
 }
 
 static RegisterPrimOp primop_hashFile({
@@ -1510,7 +1584,7 @@ static RegisterPrimOp primop_hashFile({
     .doc = R"(
       Return a base-16 representation of the cryptographic hash of the
       file at path *p*. The hash algorithm specified by *type* must be one
-      of `"md5"`, `"sha1"`, `"sha256"` or `"sha512"`.
+      of `"md5"`, `"sha1"`, `"sha256"`, `"sha512"` or `"blake3"`.
     )",
     .fun = prim_hashFile,
 });
@@ -1529,7 +1603,12 @@ static void prim_readDir(EvalState & state, const Pos & pos, Value * * args, Val
         });
     }
 
-    DirEntries entries = readDirectory(state.checkSourcePath(path));
+    auto realPath = state.checkSourcePath(path);
+
+    if (pos.file.set())
+        state.addReadDependency(pos.file, realPath);
+
+    DirEntries entries = readDirectory(realPath);
     state.mkAttrs(v, entries.size());
 
     for (auto & ent : entries) {
@@ -2100,7 +2179,6 @@ void prim_getAttr(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
-    // !!! Should we create a symbol here or just do a lookup?
     Bindings::iterator i = getAttr(
         state,
         "getAttr",
@@ -2131,7 +2209,7 @@ static void prim_unsafeGetAttrPos(EvalState & state, const Pos & pos, Value * *
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
-    Bindings::iterator i = args[1]->attrs->find(state.symbols.create(attr));
+    Bindings::iterator i = args[1]->attrs->find(state.symbols.lookup(attr));
     if (i == args[1]->attrs->end())
         mkNull(v);
     else
@@ -2149,7 +2227,7 @@ static void prim_hasAttr(EvalState & state, const Pos & pos, Value * * args, Val
 {
     string attr = state.forceStringNoCtx(*args[0], pos);
     state.forceAttrs(*args[1], pos);
-    mkBool(v, args[1]->attrs->find(state.symbols.create(attr)) != args[1]->attrs->end());
+    mkBool(v, args[1]->attrs->find(state.symbols.lookup(attr)) != args[1]->attrs->end());
 }
 
 static RegisterPrimOp primop_hasAttr({
@@ -2188,7 +2266,8 @@ static void prim_removeAttrs(EvalState & state, const Pos & pos, Value * * args,
     std::set<Symbol> names;
     for (unsigned int i = 0; i < args[1]->listSize(); ++i) {
         state.forceStringNoCtx(*args[1]->listElems()[i], pos);
-        names.insert(state.symbols.create(args[1]->listElems()[i]->string.s));
+        if (auto name = state.symbols.lookup(args[1]->listElems()[i]->string.s); name.set())
+            names.insert(name);
     }
 
     /* Copy all attributes not in that set.  Note that we don't need
@@ -2559,25 +2638,34 @@ static void prim_filter(EvalState & state, const Pos & pos, Value * * args, Valu
     state.forceFunction(*args[0], pos);
     state.forceList(*args[1], pos);
 
-    // FIXME: putting this on the stack is risky.
-    Value * vs[args[1]->listSize()];
-    unsigned int k = 0;
+    auto len = args[1]->listSize();
+
+    /* Collect the selected elements in a list of the maximum possible
+       size, which is then shrunk, rather than in a temporary array
+       that has to be copied. Lists of up to two elements are stored
+       inline in the Value, so those still need a copy. */
+    Value vList;
+    state.mkList(vList, len);
+    size_t k = 0;
 
     bool same = true;
-    for (unsigned int n = 0; n < args[1]->listSize(); ++n) {
+    for (size_t n = 0; n < len; ++n) {
         Value res;
         state.callFunction(*args[0], *args[1]->listElems()[n], res, noPos);
         if (state.forceBool(res, pos))
-            vs[k++] = args[1]->listElems()[n];
+            vList.listElems()[k++] = args[1]->listElems()[n];
         else
             same = false;
     }
 
     if (same)
         v = *args[1];
-    else {
+    else if (k > 2) {
+        vList.bigList.size = k;
+        v = vList;
+    } else {
         state.mkList(v, k);
-        for (unsigned int n = 0; n < k; ++n) v.listElems()[n] = vs[n];
+        for (size_t n = 0; n < k; ++n) v.listElems()[n] = vList.listElems()[n];
     }
 }
 
@@ -2782,12 +2870,14 @@ static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value
     }
 
 
-    auto comparator = [&](Value * a, Value * b) {
-        /* Optimization: if the comparator is lessThan, bypass
-           callFunction. */
-        if (args[0]->isPrimOp() && args[0]->primOp->fun == prim_lessThan)
-            return CompareValues()(a, b);
+    /* Optimization: if the comparator is lessThan, bypass
+       callFunction. */
+    if (args[0]->isPrimOp() && args[0]->primOp->fun == prim_lessThan) {
+        std::stable_sort(v.listElems(), v.listElems() + len, CompareValues());
+        return;
+    }
 
+    auto comparator = [&](Value * a, Value * b) {
         Value vTmp1, vTmp2;
         state.callFunction(*args[0], *a, vTmp1, pos);
         state.callFunction(vTmp1, *b, vTmp2, pos);
@@ -2821,6 +2911,58 @@ static RegisterPrimOp primop_sort({
     .fun = prim_sort,
 });
 
+static void prim_sortOn(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.forceFunction(*args[0], pos);
+    state.forceList(*args[1], pos);
+
+    auto len = args[1]->listSize();
+
+    /* Compute the key of every element once, rather than calling a
+       comparator function for every comparison. */
+    ValueVector keys;
+    keys.reserve(len);
+    for (size_t n = 0; n < len; ++n) {
+        auto vKey = state.allocValue();
+        state.callFunction(*args[0], *args[1]->listElems()[n], *vKey, pos);
+        state.forceValue(*vKey, pos);
+        keys.push_back(vKey);
+    }
+
+    std::vector<size_t> order(len);
+    for (size_t n = 0; n < len; ++n) order[n] = n;
+
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return CompareValues()(keys[a], keys[b]);
+    });
+
+    state.mkList(v, len);
+    for (size_t n = 0; n < len; ++n)
+        v.listElems()[n] = args[1]->listElems()[order[n]];
+}
+
+static RegisterPrimOp primop_sortOn({
+    .name = "__sortOn",
+    .args = {"f", "list"},
+    .doc = R"(
+      Return *list* sorted in ascending order of the keys computed by
+      applying *f* to each element. The keys are compared like
+      `builtins.lessThan` does, so they must all be numbers, all
+      strings or all paths. For example,
+
+      ```nix
+      builtins.sortOn (x: x.key) [ { key = 2; } { key = 1; } ]
+      ```
+
+      produces the list `[ { key = 1; } { key = 2; } ]`.
+
+      This is equivalent to `builtins.sort (a: b: f a < f b) list`, but
+      calls *f* only once per element. Like `builtins.sort`, it is a
+      stable sort.
+    )",
+    .fun = prim_sortOn,
+});
+
 static void prim_partition(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
@@ -3203,14 +3345,26 @@ static RegisterPrimOp primop_hashString({
     .doc = R"(
       Return a base-16 representation of the cryptographic hash of string
       *s*. The hash algorithm specified by *type* must be one of `"md5"`,
-      `"sha1"`, `"sha256"` or `"sha512"`.
+      `"sha1"`, `"sha256"`, `"sha512"` or `"blake3"`.
     )",
     .fun = prim_hashString,
 });
 
+/* Compiled regular expressions, shared by builtins.match and
+   builtins.split. Compiling a std::regex is much more expensive than
+   matching it, and the same handful of patterns tend to be applied
+   to every element of a package set. */
 struct RegexCache
 {
     std::unordered_map<std::string, std::regex> cache;
+
+    const std::regex & get(const std::string & re)
+    {
+        auto i = cache.find(re);
+        if (i == cache.end())
+            i = cache.emplace(re, std::regex(re, std::regex::extended)).first;
+        return i->second;
+    }
 };
 
 std::shared_ptr<RegexCache> makeRegexCache()
@@ -3224,15 +3378,13 @@ void prim_match(EvalState & state, const Pos & pos, Value * * args, Value & v)
 
     try {
 
-        auto regex = state.regexCache->cache.find(re);
-        if (regex == state.regexCache->cache.end())
-            regex = state.regexCache->cache.emplace(re, std::regex(re, std::regex::extended)).first;
+        auto & regex = state.regexCache->get(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
 
         std::smatch match;
-        if (!std::regex_match(str, match, regex->second)) {
+        if (!std::regex_match(str, match, regex)) {
             mkNull(v);
             return;
         }
@@ -3301,13 +3453,13 @@ static RegisterPrimOp primop_match({
 
 /* Split a string with a regular expression, and return a list of the
    non-matching parts interleaved by the lists of the matching groups. */
-static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v)
+void prim_split(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     auto re = state.forceStringNoCtx(*args[0], pos);
 
     try {
 
-        std::regex regex(re, std::regex::extended);
+        auto & regex = state.regexCache->get(re);
 
         PathSet context;
         const std::string str = state.forceString(*args[1], context, pos);
@@ -3697,9 +3849,14 @@ void EvalState::createBaseEnv()
     /* Add a wrapper around the derivation primop that computes the
        `drvPath' and `outPath' attributes lazily. */
     sDerivationNix = symbols.create("//builtin/derivation.nix");
-    eval(parse(
-        #include "primops/derivation.nix.gen.hh"
-        , foFile, sDerivationNix, "/", staticBaseEnv), v);
+    {
+        char code[] =
+            #include "primops/derivation.nix.gen.hh"
+            // The parser needs two NUL terminators; the second one is
+            // implied by this being a C string.
+            "\0";
+        eval(parse(code, sizeof(code), foFile, sDerivationNix, "/", staticBaseEnv), v);
+    }
     addConstant("derivation", v);
 
     /* Now that we've added all primops, sort the `builtins' set,
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <map>
-#include <unordered_set>
+#include <string_view>
+#include <vector>
 
 #include "types.hh"
 
@@ -70,28 +73,96 @@ public:
 class SymbolTable
 {
 private:
-    typedef std::unordered_set<string> Symbols;
-    Symbols symbols;
+    /* The strings live in a deque, which never moves its elements, so
+       symbols stay valid as the table grows. They are indexed by a
+       flat open-addressing hash table with linear probing; each slot
+       keeps the hash of its string so that probing and rehashing
+       don't need to touch the strings themselves.
+
+       The table is not thread-safe. The evaluator is single-threaded,
+       so it isn't shared between threads; a parallel evaluator would
+       have to serialise access to it. */
+    struct Slot
+    {
+        size_t hash;
+        const string * s = nullptr;
+    };
+
+    std::deque<string> store;
+    std::vector<Slot> slots;
+    size_t totalSize_ = 0;
+
+    static size_t hash(std::string_view s)
+    {
+        return std::hash<std::string_view>()(s);
+    }
+
+    /* Return the index of the slot of 's', or of the empty slot
+       where it would go. */
+    size_t probe(std::string_view s, size_t h) const
+    {
+        auto mask = slots.size() - 1;
+        for (auto i = h & mask; ; i = (i + 1) & mask) {
+            auto & slot = slots[i];
+            if (!slot.s || (slot.hash == h && *slot.s == s))
+                return i;
+        }
+    }
+
+    void grow()
+    {
+        std::vector<Slot> newSlots(std::max<size_t>(slots.size() * 2, 1024));
+        auto mask = newSlots.size() - 1;
+        for (auto & slot : slots) {
+            if (!slot.s) continue;
+            auto i = slot.hash & mask;
+            while (newSlots[i].s) i = (i + 1) & mask;
+            newSlots[i] = slot;
+        }
+        slots = std::move(newSlots);
+    }
 
 public:
     Symbol create(std::string_view s)
     {
-        // FIXME: avoid allocation if 's' already exists in the symbol table.
-        std::pair<Symbols::iterator, bool> res = symbols.emplace(std::string(s));
-        return Symbol(&*res.first);
+        auto h = hash(s);
+        /* Keep the load factor below one half. */
+        if (2 * (store.size() + 1) > slots.size())
+            grow();
+        auto & slot = slots[probe(s, h)];
+        if (!slot.s) {
+            slot.hash = h;
+            slot.s = &store.emplace_back(s);
+            totalSize_ += s.size();
+        }
+        return Symbol(slot.s);
+    }
+
+    /* Return the symbol for 's' if it exists, or an unset symbol
+       otherwise. Unlike create(), this doesn't grow the table, so it
+       is preferable for names that are only used to query an
+       attribute set: if there is no such symbol, no attribute can
+       have that name. */
+    Symbol lookup(std::string_view s) const
+    {
+        if (slots.empty()) return Symbol();
+        return Symbol(slots[probe(s, hash(s))].s);
     }
 
     size_t size() const
     {
-        return symbols.size();
+        return store.size();
     }
 
-    size_t totalSize() const;
+    size_t totalSize() const
+    {
+        return totalSize_;
+    }
 
     template<typename T>
-    void dump(T callback)
+    void dump(T callback) const
     {
-        for (auto & s : symbols)
+        for (auto & s : store)
             callback(s);
     }
 };
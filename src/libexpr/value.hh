@@ -104,6 +104,11 @@ class ExternalValueBase
 std::ostream & operator << (std::ostream & str, const ExternalValueBase & v);
 
 
+/* A value in the Nix language. This is the most frequently allocated
+   object in the evaluator, so its size matters: it consists of a type
+   tag and a union of at most two pointers, i.e. 24 bytes on 64-bit
+   platforms. Don't add members to the union that are larger than two
+   pointers. */
 struct Value
 {
 private:
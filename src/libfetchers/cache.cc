@@ -1,6 +1,7 @@
 #include "cache.hh"
 #include "sqlite.hh"
 #include "sync.hh"
+#include "lru-cache.hh"
 #include "store-api.hh"
 
 #include <nlohmann/json.hpp>
@@ -21,10 +22,24 @@ create table if not exists Cache (
 
 struct CacheImpl : Cache
 {
+    struct Entry
+    {
+        Attrs infoAttrs;
+        Path storePath;
+        bool immutable;
+        time_t timestamp;
+    };
+
     struct State
     {
         SQLite db;
         SQLiteStmt add, lookup;
+
+        /* Recently used entries, keyed on the JSON encoding of their
+           input attributes, so that repeated lookups of the same input
+           (e.g. while locking a flake) don't go to the database and
+           re-parse the JSON every time. */
+        LRUCache<std::string, Entry> recent{1024};
     };
 
     Sync<State> _state;
@@ -54,12 +69,20 @@ struct CacheImpl : Cache
         const StorePath & storePath,
         bool immutable) override
     {
-        _state.lock()->add.use()
-            (attrsToJSON(inAttrs).dump())
+        auto state(_state.lock());
+
+        auto inAttrsJSON = attrsToJSON(inAttrs).dump();
+        auto now = time(0);
+
+        state->add.use()
+            (inAttrsJSON)
             (attrsToJSON(infoAttrs).dump())
             (store->printStorePath(storePath))
             (immutable)
-            (time(0)).exec();
+            (now).exec();
+
+        state->recent.upsert(inAttrsJSON,
+            Entry { infoAttrs, store->printStorePath(storePath), immutable, now });
     }
 
     std::optional<std::pair<Attrs, StorePath>> lookup(
@@ -83,16 +106,25 @@ struct CacheImpl : Cache
 
         auto inAttrsJSON = attrsToJSON(inAttrs).dump();
 
-        auto stmt(state->lookup.use()(inAttrsJSON));
-        if (!stmt.next()) {
-            debug("did not find cache entry for '%s'", inAttrsJSON);
-            return {};
+        auto entry = state->recent.get(inAttrsJSON);
+
+        if (!entry) {
+            auto stmt(state->lookup.use()(inAttrsJSON));
+            if (!stmt.next()) {
+                debug("did not find cache entry for '%s'", inAttrsJSON);
+                return {};
+            }
+
+            entry = Entry {
+                .infoAttrs = jsonToAttrs(nlohmann::json::parse(stmt.getStr(0))),
+                .storePath = stmt.getStr(1),
+                .immutable = stmt.getInt(2) != 0,
+                .timestamp = stmt.getInt(3),
+            };
+            state->recent.upsert(inAttrsJSON, *entry);
         }
 
-        auto infoJSON = stmt.getStr(0);
-        auto storePath = store->parseStorePath(stmt.getStr(1));
-        auto immutable = stmt.getInt(2) != 0;
-        auto timestamp = stmt.getInt(3);
+        auto storePath = store->parseStorePath(entry->storePath);
 
         store->addTempRoot(storePath);
         if (!store->isValidPath(storePath)) {
@@ -101,12 +133,12 @@ struct CacheImpl : Cache
             return {};
         }
 
-        debug("using cache entry '%s' -> '%s', '%s'",
-            inAttrsJSON, infoJSON, store->printStorePath(storePath));
+        debug("using cache entry '%s' -> '%s'",
+            inAttrsJSON, store->printStorePath(storePath));
 
         return Result {
-            .expired = !immutable && (settings.tarballTtl.get() == 0 || timestamp + settings.tarballTtl < time(0)),
-            .infoAttrs = jsonToAttrs(nlohmann::json::parse(infoJSON)),
+            .expired = !entry->immutable && (settings.tarballTtl.get() == 0 || entry->timestamp + settings.tarballTtl < time(0)),
+            .infoAttrs = std::move(entry->infoAttrs),
             .storePath = std::move(storePath)
         };
     }
@@ -118,4 +150,55 @@ ref<Cache> getCache()
     return ref<Cache>(cache);
 }
 
+std::optional<Hash> fingerprintSourceTree(const Path & path)
+{
+    HashSink sink(htSHA256);
+    auto now = time(0);
+    bool racy = false;
+
+    std::function<void(const Path &)> walk;
+    walk = [&](const Path & p) {
+        auto st = lstat(p);
+        if (st.st_mtime >= now - 1 || st.st_ctime >= now - 1) racy = true;
+        sink << p << st.st_mode << st.st_size << st.st_ino << st.st_mtime << st.st_ctime;
+        if (S_ISDIR(st.st_mode)) {
+            auto entries = readDirectory(p);
+            std::sort(entries.begin(), entries.end(),
+                [](const DirEntry & a, const DirEntry & b) { return a.name < b.name; });
+            for (auto & i : entries)
+                walk(p + "/" + i.name);
+        }
+    };
+    walk(path);
+
+    if (racy) return {};
+    return sink.finish().first;
+}
+
+StorePath addSourceTreeCached(
+    ref<Store> store,
+    const Path & path,
+    std::string_view name,
+    std::function<StorePath()> add)
+{
+    if (!settings.cacheSourceImports) return add();
+
+    auto fingerprint = fingerprintSourceTree(path);
+    if (!fingerprint) return add();
+
+    Attrs key({
+        {"type", "source-import"},
+        {"path", path},
+        {"name", std::string(name)},
+        {"fingerprint", fingerprint->to_string(Base32, false)},
+    });
+
+    if (auto res = getCache()->lookup(store, key))
+        return std::move(res->second);
+
+    auto storePath = add();
+    getCache()->add(store, key, {}, storePath, true);
+    return storePath;
+}
+
 }
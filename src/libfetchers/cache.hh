@@ -33,4 +33,21 @@ struct Cache
 
 ref<Cache> getCache();
 
+/* Hash the names, types, sizes, inodes and timestamps of every file in
+   the tree rooted at 'path', in the spirit of Git's index. Returns
+   nothing if some file was modified too recently for its timestamps
+   to be trusted, since it could still change within the same
+   second. */
+std::optional<Hash> fingerprintSourceTree(const Path & path);
+
+/* Return the store path under which the source tree 'path' was
+   previously added as 'name', if 'cache-source-imports' is enabled and
+   the tree's fingerprint hasn't changed. Otherwise call 'add' and
+   remember its result. */
+StorePath addSourceTreeCached(
+    ref<Store> store,
+    const Path & path,
+    std::string_view name,
+    std::function<StorePath()> add);
+
 }
@@ -17,6 +17,45 @@ static std::string readHead(const Path & path)
     return chomp(runProgram("git", true, { "-C", path, "rev-parse", "--abbrev-ref", "HEAD" }));
 }
 
+/* Return the committer timestamp of a raw commit object, as printed by
+   'git cat-file commit'. */
+static std::optional<uint64_t> parseCommitterTime(const std::string & commit)
+{
+    auto headerEnd = commit.find("\n\n");
+    auto pos = commit.rfind("\ncommitter ", headerEnd);
+    if (pos == std::string::npos) return std::nullopt;
+    auto eol = commit.find('\n', pos + 1);
+    auto fields = tokenizeString<std::vector<std::string>>(
+        commit.substr(pos + 1, eol == std::string::npos ? std::string::npos : eol - pos - 1), " ");
+    if (fields.size() < 3) return std::nullopt;
+    return string2Int<uint64_t>(fields[fields.size() - 2]);
+}
+
+/* Hash the names and stat information of the given files in 'root',
+   like the git index does. Returns nothing if a file was changed too
+   recently for its timestamps to be trusted. */
+static std::optional<Hash> fingerprintFiles(const Path & root, const std::set<std::string> & files)
+{
+    HashSink sink(htSHA256);
+    auto now = time(0);
+
+    for (auto & file : files) {
+        struct stat st;
+        sink << file;
+        if (lstat((root + "/" + file).c_str(), &st)) {
+            if (errno != ENOENT && errno != ENOTDIR)
+                throw SysError("getting status of '%s'", root + "/" + file);
+            sink << "missing";
+            continue;
+        }
+        if (st.st_mtime >= now - 1 || st.st_ctime >= now - 1)
+            return std::nullopt;
+        sink << st.st_mode << st.st_size << st.st_ino << st.st_mtime << st.st_ctime;
+    }
+
+    return sink.finish().first;
+}
+
 static bool isNotDotGitDirectory(const Path & path)
 {
     static const std::regex gitDirRegex("^(?:.*/)?\\.git$");
@@ -270,7 +309,28 @@ struct GitInputScheme : InputScheme
                     return files.count(file);
                 };
 
-                auto storePath = store->addToStore(input.getName(), actualUrl, FileIngestionMethod::Recursive, htSHA256, filter);
+                /* If none of the tracked files changed since we last
+                   copied this tree, reuse the result without reading
+                   the files again. */
+                std::optional<Attrs> dirtyAttrs;
+                if (auto fingerprint = fingerprintFiles(actualUrl, files))
+                    dirtyAttrs = Attrs({
+                        {"type", "git-dirty"},
+                        {"name", input.getName()},
+                        {"url", actualUrl},
+                        {"fingerprint", fingerprint->to_string(Base32, false)},
+                    });
+
+                std::optional<StorePath> storePath;
+                if (dirtyAttrs)
+                    if (auto res = getCache()->lookup(store, *dirtyAttrs))
+                        storePath = std::move(res->second);
+
+                if (!storePath) {
+                    storePath = store->addToStore(input.getName(), actualUrl, FileIngestionMethod::Recursive, htSHA256, filter);
+                    if (dirtyAttrs)
+                        getCache()->add(store, *dirtyAttrs, {}, *storePath, true);
+                }
 
                 // FIXME: maybe we should use the timestamp of the last
                 // modified dirty file?
@@ -279,7 +339,7 @@ struct GitInputScheme : InputScheme
                     haveCommits ? std::stoull(runProgram("git", true, { "-C", actualUrl, "log", "-1", "--format=%ct", "--no-show-signature", "HEAD" })) : 0);
 
                 return {
-                    Tree(store->toRealPath(storePath), std::move(storePath)),
+                    Tree(store->toRealPath(*storePath), std::move(*storePath)),
                     input
                 };
             }
@@ -314,7 +374,10 @@ struct GitInputScheme : InputScheme
                 }
             }
 
-            Path cacheDir = getCacheDir() + "/nix/gitv3/" + hashString(htSHA256, actualUrl).to_string(Base32, false);
+            /* Shallow clones are kept apart from full ones, since a
+               full fetch can't use a shallow repository. */
+            Path cacheDir = getCacheDir() + "/nix/gitv3/" + hashString(htSHA256, actualUrl).to_string(Base32, false)
+                + (shallow ? "-shallow" : "");
             repoDir = cacheDir;
 
             if (!pathExists(cacheDir)) {
@@ -369,7 +432,32 @@ struct GitInputScheme : InputScheme
                             : ref == "HEAD"
                                 ? *ref
                                 : "refs/heads/" + *ref;
-                    runProgram("git", true, { "-C", repoDir, "fetch", "--quiet", "--force", "--", actualUrl, fmt("%s:%s", fetchRef, fetchRef) });
+                    auto fetch = [&](bool depth, bool askForRev) {
+                        Strings fetchArgs{"-C", repoDir, "fetch", "--quiet", "--force"};
+                        if (depth) fetchArgs.push_back("--depth=1");
+                        fetchArgs.push_back("--");
+                        fetchArgs.push_back(actualUrl);
+                        if (askForRev)
+                            fetchArgs.push_back(input.getRev()->gitRev());
+                        fetchArgs.push_back(fmt("%s:%s", fetchRef, fetchRef));
+                        runProgram("git", true, fetchArgs);
+                    };
+                    if (shallow && input.getRev()) {
+                        /* A shallow fetch of a ref only gets its tip,
+                           so also ask for the revision itself. Servers
+                           that don't allow fetching unadvertised
+                           commits (uploadpack.allowReachableSHA1InWant)
+                           refuse that, so then fetch the whole history
+                           of the ref instead. */
+                        try {
+                            fetch(true, true);
+                        } catch (ExecError & e) {
+                            debug("shallow fetch of revision '%s' failed, fetching the full history of '%s'",
+                                input.getRev()->gitRev(), fetchRef);
+                            fetch(false, false);
+                        }
+                    } else
+                        fetch(shallow, false);
                 } catch (Error & e) {
                     if (!pathExists(localRefFile)) throw;
                     warn("could not update local clone of Git repository '%s'; continuing with the most recent version", actualUrl);
@@ -458,11 +546,15 @@ struct GitInputScheme : InputScheme
 
         auto storePath = store->addToStore(name, tmpDir, FileIngestionMethod::Recursive, htSHA256, filter);
 
-        auto lastModified = std::stoull(runProgram("git", true, { "-C", repoDir, "log", "-1", "--format=%ct", "--no-show-signature", input.getRev()->gitRev() }));
+        /* The commit object we already read contains the commit time,
+           so avoid running 'git log' for it. */
+        auto lastModified = WEXITSTATUS(result.first) == 0 ? parseCommitterTime(result.second) : std::nullopt;
+        if (!lastModified)
+            lastModified = std::stoull(runProgram("git", true, { "-C", repoDir, "log", "-1", "--format=%ct", "--no-show-signature", input.getRev()->gitRev() }));
 
         Attrs infoAttrs({
             {"rev", input.getRev()->gitRev()},
-            {"lastModified", lastModified},
+            {"lastModified", *lastModified},
         });
 
         if (!shallow)
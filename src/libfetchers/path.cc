@@ -1,5 +1,6 @@
 #include "fetchers.hh"
 #include "store-api.hh"
+#include "cache.hh"
 
 namespace nix::fetchers {
 
@@ -109,7 +110,9 @@ struct PathInputScheme : InputScheme
 
         if (!storePath || storePath->name() != "source" || !store->isValidPath(*storePath))
             // FIXME: try to substitute storePath.
-            storePath = store->addToStore("source", absPath);
+            storePath = addSourceTreeCached(store, absPath, "source", [&]() {
+                return store->addToStore("source", absPath);
+            });
 
         return {
             Tree(store->toRealPath(*storePath), std::move(*storePath)),
@@ -4,8 +4,11 @@
 #include "globals.hh"
 #include "store-api.hh"
 #include "local-fs-store.hh"
+#include "cache.hh"
+#include "filetransfer.hh"
 
 #include <nlohmann/json.hpp>
+#include <thread>
 
 namespace nix::fetchers {
 
@@ -153,10 +156,56 @@ static std::shared_ptr<Registry> getGlobalRegistry(ref<Store> store)
         auto path = settings.flakeRegistry.get();
 
         if (!hasPrefix(path, "/")) {
-            auto storePath = downloadFile(store, path, "flake-registry.json", false).storePath;
+            /* If we have a copy of the registry that has merely expired,
+               use it rather than wait for the network, and refresh it
+               in the background for the next invocation. A TTL of 0
+               (e.g. --refresh) asks for a fresh copy, so wait then. */
+            auto cached = getCache()->lookupExpired(store, {
+                {"type", "file"},
+                {"url", path},
+                {"name", "flake-registry.json"},
+            });
+
+            std::optional<StorePath> storePath;
+
+            if (cached && cached->expired && settings.tarballTtl.get() != 0) {
+                storePath = cached->storePath;
+
+                /* Make sure the file transfer and cache singletons
+                   outlive the refresh thread, which is joined on
+                   exit. */
+                getFileTransfer();
+
+                struct Refresh
+                {
+                    std::thread thread;
+                    ~Refresh()
+                    {
+                        if (!thread.joinable()) return;
+                        /* Don't make Nix wait for the download on
+                           exit. Interrupting aborts the transfer, and
+                           the refresh is simply tried again next
+                           time. */
+                        _isInterrupted = true;
+                        thread.join();
+                        _isInterrupted = false;
+                    }
+                };
+
+                static Refresh refresh;
+                refresh.thread = std::thread([store, path]() {
+                    try {
+                        downloadFile(store, path, "flake-registry.json", false);
+                    } catch (std::exception & e) {
+                        debug("cannot refresh the global flake registry: %s", e.what());
+                    }
+                });
+            } else
+                storePath = downloadFile(store, path, "flake-registry.json", false).storePath;
+
             if (auto store2 = store.dynamic_pointer_cast<LocalFSStore>())
-                store2->addPermRoot(storePath, getCacheDir() + "/nix/flake-registry.json");
-            path = store->toRealPath(storePath);
+                store2->addPermRoot(*storePath, getCacheDir() + "/nix/flake-registry.json");
+            path = store->toRealPath(*storePath);
         }
 
         return Registry::read(path, Registry::Global);
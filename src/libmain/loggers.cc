@@ -48,6 +48,19 @@ void setLogFormat(const LogFormat & logFormat) {
 
 void createDefaultLogger() {
     logger = makeDefaultLogger();
+    wrapLoggerForTracing();
+}
+
+void wrapLoggerForTracing() {
+    /* Take the variable out of the environment the first time, so
+       that Nix processes we run don't truncate our trace file. */
+    static auto traceFile = []() {
+        auto traceFile = getEnv("NIX_TRACE_FILE");
+        unsetenv("NIX_TRACE_FILE");
+        return traceFile;
+    }();
+    if (traceFile && !traceFile->empty())
+        logger = makeTracingLogger(*logger, *traceFile);
 }
 
 }
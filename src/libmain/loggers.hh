@@ -17,4 +17,9 @@ void setLogFormat(const LogFormat & logFormat);
 
 void createDefaultLogger();
 
+/* Wrap `logger' in a tracing logger if NIX_TRACE_FILE is set. This
+   is done by initNix(); call it again whenever `logger' is
+   replaced. */
+void wrapLoggerForTracing();
+
 }
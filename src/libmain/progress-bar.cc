@@ -1,4 +1,5 @@
 #include "progress-bar.hh"
+#include "loggers.hh"
 #include "util.hh"
 #include "sync.hh"
 #include "store-api.hh"
@@ -50,12 +51,23 @@ private:
         std::optional<std::string> name;
     };
 
+    /* Aggregate progress of the activities of one type. The totals of
+       running activities are kept up to date incrementally, so that
+       rendering the status doesn't have to visit every activity. */
     struct ActivitiesByType
     {
-        std::map<ActivityId, std::list<ActInfo>::iterator> its;
+        /* Totals of activities that have finished. */
         uint64_t done = 0;
-        uint64_t expected = 0;
         uint64_t failed = 0;
+
+        /* The sum of the expected counts set by resSetExpected. */
+        uint64_t expected = 0;
+
+        /* Totals of activities that are still running. */
+        uint64_t runningDone = 0;
+        uint64_t runningExpected = 0;
+        uint64_t running = 0;
+        uint64_t runningFailed = 0;
     };
 
     struct State
@@ -71,6 +83,10 @@ private:
 
         bool active = true;
         bool haveUpdate = true;
+
+        /* The status line as last drawn, so that it can be restored
+           cheaply after printing a log message. */
+        std::string statusLine;
     };
 
     Sync<State> state_;
@@ -140,8 +156,10 @@ public:
     void log(State & state, Verbosity lvl, const std::string & s)
     {
         if (state.active) {
-            writeToStderr("\r\e[K" + filterANSIEscapes(s, !isTTY) + ANSI_NORMAL "\n");
-            draw(state);
+            /* Redraw the previous status line rather than recomputing
+               it; if it is out of date, the update thread will redraw
+               it soon. */
+            writeToStderr("\r\e[K" + filterANSIEscapes(s, !isTTY) + ANSI_NORMAL "\n" + state.statusLine);
         } else {
             auto s2 = s + ANSI_NORMAL "\n";
             if (!isTTY) s2 = filterANSIEscapes(s2, true);
@@ -163,7 +181,6 @@ public:
         i->type = type;
         i->parent = parent;
         state->its.emplace(act, i);
-        state->activitiesByType[type].its.emplace(act, i);
 
         if (type == actBuild) {
             std::string name(storePathToName(getS(fields, 0)));
@@ -231,14 +248,18 @@ public:
         auto i = state->its.find(act);
         if (i != state->its.end()) {
 
-            auto & actByType = state->activitiesByType[i->second->type];
-            actByType.done += i->second->done;
-            actByType.failed += i->second->failed;
+            auto & info = *i->second;
+            auto & actByType = state->activitiesByType[info.type];
+            actByType.done += info.done;
+            actByType.failed += info.failed;
+            actByType.runningDone -= info.done;
+            actByType.runningExpected -= info.expected;
+            actByType.running -= info.running;
+            actByType.runningFailed -= info.failed;
 
-            for (auto & j : i->second->expectedByType)
+            for (auto & j : info.expectedByType)
                 state->activitiesByType[j.first].expected -= j.second;
 
-            actByType.its.erase(act);
             state->activities.erase(i->second);
             state->its.erase(i);
         }
@@ -248,6 +269,31 @@ public:
 
     void result(ActivityId act, ResultType type, const std::vector<Field> & fields) override
     {
+        if (type == resBuildLogLine || type == resPostBuildLogLine) {
+            /* Build logs are by far the most frequent results, so do
+               as little as possible while holding the lock. */
+            auto lastLine = chomp(getS(fields, 0));
+            if (lastLine.empty()) return;
+
+            auto state(state_.lock());
+            auto i = state->its.find(act);
+            assert(i != state->its.end());
+            if (printBuildLogs) {
+                auto suffix = "> ";
+                if (type == resPostBuildLogLine) {
+                    suffix = " (post)> ";
+                }
+                log(*state, lvlInfo, ANSI_FAINT + i->second->name.value_or("unnamed") + suffix + ANSI_NORMAL + lastLine);
+            } else {
+                /* Move the activity to the end of the list, so that
+                   it's the one shown in the status line. */
+                i->second->lastLine = std::move(lastLine);
+                state->activities.splice(state->activities.end(), state->activities, i->second);
+                update(*state);
+            }
+            return;
+        }
+
         auto state(state_.lock());
 
         if (type == resFileLinked) {
@@ -256,28 +302,6 @@ public:
             update(*state);
         }
 
-        else if (type == resBuildLogLine || type == resPostBuildLogLine) {
-            auto lastLine = chomp(getS(fields, 0));
-            if (!lastLine.empty()) {
-                auto i = state->its.find(act);
-                assert(i != state->its.end());
-                ActInfo info = *i->second;
-                if (printBuildLogs) {
-                    auto suffix = "> ";
-                    if (type == resPostBuildLogLine) {
-                        suffix = " (post)> ";
-                    }
-                    log(*state, lvlInfo, ANSI_FAINT + info.name.value_or("unnamed") + suffix + ANSI_NORMAL + lastLine);
-                } else {
-                    state->activities.erase(i->second);
-                    info.lastLine = lastLine;
-                    state->activities.emplace_back(info);
-                    i->second = std::prev(state->activities.end());
-                    update(*state);
-                }
-            }
-        }
-
         else if (type == resUntrustedPath) {
             state->untrustedPaths++;
             update(*state);
@@ -299,10 +323,19 @@ public:
             auto i = state->its.find(act);
             assert(i != state->its.end());
             ActInfo & actInfo = *i->second;
+            auto & actByType = state->activitiesByType[actInfo.type];
+            actByType.runningDone -= actInfo.done;
+            actByType.runningExpected -= actInfo.expected;
+            actByType.running -= actInfo.running;
+            actByType.runningFailed -= actInfo.failed;
             actInfo.done = getI(fields, 0);
             actInfo.expected = getI(fields, 1);
             actInfo.running = getI(fields, 2);
             actInfo.failed = getI(fields, 3);
+            actByType.runningDone += actInfo.done;
+            actByType.runningExpected += actInfo.expected;
+            actByType.running += actInfo.running;
+            actByType.runningFailed += actInfo.failed;
             update(*state);
         }
 
@@ -321,6 +354,9 @@ public:
 
     void update(State & state)
     {
+        /* The update thread only waits for a notification when
+           there's nothing to draw. */
+        if (state.haveUpdate) return;
         state.haveUpdate = true;
         updateCV.notify_one();
     }
@@ -363,7 +399,8 @@ public:
         auto width = getWindowSize().second;
         if (width <= 0) width = std::numeric_limits<decltype(width)>::max();
 
-        writeToStderr("\r" + filterANSIEscapes(line, false, width) + ANSI_NORMAL + "\e[K");
+        state.statusLine = filterANSIEscapes(line, false, width) + ANSI_NORMAL + "\e[K";
+        writeToStderr("\r" + state.statusLine);
     }
 
     std::string getStatus(State & state)
@@ -374,15 +411,10 @@ public:
 
         auto renderActivity = [&](ActivityType type, const std::string & itemFmt, const std::string & numberFmt = "%d", double unit = 1) {
             auto & act = state.activitiesByType[type];
-            uint64_t done = act.done, expected = act.done, running = 0, failed = act.failed;
-            for (auto & j : act.its) {
-                done += j.second->done;
-                expected += j.second->expected;
-                running += j.second->running;
-                failed += j.second->failed;
-            }
-
-            expected = std::max(expected, act.expected);
+            uint64_t done = act.done + act.runningDone;
+            uint64_t expected = std::max(act.done + act.runningExpected, act.expected);
+            uint64_t running = act.running;
+            uint64_t failed = act.failed + act.runningFailed;
 
             std::string s;
 
@@ -491,13 +523,14 @@ Logger * makeProgressBar(bool printBuildLogs)
 void startProgressBar(bool printBuildLogs)
 {
     logger = makeProgressBar(printBuildLogs);
+    wrapLoggerForTracing();
 }
 
 void stopProgressBar()
 {
-    auto progressBar = dynamic_cast<ProgressBar *>(logger);
-    if (progressBar) progressBar->stop();
-
+    /* The progress bar may be wrapped by another logger (e.g. the
+       tracing logger), which passes this on. */
+    logger->stop();
 }
 
 }
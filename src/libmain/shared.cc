@@ -133,6 +133,9 @@ void initNix()
 
     loadConfFile();
 
+    /* Trace every program, not just those that set a log format. */
+    wrapLoggerForTracing();
+
     startSignalHandlerThread();
 
     /* Reset SIGCHLD to its default. */
@@ -12,11 +12,16 @@
 #include "json.hh"
 #include "thread-pool.hh"
 #include "callback.hh"
+#include "finally.hh"
 
 #include <chrono>
 #include <future>
 #include <regex>
 #include <fstream>
+#include <thread>
+
+#include <sys/time.h>
+#include <fcntl.h>
 
 #include <nlohmann/json.hpp>
 
@@ -100,6 +105,44 @@ std::shared_ptr<std::string> BinaryCacheStore::getFile(const std::string & path)
     return sink.s;
 }
 
+std::shared_ptr<FSAccessor> BinaryCacheStore::getNarRangeAccessor(const StorePath & storePath)
+{
+    auto info = std::dynamic_pointer_cast<const NarInfo>(queryPathInfo(storePath).get_ptr());
+    if (!info || info->compression != "none" || info->url == "") return nullptr;
+
+    auto listing = getFile(std::string(storePath.hashPart()) + ".ls");
+    if (!listing) return nullptr;
+
+    auto json = nlohmann::json::parse(*listing, nullptr, false);
+    if (json.is_discarded() || !json.contains("root")) return nullptr;
+
+    /* Listings written by other tools may lack the offsets of the
+       files in the NAR. */
+    std::function<bool(const nlohmann::json &)> hasOffsets;
+    hasOffsets = [&](const nlohmann::json & v) {
+        auto type = v.value("type", "");
+        if (type == "regular")
+            return v.contains("narOffset");
+        if (type == "directory" && v.contains("entries"))
+            for (auto & entry : v["entries"])
+                if (!hasOffsets(entry)) return false;
+        return true;
+    };
+    if (!hasOffsets(json["root"])) return nullptr;
+
+    /* Check that the store can actually serve ranges of the NAR. */
+    if (!getFileRange(info->url, 0, 1)) return nullptr;
+
+    auto url = info->url;
+    return makeLazyNarAccessor(json["root"].dump(),
+        [this, url](uint64_t offset, uint64_t length) {
+            auto data = getFileRange(url, offset, length);
+            if (!data)
+                throw Error("cannot read part of '%s' from binary cache '%s'", url, getUri());
+            return *data;
+        }).get_ptr();
+}
+
 std::string BinaryCacheStore::narInfoFileFor(const StorePath & storePath)
 {
     return std::string(storePath.hashPart()) + ".narinfo";
@@ -114,7 +157,7 @@ void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
     std::string hashPart(narInfo->path.hashPart());
 
     {
-        auto state_(state.lock());
+        auto state_(state(hashPart).lock());
         state_->pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
     }
 
@@ -141,13 +184,32 @@ struct FileSource : FdSource
     }
 };
 
+void BinaryCacheStore::upsertFileFromPath(const std::string & path,
+    const Path & localPath,
+    const std::string & mimeType)
+{
+    upsertFile(path,
+        std::make_shared<std::fstream>(localPath, std::ios_base::in | std::ios_base::binary),
+        mimeType);
+}
+
 ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
     std::function<ValidPathInfo(HashResult)> mkInfo)
 {
-    auto [fdTemp, fnTemp] = createTempFile();
+    auto narInfo = uploadNar(narSource, repair, mkInfo, true);
+    publishNarInfo(narInfo);
+    return narInfo;
+}
+
+ref<NarInfo> BinaryCacheStore::uploadNar(
+    Source & narSource, RepairFlag repair,
+    std::function<ValidPathInfo(HashResult)> mkInfo,
+    bool checkReferences)
+{
+    auto [fdTemp, fnTemp] = createNarTempFile();
 
-    AutoDelete autoDelete(fnTemp);
+    AutoDelete autoDelete(fnTemp, false);
 
     auto now1 = std::chrono::steady_clock::now();
 
@@ -160,7 +222,7 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     {
     FdSink fileSink(fdTemp.get());
     TeeSink teeSinkCompressed { fileSink, fileHashSink };
-    auto compressionSink = makeCompressionSink(compression, teeSinkCompressed);
+    auto compressionSink = makeCompressionSink(compression, teeSinkCompressed, parallelCompression, compressionLevel);
     TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
     TeeSource teeSource { narSource, teeSinkUncompressed };
     narAccessor = makeNarAccessor(teeSource);
@@ -193,14 +255,15 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     /* Verify that all references are valid. This may do some .narinfo
        reads, but typically they'll already be cached. */
-    for (auto & ref : info.references)
-        try {
-            if (ref != info.path)
-                queryPathInfo(ref);
-        } catch (InvalidPath &) {
-            throw Error("cannot add '%s' to the binary cache because the reference '%s' is not valid",
-                printStorePath(info.path), printStorePath(ref));
-        }
+    if (checkReferences)
+        for (auto & ref : info.references)
+            try {
+                if (ref != info.path)
+                    queryPathInfo(ref);
+            } catch (InvalidPath &) {
+                throw Error("cannot add '%s' to the binary cache because the reference '%s' is not valid",
+                    printStorePath(info.path), printStorePath(ref));
+            }
 
     /* Optionally write a JSON file containing a listing of the
        contents of the NAR. */
@@ -280,9 +343,7 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     /* Atomically write the NAR file. */
     if (repair || !fileExists(narInfo->url)) {
         stats.narWrite++;
-        upsertFile(narInfo->url,
-            std::make_shared<std::fstream>(fnTemp, std::ios_base::in | std::ios_base::binary),
-            "application/x-nix-nar");
+        upsertFileFromPath(narInfo->url, fnTemp, "application/x-nix-nar");
     } else
         stats.narWriteAverted++;
 
@@ -290,6 +351,11 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     stats.narWriteCompressedBytes += fileSize;
     stats.narWriteCompressionTimeMs += duration;
 
+    return narInfo;
+}
+
+void BinaryCacheStore::publishNarInfo(ref<NarInfo> narInfo)
+{
     /* Atomically write the NAR info file.*/
     if (secretKey) narInfo->sign(*this, *secretKey);
 
@@ -297,6 +363,50 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     stats.narInfoWrite++;
 
+    unlink(journalFileFor(narInfo->path).c_str());
+}
+
+Path BinaryCacheStore::journalFileFor(const StorePath & storePath)
+{
+    return getCacheDir() + "/nix/upload-journal/"
+        + hashString(htSHA256, getUri()).to_string(Base32, false)
+        + "/" + std::string(storePath.hashPart()) + ".narinfo";
+}
+
+ref<NarInfo> BinaryCacheStore::addToStoreUnpublished(const ValidPathInfo & info, Source & narSource,
+    RepairFlag repair)
+{
+    auto journalFile = journalFileFor(info.path);
+
+    /* Reuse the NAR uploaded by a previous, interrupted attempt. */
+    if (!repair && pathExists(journalFile)) {
+        try {
+            auto narInfo = make_ref<NarInfo>(*this, readFile(journalFile), journalFile);
+            if (narInfo->path == info.path && fileExists(narInfo->url)) {
+                debug("reusing NAR '%s' of path '%s' from a previous upload",
+                    narInfo->url, printStorePath(info.path));
+                stats.narWriteAverted++;
+                return narInfo;
+            }
+        } catch (Error &) {
+            ignoreException();
+        }
+    }
+
+    auto narInfo = uploadNar(narSource, repair, {[&](HashResult nar) {
+        return info;
+    }}, false);
+
+    try {
+        createDirs(dirOf(journalFile));
+        auto tmp = fmt("%s.tmp-%d", journalFile, getpid());
+        writeFile(tmp, narInfo->to_string(*this));
+        if (rename(tmp.c_str(), journalFile.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, journalFile);
+    } catch (Error &) {
+        ignoreException();
+    }
+
     return narInfo;
 }
 
@@ -345,22 +455,179 @@ void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
 {
     auto info = queryPathInfo(storePath).cast<const NarInfo>();
 
+    auto startTime = std::chrono::steady_clock::now();
+
     LengthSink narSize;
     TeeSink tee { sink, narSize };
 
-    auto decompressor = makeDecompressionSink(info->compression, tee);
+    /* Use the local NAR cache if it has a good copy of this NAR.
+       Otherwise, put the NAR that we download into it. */
+    Path cacheFile;
+    AutoCloseFD cacheFd;
+    Path cacheTemp;
+    std::optional<AutoDelete> deleteCacheTemp;
+    std::optional<HashSink> cacheHash;
+
+    if (localNarCache != "") {
+        cacheFile = fmt("%s/%s.nar", localNarCache, storePath.hashPart());
+
+        if (pathExists(cacheFile)) {
+            /* Only errors while checking the cache file make us fall
+               back to downloading. Once its contents are being written
+               to `sink', a failure can't be recovered from. */
+            AutoCloseFD fd;
+            try {
+                fd = open(cacheFile.c_str(), O_RDONLY | O_CLOEXEC);
+                if (!fd) throw SysError("opening file '%s'", cacheFile);
+                HashSink hashSink(info->narHash.type);
+                drainFD(fd.get(), hashSink);
+                if (hashSink.finish() != HashResult{info->narHash, info->narSize}) {
+                    warn("deleting corrupt NAR cache file '%s'", cacheFile);
+                    fd.close();
+                    deletePath(cacheFile);
+                } else {
+                    utimes(cacheFile.c_str(), nullptr);
+                    if (lseek(fd.get(), 0, SEEK_SET) == -1)
+                        throw SysError("seeking in file '%s'", cacheFile);
+                }
+            } catch (SysError &) {
+                ignoreException();
+                fd.close();
+            }
 
-    try {
-        getFile(info->url, *decompressor);
-    } catch (NoSuchBinaryCacheFile & e) {
-        throw SubstituteGone(e.info());
+            if (fd) {
+                /* The open file is what was verified, even if the
+                   cache file has been replaced in the meantime. */
+                drainFD(fd.get(), tee);
+                stats.narRead++;
+                stats.narReadBytes += narSize.length;
+                stats.narReadLatency.record(std::chrono::steady_clock::now() - startTime);
+                return;
+            }
+        }
+
+        /* Not mkstemp(), which ignores the umask. */
+        static std::atomic<unsigned int> counter{0};
+        createDirs(localNarCache);
+        cacheTemp = fmt("%s.tmp.%d.%d", cacheFile, getpid(), counter++);
+        cacheFd = open(cacheTemp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (cacheFd) {
+            deleteCacheTemp.emplace(cacheTemp, false);
+            cacheHash.emplace(info->narHash.type);
+        }
     }
 
-    decompressor->finish();
+    /* Download and decompress the NAR on a separate thread, so that
+       decompression overlaps with the caller writing the previous
+       part of the NAR to the store. `sink' may be a coroutine, so it
+       has to be called from this thread. The threads exchange data
+       through a bounded buffer. */
+    struct State {
+        bool quit = false;
+        bool done = false;
+        std::exception_ptr exc;
+        std::string data;
+        std::condition_variable avail, request;
+    };
+
+    Sync<State> state_;
+
+    struct BufferSink : Sink
+    {
+        Sync<State> & state_;
+        BufferSink(Sync<State> & state_) : state_(state_) { }
+        void operator () (std::string_view data) override
+        {
+            auto state(state_.lock());
+            while (!state->quit && state->data.size() > 1024 * 1024)
+                state.wait(state->request);
+            if (state->quit)
+                throw Error("NAR consumer has stopped reading");
+            state->data.append(data);
+            state->avail.notify_one();
+        }
+    };
+
+    auto act = getCurActivity();
+
+    std::thread thr([&]() {
+        try {
+            PushActivity pact(act);
+            BufferSink bufferSink(state_);
+            auto decompressor = makeDecompressionSink(info->compression, bufferSink);
+            LengthSink compressedSize;
+            TeeSink compressedTee { *decompressor, compressedSize };
+            try {
+                getFile(info->url, compressedTee);
+            } catch (NoSuchBinaryCacheFile & e) {
+                throw SubstituteGone(e.info());
+            }
+            decompressor->finish();
+            stats.narReadCompressedBytes += compressedSize.length;
+        } catch (...) {
+            state_.lock()->exc = std::current_exception();
+        }
+        auto state(state_.lock());
+        state->done = true;
+        state->avail.notify_one();
+    });
+
+    Finally joinThread([&]() {
+        {
+            auto state(state_.lock());
+            state->quit = true;
+            state->request.notify_one();
+        }
+        thr.join();
+    });
+
+    while (true) {
+        checkInterrupt();
+
+        std::string chunk;
+
+        {
+            auto state(state_.lock());
+            while (state->data.empty() && !state->done)
+                state.wait(state->avail);
+            if (state->data.empty()) {
+                if (state->exc) std::rethrow_exception(state->exc);
+                break;
+            }
+            std::swap(chunk, state->data);
+            state->request.notify_one();
+        }
+
+        tee(chunk);
+
+        if (cacheFd) {
+            try {
+                writeFull(cacheFd.get(), chunk);
+                (*cacheHash)(chunk);
+            } catch (SysError &) {
+                ignoreException();
+                cacheFd = -1;
+            }
+        }
+    }
+
+    if (cacheFd) {
+        cacheFd = -1;
+        if (cacheHash->finish() == HashResult{info->narHash, info->narSize}) {
+            if (rename(cacheTemp.c_str(), cacheFile.c_str()) == 0) {
+                deleteCacheTemp->cancel();
+                try {
+                    trimNarCache(localNarCache, localNarCacheSize);
+                } catch (Error &) {
+                    ignoreException();
+                }
+            }
+        }
+    }
 
     stats.narRead++;
-    //stats.narReadCompressedBytes += nar->size(); // FIXME
     stats.narReadBytes += narSize.length;
+    stats.narReadLatency.record(std::chrono::steady_clock::now() - startTime);
 }
 
 void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
@@ -484,6 +751,78 @@ std::optional<const Realisation> BinaryCacheStore::queryRealisation(const DrvOut
     }
 }
 
+std::map<DrvOutput, Realisation> BinaryCacheStore::queryRealisations(const std::set<DrvOutput> & ids)
+{
+    std::map<DrvOutput, Realisation> res;
+
+    std::set<DrvOutput> missing;
+    for (auto & id : ids) {
+        if (diskCache) {
+            auto [cacheOutcome, maybeCachedRealisation] =
+                diskCache->lookupRealisation(getUri(), id);
+            if (cacheOutcome == NarInfoDiskCache::oValid) {
+                res.insert_or_assign(id, *maybeCachedRealisation);
+                continue;
+            }
+            if (cacheOutcome == NarInfoDiskCache::oInvalid)
+                continue;
+        }
+        missing.insert(id);
+    }
+
+    /* Fetch the remaining ones concurrently. */
+    struct State
+    {
+        size_t left;
+        std::map<DrvOutput, Realisation> realisations;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_(State{missing.size(), {}, {}});
+
+    std::condition_variable wakeup;
+
+    for (auto & id : missing) {
+        auto outputInfoFilePath = realisationsPrefix + "/" + id.to_string() + ".doi";
+        getFile(outputInfoFilePath,
+            {[&, id, outputInfoFilePath](std::future<std::shared_ptr<std::string>> fut) {
+                std::optional<Realisation> realisation;
+                std::exception_ptr exc;
+                try {
+                    if (auto rawOutputInfo = fut.get()) {
+                        realisation = Realisation::fromJSON(
+                            nlohmann::json::parse(*rawOutputInfo), outputInfoFilePath);
+                        if (diskCache)
+                            diskCache->upsertRealisation(getUri(), *realisation);
+                    } else if (diskCache)
+                        diskCache->upsertAbsentRealisation(getUri(), id);
+                } catch (...) {
+                    exc = std::current_exception();
+                }
+
+                auto state(state_.lock());
+                if (realisation)
+                    state->realisations.insert_or_assign(id, std::move(*realisation));
+                if (exc && !state->exc)
+                    state->exc = exc;
+                assert(state->left);
+                if (!--state->left)
+                    wakeup.notify_one();
+            }});
+    }
+
+    {
+        auto state(state_.lock());
+        while (state->left)
+            state.wait(wakeup);
+        if (state->exc)
+            std::rethrow_exception(state->exc);
+        res.merge(state->realisations);
+    }
+
+    return res;
+}
+
 void BinaryCacheStore::registerDrvOutput(const Realisation& info) {
     if (diskCache)
         diskCache->upsertRealisation(getUri(), info);
@@ -493,7 +832,7 @@ void BinaryCacheStore::registerDrvOutput(const Realisation& info) {
 
 ref<FSAccessor> BinaryCacheStore::getFSAccessor()
 {
-    return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()), localNarCache);
+    return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()), localNarCache, localNarCacheSize);
 }
 
 void BinaryCacheStore::addSignatures(const StorePath & storePath, const StringSet & sigs)
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "compression.hh"
 #include "crypto.hh"
 #include "store-api.hh"
 
@@ -20,8 +21,12 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     const Setting<bool> writeDebugInfo{(StoreConfig*) this, false, "index-debug-info", "whether to index DWARF debug info files by build ID"};
     const Setting<Path> secretKeyFile{(StoreConfig*) this, "", "secret-key", "path to secret key used to sign the binary cache"};
     const Setting<Path> localNarCache{(StoreConfig*) this, "", "local-nar-cache", "path to a local cache of NARs"};
+    const Setting<uint64_t> localNarCacheSize{(StoreConfig*) this, 0, "local-nar-cache-size",
+        "maximum size (in bytes) of the local NAR cache; least recently used NARs are deleted beyond it (0 means no limit)"};
     const Setting<bool> parallelCompression{(StoreConfig*) this, false, "parallel-compression",
-        "enable multi-threading compression, available for xz only currently"};
+        "enable multi-threading compression, available for xz and zstd only currently"};
+    const Setting<int> compressionLevel{(StoreConfig*) this, COMPRESSION_LEVEL_DEFAULT, "compression-level",
+        "NAR compression level; its meaning and valid range depend on the compression method (-1 means the method's default)"};
 };
 
 class BinaryCacheStore : public virtual BinaryCacheStoreConfig, public virtual Store
@@ -50,6 +55,18 @@ public:
         std::string && data,
         const std::string & mimeType);
 
+    /* Store the local file 'localPath', which the caller deletes
+       afterwards, as 'path'. Stores that can move the file into
+       place override this to avoid copying it. */
+    virtual void upsertFileFromPath(const std::string & path,
+        const Path & localPath,
+        const std::string & mimeType);
+
+    /* Create the temporary file that uploadNar() writes the
+       compressed NAR to before upserting it. */
+    virtual std::pair<AutoCloseFD, Path> createNarTempFile()
+    { return createTempFile(); }
+
     /* Note: subclasses must implement at least one of the two
        following getFile() methods. */
 
@@ -63,6 +80,19 @@ public:
 
     std::shared_ptr<std::string> getFile(const std::string & path);
 
+    /* Return 'length' bytes of the specified file, starting at
+       'offset', or std::nullopt if this store cannot read part of a
+       file. */
+    virtual std::optional<std::string> getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length)
+    { return std::nullopt; }
+
+    /* Return an accessor for 'storePath' that reads files from its
+       NAR individually, using the NAR listing stored in the cache
+       ('write-nar-listing'), or nullptr if the NAR is compressed,
+       has no listing, or the store cannot read parts of files. */
+    std::shared_ptr<FSAccessor> getNarRangeAccessor(const StorePath & storePath);
+
 public:
 
     virtual void init() override;
@@ -73,14 +103,38 @@ private:
 
     std::string narInfoFileFor(const StorePath & storePath);
 
+    Path journalFileFor(const StorePath & storePath);
+
     void writeNarInfo(ref<NarInfo> narInfo);
 
     ref<const ValidPathInfo> addToStoreCommon(
         Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
         std::function<ValidPathInfo(HashResult)> mkInfo);
 
+    ref<NarInfo> uploadNar(
+        Source & narSource, RepairFlag repair,
+        std::function<ValidPathInfo(HashResult)> mkInfo,
+        bool checkReferences);
+
 public:
 
+    /* Like addToStore(), but don't write the .narinfo file and don't
+       check that the references are valid. This allows the NARs of a
+       closure to be uploaded concurrently. The caller must then call
+       publishNarInfo(), but only after doing so for all references,
+       so that the cache never has paths with incomplete closures.
+
+       Uploaded but unpublished paths are recorded in a journal in
+       ~/.cache/nix/upload-journal, so that if the process dies before
+       publishing them, a later call doesn't need to read 'narSource'
+       and upload the NAR again. */
+    ref<NarInfo> addToStoreUnpublished(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair);
+
+    /* Sign and write the .narinfo file of a path added by
+       addToStoreUnpublished(). */
+    void publishNarInfo(ref<NarInfo> narInfo);
+
     bool isValidPathUncached(const StorePath & path) override;
 
     void queryPathInfoUncached(const StorePath & path,
@@ -106,6 +160,8 @@ public:
 
     std::optional<const Realisation> queryRealisation(const DrvOutput &) override;
 
+    std::map<DrvOutput, Realisation> queryRealisations(const std::set<DrvOutput> & ids) override;
+
     void narFromPath(const StorePath & path, Sink & sink) override;
 
     ref<FSAccessor> getFSAccessor() override;
@@ -0,0 +1,180 @@
+#include "build-time-cache.hh"
+#include "sync.hh"
+#include "sqlite.hh"
+#include "names.hh"
+#include "util.hh"
+
+#include <sqlite3.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists BuildTimes (
+    name      text primary key not null,
+    duration  integer not null,
+    builds    integer not null,
+    timestamp integer not null
+);
+
+create table if not exists BuildResources (
+    name       text primary key not null,
+    cpuTime    integer not null,
+    peakMemory integer,
+    timestamp  integer not null
+);
+
+)sql";
+
+class BuildTimeCacheImpl : public BuildTimeCache
+{
+public:
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt queryBuildTime, upsertBuildTime;
+        SQLiteStmt queryResources, upsertResources;
+    };
+
+    Sync<State> _state;
+
+    BuildTimeCacheImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/build-times-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        state->db.isCache();
+
+        state->db.exec(schema);
+
+        state->queryBuildTime.create(state->db,
+            "select duration, builds from BuildTimes where name = ?");
+
+        state->upsertBuildTime.create(state->db,
+            "insert or replace into BuildTimes(name, duration, builds, timestamp) values (?, ?, ?, ?)");
+
+        state->queryResources.create(state->db,
+            "select cpuTime, peakMemory from BuildResources where name = ?");
+
+        state->upsertResources.create(state->db,
+            "insert or replace into BuildResources(name, cpuTime, peakMemory, timestamp) values (?, ?, ?, ?)");
+    }
+
+    static std::string key(std::string_view drvName)
+    {
+        return DrvName(drvName).name;
+    }
+
+    void recordBuild(std::string_view drvName, time_t duration) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            auto name = key(drvName);
+
+            /* Keep an exponentially weighted average so that one
+               unusually slow or fast build doesn't dominate. */
+            int64_t builds = 0;
+            {
+                auto query(state->queryBuildTime.use()(name));
+                if (query.next()) {
+                    duration = (query.getInt(0) * 3 + duration) / 4;
+                    builds = query.getInt(1);
+                }
+            }
+
+            state->upsertBuildTime.use()
+                (name)
+                (duration)
+                (builds + 1)
+                (time(0)).exec();
+        });
+    }
+
+    std::optional<time_t> expectedBuildTime(std::string_view drvName) override
+    {
+        return retrySQLite<std::optional<time_t>>([&]() -> std::optional<time_t> {
+            auto state(_state.lock());
+
+            auto query(state->queryBuildTime.use()(key(drvName)));
+            if (!query.next()) return {};
+
+            return query.getInt(0);
+        });
+    }
+
+    BuildTimes allBuildTimes() override
+    {
+        return retrySQLite<BuildTimes>([&]() {
+            auto state(_state.lock());
+
+            BuildTimes res;
+            SQLiteStmt stmt(state->db, "select name, duration from BuildTimes");
+            auto query(stmt.use());
+            while (query.next())
+                res.insert_or_assign(query.getStr(0), query.getInt(1));
+            return res;
+        });
+    }
+
+    void recordResourceUsage(std::string_view drvName,
+        uint64_t cpuTime, std::optional<uint64_t> peakMemory) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            auto name = key(drvName);
+
+            /* Average the CPU time like the build time. For memory,
+               a build that needed more than usual is more important
+               to remember than one that needed less, so never go
+               below the latest peak. */
+            {
+                auto query(state->queryResources.use()(name));
+                if (query.next()) {
+                    cpuTime = (query.getInt(0) * 3 + cpuTime) / 4;
+                    if (peakMemory && !query.isNull(1))
+                        peakMemory = std::max(*peakMemory, (query.getInt(1) * 3 + *peakMemory) / 4);
+                }
+            }
+
+            state->upsertResources.use()
+                (name)
+                (cpuTime)
+                (peakMemory.value_or(0), peakMemory.has_value())
+                (time(0)).exec();
+        });
+    }
+
+    std::optional<uint64_t> expectedPeakMemory(std::string_view drvName) override
+    {
+        return retrySQLite<std::optional<uint64_t>>([&]() -> std::optional<uint64_t> {
+            auto state(_state.lock());
+
+            auto query(state->queryResources.use()(key(drvName)));
+            if (!query.next() || query.isNull(1)) return {};
+
+            return query.getInt(1);
+        });
+    }
+};
+
+std::optional<time_t> BuildTimeCache::lookupBuildTime(const BuildTimes & buildTimes, std::string_view drvName)
+{
+    auto i = buildTimes.find(BuildTimeCacheImpl::key(drvName));
+    if (i == buildTimes.end()) return {};
+    return i->second;
+}
+
+ref<BuildTimeCache> getBuildTimeCache()
+{
+    static ref<BuildTimeCache> cache = make_ref<BuildTimeCacheImpl>();
+    return cache;
+}
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "ref.hh"
+#include "types.hh"
+
+#include <optional>
+#include <unordered_map>
+
+namespace nix {
+
+/* A record of how long derivations took to build, keyed on the
+   derivation name without its version (so that e.g. a new release of
+   a compiler inherits the build time of the previous one). */
+class BuildTimeCache
+{
+public:
+
+    virtual ~BuildTimeCache() { }
+
+    /* Record that building the derivation named `drvName' took
+       `duration' seconds. */
+    virtual void recordBuild(std::string_view drvName, time_t duration) = 0;
+
+    /* Return the expected build time of the derivation named
+       `drvName', or nothing if no similar derivation has been built
+       before. */
+    virtual std::optional<time_t> expectedBuildTime(std::string_view drvName) = 0;
+
+    /* All recorded build times, keyed on the name without its
+       version. Look them up with lookupBuildTime(), for callers that
+       need the build times of many derivations. */
+    typedef std::unordered_map<std::string, time_t> BuildTimes;
+    virtual BuildTimes allBuildTimes() = 0;
+
+    static std::optional<time_t> lookupBuildTime(const BuildTimes & buildTimes, std::string_view drvName);
+
+    /* Record the CPU time (in microseconds) and peak memory usage (in
+       bytes, if known) of a build of the derivation named `drvName'. */
+    virtual void recordResourceUsage(std::string_view drvName,
+        uint64_t cpuTime, std::optional<uint64_t> peakMemory) = 0;
+
+    /* Return the peak memory usage that a build of the derivation
+       named `drvName' can be expected to reach, or nothing if it is
+       not known. */
+    virtual std::optional<uint64_t> expectedPeakMemory(std::string_view drvName) = 0;
+};
+
+/* Return a singleton cache object that can be used concurrently by
+   multiple threads. */
+ref<BuildTimeCache> getBuildTimeCache();
+
+}
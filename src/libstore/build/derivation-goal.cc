@@ -12,6 +12,7 @@
 #include "worker-protocol.hh"
 #include "topo-sort.hh"
 #include "callback.hh"
+#include "build-time-cache.hh"
 #include "local-store.hh" // TODO remove, along with remaining downcasts
 
 #include <regex>
@@ -77,6 +78,8 @@ DerivationGoal::DerivationGoal(const StorePath & drvPath,
         DerivedPath::Built { drvPath, wantedOutputs }.to_string(worker.store));
     trace("created");
 
+    expectedDuration = worker.getExpectedDuration(drvPath);
+
     mcExpectedBuilds = std::make_unique<MaintainCount<uint64_t>>(worker.expectedBuilds);
     worker.updateProgress();
 }
@@ -98,6 +101,8 @@ DerivationGoal::DerivationGoal(const StorePath & drvPath, const BasicDerivation
         DerivedPath::Built { drvPath, drv.outputNames() }.to_string(worker.store));
     trace("created");
 
+    expectedDuration = worker.getExpectedDuration(drvPath);
+
     mcExpectedBuilds = std::make_unique<MaintainCount<uint64_t>>(worker.expectedBuilds);
     worker.updateProgress();
 
@@ -333,12 +338,17 @@ void DerivationGoal::gaveUpOnSubstitution()
        outputs. */
     wantedOutputs.clear();
 
+    phaseStart = std::chrono::steady_clock::now();
+
     /* The inputs must be built before we can build this goal. */
     if (useDerivation)
         for (auto & i : dynamic_cast<Derivation *>(drv.get())->inputDrvs)
             addWaitee(worker.makeDerivationGoal(i.first, i.second, buildMode == bmRepair ? bmRepair : bmNormal));
 
     for (auto & i : drv->inputSrcs) {
+        /* Like the outputs of the input derivations, the input
+           sources count as used by this build. */
+        worker.store.addTempRoot(i);
         if (worker.store.isValidPath(i)) continue;
         if (!settings.useSubstitutes)
             throw Error("dependency '%s' of '%s' does not exist, and substitution is disabled",
@@ -454,9 +464,14 @@ void DerivationGoal::inputsRealised()
             std::optional attempt = fullDrv.tryResolve(worker.store);
             assert(attempt);
             Derivation drvResolved { *std::move(attempt) };
+            resolvedDrv = drvResolved;
+
+            /* If the resolved derivation has been built before, e.g.
+               because a rebuilt input produced the same output as
+               before, we're done (early cutoff). */
+            if (tryResolvedCutoff(drvResolved)) return;
 
             auto pathResolved = writeDerivation(worker.store, drvResolved);
-            resolvedDrv = drvResolved;
 
             auto msg = fmt("Resolved derivation: '%s' -> '%s'",
                 worker.store.printStorePath(drvPath),
@@ -516,6 +531,7 @@ void DerivationGoal::inputsRealised()
     worker.wakeUp(shared_from_this());
 
     result = BuildResult();
+    endPhase("realiseInputs");
 }
 
 void DerivationGoal::started() {
@@ -561,11 +577,12 @@ void DerivationGoal::tryToBuild()
         if (!actLock)
             actLock = std::make_unique<Activity>(*logger, lvlWarn, actBuildWaiting,
                 fmt("waiting for lock on %s", yellowtxt(showPaths(lockFiles))));
-        worker.waitForAWhile(shared_from_this());
+        worker.waitForLocks(shared_from_this(), lockFiles);
         return;
     }
 
     actLock.reset();
+    endPhase("waitForLocks");
 
     /* Now check again whether the outputs are valid.  This is because
        another process may have started building in parallel.  After
@@ -611,6 +628,7 @@ void DerivationGoal::tryToBuild()
                    EOF from the hook. */
                 actLock.reset();
                 result.startTime = time(0); // inexact
+                endPhase("startBuilder");
                 state = &DerivationGoal::buildDone;
                 started();
                 return;
@@ -815,6 +833,7 @@ void DerivationGoal::buildDone()
 
     result.timesBuilt++;
     result.stopTime = time(0);
+    endPhase("runBuilder");
 
     /* So the child is gone now. */
     worker.childTerminated(this);
@@ -860,6 +879,7 @@ void DerivationGoal::buildDone()
         /* Compute the FS closure of the outputs and register them as
            being valid. */
         registerOutputs();
+        endPhase("registerOutputs");
 
         StorePathSet outputPaths;
         for (auto & [_, path] : finalOutputs)
@@ -870,6 +890,7 @@ void DerivationGoal::buildDone()
             drvPath,
             outputPaths
         );
+        endPhase("postBuildHook");
 
         if (buildMode == bmCheck) {
             cleanupPostOutputsRegisteredModeCheck();
@@ -894,6 +915,12 @@ void DerivationGoal::buildDone()
         outputLocks.setDeletion(true);
         outputLocks.unlock();
 
+        try {
+            getBuildTimeCache()->recordBuild(Derivation::nameFromPath(drvPath), result.stopTime - result.startTime);
+        } catch (Error & e) {
+            debug("cannot record build time: %s", e.msg());
+        }
+
     } catch (BuildError & e) {
         outputLocks.unlock();
 
@@ -920,6 +947,48 @@ void DerivationGoal::buildDone()
     done(BuildResult::Built);
 }
 
+bool DerivationGoal::tryResolvedCutoff(const Derivation & drvResolved)
+{
+    if (buildMode != bmNormal) return false;
+
+    auto resolvedHashes = staticOutputHashes(worker.store, drvResolved);
+
+    auto realWantedOutputs = wantedOutputs;
+    if (realWantedOutputs.empty())
+        realWantedOutputs = drvResolved.outputNames();
+
+    std::set<DrvOutput> drvOutputs;
+    for (auto & wantedOutput : realWantedOutputs) {
+        auto hash = get(resolvedHashes, wantedOutput);
+        if (!hash) return false;
+        drvOutputs.insert(DrvOutput{*hash, wantedOutput});
+    }
+
+    auto realisations = worker.store.queryRealisations(drvOutputs);
+    if (realisations.size() != drvOutputs.size()) return false;
+    for (auto & [_, realisation] : realisations)
+        if (!worker.store.isValidPath(realisation.outPath)) return false;
+
+    debug("outputs of resolved derivation of '%s' are already valid",
+        worker.store.printStorePath(drvPath));
+
+    for (auto & [_, realisation] : realisations)
+        registerResolvedRealisation(realisation);
+
+    done(BuildResult::AlreadyValid);
+    return true;
+}
+
+void DerivationGoal::registerResolvedRealisation(const Realisation & realisation)
+{
+    auto newRealisation = realisation;
+    newRealisation.id = DrvOutput{initialOutputs.at(realisation.id.outputName).outputHash, realisation.id.outputName};
+    newRealisation.signatures.clear();
+    newRealisation.dependentRealisations = drvOutputReferences(worker.store, *drv, realisation.outPath);
+    signRealisation(newRealisation);
+    worker.store.registerDrvOutput(newRealisation);
+}
+
 void DerivationGoal::resolvedFinished() {
     assert(resolvedDrv);
 
@@ -941,12 +1010,7 @@ void DerivationGoal::resolvedFinished() {
         // We've just built it, but maybe the build failed, in which case the
         // realisation won't be there
         if (realisation) {
-            auto newRealisation = *realisation;
-            newRealisation.id = DrvOutput{initialOutputs.at(wantedOutput).outputHash, wantedOutput};
-            newRealisation.signatures.clear();
-            newRealisation.dependentRealisations = drvOutputReferences(worker.store, *drv, realisation->outPath);
-            signRealisation(newRealisation);
-            worker.store.registerDrvOutput(newRealisation);
+            registerResolvedRealisation(*realisation);
             outputPaths.insert(realisation->outPath);
         } else {
             // If we don't have a realisation, then it must mean that something
@@ -1153,16 +1217,23 @@ Path DerivationGoal::openLogFile()
     Path dir = fmt("%s/%s/%s/", logDir, LocalFSStore::drvsLogDir, string(baseName, 0, 2));
     createDirs(dir);
 
-    Path logFileName = fmt("%s/%s%s", dir, string(baseName, 2),
-        settings.compressLog ? ".bz2" : "");
+    std::string method = settings.compressLog ? settings.logCompression.get() : "none";
+    std::string ext =
+        method == "none" ? "" :
+        method == "bzip2" ? ".bz2" :
+        method == "zstd" ? ".zst" :
+        method == "xz" ? ".xz" :
+        throw Error("unsupported build log compression method '%s'", method);
+
+    Path logFileName = fmt("%s/%s%s", dir, string(baseName, 2), ext);
 
     fdLogFile = open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
     if (!fdLogFile) throw SysError("creating log file '%1%'", logFileName);
 
     logFileSink = std::make_shared<FdSink>(fdLogFile.get());
 
-    if (settings.compressLog)
-        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
+    if (method != "none")
+        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink(method, *logFileSink));
     else
         logSink = logFileSink;
 
@@ -1278,7 +1349,19 @@ void DerivationGoal::checkPathValidity()
 {
     bool checkHash = buildMode == bmRepair;
     auto wantedOutputsLeft = wantedOutputs;
-    for (auto & i : queryPartialDerivationOutputMap()) {
+    auto outputMap = queryPartialDerivationOutputMap();
+
+    /* Look up the realisations of all outputs at once. */
+    bool caDerivations = settings.isExperimentalFeatureEnabled("ca-derivations");
+    std::map<DrvOutput, Realisation> realisations;
+    if (caDerivations) {
+        std::set<DrvOutput> drvOutputs;
+        for (auto & i : outputMap)
+            drvOutputs.insert(DrvOutput{initialOutputs.at(i.first).outputHash, i.first});
+        realisations = worker.store.queryRealisations(drvOutputs);
+    }
+
+    for (auto & i : outputMap) {
         InitialOutput & info = initialOutputs.at(i.first);
         info.wanted = wantOutput(i.first, wantedOutputs);
         if (info.wanted)
@@ -1294,9 +1377,9 @@ void DerivationGoal::checkPathValidity()
                     : PathStatus::Corrupt,
             };
         }
-        if (settings.isExperimentalFeatureEnabled("ca-derivations")) {
+        if (caDerivations) {
             auto drvOutput = DrvOutput{initialOutputs.at(i.first).outputHash, i.first};
-            if (auto real = worker.store.queryRealisation(drvOutput)) {
+            if (auto real = get(realisations, drvOutput)) {
                 info.known = {
                     .path = real->outPath,
                     .status = PathStatus::Valid,
@@ -1325,11 +1408,28 @@ void DerivationGoal::checkPathValidity()
 }
 
 
+void DerivationGoal::endPhase(const std::string & phase)
+{
+    auto now = std::chrono::steady_clock::now();
+    result.timings[phase] += std::chrono::duration_cast<std::chrono::microseconds>(now - phaseStart).count();
+    phaseStart = now;
+}
+
+
 void DerivationGoal::done(BuildResult::Status status, std::optional<Error> ex)
 {
     result.status = status;
     if (ex)
         result.errorMsg = ex->what();
+
+    if (act && !result.timings.empty()) {
+        Logger::Fields fields;
+        for (auto & [phase, time] : result.timings) {
+            fields.emplace_back(phase);
+            fields.emplace_back(time);
+        }
+        act->result(resBuildTimings, fields);
+    }
     amDone(result.success() ? ecSuccess : ecFailed, ex);
     if (result.status == BuildResult::TimedOut)
         worker.timedOut = true;
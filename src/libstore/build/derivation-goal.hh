@@ -135,6 +135,9 @@ struct DerivationGoal : public Goal
     /* The remote machine on which we're building. */
     std::string machineName;
 
+    /* When the current phase of the build started. */
+    std::chrono::steady_clock::time_point phaseStart = std::chrono::steady_clock::now();
+
     DerivationGoal(const StorePath & drvPath,
         const StringSet & wantedOutputs, Worker & worker,
         BuildMode buildMode = bmNormal);
@@ -168,6 +171,16 @@ struct DerivationGoal : public Goal
 
     void resolvedFinished();
 
+    /* If the wanted outputs of the resolved derivation have already
+       been built, register them as outputs of this derivation and
+       return true. */
+    bool tryResolvedCutoff(const Derivation & drvResolved);
+
+    /* Register the realisation of an output of the resolved
+       derivation as the realisation of the same output of this
+       derivation. */
+    void registerResolvedRealisation(const Realisation & realisation);
+
     /* Is the build hook willing to perform the build? */
     HookReply tryBuildHook();
 
@@ -220,6 +233,10 @@ struct DerivationGoal : public Goal
 
     void started();
 
+    /* Add the time since the start of the current phase to
+       `result.timings', and start the next phase. */
+    void endPhase(const std::string & phase);
+
     void done(
         BuildResult::Status status,
         std::optional<Error> ex = {});
@@ -60,9 +60,14 @@ void DrvOutputSubstitutionGoal::tryNext()
         return;
     }
 
+    std::set<DrvOutput> depIds;
+    for (const auto & [depId, _] : outputInfo->dependentRealisations)
+        if (depId != id) depIds.insert(depId);
+    auto localOutputInfos = worker.store.queryRealisations(depIds);
+
     for (const auto & [depId, depPath] : outputInfo->dependentRealisations) {
         if (depId != id) {
-            if (auto localOutputInfo = worker.store.queryRealisation(depId);
+            if (auto localOutputInfo = get(localOutputInfos, depId);
                 localOutputInfo && localOutputInfo->outPath != depPath) {
                 warn(
                     "substituter '%s' has an incompatible realisation for '%s', ignoring.\n"
@@ -25,6 +25,16 @@ void Goal::addWaitee(GoalPtr waitee)
 {
     waitees.insert(waitee);
     addToWeakGoals(waitee->waiters, shared_from_this());
+    waitee->raiseDepth(depth + 1);
+}
+
+
+void Goal::raiseDepth(unsigned int d)
+{
+    if (d <= depth) return;
+    depth = d;
+    for (auto & i : waitees)
+        i->raiseDepth(d + 1);
 }
 
 
@@ -24,6 +24,13 @@ typedef list<WeakGoalPtr> WeakGoals;
 /* A map of paths to goals (and the other way around). */
 typedef std::map<StorePath, WeakGoalPtr> WeakGoalMap;
 
+/* The pool of job slots that a goal's child process counts
+   against. */
+enum struct JobCategory {
+    Build,
+    Substitution,
+};
+
 struct Goal : public std::enable_shared_from_this<Goal>
 {
     typedef enum {ecBusy, ecSuccess, ecFailed, ecNoSubstituters, ecIncompleteClosure} ExitCode;
@@ -49,6 +56,21 @@ struct Goal : public std::enable_shared_from_this<Goal>
        failed because they had unsubstitutable references. */
     unsigned int nrIncompleteClosure;
 
+    /* Length of the longest chain of goals waiting for this one.
+       Goals with a greater depth are on the critical path of the
+       build, so the worker runs them first. */
+    unsigned int depth = 0;
+
+    /* Expected duration of this goal in seconds, based on previous
+       builds of similar derivations, or 0 if unknown. Used to order
+       goals of equal depth. */
+    time_t expectedDuration = 0;
+
+    /* Number of bytes this goal expects to download, or 0 if unknown
+       or not applicable. Among goals of otherwise equal priority,
+       those with less to download are run first. */
+    uint64_t downloadSize = 0;
+
     /* Name of this goal for debugging purposes. */
     string name;
 
@@ -73,6 +95,9 @@ struct Goal : public std::enable_shared_from_this<Goal>
 
     void addWaitee(GoalPtr waitee);
 
+    /* Raise the depth of this goal and its waitees to at least `d'. */
+    void raiseDepth(unsigned int d);
+
     virtual void waiteeDone(GoalPtr waitee, ExitCode result);
 
     virtual void handleChildOutput(int fd, const string & data)
@@ -99,6 +124,8 @@ struct Goal : public std::enable_shared_from_this<Goal>
 
     virtual string key() = 0;
 
+    virtual JobCategory jobCategory() { return JobCategory::Build; }
+
     void amDone(ExitCode result, std::optional<Error> ex = {});
 
     virtual void cleanup() { }
@@ -13,6 +13,9 @@
 #include "worker-protocol.hh"
 #include "topo-sort.hh"
 #include "callback.hh"
+#include "thread-pool.hh"
+#include "build-time-cache.hh"
+#include "cgroup.hh"
 
 #include <regex>
 #include <queue>
@@ -146,10 +149,41 @@ void LocalDerivationGoal::killChild()
         assert(pid == -1);
     }
 
+    finishCgroup(false);
+    releaseJobserverToken();
+
     DerivationGoal::killChild();
 }
 
 
+void LocalDerivationGoal::releaseJobserverToken()
+{
+    if (!jobserverToken) return;
+    jobserverToken = false;
+    worker.releaseJobserverToken();
+}
+
+
+/* Return the amount of memory that can be used for new processes
+   without swapping, if known. */
+static std::optional<uint64_t> getAvailableMemory()
+{
+#if __linux__
+    try {
+        for (auto & line : tokenizeString<Strings>(readFile("/proc/meminfo"), "\n")) {
+            if (!hasPrefix(line, "MemAvailable:")) continue;
+            auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+            if (fields.size() >= 2)
+                if (auto kb = string2Int<uint64_t>(fields[1]))
+                    return *kb * 1024;
+        }
+    } catch (SysError &) {
+    }
+#endif
+    return {};
+}
+
+
 void LocalDerivationGoal::tryLocalBuild() {
     unsigned int curBuilds = worker.getNrLocalBuilds();
     if (curBuilds >= settings.maxBuildJobs) {
@@ -159,6 +193,28 @@ void LocalDerivationGoal::tryLocalBuild() {
         return;
     }
 
+    /* Don't start another build if memory is tight, unless nothing
+       else is running (in which case waiting won't help). */
+    if (settings.minFreeMemory && curBuilds > 0) {
+        auto avail = getAvailableMemory();
+        uint64_t needed = settings.minFreeMemory;
+        if (settings.useCgroups) {
+            try {
+                if (auto peak = getBuildTimeCache()->expectedPeakMemory(Derivation::nameFromPath(drvPath)))
+                    needed = std::max(needed, *peak);
+            } catch (Error & e) {
+                debug("cannot get expected memory usage: %s", e.msg());
+            }
+        }
+        if (avail && *avail < needed) {
+            if (!actLock)
+                actLock = std::make_unique<Activity>(*logger, lvlWarn, actBuildWaiting,
+                    fmt("waiting for free memory to build '%s'", yellowtxt(worker.store.printStorePath(drvPath))));
+            worker.waitForAWhile(shared_from_this());
+            return;
+        }
+    }
+
     /* If `build-users-group' is not empty, then we have to build as
        one of the members of that group. */
     if (settings.buildUsersGroup != "" && getuid() == 0) {
@@ -184,6 +240,7 @@ void LocalDerivationGoal::tryLocalBuild() {
     }
 
     actLock.reset();
+    endPhase("waitForBuildSlot");
 
     try {
 
@@ -198,6 +255,8 @@ void LocalDerivationGoal::tryLocalBuild() {
         return;
     }
 
+    endPhase("startBuilder");
+
     /* This state will be reached when we get EOF on the child's
        log pipe. */
     state = &DerivationGoal::buildDone;
@@ -237,7 +296,61 @@ extern void replaceValidPath(const Path & storePath, const Path & tmpPath);
 
 int LocalDerivationGoal::getChildStatus()
 {
-    return hook ? DerivationGoal::getChildStatus() : pid.kill();
+    if (hook) return DerivationGoal::getChildStatus();
+    int status = pid.kill();
+    finishCgroup(true);
+    releaseJobserverToken();
+    return status;
+}
+
+
+void LocalDerivationGoal::finishCgroup(bool recordUsage)
+{
+#if __linux__
+    if (!cgroup) return;
+
+    auto path = *cgroup;
+    cgroup.reset();
+
+    std::optional<CgroupStats> stats;
+    if (recordUsage) {
+        try {
+            stats = getCgroupStats(path);
+        } catch (Error & e) {
+            debug("cannot get resource usage of cgroup '%s': %s", path, e.msg());
+        }
+    }
+
+    try {
+        killCgroup(path);
+        if (!removeCgroup(path))
+            worker.removeCgroupWhenEmpty(path);
+    } catch (Error & e) {
+        warn("%s", e.msg());
+    }
+
+    if (!stats) return;
+
+    Logger::Fields fields;
+    auto add = [&](const char * name, std::optional<uint64_t> value) {
+        if (!value) return;
+        fields.emplace_back(name);
+        fields.emplace_back(*value);
+    };
+    add("cpuUser", stats->cpuUser);
+    add("cpuSystem", stats->cpuSystem);
+    add("peakMemory", stats->peakMemory);
+    add("ioRead", stats->ioRead);
+    add("ioWrite", stats->ioWrite);
+    if (act) act->result(resBuildResources, fields);
+
+    try {
+        getBuildTimeCache()->recordResourceUsage(Derivation::nameFromPath(drvPath),
+            stats->cpuUser + stats->cpuSystem, stats->peakMemory);
+    } catch (Error & e) {
+        debug("cannot record resource usage: %s", e.msg());
+    }
+#endif
 }
 
 void LocalDerivationGoal::closeReadPipes()
@@ -777,6 +890,25 @@ void LocalDerivationGoal::startBuilder()
     /* Fork a child to build the package. */
     ProcessOptions options;
 
+#if __linux__
+    if (settings.useCgroups) {
+        auto ownCgroup = getOwnCgroup();
+        if (!ownCgroup)
+            throw Error("cannot run builds in cgroups because cgroups v2 are not available");
+        cgroup = createCgroup(*ownCgroup, fmt("nix-build-%s", drvPath.hashPart()));
+        /* createCgroup() has removed any previous cgroup of this
+           derivation, such as one of an earlier round of --check. */
+        worker.forgetCgroup(*cgroup);
+    }
+#endif
+
+    /* Move the calling process into the build's cgroup, if any, so
+       that the builder and all its children are accounted there. */
+    auto enterCgroup = [&]() {
+        if (cgroup)
+            writeFile(*cgroup + "/cgroup.procs", std::to_string(getpid()));
+    };
+
 #if __linux__
     if (useChroot) {
         /* Set up private namespaces for the build:
@@ -829,6 +961,8 @@ void LocalDerivationGoal::startBuilder()
 
         Pid helper = startProcess([&]() {
 
+            enterCgroup();
+
             /* Drop additional groups here because we can't do it
                after we've created the new user namespace.  FIXME:
                this means that if we're not root in the parent
@@ -941,8 +1075,9 @@ void LocalDerivationGoal::startBuilder()
 #endif
     {
     fallback:
-        options.allowVfork = !buildUser && !drv->isBuiltin();
+        options.allowVfork = !buildUser && !drv->isBuiltin() && !cgroup;
         pid = startProcess([&]() {
+            enterCgroup();
             runChild();
         }, options);
     }
@@ -1081,6 +1216,21 @@ void LocalDerivationGoal::initEnv()
 
     /* Trigger colored output in various tools. */
     env["TERM"] = "xterm-256color";
+
+    /* Let jobserver-aware tools in the builder share the worker's job
+       tokens with other builds, if the derivation allows parallel
+       building at all. If no token is free for the builder's implicit
+       job slot, it still runs, as it would without a jobserver. */
+    useJobserver = worker.jobserver.readSide
+        && parsedDrv->getBoolAttr("enableParallelBuilding");
+    if (useJobserver) {
+        if (!jobserverToken)
+            jobserverToken = worker.acquireJobserverToken();
+        auto & makeFlags = env["MAKEFLAGS"];
+        if (!makeFlags.empty()) makeFlags += " ";
+        makeFlags += fmt("-j --jobserver-auth=%d,%d",
+            worker.jobserver.readSide.get(), worker.jobserver.writeSide.get());
+    }
 }
 
 
@@ -1446,6 +1596,8 @@ void LocalDerivationGoal::startDaemon()
 
     chownToBuilder(socketPath);
 
+    *daemonState.lock() = DaemonState();
+
     daemonThread = std::thread([this, store]() {
 
         while (true) {
@@ -1466,20 +1618,22 @@ void LocalDerivationGoal::startDaemon()
 
             debug("received daemon connection");
 
-            auto workerThread = std::thread([store, remote{std::move(remote)}]() {
-                FdSource from(remote.get());
-                FdSink to(remote.get());
-                try {
-                    daemon::processConnection(store, from, to,
-                        daemon::NotTrusted, daemon::Recursive,
-                        [&](Store & store) { store.createUser("nobody", 65535); });
-                    debug("terminated daemon connection");
-                } catch (SysError &) {
-                    ignoreException();
-                }
-            });
+            /* Hand the connection to an idle worker, or start a new
+               one. The number of workers isn't capped: a client may
+               keep a connection open while waiting for another one
+               (e.g. a build that runs several 'nix' commands in
+               parallel), so a bounded pool could deadlock. */
+            bool startWorker;
+            {
+                auto state(daemonState.lock());
+                state->pending.push(std::move(remote));
+                startWorker = state->pending.size() > state->idle;
+            }
 
-            daemonWorkerThreads.push_back(std::move(workerThread));
+            if (startWorker)
+                daemonWorkerThreads.emplace_back(&LocalDerivationGoal::daemonWorker, this, store);
+            else
+                daemonWakeup.notify_one();
         }
 
         debug("daemon shutting down");
@@ -1487,6 +1641,36 @@ void LocalDerivationGoal::startDaemon()
 }
 
 
+void LocalDerivationGoal::daemonWorker(ref<Store> store)
+{
+    while (true) {
+        AutoCloseFD remote;
+
+        {
+            auto state(daemonState.lock());
+            state->idle++;
+            while (state->pending.empty() && !state->quit)
+                state.wait(daemonWakeup);
+            state->idle--;
+            if (state->quit) return;
+            remote = std::move(state->pending.front());
+            state->pending.pop();
+        }
+
+        FdSource from(remote.get());
+        FdSink to(remote.get());
+        try {
+            daemon::processConnection(store, from, to,
+                daemon::NotTrusted, daemon::Recursive,
+                [&](Store & store) { store.createUser("nobody", 65535); });
+            debug("terminated daemon connection");
+        } catch (SysError &) {
+            ignoreException();
+        }
+    }
+}
+
+
 void LocalDerivationGoal::stopDaemon()
 {
     if (daemonSocket && shutdown(daemonSocket.get(), SHUT_RDWR) == -1)
@@ -1495,7 +1679,14 @@ void LocalDerivationGoal::stopDaemon()
     if (daemonThread.joinable())
         daemonThread.join();
 
-    // FIXME: should prune worker threads more quickly.
+    /* Connections that no worker has picked up yet are dropped. */
+    {
+        auto state(daemonState.lock());
+        state->quit = true;
+        state->pending = {};
+    }
+    daemonWakeup.notify_all();
+
     // FIXME: shutdown the client socket to speed up worker termination.
     for (auto & thread : daemonWorkerThreads)
         thread.join();
@@ -1869,8 +2060,17 @@ void LocalDerivationGoal::runChild()
         if (chdir(tmpDirInSandbox.c_str()) == -1)
             throw SysError("changing into '%1%'", tmpDir);
 
-        /* Close all other file descriptors. */
-        closeMostFDs({STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO});
+        /* Close all other file descriptors, except for the
+           jobserver pipe, which must survive exec(). */
+        set<int> keepFDs{STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+        if (useJobserver) {
+            for (int fd : {worker.jobserver.readSide.get(), worker.jobserver.writeSide.get()}) {
+                if (fcntl(fd, F_SETFD, 0) == -1)
+                    throw SysError("clearing close-on-exec flag of the jobserver pipe");
+                keepFDs.insert(fd);
+            }
+        }
+        closeMostFDs(keepFDs);
 
 #if __linux__
         /* Change the personality to 32-bit if we're doing an
@@ -2193,6 +2393,7 @@ void LocalDerivationGoal::registerOutputs()
     struct PerhapsNeedToRegister { StorePathSet refs; };
     std::map<std::string, std::variant<AlreadyRegistered, PerhapsNeedToRegister>> outputReferencesIfUnregistered;
     std::map<std::string, struct stat> outputStats;
+    std::vector<std::pair<std::string, Path>> outputsToScan;
     for (auto & [outputName, _] : drv->outputs) {
         auto actualPath = toRealPathChroot(worker.store.printStorePath(scratchOutputs.at(outputName)));
 
@@ -2237,17 +2438,74 @@ void LocalDerivationGoal::registerOutputs()
            something like that. */
         canonicalisePathMetaData(actualPath, buildUser ? buildUser->getUID() : -1, inodesSeen);
 
-        debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
+        outputsToScan.emplace_back(outputName, actualPath);
+        outputStats.insert_or_assign(outputName, std::move(st));
+    }
+
+    /* The NAR hash and (for recursive content-addressed outputs) the
+       content hash of each output, computed in the same pass as the
+       reference scan. They are only valid as long as the output isn't
+       rewritten afterwards. */
+    std::map<std::string, HashResult> scannedNarHashes;
+    std::map<std::string, Hash> scannedCAHashes;
 
-        /* Pass blank Sink as we are not ready to hash data at this stage. */
-        NullSink blank;
-        auto references = worker.store.parseStorePathSet(
-            scanForReferences(blank, actualPath, worker.store.printStorePathSet(referenceablePaths)));
+    /* Scan the outputs for references. This reads every byte of every
+       output, so do it in parallel. */
+    {
+        auto referenceablePathsS = worker.store.printStorePathSet(referenceablePaths);
+
+        std::vector<StorePathSet> references(outputsToScan.size());
+        std::vector<std::optional<HashResult>> narHashes(outputsToScan.size());
+        std::vector<std::optional<Hash>> caHashes(outputsToScan.size());
+
+        ThreadPool pool;
+
+        for (size_t n = 0; n < outputsToScan.size(); ++n)
+            pool.enqueue([&, n]() {
+                auto & [outputName, actualPath] = outputsToScan[n];
+
+                debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
+
+                std::optional<HashType> caHashType = std::visit(overloaded {
+                    [&](DerivationOutputCAFloating dof) -> std::optional<HashType> {
+                        if (dof.method != FileIngestionMethod::Recursive) return std::nullopt;
+                        return dof.hashType;
+                    },
+                    [&](DerivationOutputCAFixed dof) -> std::optional<HashType> {
+                        if (dof.hash.method != FileIngestionMethod::Recursive) return std::nullopt;
+                        return dof.hash.hash.type;
+                    },
+                    [&](auto &) -> std::optional<HashType> {
+                        return std::nullopt;
+                    },
+                }, drv->outputs.at(outputName).output);
+
+                HashSink narSink { htSHA256 };
+
+                if (caHashType) {
+                    HashModuloSink caSink { *caHashType, std::string(scratchOutputs.at(outputName).hashPart()) };
+                    TeeSink sink { narSink, caSink };
+                    references[n] = worker.store.parseStorePathSet(
+                        scanForReferences(sink, actualPath, referenceablePathsS));
+                    caHashes[n] = caSink.finish().first;
+                } else
+                    references[n] = worker.store.parseStorePathSet(
+                        scanForReferences(narSink, actualPath, referenceablePathsS));
 
-        outputReferencesIfUnregistered.insert_or_assign(
-            outputName,
-            PerhapsNeedToRegister { .refs = references });
-        outputStats.insert_or_assign(outputName, std::move(st));
+                narHashes[n] = narSink.finish();
+            });
+
+        pool.process();
+
+        for (size_t n = 0; n < outputsToScan.size(); ++n) {
+            auto & outputName = outputsToScan[n].first;
+            outputReferencesIfUnregistered.insert_or_assign(
+                outputName,
+                PerhapsNeedToRegister { .refs = std::move(references[n]) });
+            scannedNarHashes.insert_or_assign(outputName, *narHashes[n]);
+            if (caHashes[n])
+                scannedCAHashes.insert_or_assign(outputName, *caHashes[n]);
+        }
     }
 
     auto sortedOutputNames = topoSort(outputsToSort,
@@ -2311,6 +2569,9 @@ void LocalDerivationGoal::registerOutputs()
             if (!outputRewrites.empty()) {
                 warn("rewriting hashes in '%1%'; cross fingers", actualPath);
 
+                scannedNarHashes.erase(outputName);
+                scannedCAHashes.erase(outputName);
+
                 /* FIXME: this is in-memory. */
                 StringSink sink;
                 dumpPath(actualPath, sink);
@@ -2321,6 +2582,13 @@ void LocalDerivationGoal::registerOutputs()
             }
         };
 
+        /* The NAR hash of the output in its current state. */
+        auto narHashOf = [&]() {
+            auto i = scannedNarHashes.find(outputName);
+            if (i != scannedNarHashes.end()) return i->second;
+            return hashPath(htSHA256, actualPath);
+        };
+
         auto rewriteRefs = [&]() -> std::pair<bool, StorePathSet> {
             /* In the CA case, we need the rewritten refs to calculate the
                final path, therefore we look for a *non-rewritten
@@ -2360,16 +2628,20 @@ void LocalDerivationGoal::registerOutputs()
             rewriteOutput();
             /* FIXME optimize and deduplicate with addToStore */
             std::string oldHashPart { scratchPath.hashPart() };
-            HashModuloSink caSink { outputHash.hashType, oldHashPart };
-            switch (outputHash.method) {
-            case FileIngestionMethod::Recursive:
-                dumpPath(actualPath, caSink);
-                break;
-            case FileIngestionMethod::Flat:
-                readFile(actualPath, caSink);
-                break;
-            }
-            auto got = caSink.finish().first;
+            auto got = [&]() {
+                auto i = scannedCAHashes.find(outputName);
+                if (i != scannedCAHashes.end()) return i->second;
+                HashModuloSink caSink { outputHash.hashType, oldHashPart };
+                switch (outputHash.method) {
+                case FileIngestionMethod::Recursive:
+                    dumpPath(actualPath, caSink);
+                    break;
+                case FileIngestionMethod::Flat:
+                    readFile(actualPath, caSink);
+                    break;
+                }
+                return caSink.finish().first;
+            }();
             auto refs = rewriteRefs();
 
             auto finalPath = worker.store.makeFixedOutputPath(
@@ -2391,9 +2663,10 @@ void LocalDerivationGoal::registerOutputs()
                 restorePath(tmpPath, *source);
                 deletePath(actualPath);
                 movePath(tmpPath, actualPath);
+                scannedNarHashes.erase(outputName);
             }
 
-            HashResult narHashAndSize = hashPath(htSHA256, actualPath);
+            HashResult narHashAndSize = narHashOf();
             ValidPathInfo newInfo0 {
                 finalPath,
                 narHashAndSize.first,
@@ -2423,7 +2696,7 @@ void LocalDerivationGoal::registerOutputs()
                         std::string { scratchPath.hashPart() },
                         std::string { requiredFinalPath.hashPart() });
                 rewriteOutput();
-                auto narHashAndSize = hashPath(htSHA256, actualPath);
+                auto narHashAndSize = narHashOf();
                 ValidPathInfo newInfo0 { requiredFinalPath, narHashAndSize.first };
                 newInfo0.narSize = narHashAndSize.second;
                 auto refs = rewriteRefs();
@@ -3,6 +3,8 @@
 #include "derivation-goal.hh"
 #include "local-store.hh"
 
+#include <queue>
+
 namespace nix {
 
 struct LocalDerivationGoal : public DerivationGoal
@@ -15,6 +17,14 @@ struct LocalDerivationGoal : public DerivationGoal
     /* The process ID of the builder. */
     Pid pid;
 
+    /* The cgroup of the builder, if `use-cgroups' is enabled. */
+    std::optional<Path> cgroup;
+
+    /* Whether the builder gets the worker's jobserver, and whether we
+       hold a jobserver token for its implicit job slot. */
+    bool useJobserver = false;
+    bool jobserverToken = false;
+
     /* The temporary directory. */
     Path tmpDir;
 
@@ -102,9 +112,25 @@ struct LocalDerivationGoal : public DerivationGoal
     /* The daemon main thread. */
     std::thread daemonThread;
 
-    /* The daemon worker threads. */
+    /* The daemon worker threads. These are reused across
+       connections, so there are only as many as the largest number
+       of simultaneous connections. */
     std::vector<std::thread> daemonWorkerThreads;
 
+    struct DaemonState
+    {
+        /* Accepted connections not yet picked up by a worker. */
+        std::queue<AutoCloseFD> pending;
+        /* The number of workers waiting for a connection. */
+        size_t idle = 0;
+        bool quit = false;
+    };
+
+    Sync<DaemonState> daemonState;
+    std::condition_variable daemonWakeup;
+
+    void daemonWorker(ref<Store> store);
+
     /* Paths that were added via recursive Nix calls. */
     StorePathSet addedPaths;
 
@@ -163,6 +189,13 @@ struct LocalDerivationGoal : public DerivationGoal
 
     int getChildStatus() override;
 
+    /* Remove the builder's cgroup, if any, and if `recordUsage' is
+       set, log and record its resource usage first. */
+    void finishCgroup(bool recordUsage);
+
+    /* Return the jobserver token of the builder, if any. */
+    void releaseJobserverToken();
+
     /* Run the builder's process. */
     void runChild();
 
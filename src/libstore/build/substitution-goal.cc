@@ -131,6 +131,8 @@ void PathSubstitutionGoal::tryNext()
         ? std::make_unique<MaintainCount<uint64_t>>(worker.expectedDownloadSize, narInfo->fileSize)
         : nullptr;
 
+    downloadSize = narInfo && narInfo->fileSize ? narInfo->fileSize : info->narSize;
+
     worker.updateProgress();
 
     /* Bail out early if this substituter lacks a valid
@@ -180,15 +182,25 @@ void PathSubstitutionGoal::tryToRun()
 {
     trace("trying to run");
 
-    /* Make sure that we are allowed to start a build.  Note that even
-       if maxBuildJobs == 0 (no local builds allowed), we still allow
-       a substituter to run.  This is because substitutions cannot be
-       distributed to another machine via the build hook. */
-    if (worker.getNrLocalBuilds() >= std::max(1U, (unsigned int) settings.maxBuildJobs)) {
+    /* Make sure that we are allowed to start a substitution.  These
+       have their own pool of slots, separate from local builds, so
+       that inputs can be downloaded while builds are running.  Note
+       that even if maxSubstitutionJobs == 0 we still allow one
+       substituter to run, because substitutions cannot be distributed
+       to another machine via the build hook. */
+    if (worker.getNrSubstitutions() >= std::max(1U, (unsigned int) settings.maxSubstitutionJobs)) {
         worker.waitForBuildSlot(shared_from_this());
         return;
     }
 
+    /* Don't use more than the substituter's share of the slots. */
+    auto & runningFromSubstituter = worker.runningSubstitutionsFrom[sub->getUri()];
+    if (sub->substitutionJobs && runningFromSubstituter >= sub->substitutionJobs) {
+        worker.waitForChildTermination(shared_from_this());
+        return;
+    }
+
+    maintainRunningFromSubstituter = std::make_unique<MaintainCount<uint64_t>>(runningFromSubstituter);
     maintainRunningSubstitutions = std::make_unique<MaintainCount<uint64_t>>(worker.runningSubstitutions);
     worker.updateProgress();
 
@@ -224,6 +236,7 @@ void PathSubstitutionGoal::finished()
     trace("substitute finished");
 
     thr.join();
+    maintainRunningFromSubstituter.reset();
     worker.childTerminated(this);
 
     try {
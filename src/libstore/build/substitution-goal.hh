@@ -45,7 +45,8 @@ struct PathSubstitutionGoal : public Goal
     Path destPath;
 
     std::unique_ptr<MaintainCount<uint64_t>> maintainExpectedSubstitutions,
-        maintainRunningSubstitutions, maintainExpectedNar, maintainExpectedDownload;
+        maintainRunningSubstitutions, maintainExpectedNar, maintainExpectedDownload,
+        maintainRunningFromSubstituter;
 
     typedef void (PathSubstitutionGoal::*GoalState)();
     GoalState state;
@@ -66,6 +67,8 @@ public:
         return "a$" + std::string(storePath.name()) + "$" + worker.store.printStorePath(storePath);
     }
 
+    JobCategory jobCategory() override { return JobCategory::Substitution; }
+
     void work() override;
 
     /* The states. */
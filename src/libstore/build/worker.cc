@@ -4,8 +4,16 @@
 #include "drv-output-substitution-goal.hh"
 #include "local-derivation-goal.hh"
 #include "hook-instance.hh"
+#include "pathlocks.hh"
 
 #include <poll.h>
+#include <thread>
+
+#if __linux__
+#include "cgroup.hh"
+
+#include <sys/epoll.h>
+#endif
 
 namespace nix {
 
@@ -17,11 +25,47 @@ Worker::Worker(Store & store)
 {
     /* Debugging: prevent recursive workers. */
     nrLocalBuilds = 0;
+    nrSubstitutions = 0;
     lastWokenUp = steady_time_point::min();
     permanentFailure = false;
     timedOut = false;
     hashMismatch = false;
     checkMismatch = false;
+
+    lockWaiters = std::make_shared<Sync<std::set<Path>>>();
+
+    locksReleased = std::make_shared<Pipe>();
+    locksReleased->create();
+    closeOnExec(locksReleased->readSide.get());
+    closeOnExec(locksReleased->writeSide.get());
+    if (fcntl(locksReleased->readSide.get(), F_SETFL, O_NONBLOCK) == -1)
+        throw SysError("making lock release pipe non-blocking");
+
+#if __linux__
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (!epollFd)
+        throw SysError("creating epoll instance");
+
+    struct epoll_event event = { .events = EPOLLIN, .data = { .fd = locksReleased->readSide.get() } };
+    if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, locksReleased->readSide.get(), &event) == -1)
+        throw SysError("watching lock release pipe");
+#endif
+
+    /* Every jobserver client has one implicit job slot for which it
+       doesn't take a token, so the pipe holds one token less than
+       `jobserver-tokens'. The worker holds the last one and gives it
+       to a build as its implicit slot; other builds running at the
+       same time take a token from the pipe for theirs. */
+    if (settings.jobserverTokens) {
+        jobserver.create();
+        std::string tokens(settings.jobserverTokens - 1, '+');
+        writeFull(jobserver.writeSide.get(), tokens);
+        jobserverSpare = true;
+        /* GNU Make makes the read side non-blocking as well, so
+           jobserver clients already have to cope with this. */
+        if (fcntl(jobserver.readSide.get(), F_SETFL, O_NONBLOCK) == -1)
+            throw SysError("making the jobserver pipe non-blocking");
+    }
 }
 
 
@@ -33,6 +77,15 @@ Worker::~Worker()
        their destructors). */
     topGoals.clear();
 
+#if __linux__
+    for (auto & [cgroup, fd] : dyingCgroups)
+        try {
+            destroyCgroup(cgroup);
+        } catch (Error & e) {
+            warn("%s", e.msg());
+        }
+#endif
+
     assert(expectedSubstitutions == 0);
     assert(expectedDownloadSize == 0);
     assert(expectedNarSize == 0);
@@ -160,6 +213,12 @@ unsigned Worker::getNrLocalBuilds()
 }
 
 
+unsigned Worker::getNrSubstitutions()
+{
+    return nrSubstitutions;
+}
+
+
 void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     bool inBuildSlot, bool respectTimeouts)
 {
@@ -169,9 +228,49 @@ void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     child.fds = fds;
     child.timeStarted = child.lastOutput = steady_time_point::clock::now();
     child.inBuildSlot = inBuildSlot;
+    child.jobCategory = goal->jobCategory();
     child.respectTimeouts = respectTimeouts;
     children.emplace_back(child);
-    if (inBuildSlot) nrLocalBuilds++;
+    if (inBuildSlot) {
+        switch (child.jobCategory) {
+        case JobCategory::Substitution:
+            nrSubstitutions++;
+            break;
+        case JobCategory::Build:
+            nrLocalBuilds++;
+            break;
+        default:
+            abort();
+        }
+    }
+
+#if __linux__
+    for (auto fd : fds) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, fd, &event) == -1
+            && (errno != EEXIST || epoll_ctl(epollFd.get(), EPOLL_CTL_MOD, fd, &event) == -1))
+            throw SysError("watching file descriptor %d", fd);
+        fdToChild[fd] = &children.back();
+    }
+#endif
+}
+
+
+void Worker::stopWatching(Child & child, int fd)
+{
+#if __linux__
+    /* The goal may already have closed the file descriptor (and its
+       number may have been reused by another child), so only
+       unregister it if it's still ours, and ignore errors. */
+    auto i = fdToChild.find(fd);
+    if (i != fdToChild.end() && i->second == &child) {
+        epoll_ctl(epollFd.get(), EPOLL_CTL_DEL, fd, nullptr);
+        fdToChild.erase(i);
+    }
+#endif
+    child.fds.erase(fd);
 }
 
 
@@ -182,10 +281,23 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
     if (i == children.end()) return;
 
     if (i->inBuildSlot) {
-        assert(nrLocalBuilds > 0);
-        nrLocalBuilds--;
+        switch (i->jobCategory) {
+        case JobCategory::Substitution:
+            assert(nrSubstitutions > 0);
+            nrSubstitutions--;
+            break;
+        case JobCategory::Build:
+            assert(nrLocalBuilds > 0);
+            nrLocalBuilds--;
+            break;
+        default:
+            abort();
+        }
     }
 
+    for (auto fd : set<int>(i->fds))
+        stopWatching(*i, fd);
+
     children.erase(i);
 
     if (wakeSleepers) {
@@ -204,13 +316,22 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
 void Worker::waitForBuildSlot(GoalPtr goal)
 {
     debug("wait for build slot");
-    if (getNrLocalBuilds() < settings.maxBuildJobs)
+    bool isSubstitutionGoal = goal->jobCategory() == JobCategory::Substitution;
+    if ((!isSubstitutionGoal && getNrLocalBuilds() < settings.maxBuildJobs) ||
+        (isSubstitutionGoal && getNrSubstitutions() < std::max(1U, (unsigned int) settings.maxSubstitutionJobs)))
         wakeUp(goal); /* we can do it right away */
     else
         addToWeakGoals(wantingToBuild, goal);
 }
 
 
+void Worker::waitForChildTermination(GoalPtr goal)
+{
+    debug("wait for child termination");
+    addToWeakGoals(wantingToBuild, goal);
+}
+
+
 void Worker::waitForAnyGoal(GoalPtr goal)
 {
     debug("wait for any goal");
@@ -225,6 +346,33 @@ void Worker::waitForAWhile(GoalPtr goal)
 }
 
 
+void Worker::waitForLocks(GoalPtr goal, const PathSet & lockPaths)
+{
+    waitForAWhile(goal);
+
+    /* flock() can't be waited for in the event loop, so wait for the
+       locks in threads, one per lock path: goals are retried on every
+       wakeup and would otherwise start a new thread each time. A
+       shared lock is enough to know that the exclusive holder is gone;
+       it is dropped straight away, so that the goal can take the lock
+       itself. */
+    for (auto & path : lockPaths) {
+        if (!lockWaiters->lock()->insert(path).second) continue;
+
+        std::thread([locksReleased(locksReleased), lockWaiters(lockWaiters), path]() {
+            try {
+                AutoCloseFD fd = openLockFile(path + ".lock", false);
+                if (fd) lockFile(fd.get(), ltRead, true);
+            } catch (...) {
+            }
+            lockWaiters->lock()->erase(path);
+            char c = 0;
+            if (::write(locksReleased->writeSide.get(), &c, 1) == -1) { }
+        }).detach();
+    }
+}
+
+
 void Worker::run(const Goals & _topGoals)
 {
     std::vector<nix::DerivedPath> topPaths;
@@ -253,15 +401,28 @@ void Worker::run(const Goals & _topGoals)
         if (auto localStore = dynamic_cast<LocalStore *>(&store))
             localStore->autoGC(false);
 
-        /* Call every wake goal (in the ordering established by
-           CompareGoalPtrs). */
+        /* Call every wake goal, deepest first so that goals on the
+           critical path grab free build slots before goals that
+           little else depends on, and among those the ones expected
+           to take longest, then the ones with the least to download.
+           Remaining ties are broken by the ordering established by
+           CompareGoalPtrs. */
         while (!awake.empty() && !topGoals.empty()) {
-            Goals awake2;
+            Goals awake1;
             for (auto & i : awake) {
                 GoalPtr goal = i.lock();
-                if (goal) awake2.insert(goal);
+                if (goal) awake1.insert(goal);
             }
             awake.clear();
+            std::vector<GoalPtr> awake2(awake1.begin(), awake1.end());
+            std::stable_sort(awake2.begin(), awake2.end(),
+                [](const GoalPtr & a, const GoalPtr & b) {
+                    return a->depth != b->depth
+                        ? a->depth > b->depth
+                        : a->expectedDuration != b->expectedDuration
+                        ? a->expectedDuration > b->expectedDuration
+                        : a->downloadSize < b->downloadSize;
+                });
             for (auto & goal : awake2) {
                 checkInterrupt();
                 goal->work();
@@ -299,6 +460,75 @@ void Worker::run(const Goals & _topGoals)
     assert(!settings.keepGoing || children.empty());
 }
 
+void Worker::drainLocksReleased()
+{
+    char buf[64];
+    while (true) {
+        auto rd = ::read(locksReleased->readSide.get(), buf, sizeof(buf));
+        if (rd == -1 && errno == EINTR) continue;
+        if (rd < (ssize_t) sizeof(buf)) break;
+    }
+}
+
+bool Worker::acquireJobserverToken()
+{
+    if (jobserverSpare) {
+        jobserverSpare = false;
+        return true;
+    }
+    char c;
+    while (true) {
+        auto rd = ::read(jobserver.readSide.get(), &c, 1);
+        if (rd == -1 && errno == EINTR) continue;
+        return rd == 1;
+    }
+}
+
+void Worker::releaseJobserverToken()
+{
+    if (!jobserverSpare)
+        jobserverSpare = true;
+    else
+        writeFull(jobserver.writeSide.get(), "+");
+}
+
+#if __linux__
+void Worker::removeCgroupWhenEmpty(const Path & cgroup)
+{
+    AutoCloseFD fd = open((cgroup + "/cgroup.events").c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening '%s'", cgroup + "/cgroup.events");
+
+    struct epoll_event event = { .events = EPOLLPRI, .data = { .fd = fd.get() } };
+    if (epoll_ctl(epollFd.get(), EPOLL_CTL_ADD, fd.get(), &event) == -1)
+        throw SysError("watching cgroup '%s'", cgroup);
+
+    /* The processes may have exited before we started watching. */
+    if (!cgroupPopulated(fd.get()) && removeCgroup(cgroup)) return;
+
+    dyingCgroups.insert_or_assign(cgroup, std::move(fd));
+}
+
+void Worker::forgetCgroup(const Path & cgroup)
+{
+    dyingCgroups.erase(cgroup);
+}
+
+void Worker::handleCgroupEvent(int fd)
+{
+    for (auto i = dyingCgroups.begin(); i != dyingCgroups.end(); ++i) {
+        if (i->second.get() != fd) continue;
+        try {
+            if (cgroupPopulated(fd) || !removeCgroup(i->first)) return;
+        } catch (Error & e) {
+            warn("%s", e.msg());
+        }
+        dyingCgroups.erase(i);
+        return;
+    }
+}
+#endif
+
 void Worker::waitForInput()
 {
     printMsg(lvlVomit, "waiting for children");
@@ -345,11 +575,77 @@ void Worker::waitForInput()
     if (useTimeout)
         vomit("sleeping %d seconds", timeout);
 
-    /* Use select() to wait for the input side of any logger pipe to
+    std::vector<unsigned char> buffer(4096);
+
+    /* Read available data from `fd', one of the file descriptors of
+       `child'. */
+    auto handleInput = [&](Child & child, GoalPtr goal, int fd, steady_time_point now) {
+        ssize_t rd = ::read(fd, buffer.data(), buffer.size());
+        // FIXME: is there a cleaner way to handle pt close
+        // than EIO? Is this even standard?
+        if (rd == 0 || (rd == -1 && errno == EIO)) {
+            debug("%1%: got EOF", goal->getName());
+            stopWatching(child, fd);
+            goal->handleEOF(fd);
+        } else if (rd == -1) {
+            if (errno != EINTR)
+                throw SysError("%s: read failed", goal->getName());
+        } else {
+            printMsg(lvlVomit, "%1%: read %2% bytes",
+                goal->getName(), rd);
+            string data((char *) buffer.data(), rd);
+            child.lastOutput = now;
+            goal->handleChildOutput(fd, data);
+        }
+    };
+
+#if __linux__
+    /* Wait for the input side of any logger pipe to become
+       `available'.  Note that `available' (i.e., non-blocking)
+       includes EOF. */
+    std::vector<struct epoll_event> events(fdToChild.size() + dyingCgroups.size() + 1);
+
+    int nrEvents = epoll_wait(epollFd.get(), events.data(), events.size(),
+        useTimeout ? timeout * 1000 : -1);
+    if (nrEvents == -1) {
+        if (errno == EINTR) return;
+        throw SysError("waiting for input");
+    }
+
+    auto after = steady_time_point::clock::now();
+
+    bool lockReleased = false;
+
+    /* Process the file descriptors that have input. A handler may
+       terminate children, so look each one up again. */
+    for (int n = 0; n < nrEvents; ++n) {
+        checkInterrupt();
+
+        auto fd = events[n].data.fd;
+        if (fd == locksReleased->readSide.get()) {
+            drainLocksReleased();
+            lockReleased = true;
+            continue;
+        }
+        auto i = fdToChild.find(fd);
+        if (i == fdToChild.end()) {
+            handleCgroupEvent(fd);
+            continue;
+        }
+        auto & child(*i->second);
+
+        GoalPtr goal = child.goal.lock();
+        assert(goal);
+
+        handleInput(child, goal, fd, after);
+    }
+#else
+    /* Use poll() to wait for the input side of any logger pipe to
        become `available'.  Note that `available' (i.e., non-blocking)
        includes EOF. */
     std::vector<struct pollfd> pollStatus;
     std::map <int, int> fdToPollStatus;
+    pollStatus.push_back((struct pollfd) { .fd = locksReleased->readSide.get(), .events = POLLIN });
     for (auto & i : children) {
         for (auto & j : i.fds) {
             pollStatus.push_back((struct pollfd) { .fd = j, .events = POLLIN });
@@ -365,11 +661,16 @@ void Worker::waitForInput()
 
     auto after = steady_time_point::clock::now();
 
+    bool lockReleased = false;
+    if (pollStatus[0].revents) {
+        drainLocksReleased();
+        lockReleased = true;
+    }
+
     /* Process all available file descriptors. FIXME: this is
        O(children * fds). */
-    decltype(children)::iterator i;
-    for (auto j = children.begin(); j != children.end(); j = i) {
-        i = std::next(j);
+    for (auto j = children.begin(); j != children.end(); ) {
+        auto i = std::next(j);
 
         checkInterrupt();
 
@@ -377,32 +678,26 @@ void Worker::waitForInput()
         assert(goal);
 
         set<int> fds2(j->fds);
-        std::vector<unsigned char> buffer(4096);
-        for (auto & k : fds2) {
-            if (pollStatus.at(fdToPollStatus.at(k)).revents) {
-                ssize_t rd = ::read(k, buffer.data(), buffer.size());
-                // FIXME: is there a cleaner way to handle pt close
-                // than EIO? Is this even standard?
-                if (rd == 0 || (rd == -1 && errno == EIO)) {
-                    debug("%1%: got EOF", goal->getName());
-                    goal->handleEOF(k);
-                    j->fds.erase(k);
-                } else if (rd == -1) {
-                    if (errno != EINTR)
-                        throw SysError("%s: read failed", goal->getName());
-                } else {
-                    printMsg(lvlVomit, "%1%: read %2% bytes",
-                        goal->getName(), rd);
-                    string data((char *) buffer.data(), rd);
-                    j->lastOutput = after;
-                    goal->handleChildOutput(k, data);
-                }
-            }
-        }
+        for (auto & k : fds2)
+            if (pollStatus.at(fdToPollStatus.at(k)).revents)
+                handleInput(*j, goal, k, after);
+
+        j = i;
+    }
+#endif
+
+    /* Check for timeouts. */
+    decltype(children)::iterator i;
+    for (auto j = children.begin(); j != children.end(); j = i) {
+        i = std::next(j);
+
+        if (!j->respectTimeouts) continue;
+
+        GoalPtr goal = j->goal.lock();
+        assert(goal);
 
         if (goal->exitCode == Goal::ecBusy &&
             0 != settings.maxSilentTime &&
-            j->respectTimeouts &&
             after - j->lastOutput >= std::chrono::seconds(settings.maxSilentTime))
         {
             goal->timedOut(Error(
@@ -412,7 +707,6 @@ void Worker::waitForInput()
 
         else if (goal->exitCode == Goal::ecBusy &&
             0 != settings.buildTimeout &&
-            j->respectTimeouts &&
             after - j->timeStarted >= std::chrono::seconds(settings.buildTimeout))
         {
             goal->timedOut(Error(
@@ -421,7 +715,7 @@ void Worker::waitForInput()
         }
     }
 
-    if (!waitingForAWhile.empty() && lastWokenUp + std::chrono::seconds(settings.pollInterval) <= after) {
+    if (!waitingForAWhile.empty() && (lockReleased || lastWokenUp + std::chrono::seconds(settings.pollInterval) <= after)) {
         lastWokenUp = after;
         for (auto & i : waitingForAWhile) {
             GoalPtr goal = i.lock();
@@ -487,6 +781,22 @@ void Worker::markContentsGood(const StorePath & path)
 }
 
 
+time_t Worker::getExpectedDuration(const StorePath & drvPath)
+{
+    /* Read the whole table once rather than querying it for every
+       derivation goal. */
+    if (!buildTimes) {
+        try {
+            buildTimes = getBuildTimeCache()->allBuildTimes();
+        } catch (Error & e) {
+            debug("cannot query build times: %s", e.msg());
+            buildTimes.emplace();
+        }
+    }
+    return BuildTimeCache::lookupBuildTime(*buildTimes, Derivation::nameFromPath(drvPath)).value_or(0);
+}
+
+
 GoalPtr upcast_goal(std::shared_ptr<PathSubstitutionGoal> subGoal) {
     return subGoal;
 }
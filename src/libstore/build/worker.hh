@@ -5,6 +5,7 @@
 #include "store-api.hh"
 #include "goal.hh"
 #include "realisation.hh"
+#include "build-time-cache.hh"
 
 #include <future>
 #include <thread>
@@ -41,6 +42,7 @@ struct Child
     set<int> fds;
     bool respectTimeouts;
     bool inBuildSlot;
+    JobCategory jobCategory;
     steady_time_point lastOutput; /* time we last got output on stdout/stderr */
     steady_time_point timeStarted;
 };
@@ -68,10 +70,13 @@ private:
     /* Child processes currently running. */
     std::list<Child> children;
 
-    /* Number of build slots occupied.  This includes local builds and
-       substitutions but not remote builds via the build hook. */
+    /* Number of build slots occupied.  This includes local builds but
+       not substitutions or remote builds via the build hook. */
     unsigned int nrLocalBuilds;
 
+    /* Number of substitution slots occupied. */
+    unsigned int nrSubstitutions;
+
     /* Maps used to prevent multiple instantiations of a goal for the
        same derivation / path. */
     std::map<StorePath, std::weak_ptr<DerivationGoal>> derivationGoals;
@@ -90,6 +95,35 @@ private:
     /* Cache for pathContentsGood(). */
     std::map<StorePath, bool> pathContentsGoodCache;
 
+    /* The build time cache, read by the first call to
+       getExpectedDuration(). */
+    std::optional<BuildTimeCache::BuildTimes> buildTimes;
+
+    /* Written to by the threads started by waitForLocks() when the
+       locks they wait for have been released. It is shared with
+       those threads because they may outlive the worker. */
+    std::shared_ptr<Pipe> locksReleased;
+
+    /* The lock paths that a thread started by waitForLocks() is
+       waiting on. Shared for the same reason. */
+    std::shared_ptr<Sync<std::set<Path>>> lockWaiters;
+
+#if __linux__
+    /* An epoll instance watching the file descriptors of all
+       children, and a map from those file descriptors back to their
+       child, so that waitForInput() doesn't have to scan every
+       child. */
+    AutoCloseFD epollFd;
+    std::unordered_map<int, Child *> fdToChild;
+
+    /* Cgroups of finished builds that still contained exiting
+       processes, with their `cgroup.events' file, which is watched by
+       `epollFd'. They are removed once they are empty. */
+    std::map<Path, AutoCloseFD> dyingCgroups;
+
+    void handleCgroupEvent(int fd);
+#endif
+
 public:
 
     const Activity act;
@@ -113,6 +147,14 @@ public:
 
     std::unique_ptr<HookInstance> hook;
 
+    /* A GNU Make jobserver pipe shared by all local builds, if
+       `jobserver-tokens' is set. */
+    Pipe jobserver;
+
+    /* Whether the worker holds the one token that is not in the
+       jobserver pipe. */
+    bool jobserverSpare = false;
+
     uint64_t expectedBuilds = 0;
     uint64_t doneBuilds = 0;
     uint64_t failedBuilds = 0;
@@ -127,6 +169,10 @@ public:
     uint64_t expectedNarSize = 0;
     uint64_t doneNarSize = 0;
 
+    /* Number of substitutions currently running from each
+       substituter, keyed by its URI. */
+    std::map<std::string, uint64_t> runningSubstitutionsFrom;
+
     /* Whether to ask the build hook if it can build a derivation. If
        it answers with "decline-permanently", we don't try again. */
     bool tryBuildHook = true;
@@ -159,13 +205,17 @@ public:
     /* Wake up a goal (i.e., there is something for it to do). */
     void wakeUp(GoalPtr goal);
 
-    /* Return the number of local build and substitution processes
-       currently running (but not remote builds via the build
-       hook). */
+    /* Return the number of local build processes currently running
+       (but not remote builds via the build hook). */
     unsigned int getNrLocalBuilds();
 
+    /* Return the number of substitution processes currently
+       running. */
+    unsigned int getNrSubstitutions();
+
     /* Registers a running child process.  `inBuildSlot' means that
-       the process counts towards the jobs limit. */
+       the process counts towards the jobs limit of the goal's job
+       category (`max-jobs' or `max-substitution-jobs'). */
     void childStarted(GoalPtr goal, const set<int> & fds,
         bool inBuildSlot, bool respectTimeouts);
 
@@ -175,10 +225,20 @@ public:
        or the hook would still say `postpone'). */
     void childTerminated(Goal * goal, bool wakeSleepers = true);
 
-    /* Put `goal' to sleep until a build slot becomes available (which
-       might be right away). */
+private:
+
+    /* Stop watching file descriptor `fd' of `child'. */
+    void stopWatching(Child & child, int fd);
+
+public:
+
+    /* Put `goal' to sleep until a slot of its job category becomes
+       available (which might be right away). */
     void waitForBuildSlot(GoalPtr goal);
 
+    /* Put `goal' to sleep until some child process terminates. */
+    void waitForChildTermination(GoalPtr goal);
+
     /* Wait for any goal to finish.  Pretty indiscriminate way to
        wait for some resource that some other goal is holding. */
     void waitForAnyGoal(GoalPtr goal);
@@ -189,12 +249,37 @@ public:
        to wait for multiple locks in the main select() loop. */
     void waitForAWhile(GoalPtr goal);
 
+    /* Like waitForAWhile(), but also retry the goal as soon as the
+       locks on 'lockPaths' held by another process are released,
+       rather than at the next poll. */
+    void waitForLocks(GoalPtr goal, const PathSet & lockPaths);
+
     /* Loop until the specified top-level goals have finished. */
     void run(const Goals & topGoals);
 
     /* Wait for input to become available. */
     void waitForInput();
 
+    /* Empty the pipe written to by waitForLocks(). */
+    void drainLocksReleased();
+
+    /* Take a jobserver token for the implicit job slot of a build
+       that gets the jobserver. Returns false if no token is free. */
+    bool acquireJobserverToken();
+
+    /* Return a token taken by acquireJobserverToken(). */
+    void releaseJobserverToken();
+
+#if __linux__
+    /* Remove `cgroup', whose processes have been killed, as soon as
+       they have exited, without blocking the other goals. */
+    void removeCgroupWhenEmpty(const Path & cgroup);
+
+    /* Stop waiting to remove `cgroup', because it has been
+       recreated. */
+    void forgetCgroup(const Path & cgroup);
+#endif
+
     unsigned int exitStatus();
 
     /* Check whether the given valid path exists and has the right
@@ -203,6 +288,11 @@ public:
 
     void markContentsGood(const StorePath & path);
 
+    /* Return how long building `drvPath' is expected to take, based
+       on previous builds of derivations with the same name, or 0 if
+       that is unknown. */
+    time_t getExpectedDuration(const StorePath & drvPath);
+
     void updateProgress()
     {
         actDerivations.progress(doneBuilds, expectedBuilds + doneBuilds, runningBuilds, failedBuilds);
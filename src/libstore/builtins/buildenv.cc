@@ -35,18 +35,6 @@ static void createLinks(State & state, const Path & srcDir, const Path & dstDir,
         auto srcFile = srcDir + "/" + ent.name;
         auto dstFile = dstDir + "/" + ent.name;
 
-        struct stat srcSt;
-        try {
-            if (stat(srcFile.c_str(), &srcSt) == -1)
-                throw SysError("getting status of '%1%'", srcFile);
-        } catch (SysError & e) {
-            if (e.errNo == ENOENT || e.errNo == ENOTDIR) {
-                warn("skipping dangling symlink '%s'", dstFile);
-                continue;
-            }
-            throw;
-        }
-
         /* The files below are special-cased to that they don't show up
          * in user profiles, either because they are useless, or
          * because they would cauase pointless collisions (e.g., each
@@ -60,7 +48,25 @@ static void createLinks(State & state, const Path & srcDir, const Path & dstDir,
             hasSuffix(srcFile, "/log"))
             continue;
 
-        else if (S_ISDIR(srcSt.st_mode)) {
+        /* Only symlinks (and entries of unknown type) need to be
+           stat()ed to find out whether they refer to a directory. */
+        bool isDir = ent.type == DT_DIR;
+        if (ent.type == DT_LNK || ent.type == DT_UNKNOWN) {
+            struct stat srcSt;
+            try {
+                if (stat(srcFile.c_str(), &srcSt) == -1)
+                    throw SysError("getting status of '%1%'", srcFile);
+            } catch (SysError & e) {
+                if (e.errNo == ENOENT || e.errNo == ENOTDIR) {
+                    warn("skipping dangling symlink '%s'", dstFile);
+                    continue;
+                }
+                throw;
+            }
+            isDir = S_ISDIR(srcSt.st_mode);
+        }
+
+        if (isDir) {
             struct stat dstSt;
             auto res = lstat(dstFile.c_str(), &dstSt);
             if (res == 0) {
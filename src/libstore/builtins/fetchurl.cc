@@ -58,18 +58,47 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
         }
     };
 
-    /* Try the hashed mirrors first. */
-    if (getAttr("outputHashMode") == "flat")
-        for (auto hashedMirror : settings.hashedMirrors.get())
+    /* Try the hashed mirrors first. Most of them won't have the
+       file, so rather than waiting for each of them to fail in turn,
+       first ask all of them concurrently, and then only download
+       from those that didn't report it as missing. */
+    if (getAttr("outputHashMode") == "flat" && !settings.hashedMirrors.get().empty()) {
+        /* The algorithm is empty or missing if the hash is given in
+           SRI form. */
+        std::optional<HashType> ht = parseHashTypeOpt(get(drv.env, "outputHashAlgo").value_or(""));
+        Hash h = newHashAllowEmpty(getAttr("outputHash"), ht);
+
+        std::vector<std::pair<std::string, std::future<FileTransferResult>>> mirrors;
+        for (auto hashedMirror : settings.hashedMirrors.get()) {
+            if (!hasSuffix(hashedMirror, "/")) hashedMirror += '/';
+            auto url = hashedMirror + printHashType(h.type) + "/" + h.to_string(Base16, false);
+            FileTransferRequest request(url);
+            request.verifyTLS = false;
+            request.head = true;
+            mirrors.emplace_back(url, fileTransfer->enqueueFileTransfer(request));
+        }
+
+        for (auto & [url, probe] : mirrors) {
             try {
-                if (!hasSuffix(hashedMirror, "/")) hashedMirror += '/';
-                std::optional<HashType> ht = parseHashTypeOpt(getAttr("outputHashAlgo"));
-                Hash h = newHashAllowEmpty(getAttr("outputHash"), ht);
-                fetch(hashedMirror + printHashType(h.type) + "/" + h.to_string(Base16, false));
+                probe.get();
+            } catch (FileTransferError & e) {
+                if (e.error == FileTransfer::NotFound) {
+                    debug(e.what());
+                    continue;
+                }
+            } catch (Error &) {
+                /* Other errors (e.g. a server that doesn't support
+                   HEAD requests) don't say whether the file is
+                   there, so try downloading it anyway. */
+            }
+            try {
+                fetch(url);
                 return;
             } catch (Error & e) {
                 debug(e.what());
             }
+        }
+    }
 
     /* Otherwise try the specified URL. */
     fetch(mainUrl);
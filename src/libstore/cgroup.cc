@@ -0,0 +1,143 @@
+#if __linux__
+
+#include "cgroup.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <thread>
+
+#include <signal.h>
+#include <unistd.h>
+
+namespace nix {
+
+static const Path cgroupRoot = "/sys/fs/cgroup";
+
+std::optional<Path> getOwnCgroup()
+{
+    if (!pathExists(cgroupRoot + "/cgroup.controllers")) return {};
+
+    /* In the unified hierarchy, our entry in /proc/self/cgroup looks
+       like ‘0::/system.slice/nix-daemon.service’. */
+    for (auto & line : tokenizeString<std::vector<std::string>>(readFile("/proc/self/cgroup"), "\n"))
+        if (hasPrefix(line, "0::"))
+            return canonPath(cgroupRoot + "/" + line.substr(3));
+
+    return {};
+}
+
+Path createCgroup(const Path & parent, const std::string & name)
+{
+    /* This fails if processes (such as ourselves) live in `parent'
+       itself. The build then only gets CPU accounting. */
+    try {
+        writeFile(parent + "/cgroup.subtree_control", "+cpu +memory +io");
+    } catch (SysError & e) {
+        debug("cannot enable cgroup controllers in '%s': %s", parent, e.msg());
+    }
+
+    auto cgroup = parent + "/" + name;
+
+    /* Remove a cgroup left behind by a build that was interrupted. */
+    if (pathExists(cgroup)) destroyCgroup(cgroup);
+
+    if (mkdir(cgroup.c_str(), 0755) == -1)
+        throw SysError("creating cgroup '%s'", cgroup);
+
+    return cgroup;
+}
+
+/* Parse the lines of a ‘key value’ file such as cpu.stat. */
+static std::map<std::string, uint64_t> readKeyValues(const Path & path)
+{
+    std::map<std::string, uint64_t> res;
+    for (auto & line : tokenizeString<std::vector<std::string>>(readFile(path), "\n")) {
+        auto fields = tokenizeString<std::vector<std::string>>(line);
+        if (fields.size() == 2)
+            if (auto n = string2Int<uint64_t>(fields[1]))
+                res[fields[0]] = *n;
+    }
+    return res;
+}
+
+CgroupStats getCgroupStats(const Path & cgroup)
+{
+    CgroupStats stats;
+
+    auto cpuStat = readKeyValues(cgroup + "/cpu.stat");
+    stats.cpuUser = cpuStat["user_usec"];
+    stats.cpuSystem = cpuStat["system_usec"];
+
+    auto peakPath = cgroup + "/memory.peak";
+    if (pathExists(peakPath))
+        stats.peakMemory = string2Int<uint64_t>(trim(readFile(peakPath)));
+
+    /* io.stat has a line per device, such as ‘8:0 rbytes=1024
+       wbytes=4096 rios=1 wios=2 dbytes=0 dios=0’. */
+    auto ioPath = cgroup + "/io.stat";
+    if (pathExists(ioPath)) {
+        stats.ioRead = 0;
+        stats.ioWrite = 0;
+        for (auto & field : tokenizeString<std::vector<std::string>>(readFile(ioPath))) {
+            auto eq = field.find('=');
+            if (eq == std::string::npos) continue;
+            auto n = string2Int<uint64_t>(field.substr(eq + 1)).value_or(0);
+            auto key = field.substr(0, eq);
+            if (key == "rbytes") *stats.ioRead += n;
+            else if (key == "wbytes") *stats.ioWrite += n;
+        }
+    }
+
+    return stats;
+}
+
+void killCgroup(const Path & cgroup)
+{
+    /* Kill processes that escaped the builder's process group, using
+       cgroup.kill if the kernel has it (Linux >= 5.14). */
+    auto killPath = cgroup + "/cgroup.kill";
+    if (pathExists(killPath))
+        writeFile(killPath, "1");
+    else
+        for (auto & pid : tokenizeString<std::vector<std::string>>(readFile(cgroup + "/cgroup.procs")))
+            if (auto n = string2Int<pid_t>(pid))
+                kill(*n, SIGKILL);
+}
+
+bool removeCgroup(const Path & cgroup)
+{
+    if (rmdir(cgroup.c_str()) == 0 || errno == ENOENT) return true;
+    if (errno == EBUSY) return false;
+    throw SysError("deleting cgroup '%s'", cgroup);
+}
+
+bool cgroupPopulated(int eventsFd)
+{
+    /* Read through `eventsFd' itself: that is what tells the kernel
+       that we have seen the latest event. */
+    char buf[1024];
+    auto n = pread(eventsFd, buf, sizeof(buf) - 1, 0);
+    if (n == -1)
+        throw SysError("reading cgroup.events");
+    for (auto & line : tokenizeString<std::vector<std::string>>(std::string(buf, n), "\n"))
+        if (line == "populated 0") return false;
+    return true;
+}
+
+void destroyCgroup(const Path & cgroup)
+{
+    killCgroup(cgroup);
+
+    /* Killed processes leave the cgroup asynchronously, so retry for
+       a while. */
+    for (int attempt = 0; ; ++attempt) {
+        if (removeCgroup(cgroup)) return;
+        if (attempt == 100)
+            throw Error("cannot delete cgroup '%s' because it still contains processes", cgroup);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+}
+
+#endif
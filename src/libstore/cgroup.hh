@@ -0,0 +1,55 @@
+#pragma once
+
+#if __linux__
+
+#include "types.hh"
+
+#include <optional>
+
+namespace nix {
+
+/* The resource usage of a cgroup, as accounted by the kernel. */
+struct CgroupStats
+{
+    /* User and system CPU time, in microseconds. */
+    uint64_t cpuUser = 0, cpuSystem = 0;
+
+    /* The peak memory usage in bytes, if the memory controller is
+       enabled (and the kernel is recent enough to report it). */
+    std::optional<uint64_t> peakMemory;
+
+    /* The bytes read from and written to block devices, if the io
+       controller is enabled. */
+    std::optional<uint64_t> ioRead, ioWrite;
+};
+
+/* Return the directory of the cgroup of the calling process in the
+   unified (v2) hierarchy, or nothing if there is no such
+   hierarchy. */
+std::optional<Path> getOwnCgroup();
+
+/* Create the cgroup `name' inside `parent', after trying to enable
+   the cpu, memory and io controllers for the children of `parent'.
+   Return the path of the new cgroup. */
+Path createCgroup(const Path & parent, const std::string & name);
+
+CgroupStats getCgroupStats(const Path & cgroup);
+
+/* Kill all processes in `cgroup'. They leave it asynchronously. */
+void killCgroup(const Path & cgroup);
+
+/* Remove `cgroup'. Return false if it still contains processes. */
+bool removeCgroup(const Path & cgroup);
+
+/* Return whether the cgroup whose `cgroup.events' file is open as
+   `eventsFd' contains processes. The file signals EPOLLPRI when this
+   changes. */
+bool cgroupPopulated(int eventsFd);
+
+/* Kill all processes in `cgroup', and remove it, waiting up to a
+   second for the processes to exit. */
+void destroyCgroup(const Path & cgroup);
+
+}
+
+#endif
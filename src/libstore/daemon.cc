@@ -9,6 +9,8 @@
 #include "derivations.hh"
 #include "args.hh"
 
+#include <chrono>
+
 namespace nix::daemon {
 
 Sink & operator << (Sink & sink, const Logger::Fields & fields)
@@ -274,7 +276,7 @@ static std::vector<DerivedPath> readDerivedPaths(Store & store, unsigned int cli
 
 static void performOp(TunnelLogger * logger, ref<Store> store,
     TrustedFlag trusted, RecursiveFlag recursive, unsigned int clientVersion,
-    Source & from, BufferedSink & to, unsigned int op)
+    unsigned int clientExtensions, Source & from, BufferedSink & to, unsigned int op)
 {
     switch (op) {
 
@@ -592,6 +594,11 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         if (GET_PROTOCOL_MINOR(clientVersion) >= 28) {
             worker_proto::write(*store, to, res.builtOutputs);
         }
+        if (HAS_WORKER_EXT(clientExtensions, WORKER_EXT_BUILD_TIMINGS)) {
+            to << res.timings.size();
+            for (auto & [phase, time] : res.timings)
+                to << phase << time;
+        }
         break;
     }
 
@@ -778,6 +785,44 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopQueryPathInfos: {
+        auto paths = worker_proto::read(*store, from, Phantom<StorePathSet> {});
+        std::vector<ref<const ValidPathInfo>> infos;
+        logger->startWork();
+        for (auto & path : paths) {
+            try {
+                infos.push_back(store->queryPathInfo(path));
+            } catch (InvalidPath &) {
+            }
+        }
+        logger->stopWork();
+        to << infos.size();
+        for (auto & info : infos) {
+            to << store->printStorePath(info->path);
+            writeValidPathInfo(store, clientVersion, to, info);
+        }
+        break;
+    }
+
+    case wopQueryClosure: {
+        auto paths = worker_proto::read(*store, from, Phantom<StorePathSet> {});
+        bool flipDirection;
+        from >> flipDirection;
+        std::vector<ref<const ValidPathInfo>> infos;
+        logger->startWork();
+        StorePathSet closure;
+        store->computeFSClosure(paths, closure, flipDirection);
+        for (auto & path : closure)
+            infos.push_back(store->queryPathInfo(path));
+        logger->stopWork();
+        to << infos.size();
+        for (auto & info : infos) {
+            to << store->printStorePath(info->path);
+            writeValidPathInfo(store, clientVersion, to, info);
+        }
+        break;
+    }
+
     case wopOptimiseStore:
         logger->startWork();
         store->optimiseStore();
@@ -869,6 +914,34 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopAddMultipleToStore: {
+        bool repair, dontCheckSigs;
+        from >> repair >> dontCheckSigs;
+        if (!trusted && dontCheckSigs)
+            dontCheckSigs = false;
+
+        logger->startWork();
+        {
+            FramedSource source(from);
+            auto count = readNum<size_t>(source);
+            for (size_t n = 0; n < count; n++) {
+                auto info = worker_proto::read(*store, source, Phantom<ValidPathInfo> {});
+                if (!trusted)
+                    info.ultimate = false;
+                /* The NARs are not framed individually, so make sure
+                   that exactly this one is consumed, even if
+                   addToStore() doesn't read it because the path is
+                   already valid. */
+                SizedSource narSource(source, info.narSize);
+                store->addToStore(info, narSource, (RepairFlag) repair,
+                    dontCheckSigs ? NoCheckSigs : CheckSigs);
+                narSource.drainAll();
+            }
+        }
+        logger->stopWork();
+        break;
+    }
+
     case wopQueryMissing: {
         auto targets = readDerivedPaths(*store, clientVersion, from);
         logger->startWork();
@@ -915,11 +988,122 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopQueryRealisations: {
+        auto ids = worker_proto::read(*store, from, Phantom<std::set<DrvOutput>> {});
+        logger->startWork();
+        std::set<Realisation> realisations;
+        for (auto & [_, realisation] : store->queryRealisations(ids))
+            realisations.insert(realisation);
+        logger->stopWork();
+        worker_proto::write(*store, to, realisations);
+        break;
+    }
+
     default:
         throw Error("invalid operation %1%", op);
     }
 }
 
+Metrics * metrics = nullptr;
+
+/* The index in `Metrics::ops' of an operation, if it has one. */
+static std::optional<size_t> opIndex(unsigned int op)
+{
+    if (op < Metrics::maxOps) return op;
+    if (op >= wopQueryPathInfos && op - wopQueryPathInfos < Metrics::maxExtOps)
+        return Metrics::maxOps + (op - wopQueryPathInfos);
+    return std::nullopt;
+}
+
+/* The operation number of an index in `Metrics::ops'. */
+static unsigned int opNumber(size_t index)
+{
+    return index < Metrics::maxOps ? index : wopQueryPathInfos + (index - Metrics::maxOps);
+}
+
+void Metrics::recordOp(unsigned int op, std::chrono::steady_clock::duration duration, bool failed)
+{
+    auto index = opIndex(op);
+    if (!index) return;
+    auto & o(ops[*index]);
+    o.latency.record(duration);
+    if (failed) o.failed++;
+}
+
+void Metrics::addStoreStats(const Store::Stats & stats)
+{
+    storeStats.narInfoRead += stats.narInfoRead;
+    storeStats.narInfoReadAverted += stats.narInfoReadAverted;
+    storeStats.narInfoMissing += stats.narInfoMissing;
+    storeStats.narInfoWrite += stats.narInfoWrite;
+    storeStats.narRead += stats.narRead;
+    storeStats.narReadBytes += stats.narReadBytes;
+    storeStats.narReadCompressedBytes += stats.narReadCompressedBytes;
+    storeStats.narWrite += stats.narWrite;
+    storeStats.narWriteAverted += stats.narWriteAverted;
+    storeStats.narWriteBytes += stats.narWriteBytes;
+    storeStats.narWriteCompressedBytes += stats.narWriteCompressedBytes;
+    storeStats.narWriteCompressionTimeMs += stats.narWriteCompressionTimeMs;
+}
+
+std::string Metrics::toPrometheus()
+{
+    std::string res;
+
+    auto header = [&](std::string_view name, std::string_view type, std::string_view help) {
+        res += fmt("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    };
+
+    auto single = [&](std::string_view name, std::string_view type, std::string_view help, uint64_t value) {
+        header(name, type, help);
+        res += fmt("%s %d\n", name, value);
+    };
+
+    single("nix_daemon_connections_total", "counter", "Number of client connections.", connections);
+    single("nix_daemon_active_connections", "gauge", "Number of client connections being handled.", activeConnections);
+
+    header("nix_daemon_op_duration_seconds", "histogram", "Time taken by worker protocol operations, by operation number.");
+    for (size_t index = 0; index < maxOps + maxExtOps; index++) {
+        auto & h(ops[index].latency);
+        uint64_t count = h.count;
+        if (!count) continue;
+        auto op = opNumber(index);
+        for (size_t i = 0; i < LatencyHistogram::nrBuckets; i++)
+            res += fmt("nix_daemon_op_duration_seconds_bucket{op=\"%d\",le=\"%g\"} %d\n",
+                op, LatencyHistogram::bounds[i] / 1e6, (uint64_t) h.buckets[i]);
+        res += fmt("nix_daemon_op_duration_seconds_bucket{op=\"%d\",le=\"+Inf\"} %d\n", op, count);
+        res += fmt("nix_daemon_op_duration_seconds_sum{op=\"%d\"} %.6f\n", op, h.totalMicros / 1e6);
+        res += fmt("nix_daemon_op_duration_seconds_count{op=\"%d\"} %d\n", op, count);
+    }
+
+    header("nix_daemon_op_failures_total", "counter", "Number of worker protocol operations that failed, by operation number.");
+    for (size_t index = 0; index < maxOps + maxExtOps; index++)
+        if (ops[index].latency.count)
+            res += fmt("nix_daemon_op_failures_total{op=\"%d\"} %d\n", opNumber(index), (uint64_t) ops[index].failed);
+
+    single("nix_daemon_store_nar_info_read_total", "counter", "Number of NAR info lookups.", storeStats.narInfoRead);
+    single("nix_daemon_store_nar_info_read_averted_total", "counter", "Number of NAR info lookups answered from a cache.", storeStats.narInfoReadAverted);
+    single("nix_daemon_store_nar_info_missing_total", "counter", "Number of NAR info lookups of paths that don't exist.", storeStats.narInfoMissing);
+    single("nix_daemon_store_nar_info_write_total", "counter", "Number of NAR infos written.", storeStats.narInfoWrite);
+    single("nix_daemon_store_nar_read_total", "counter", "Number of NARs read.", storeStats.narRead);
+    single("nix_daemon_store_nar_read_bytes_total", "counter", "Uncompressed size of the NARs read.", storeStats.narReadBytes);
+    single("nix_daemon_store_nar_write_total", "counter", "Number of NARs written.", storeStats.narWrite);
+    single("nix_daemon_store_nar_write_bytes_total", "counter", "Uncompressed size of the NARs written.", storeStats.narWriteBytes);
+
+    return res;
+}
+
+void writeMetrics(const Path & path)
+{
+    if (!metrics) return;
+    auto tmp = fmt("%s.tmp-%d", path, getpid());
+    AutoDelete del(tmp, false);
+    writeFile(tmp, metrics->toPrometheus());
+    if (rename(tmp.c_str(), path.c_str()) == -1)
+        throw SysError("renaming '%s' to '%s'", tmp, path);
+    del.cancel();
+}
+
 void processConnection(
     ref<Store> store,
     FdSource & from,
@@ -948,9 +1132,18 @@ void processConnection(
 
     unsigned int opCount = 0;
 
+    if (metrics) {
+        metrics->connections++;
+        metrics->activeConnections++;
+    }
+
     Finally finally([&]() {
         _isInterrupted = false;
         prevLogger->log(lvlDebug, fmt("%d operations", opCount));
+        if (metrics) {
+            metrics->activeConnections--;
+            metrics->addStoreStats(store->getStats());
+        }
     });
 
     if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from)) {
@@ -958,7 +1151,14 @@ void processConnection(
         setAffinityTo(affinity);
     }
 
-    readInt(from); // obsolete reserveSpace
+    /* The obsolete `reserveSpace' word carries the client's protocol
+       extensions, if it has any. Announce ours in return. */
+    unsigned int clientExtensions = 0;
+    auto reserveSpace = readInt(from);
+    if ((reserveSpace & WORKER_EXT_MAGIC_MASK) == WORKER_EXT_MAGIC) {
+        clientExtensions = reserveSpace & WORKER_EXTENSIONS;
+        to << STDERR_EXTENSIONS << WORKER_EXTENSIONS;
+    }
 
     /* Send startup error messages to the client. */
     tunnelLogger->startWork();
@@ -985,8 +1185,17 @@ void processConnection(
 
             opCount++;
 
+            auto startTime = std::chrono::steady_clock::now();
+            bool failed = true;
+
+            Finally recordOp([&]() {
+                if (metrics)
+                    metrics->recordOp(op, std::chrono::steady_clock::now() - startTime, failed);
+            });
+
             try {
-                performOp(tunnelLogger, store, trusted, recursive, clientVersion, from, to, op);
+                performOp(tunnelLogger, store, trusted, recursive, clientVersion, clientExtensions, from, to, op);
+                failed = false;
             } catch (Error & e) {
                 /* If we're not in a state where we can send replies, then
                    something went wrong processing the input of the
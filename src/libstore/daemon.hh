@@ -8,6 +8,42 @@ namespace nix::daemon {
 enum TrustedFlag : bool { NotTrusted = false, Trusted = true };
 enum RecursiveFlag : bool { NotRecursive = false, Recursive = true };
 
+/* Counters about the connections handled by a daemon. Every
+   connection is handled by a separate process, so the daemon keeps
+   these in shared memory. */
+struct Metrics
+{
+    struct Op
+    {
+        LatencyHistogram latency;
+        std::atomic<uint64_t> failed{0};
+    };
+
+    /* Indexed by WorkerOp for upstream operations, followed by the
+       operations of protocol extensions, which are numbered from
+       1000. This lives in shared memory, so it can't be a map. */
+    static constexpr size_t maxOps = 64;
+    static constexpr size_t maxExtOps = 16;
+    Op ops[maxOps + maxExtOps];
+
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> activeConnections{0};
+
+    Store::Stats storeStats;
+
+    void recordOp(unsigned int op, std::chrono::steady_clock::duration duration, bool failed);
+
+    void addStoreStats(const Store::Stats & stats);
+
+    std::string toPrometheus();
+};
+
+/* The metrics of this daemon, or null if not enabled. */
+extern Metrics * metrics;
+
+/* Atomically replace `path' with the current metrics. */
+void writeMetrics(const Path & path);
+
 void processConnection(
     ref<Store> store,
     FdSource & from,
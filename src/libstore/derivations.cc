@@ -4,6 +4,7 @@
 #include "util.hh"
 #include "worker-protocol.hh"
 #include "fs-accessor.hh"
+#include "sqlite.hh"
 
 namespace nix {
 
@@ -86,7 +87,7 @@ bool BasicDerivation::isBuiltin() const
 
 
 StorePath writeDerivation(Store & store,
-    const Derivation & drv, RepairFlag repair, bool readOnly)
+    const Derivation & drv, RepairFlag repair, bool readOnly, bool deferred)
 {
     auto references = drv.inputSrcs;
     for (auto & i : drv.inputDrvs)
@@ -96,38 +97,47 @@ StorePath writeDerivation(Store & store,
        held during a garbage collection). */
     auto suffix = std::string(drv.name) + drvExtension;
     auto contents = drv.unparse(store, false);
-    return readOnly || settings.readOnlyMode
-        ? store.computeStorePathForText(suffix, contents, references)
-        : store.addTextToStore(suffix, contents, references, repair);
+    if (readOnly || settings.readOnlyMode)
+        return store.computeStorePathForText(suffix, contents, references);
+    if (deferred && !repair)
+        return store.addTextToStoreDeferred(suffix, contents, references);
+    return store.addTextToStore(suffix, contents, references, repair);
 }
 
 
-/* Read string `s' from stream `str'. */
-static void expect(std::istream & str, const string & s)
+/* The parser below works on a view of the text of a derivation,
+   consuming it from the front. */
+
+/* Read string `s' from `str'. */
+static void expect(std::string_view & str, std::string_view s)
 {
-    char s2[s.size()];
-    str.read(s2, s.size());
-    if (string(s2, s.size()) != s)
+    if (str.substr(0, s.size()) != s)
         throw FormatError("expected string '%1%'", s);
+    str.remove_prefix(s.size());
 }
 
 
-/* Read a C-style string from stream `str'. */
-static string parseString(std::istream & str)
+/* Read a C-style string from `str'. */
+static string parseString(std::string_view & str)
 {
     string res;
     expect(str, "\"");
-    int c;
-    while ((c = str.get()) != '"')
-        if (c == '\\') {
-            c = str.get();
-            if (c == 'n') res += '\n';
-            else if (c == 'r') res += '\r';
-            else if (c == 't') res += '\t';
-            else res += c;
-        }
+    while (true) {
+        /* Copy everything up to the next quote or escape at once. */
+        auto n = str.find_first_of("\"\\");
+        if (n == str.npos || (str[n] == '\\' && n + 1 == str.size()))
+            throw FormatError("unterminated string in derivation");
+        res.append(str.substr(0, n));
+        auto c = str[n];
+        str.remove_prefix(n + 1);
+        if (c == '"') return res;
+        c = str[0];
+        str.remove_prefix(1);
+        if (c == 'n') res += '\n';
+        else if (c == 'r') res += '\r';
+        else if (c == 't') res += '\t';
         else res += c;
-    return res;
+    }
 }
 
 static void validatePath(std::string_view s) {
@@ -135,7 +145,7 @@ static void validatePath(std::string_view s) {
         throw FormatError("bad path '%1%' in derivation", s);
 }
 
-static Path parsePath(std::istream & str)
+static Path parsePath(std::string_view & str)
 {
     auto s = parseString(str);
     validatePath(s);
@@ -143,21 +153,21 @@ static Path parsePath(std::istream & str)
 }
 
 
-static bool endOfList(std::istream & str)
+static bool endOfList(std::string_view & str)
 {
-    if (str.peek() == ',') {
-        str.get();
+    if (!str.empty() && str[0] == ',') {
+        str.remove_prefix(1);
         return false;
     }
-    if (str.peek() == ']') {
-        str.get();
+    if (!str.empty() && str[0] == ']') {
+        str.remove_prefix(1);
         return true;
     }
     return false;
 }
 
 
-static StringSet parseStrings(std::istream & str, bool arePaths)
+static StringSet parseStrings(std::string_view & str, bool arePaths)
 {
     StringSet res;
     while (!endOfList(str))
@@ -211,7 +221,7 @@ static DerivationOutput parseDerivationOutput(const Store & store,
     }
 }
 
-static DerivationOutput parseDerivationOutput(const Store & store, std::istringstream & str)
+static DerivationOutput parseDerivationOutput(const Store & store, std::string_view & str)
 {
     expect(str, ","); const auto pathS = parseString(str);
     expect(str, ","); const auto hashAlgo = parseString(str);
@@ -227,7 +237,7 @@ Derivation parseDerivation(const Store & store, std::string && s, std::string_vi
     Derivation drv;
     drv.name = name;
 
-    std::istringstream str(std::move(s));
+    std::string_view str(s);
     expect(str, "Derive([");
 
     /* Parse the list of outputs. */
@@ -262,7 +272,7 @@ Derivation parseDerivation(const Store & store, std::string && s, std::string_vi
         expect(str, "("); string name = parseString(str);
         expect(str, ","); string value = parseString(str);
         expect(str, ")");
-        drv.env[name] = value;
+        drv.env.insert_or_assign(std::move(name), std::move(value));
     }
 
     expect(str, ")");
@@ -270,133 +280,178 @@ Derivation parseDerivation(const Store & store, std::string && s, std::string_vi
 }
 
 
-static void printString(string & res, std::string_view s)
+/* The printing functions below write either to a string or to a sink
+   (such as a HashSink, so that hashing a derivation doesn't need to
+   build its text first). */
+struct StringPrinter
+{
+    string & s;
+    void operator () (char c) { s += c; }
+    void operator () (std::string_view data) { s.append(data); }
+};
+
+struct SinkPrinter
+{
+    Sink & sink;
+    void operator () (char c) { sink({&c, 1}); }
+    void operator () (std::string_view data) { sink(data); }
+};
+
+
+template<class Printer>
+static void printString(Printer & out, std::string_view s)
 {
-    char buf[s.size() * 2 + 2];
-    char * p = buf;
-    *p++ = '"';
-    for (auto c : s)
-        if (c == '\"' || c == '\\') { *p++ = '\\'; *p++ = c; }
-        else if (c == '\n') { *p++ = '\\'; *p++ = 'n'; }
-        else if (c == '\r') { *p++ = '\\'; *p++ = 'r'; }
-        else if (c == '\t') { *p++ = '\\'; *p++ = 't'; }
-        else *p++ = c;
-    *p++ = '"';
-    res.append(buf, p - buf);
+    out('"');
+    while (true) {
+        /* Copy everything up to the next character that needs
+           escaping at once. */
+        auto n = s.find_first_of("\"\\\n\r\t");
+        out(s.substr(0, n));
+        if (n == s.npos) break;
+        auto c = s[n];
+        out('\\');
+        out(c == '\n' ? 'n' : c == '\r' ? 'r' : c == '\t' ? 't' : c);
+        s.remove_prefix(n + 1);
+    }
+    out('"');
 }
 
 
-static void printUnquotedString(string & res, std::string_view s)
+template<class Printer>
+static void printUnquotedString(Printer & out, std::string_view s)
 {
-    res += '"';
-    res.append(s);
-    res += '"';
+    out('"');
+    out(s);
+    out('"');
 }
 
 
-template<class ForwardIterator>
-static void printStrings(string & res, ForwardIterator i, ForwardIterator j)
+template<class Printer, class ForwardIterator>
+static void printStrings(Printer & out, ForwardIterator i, ForwardIterator j)
 {
-    res += '[';
+    out('[');
     bool first = true;
     for ( ; i != j; ++i) {
-        if (first) first = false; else res += ',';
-        printString(res, *i);
+        if (first) first = false; else out(',');
+        printString(out, *i);
     }
-    res += ']';
+    out(']');
 }
 
 
-template<class ForwardIterator>
-static void printUnquotedStrings(string & res, ForwardIterator i, ForwardIterator j)
+template<class Printer, class ForwardIterator>
+static void printUnquotedStrings(Printer & out, ForwardIterator i, ForwardIterator j)
 {
-    res += '[';
+    out('[');
     bool first = true;
     for ( ; i != j; ++i) {
-        if (first) first = false; else res += ',';
-        printUnquotedString(res, *i);
+        if (first) first = false; else out(',');
+        printUnquotedString(out, *i);
     }
-    res += ']';
+    out(']');
 }
 
 
-string Derivation::unparse(const Store & store, bool maskOutputs,
-    std::map<std::string, StringSet> * actualInputs) const
+template<class Printer>
+static void unparseDerivation(Printer & out, const Derivation & drv,
+    const Store & store, bool maskOutputs,
+    std::map<std::string, StringSet> * actualInputs)
 {
-    string s;
-    s.reserve(65536);
-    s += "Derive([";
+    out("Derive([");
 
     bool first = true;
-    for (auto & i : outputs) {
-        if (first) first = false; else s += ',';
-        s += '('; printUnquotedString(s, i.first);
+    for (auto & i : drv.outputs) {
+        if (first) first = false; else out(',');
+        out('('); printUnquotedString(out, i.first);
         std::visit(overloaded {
-            [&](DerivationOutputInputAddressed doi) {
-                s += ','; printUnquotedString(s, maskOutputs ? "" : store.printStorePath(doi.path));
-                s += ','; printUnquotedString(s, "");
-                s += ','; printUnquotedString(s, "");
+            [&](const DerivationOutputInputAddressed & doi) {
+                out(','); printUnquotedString(out, maskOutputs ? "" : store.printStorePath(doi.path));
+                out(','); printUnquotedString(out, "");
+                out(','); printUnquotedString(out, "");
             },
-            [&](DerivationOutputCAFixed dof) {
-                s += ','; printUnquotedString(s, maskOutputs ? "" : store.printStorePath(dof.path(store, name, i.first)));
-                s += ','; printUnquotedString(s, dof.hash.printMethodAlgo());
-                s += ','; printUnquotedString(s, dof.hash.hash.to_string(Base16, false));
+            [&](const DerivationOutputCAFixed & dof) {
+                out(','); printUnquotedString(out, maskOutputs ? "" : store.printStorePath(dof.path(store, drv.name, i.first)));
+                out(','); printUnquotedString(out, dof.hash.printMethodAlgo());
+                out(','); printUnquotedString(out, dof.hash.hash.to_string(Base16, false));
             },
-            [&](DerivationOutputCAFloating dof) {
-                s += ','; printUnquotedString(s, "");
-                s += ','; printUnquotedString(s, makeFileIngestionPrefix(dof.method) + printHashType(dof.hashType));
-                s += ','; printUnquotedString(s, "");
+            [&](const DerivationOutputCAFloating & dof) {
+                out(','); printUnquotedString(out, "");
+                out(','); printUnquotedString(out, makeFileIngestionPrefix(dof.method) + printHashType(dof.hashType));
+                out(','); printUnquotedString(out, "");
             },
-            [&](DerivationOutputDeferred) {
-                s += ','; printUnquotedString(s, "");
-                s += ','; printUnquotedString(s, "");
-                s += ','; printUnquotedString(s, "");
+            [&](const DerivationOutputDeferred &) {
+                out(','); printUnquotedString(out, "");
+                out(','); printUnquotedString(out, "");
+                out(','); printUnquotedString(out, "");
             }
         }, i.second.output);
-        s += ')';
+        out(')');
     }
 
-    s += "],[";
+    out("],[");
     first = true;
     if (actualInputs) {
         for (auto & i : *actualInputs) {
-            if (first) first = false; else s += ',';
-            s += '('; printUnquotedString(s, i.first);
-            s += ','; printUnquotedStrings(s, i.second.begin(), i.second.end());
-            s += ')';
+            if (first) first = false; else out(',');
+            out('('); printUnquotedString(out, i.first);
+            out(','); printUnquotedStrings(out, i.second.begin(), i.second.end());
+            out(')');
         }
     } else {
-        for (auto & i : inputDrvs) {
-            if (first) first = false; else s += ',';
-            s += '('; printUnquotedString(s, store.printStorePath(i.first));
-            s += ','; printUnquotedStrings(s, i.second.begin(), i.second.end());
-            s += ')';
+        for (auto & i : drv.inputDrvs) {
+            if (first) first = false; else out(',');
+            out('('); printUnquotedString(out, store.printStorePath(i.first));
+            out(','); printUnquotedStrings(out, i.second.begin(), i.second.end());
+            out(')');
         }
     }
 
-    s += "],";
-    auto paths = store.printStorePathSet(inputSrcs); // FIXME: slow
-    printUnquotedStrings(s, paths.begin(), paths.end());
+    /* StorePathSet is ordered by base name, so this prints the input
+       sources in the same order as a set of printed paths would. */
+    out("],[");
+    first = true;
+    for (auto & i : drv.inputSrcs) {
+        if (first) first = false; else out(',');
+        printUnquotedString(out, store.printStorePath(i));
+    }
+    out(']');
 
-    s += ','; printUnquotedString(s, platform);
-    s += ','; printString(s, builder);
-    s += ','; printStrings(s, args.begin(), args.end());
+    out(','); printUnquotedString(out, drv.platform);
+    out(','); printString(out, drv.builder);
+    out(','); printStrings(out, drv.args.begin(), drv.args.end());
 
-    s += ",[";
+    out(",[");
     first = true;
-    for (auto & i : env) {
-        if (first) first = false; else s += ',';
-        s += '('; printString(s, i.first);
-        s += ','; printString(s, maskOutputs && outputs.count(i.first) ? "" : i.second);
-        s += ')';
+    for (auto & i : drv.env) {
+        if (first) first = false; else out(',');
+        out('('); printString(out, i.first);
+        out(','); printString(out, maskOutputs && drv.outputs.count(i.first) ? "" : i.second);
+        out(')');
     }
 
-    s += "])";
+    out("])");
+}
 
+
+string Derivation::unparse(const Store & store, bool maskOutputs,
+    std::map<std::string, StringSet> * actualInputs) const
+{
+    string s;
+    s.reserve(65536);
+    StringPrinter out { s };
+    unparseDerivation(out, *this, store, maskOutputs, actualInputs);
     return s;
 }
 
 
+void Derivation::unparse(Sink & sink, const Store & store, bool maskOutputs,
+    std::map<std::string, StringSet> * actualInputs) const
+{
+    SinkPrinter out { sink };
+    unparseDerivation(out, *this, store, maskOutputs, actualInputs);
+}
+
+
 // FIXME: remove
 bool isDerivation(const string & fileName)
 {
@@ -464,6 +519,137 @@ DerivationType BasicDerivation::type() const
 
 Sync<DrvHashes> drvHashes;
 
+
+static const char * drvHashCacheSchema = R"sql(
+create table if not exists DrvHashes (
+    path        text primary key not null,
+    hash        text not null
+);
+)sql";
+
+/* A cache of the hashDerivationModulo() results of derivations in
+   the store that persists across invocations. Derivations are
+   immutable, so entries never become stale. New entries are written
+   in batches to keep write transactions short. Since this is only a
+   cache, we don't wait long for other processes that are using it. */
+struct DrvHashCache
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insert, lookup;
+        std::vector<std::pair<std::string, std::string>> pending;
+    };
+
+    Sync<State> _state;
+
+    DrvHashCache()
+    {
+        auto state(_state.lock());
+
+        auto dbPath = getCacheDir() + "/nix/drv-hashes-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+        state->db.setBusyTimeout(100);
+        state->db.isCache();
+        state->db.exec(drvHashCacheSchema);
+
+        state->insert.create(state->db,
+            "insert or replace into DrvHashes(path, hash) values (?, ?)");
+
+        state->lookup.create(state->db,
+            "select hash from DrvHashes where path = ?");
+    }
+
+    ~DrvHashCache()
+    {
+        try {
+            flush(*_state.lock());
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    static void flush(State & state)
+    {
+        if (state.pending.empty()) return;
+        auto pending = std::move(state.pending);
+        state.pending.clear();
+        SQLiteTxn txn(state.db);
+        for (auto & [path, hash] : pending)
+            state.insert.use()(path)(hash).exec();
+        txn.commit();
+    }
+
+    std::optional<std::string> lookup(const std::string & path)
+    {
+        auto state(_state.lock());
+        auto query(state->lookup.use()(path));
+        if (!query.next()) return std::nullopt;
+        return query.getStr(0);
+    }
+
+    void add(std::string path, std::string hash)
+    {
+        auto state(_state.lock());
+        state->pending.emplace_back(std::move(path), std::move(hash));
+        if (state->pending.size() >= 1024)
+            flush(*state);
+    }
+};
+
+static DrvHashCache * getDrvHashCache()
+{
+    static std::unique_ptr<DrvHashCache> cache = []() -> std::unique_ptr<DrvHashCache> {
+        try {
+            return std::make_unique<DrvHashCache>();
+        } catch (Error & e) {
+            debug("not using the derivation hash cache: %s", e.what());
+            return nullptr;
+        }
+    }();
+    return cache.get();
+}
+
+/* Encode a DrvHashModulo as "regular:<hash>" or "fixed:<output>=<hash>
+   ...". Deferred hashes only occur with ca-derivations and are not
+   cached. */
+static std::optional<std::string> encodeDrvHash(const DrvHashModulo & h)
+{
+    return std::visit(overloaded {
+        [](const Hash & hash) -> std::optional<std::string> {
+            return "regular:" + hash.to_string(Base16, true);
+        },
+        [](const CaOutputHashes & outputHashes) -> std::optional<std::string> {
+            Strings outputs;
+            for (auto & [outputName, hash] : outputHashes)
+                outputs.push_back(outputName + "=" + hash.to_string(Base16, true));
+            return "fixed:" + concatStringsSep(" ", outputs);
+        },
+        [](const DeferredHash &) -> std::optional<std::string> {
+            return std::nullopt;
+        },
+    }, h);
+}
+
+static DrvHashModulo decodeDrvHash(std::string_view s)
+{
+    if (hasPrefix(s, "regular:"))
+        return Hash::parseAnyPrefixed(s.substr(8));
+    if (hasPrefix(s, "fixed:")) {
+        CaOutputHashes outputHashes;
+        for (auto & output : tokenizeString<Strings>(s.substr(6), " ")) {
+            auto eq = output.find('=');
+            if (eq == std::string::npos)
+                throw Error("invalid derivation hash cache entry '%s'", s);
+            outputHashes.insert_or_assign(output.substr(0, eq), Hash::parseAnyPrefixed(output.substr(eq + 1)));
+        }
+        return outputHashes;
+    }
+    throw Error("invalid derivation hash cache entry '%s'", s);
+}
+
 /* pathDerivationModulo and hashDerivationModulo are mutually recursive
  */
 
@@ -479,12 +665,42 @@ static const DrvHashModulo pathDerivationModulo(Store & store, const StorePath &
             return h->second;
         }
     }
+
+    auto cache = getDrvHashCache();
+    auto drvPathS = store.printStorePath(drvPath);
+
+    if (cache) {
+        try {
+            if (auto s = cache->lookup(drvPathS)) {
+                auto h = decodeDrvHash(*s);
+                drvHashes.lock()->insert_or_assign(drvPath, h);
+                return h;
+            }
+        } catch (SQLiteBusy &) {
+        } catch (Error &) {
+            ignoreException();
+        }
+    }
+
     auto h = hashDerivationModulo(
         store,
         store.readInvalidDerivation(drvPath),
         false);
     // Cache it
     drvHashes.lock()->insert_or_assign(drvPath, h);
+
+    if (cache) {
+        if (auto s = encodeDrvHash(h)) {
+            try {
+                cache->add(drvPathS, *s);
+            } catch (SQLiteBusy &) {
+                /* Drop the batch; this is only a cache. */
+            } catch (Error &) {
+                ignoreException();
+            }
+        }
+    }
+
     return h;
 }
 
@@ -559,7 +775,9 @@ DrvHashModulo hashDerivationModulo(Store & store, const Derivation & drv, bool m
         }, res);
     }
 
-    auto hash = hashString(htSHA256, drv.unparse(store, maskOutputs, &inputs2));
+    HashSink sink(htSHA256);
+    drv.unparse(sink, store, maskOutputs, &inputs2);
+    auto hash = sink.finish().first;
 
     if (isDeferred)
         return DeferredHash { hash };
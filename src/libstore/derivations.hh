@@ -136,6 +136,11 @@ struct Derivation : BasicDerivation
     std::string unparse(const Store & store, bool maskOutputs,
         std::map<std::string, StringSet> * actualInputs = nullptr) const;
 
+    /* Like unparse(), but write the derivation to a sink, e.g. to
+       hash it without building its text. */
+    void unparse(Sink & sink, const Store & store, bool maskOutputs,
+        std::map<std::string, StringSet> * actualInputs = nullptr) const;
+
     /* Return the underlying basic derivation but with these changes:
 
 	   1. Input drvs are emptied, but the outputs of them that were used are
@@ -154,11 +159,14 @@ class Store;
 
 enum RepairFlag : bool { NoRepair = false, Repair = true };
 
-/* Write a derivation to the Nix store, and return its path. */
+/* Write a derivation to the Nix store, and return its path. If
+   `deferred' is set, the store may postpone writing it (see
+   Store::addTextToStoreDeferred()). */
 StorePath writeDerivation(Store & store,
     const Derivation & drv,
     RepairFlag repair = NoRepair,
-    bool readOnly = false);
+    bool readOnly = false,
+    bool deferred = false);
 
 /* Read a derivation from a file. */
 Derivation parseDerivation(const Store & store, std::string && s, std::string_view name);
@@ -2,24 +2,127 @@
 #include "store-api.hh"
 #include "archive.hh"
 #include "worker-protocol.hh"
+#include "sync.hh"
+#include "finally.hh"
 
 #include <algorithm>
+#include <thread>
 
 namespace nix {
 
+/* Paths with a NAR up to this size are dumped concurrently into
+   memory ahead of being written. Larger ones are streamed. */
+static constexpr uint64_t maxPrefetchNarSize = 8 * 1024 * 1024;
+
+/* The maximum total size of the prefetched NARs that haven't been
+   written yet. */
+static constexpr uint64_t maxPrefetchBytes = 64 * 1024 * 1024;
+
 void Store::exportPaths(const StorePathSet & paths, Sink & sink)
 {
     auto sorted = topoSortPaths(paths);
     std::reverse(sorted.begin(), sorted.end());
 
-    std::string doneLabel("paths exported");
-    //logger->incExpected(doneLabel, sorted.size());
-
-    for (auto & path : sorted) {
-        //Activity act(*logger, lvlInfo, format("exporting path '%s'") % path);
+    /* Dumping a path is dominated by reading and hashing its
+       contents, so let some threads dump the small paths ahead of the
+       one being written. The output order doesn't change. */
+    std::vector<uint64_t> narSizes;
+    narSizes.reserve(sorted.size());
+    for (auto & path : sorted)
+        narSizes.push_back(queryPathInfo(path)->narSize);
+
+    /* Paths of unknown size are streamed as well. */
+    auto prefetch = [&](size_t n) {
+        return narSizes[n] && narSizes[n] <= maxPrefetchNarSize;
+    };
+
+    struct State
+    {
+        size_t next = 0, written = 0;
+        uint64_t bytesPending = 0;
+        std::map<size_t, std::string> dumped;
+        std::exception_ptr exc;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    auto worker = [&]() {
+        while (true) {
+            size_t n;
+            {
+                auto state(state_.lock());
+                while (true) {
+                    if (state->quit || state->exc) return;
+                    /* Leave paths that are too big for memory to the
+                       writer. */
+                    while (state->next < sorted.size() && !prefetch(state->next))
+                        state->next++;
+                    if (state->next == sorted.size()) return;
+                    /* Always allow the path that the writer is waiting
+                       for, to guarantee progress. */
+                    if (state->next == state->written
+                        || state->bytesPending + narSizes[state->next] <= maxPrefetchBytes)
+                        break;
+                    state.wait(wakeup);
+                }
+                n = state->next++;
+                state->bytesPending += narSizes[n];
+            }
+
+            try {
+                StringSink dump;
+                exportPath(sorted[n], dump);
+                auto state(state_.lock());
+                state->dumped.emplace(n, std::move(*dump.s));
+            } catch (...) {
+                auto state(state_.lock());
+                if (!state->exc) state->exc = std::current_exception();
+            }
+            wakeup.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+
+    Finally joinWorkers([&]() {
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        for (auto & thread : workers)
+            thread.join();
+    });
+
+    auto nrWorkers = std::min((size_t) std::max(1U, std::thread::hardware_concurrency()), (size_t) 8);
+    for (size_t i = 0; i < nrWorkers; ++i)
+        workers.emplace_back(worker);
+
+    for (size_t n = 0; n < sorted.size(); ++n) {
         sink << 1;
-        exportPath(path, sink);
-        //logger->incProgress(doneLabel);
+
+        if (!prefetch(n)) {
+            exportPath(sorted[n], sink);
+        } else {
+            std::string dump;
+            {
+                auto state(state_.lock());
+                while (!state->dumped.count(n)) {
+                    if (state->exc) std::rethrow_exception(state->exc);
+                    state.wait(wakeup);
+                }
+                auto i = state->dumped.find(n);
+                dump = std::move(i->second);
+                state->dumped.erase(i);
+                state->bytesPending -= narSizes[n];
+            }
+            sink(dump);
+        }
+
+        {
+            auto state(state_.lock());
+            state->written = n + 1;
+        }
+        wakeup.notify_all();
     }
 
     sink << 0;
@@ -51,49 +154,95 @@ void Store::exportPath(const StorePath & path, Sink & sink)
         << 0;
 }
 
+/* Imported paths are added to the store in batches of at most this
+   many NARs or this many bytes, so that remote stores get them in
+   one request. */
+static constexpr size_t maxImportBatchPaths = 1024;
+static constexpr uint64_t maxImportBatchBytes = 64 * 1024 * 1024;
+
 StorePaths Store::importPaths(Source & source, CheckSigsFlag checkSigs)
 {
     StorePaths res;
-    while (true) {
-        auto n = readNum<uint64_t>(source);
-        if (n == 0) break;
-        if (n != 1) throw Error("input doesn't look like something created by 'nix-store --export'");
-
-        /* Extract the NAR from the source. */
-        StringSink saved;
-        TeeSource tee { source, saved };
-        ParseSink ether;
-        parseDump(ether, tee);
-
-        uint32_t magic = readInt(source);
-        if (magic != exportMagic)
-            throw Error("Nix archive cannot be imported; wrong format");
 
-        auto path = parseStorePath(readString(source));
-
-        //Activity act(*logger, lvlInfo, format("importing path '%s'") % info.path);
-
-        auto references = worker_proto::read(*this, source, Phantom<StorePathSet> {});
-        auto deriver = readString(source);
-        auto narHash = hashString(htSHA256, *saved.s);
-
-        ValidPathInfo info { path, narHash };
-        if (deriver != "")
-            info.deriver = parseStorePath(deriver);
-        info.references = references;
-        info.narSize = saved.s->size();
-
-        // Ignore optional legacy signature.
-        if (readInt(source) == 1)
-            readString(source);
-
-        // Can't use underlying source, which would have been exhausted
-        auto source = StringSource { *saved.s };
-        addToStore(info, source, NoRepair, checkSigs);
-
-        res.push_back(info.path);
+    std::vector<std::string> nars;
+    PathsSource batch;
+    uint64_t batchBytes = 0;
+
+    /* The batch is cleared even if adding it fails, so that the
+       error handler below doesn't submit it a second time. */
+    auto flush = [&]() {
+        if (batch.empty()) return;
+        Finally clear([&]() {
+            batch.clear();
+            nars.clear();
+            batchBytes = 0;
+        });
+        addMultipleToStore(batch, NoRepair, checkSigs);
+    };
+
+    try {
+        while (true) {
+            auto n = readNum<uint64_t>(source);
+            if (n == 0) break;
+            if (n != 1) throw Error("input doesn't look like something created by 'nix-store --export'");
+
+            /* Extract the NAR from the source, hashing it on the way. */
+            StringSink saved;
+            HashSink hashSink(htSHA256);
+            TeeSink both { saved, hashSink };
+            TeeSource tee { source, both };
+            ParseSink ether;
+            parseDump(ether, tee);
+
+            uint32_t magic = readInt(source);
+            if (magic != exportMagic)
+                throw Error("Nix archive cannot be imported; wrong format");
+
+            auto path = parseStorePath(readString(source));
+
+            //Activity act(*logger, lvlInfo, format("importing path '%s'") % info.path);
+
+            auto references = worker_proto::read(*this, source, Phantom<StorePathSet> {});
+            auto deriver = readString(source);
+            auto [narHash, narSize] = hashSink.finish();
+
+            ValidPathInfo info { path, narHash };
+            if (deriver != "")
+                info.deriver = parseStorePath(deriver);
+            info.references = references;
+            info.narSize = narSize;
+
+            // Ignore optional legacy signature.
+            if (readInt(source) == 1)
+                readString(source);
+
+            res.push_back(info.path);
+
+            /* The paths are in dependency order, so each batch only
+               refers to paths in earlier batches or in itself. */
+            if (batch.size() >= maxImportBatchPaths
+                || (!batch.empty() && batchBytes + narSize > maxImportBatchBytes))
+                flush();
+
+            batchBytes += narSize;
+            nars.push_back(std::move(*saved.s));
+            batch.emplace_back(std::move(info), [&nars, i{nars.size() - 1}](Sink & sink) {
+                sink(nars[i]);
+            });
+        }
+    } catch (...) {
+        /* Don't lose the paths that were read completely before the
+           stream broke. */
+        try {
+            flush();
+        } catch (...) {
+            ignoreException();
+        }
+        throw;
     }
 
+    flush();
+
     return res;
 }
 
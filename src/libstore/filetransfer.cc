@@ -20,6 +20,8 @@
 #include <cmath>
 #include <cstring>
 #include <iostream>
+#include <list>
+#include <map>
 #include <queue>
 #include <random>
 #include <thread>
@@ -45,6 +47,13 @@ struct curlFileTransfer : public FileTransfer
 {
     CURLM * curlm = 0;
 
+    /* TLS sessions shared by all easy handles, so that new
+       connections to a server we've talked to before can resume the
+       session instead of doing a full handshake. The multi handle
+       already shares the DNS and connection caches. All handles are
+       used on the worker thread only, so this needs no locking. */
+    CURLSH * curlsh = 0;
+
     std::random_device rd;
     std::mt19937 mt19937;
 
@@ -58,6 +67,7 @@ struct curlFileTransfer : public FileTransfer
         Callback<FileTransferResult> callback;
         CURL * req = 0;
         bool active = false; // whether the handle has been added to the multi object
+        bool coalesced = false; // whether other requests for the same URI are waiting for this one
         std::string statusMsg;
 
         unsigned int attempt = 0;
@@ -138,9 +148,28 @@ struct curlFileTransfer : public FileTransfer
         {
             assert(!done);
             done = true;
+            for (auto & waiter : takeWaiters())
+                waiter.rethrow(ex);
             callback.rethrow(ex);
         }
 
+        /* Return the callbacks of requests that were coalesced with
+           this one, and stop accepting new ones. */
+        std::list<Callback<FileTransferResult>> takeWaiters()
+        {
+            std::list<Callback<FileTransferResult>> waiters;
+            if (coalesced) {
+                auto state(fileTransfer.state_.lock());
+                auto i = state->waiters.find(request.uri);
+                if (i != state->waiters.end()) {
+                    waiters = std::move(i->second);
+                    state->waiters.erase(i);
+                }
+                coalesced = false;
+            }
+            return waiters;
+        }
+
         template<class T>
         void fail(const T & e)
         {
@@ -276,6 +305,9 @@ struct curlFileTransfer : public FileTransfer
 
             curl_easy_reset(req);
 
+            if (fileTransfer.curlsh)
+                curl_easy_setopt(req, CURLOPT_SHARE, fileTransfer.curlsh);
+
             if (verbosity >= lvlVomit) {
                 curl_easy_setopt(req, CURLOPT_VERBOSE, 1);
                 curl_easy_setopt(req, CURLOPT_DEBUGFUNCTION, TransferItem::debugCallback);
@@ -297,6 +329,14 @@ struct curlFileTransfer : public FileTransfer
             else
                 curl_easy_setopt(req, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
             #endif
+            #if LIBCURL_VERSION_NUM >= 0x072e00 // Stream weights require >= 7.46.0
+            /* Give small requests (like .narinfo lookups) a larger
+               share of a multiplexed connection than bulk downloads
+               that are streamed to a sink (like NARs), so that the
+               latter don't starve the former. */
+            if (!request.dataCallback)
+                curl_easy_setopt(req, CURLOPT_STREAM_WEIGHT, 256L);
+            #endif
             curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, TransferItem::writeCallbackWrapper);
             curl_easy_setopt(req, CURLOPT_WRITEDATA, this);
             curl_easy_setopt(req, CURLOPT_HEADERFUNCTION, TransferItem::headerCallbackWrapper);
@@ -375,6 +415,7 @@ struct curlFileTransfer : public FileTransfer
             else if (code == CURLE_OK && successfulStatuses.count(httpStatus))
             {
                 result.cached = httpStatus == 304;
+                result.httpStatus = httpStatus;
 
                 // In 2021, GitHub responds to If-None-Match with 304,
                 // but omits ETag. We just use the If-None-Match etag
@@ -384,6 +425,8 @@ struct curlFileTransfer : public FileTransfer
 
                 act.progress(result.bodySize, result.bodySize);
                 done = true;
+                for (auto & waiter : takeWaiters())
+                    waiter(FileTransferResult(result));
                 callback(std::move(result));
             }
 
@@ -485,6 +528,11 @@ struct curlFileTransfer : public FileTransfer
         };
         bool quit = false;
         std::priority_queue<std::shared_ptr<TransferItem>, std::vector<std::shared_ptr<TransferItem>>, EmbargoComparator> incoming;
+
+        /* For each URI that is being downloaded by a plain GET
+           request, the callbacks of identical requests that arrived
+           in the meantime and will get the same result. */
+        std::map<std::string, std::list<Callback<FileTransferResult>>> waiters;
     };
 
     Sync<State> state_;
@@ -504,12 +552,18 @@ struct curlFileTransfer : public FileTransfer
 
         curlm = curl_multi_init();
 
+        curlsh = curl_share_init();
+        if (curlsh)
+            curl_share_setopt(curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
         #if LIBCURL_VERSION_NUM >= 0x072b00 // Multiplex requires >= 7.43.0
         curl_multi_setopt(curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
         #endif
         #if LIBCURL_VERSION_NUM >= 0x071e00 // Max connections requires >= 7.30.0
         curl_multi_setopt(curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS,
             fileTransferSettings.httpConnections.get());
+        curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+            fileTransferSettings.httpConnectionsPerHost.get());
         #endif
 
         wakeupPipe.create();
@@ -525,6 +579,7 @@ struct curlFileTransfer : public FileTransfer
         workerThread.join();
 
         if (curlm) curl_multi_cleanup(curlm);
+        if (curlsh) curl_share_cleanup(curlsh);
     }
 
     void stopWorkerThread()
@@ -621,6 +676,12 @@ struct curlFileTransfer : public FileTransfer
                 quit = state->quit;
             }
 
+            /* Start small requests before bulk downloads, so that
+               they get the first free connections if curl has to
+               queue some of them. */
+            std::stable_partition(incoming.begin(), incoming.end(),
+                [](const std::shared_ptr<TransferItem> & item) { return !item->request.dataCallback; });
+
             for (auto & item : incoming) {
                 debug("starting %s of %s", item->request.verb(), item->request.uri);
                 item->init();
@@ -642,9 +703,17 @@ struct curlFileTransfer : public FileTransfer
             printError("unexpected error in download thread: %s", e.what());
         }
 
+        /* Destroy the remaining items (which fails them) without
+           holding the state lock, since failing an item acquires
+           it. */
+        std::vector<std::shared_ptr<TransferItem>> remaining;
+
         {
             auto state(state_.lock());
-            while (!state->incoming.empty()) state->incoming.pop();
+            while (!state->incoming.empty()) {
+                remaining.push_back(state->incoming.top());
+                state->incoming.pop();
+            }
             state->quit = true;
         }
     }
@@ -712,7 +781,38 @@ struct curlFileTransfer : public FileTransfer
             return;
         }
 
-        enqueueItem(std::make_shared<TransferItem>(*this, request, std::move(callback)));
+        /* If an identical download is already in progress, wait for
+           its result instead of fetching the same file again. This
+           only applies to requests that don't stream their data or
+           depend on per-request state, and that use the default
+           decompression and retry policy, so that every waiter gets
+           the result it would have got by itself. */
+        bool coalescable =
+            !request.data
+            && !request.head
+            && !request.dataCallback
+            && request.expectedETag.empty()
+            && request.headers.empty()
+            && request.verifyTLS
+            && request.decompress
+            && request.tries == fileTransferSettings.tries
+            && request.baseRetryTimeMs == FileTransferRequest::defaultBaseRetryTimeMs;
+
+        if (coalescable) {
+            auto state(state_.lock());
+            auto i = state->waiters.find(request.uri);
+            if (i != state->waiters.end()) {
+                debug("waiting for in-progress download of '%s'", request.uri);
+                i->second.push_back(std::move(callback));
+                return;
+            }
+            state->waiters[request.uri];
+        }
+
+        auto item = std::make_shared<TransferItem>(*this, request, std::move(callback));
+        item->coalesced = coalescable;
+
+        enqueueItem(item);
     }
 };
 
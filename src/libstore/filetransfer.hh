@@ -26,6 +26,13 @@ struct FileTransferSettings : Config
         )",
         {"binary-caches-parallel-connections"}};
 
+    Setting<size_t> httpConnectionsPerHost{
+        this, 0, "http-connections-per-host",
+        R"(
+          The maximum number of parallel TCP connections to a single
+          host. 0 means no limit other than `http-connections`.
+        )"};
+
     Setting<unsigned long> connectTimeout{
         this, 0, "connect-timeout",
         R"(
@@ -56,7 +63,8 @@ struct FileTransferRequest
     bool verifyTLS = true;
     bool head = false;
     size_t tries = fileTransferSettings.tries;
-    unsigned int baseRetryTimeMs = 250;
+    static constexpr unsigned int defaultBaseRetryTimeMs = 250;
+    unsigned int baseRetryTimeMs = defaultBaseRetryTimeMs;
     ActivityId parentAct;
     bool decompress = true;
     std::shared_ptr<std::string> data;
@@ -79,6 +87,8 @@ struct FileTransferResult
     std::string effectiveUri;
     std::shared_ptr<std::string> data;
     uint64_t bodySize = 0;
+    /* The HTTP status code, or 0 for other protocols. */
+    long httpStatus = 0;
 };
 
 class Store;
@@ -3,8 +3,10 @@
 #include "local-store.hh"
 #include "local-fs-store.hh"
 #include "finally.hh"
+#include "thread-pool.hh"
 
 #include <functional>
+#include <unordered_map>
 #include <queue>
 #include <algorithm>
 #include <regex>
@@ -17,6 +19,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <climits>
+#include <cstring>
+#include <limits>
 
 namespace nix {
 
@@ -113,7 +117,25 @@ Path LocalFSStore::addPermRoot(const StorePath & storePath, const Path & _gcRoot
 
 void LocalStore::addTempRoot(const StorePath & path)
 {
+    addTempRoot_(path);
+
+    /* Record that the path was used, in batches to keep the number of
+       database transactions down. */
     auto state(_state.lock());
+    state->usedPaths.insert(path);
+    if (state->usedPaths.size() >= 256)
+        flushPathUsage(*state);
+}
+
+
+void LocalStore::addTempRoot_(const StorePath & path)
+{
+    auto state(_state.lock());
+
+    /* The roots file is never truncated while we hold it, so a path
+       that was added before is still a root. Skip the locking and
+       the write in that case. */
+    if (state->tempRoots.count(path)) return;
 
     /* Create the temporary roots file for this process. */
     if (!state->fdTempRoots) {
@@ -155,6 +177,8 @@ void LocalStore::addTempRoot(const StorePath & path)
     string s = printStorePath(path) + '\0';
     writeFull(state->fdTempRoots.get(), s);
 
+    state->tempRoots.insert(path);
+
     /* Downgrade to a read lock. */
     debug(format("downgrading to read lock on '%1%'") % fnTempRoots);
     lockFile(state->fdTempRoots.get(), ltRead, true);
@@ -335,12 +359,6 @@ try_again:
             .emplace(file);
 }
 
-static string quoteRegexChars(const string & raw)
-{
-    static auto specialRegex = std::regex(R"([.^$\\*+?()\[\]{}|])");
-    return std::regex_replace(raw, specialRegex, R"(\$&)");
-}
-
 static void readFileRoots(const char * path, UncheckedRoots & roots)
 {
     try {
@@ -351,64 +369,102 @@ static void readFileRoots(const char * path, UncheckedRoots & roots)
     }
 }
 
+/* Add the store paths mentioned in `s' (e.g. an environment) to
+   `roots'. This is a cheap scan for the store directory followed by
+   the characters that can occur in a store path name; toStorePath()
+   checks the candidates later. */
+static void findStorePathsIn(const std::string & s, const Path & storeDir,
+    const Path & source, UncheckedRoots & roots)
+{
+    auto prefix = storeDir + "/";
+    for (size_t pos = 0; (pos = s.find(prefix, pos)) != std::string::npos; ) {
+        auto end = pos + prefix.size();
+        while (end < s.size() && (isalnum((unsigned char) s[end]) || (s[end] && strchr("+-._?=", s[end]))))
+            end++;
+        if (end > pos + prefix.size())
+            roots[s.substr(pos, end - pos)].emplace(source);
+        pos = end;
+    }
+}
+
 void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 {
     UncheckedRoots unchecked;
 
     auto procDir = AutoCloseDir{opendir("/proc")};
     if (procDir) {
-        struct dirent * ent;
-        auto digitsRegex = std::regex(R"(^\d+$)");
-        auto mapRegex = std::regex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
-        auto storePathRegex = std::regex(quoteRegexChars(storeDir) + R"(/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
-        while (errno = 0, ent = readdir(procDir.get())) {
-            checkInterrupt();
-            if (std::regex_match(ent->d_name, digitsRegex)) {
-                readProcLink(fmt("/proc/%s/exe" ,ent->d_name), unchecked);
-                readProcLink(fmt("/proc/%s/cwd", ent->d_name), unchecked);
-
-                auto fdStr = fmt("/proc/%s/fd", ent->d_name);
-                auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
-                if (!fdDir) {
-                    if (errno == ENOENT || errno == EACCES)
-                        continue;
-                    throw SysError("opening %1%", fdStr);
-                }
-                struct dirent * fd_ent;
-                while (errno = 0, fd_ent = readdir(fdDir.get())) {
-                    if (fd_ent->d_name[0] != '.')
-                        readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
-                }
-                if (errno) {
-                    if (errno == ESRCH)
-                        continue;
-                    throw SysError("iterating /proc/%1%/fd", ent->d_name);
-                }
-                fdDir.reset();
-
-                try {
-                    auto mapFile = fmt("/proc/%s/maps", ent->d_name);
-                    auto mapLines = tokenizeString<std::vector<string>>(readFile(mapFile), "\n");
-                    for (const auto & line : mapLines) {
-                        auto match = std::smatch{};
-                        if (std::regex_match(line, match, mapRegex))
-                            unchecked[match[1]].emplace(mapFile);
-                    }
+        Sync<UncheckedRoots> unchecked_;
+
+        auto storePrefix = storeDir + "/";
+
+        /* Inspect one process. Processes can exit at any time, so
+           ignore errors caused by that. */
+        auto scanProcess = [&](const std::string & pid) {
+            UncheckedRoots found;
+
+            readProcLink(fmt("/proc/%s/exe", pid), found);
+            readProcLink(fmt("/proc/%s/cwd", pid), found);
+
+            auto fdStr = fmt("/proc/%s/fd", pid);
+            auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
+            if (!fdDir) {
+                if (errno == ENOENT || errno == EACCES)
+                    return;
+                throw SysError("opening %1%", fdStr);
+            }
+            struct dirent * fd_ent;
+            while (errno = 0, fd_ent = readdir(fdDir.get())) {
+                if (fd_ent->d_name[0] != '.')
+                    readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), found);
+            }
+            if (errno) {
+                if (errno == ESRCH)
+                    return;
+                throw SysError("iterating /proc/%1%/fd", pid);
+            }
+            fdDir.reset();
 
-                    auto envFile = fmt("/proc/%s/environ", ent->d_name);
-                    auto envString = readFile(envFile);
-                    auto env_end = std::sregex_iterator{};
-                    for (auto i = std::sregex_iterator{envString.begin(), envString.end(), storePathRegex}; i != env_end; ++i)
-                        unchecked[i->str()].emplace(envFile);
-                } catch (SysError & e) {
-                    if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-                        continue;
-                    throw;
+            try {
+                /* The file name is the last field of a mapping, and
+                   the only one that can contain a slash. */
+                auto mapFile = fmt("/proc/%s/maps", pid);
+                for (auto & line : tokenizeString<std::vector<string>>(readFile(mapFile), "\n")) {
+                    auto slash = line.find('/');
+                    if (slash != std::string::npos)
+                        found[trim(line.substr(slash))].emplace(mapFile);
                 }
+
+                auto envFile = fmt("/proc/%s/environ", pid);
+                findStorePathsIn(readFile(envFile), storeDir, envFile, found);
+            } catch (SysError & e) {
+                if (errno == ENOENT || errno == EACCES || errno == ESRCH)
+                    return;
+                throw;
             }
+
+            auto unchecked(unchecked_.lock());
+            for (auto & [target, links] : found)
+                if (hasPrefix(target, storePrefix))
+                    (*unchecked)[target].insert(links.begin(), links.end());
+        };
+
+        {
+            ThreadPool pool;
+
+            struct dirent * ent;
+            while (errno = 0, ent = readdir(procDir.get())) {
+                checkInterrupt();
+                std::string name = ent->d_name;
+                if (!name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return isdigit((unsigned char) c); }))
+                    pool.enqueue(std::bind(scanProcess, name));
+            }
+            if (errno)
+                throw SysError("iterating /proc");
+
+            pool.process();
         }
-        if (errno)
-            throw SysError("iterating /proc");
+
+        unchecked = std::move(*unchecked_.lock());
     }
 
 #if !defined(__linux__)
@@ -459,15 +515,21 @@ struct LocalStore::GCState
 {
     const GCOptions & options;
     GCResults & results;
-    StorePathSet roots;
-    StorePathSet tempRoots;
-    StorePathSet dead;
-    StorePathSet alive;
+    StorePathHashSet roots;
+    StorePathHashSet tempRoots;
+    StorePathHashSet dead;
+    StorePathHashSet alive;
     bool gcKeepOutputs;
     bool gcKeepDerivations;
     uint64_t bytesInvalidated;
     bool moveToTrash = true;
     bool shouldDelete;
+    /* Whether `alive' contains every path that was reachable from
+       the roots when markLivePaths() ran. */
+    bool marked = false;
+    /* If `marked', the total NAR size of the valid paths that are not
+       alive. */
+    uint64_t unreachableBytes = 0;
     GCState(const GCOptions & options, GCResults & results)
         : options(options), results(results), bytesInvalidated(0) { }
 };
@@ -489,6 +551,36 @@ void LocalStore::deleteGarbage(GCState & state, const Path & path)
 }
 
 
+/* Delete the trash directory. Its entries are independent and
+   deleting a large amount of garbage is mostly waiting for the file
+   system, so delete several of them at the same time. */
+void LocalStore::deleteTrash(GCState & state)
+{
+    if (!pathExists(trashDir)) return;
+
+    printInfo(format("deleting '%1%'") % trashDir);
+
+    std::atomic<uint64_t> bytesFreed{0};
+
+    {
+        ThreadPool pool;
+
+        for (auto & i : readDirectory(trashDir))
+            pool.enqueue([&, path(trashDir + "/" + i.name)]() {
+                uint64_t n;
+                deletePath(path, n);
+                bytesFreed += n;
+            });
+
+        pool.process();
+    }
+
+    state.results.bytesFreed += bytesFreed;
+
+    deleteGarbage(state, trashDir);
+}
+
+
 void LocalStore::deletePathRecursive(GCState & state, const Path & path)
 {
     checkInterrupt();
@@ -549,7 +641,7 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
 }
 
 
-bool LocalStore::canReachRoot(GCState & state, StorePathSet & visited, const StorePath & path)
+bool LocalStore::canReachRoot(GCState & state, StorePathHashSet & visited, const StorePath & path)
 {
     if (visited.count(path)) return false;
 
@@ -565,6 +657,11 @@ bool LocalStore::canReachRoot(GCState & state, StorePathSet & visited, const Sto
 
     visited.insert(path);
 
+    /* A path that the mark phase didn't reach is only garbage if
+       that's still true now: paths can be registered, or get new
+       references, after the snapshot was taken. So check its current
+       referrers below like we do without a snapshot. */
+
     if (!isValidPath(path)) return false;
 
     StorePathSet incoming;
@@ -602,6 +699,155 @@ bool LocalStore::canReachRoot(GCState & state, StorePathSet & visited, const Sto
 }
 
 
+/* Compute the set of live paths in one pass: load the reference
+   graph (and, if needed, the derivation outputs) from the database
+   into memory, and mark everything reachable from the roots. This is
+   what canReachRoot() computes path by path, but without a few
+   queries for every live path in the store. Paths that aren't marked
+   are still checked against the database before they're deleted. */
+void LocalStore::markLivePaths(GCState & state)
+{
+    printInfo("marking live paths...");
+
+    typedef uint32_t Id;
+
+    std::vector<std::string> pathOf;
+    std::unordered_map<std::string_view, Id> idOf;
+    std::vector<std::optional<std::string>> deriverOf;
+    std::vector<uint64_t> narSizeOf;
+    /* The references of path `i' are refs[refStart[i] .. refStart[i + 1]). */
+    std::vector<size_t> refStart;
+    std::vector<Id> refs;
+    std::unordered_map<Id, std::vector<Id>> outputsOf;
+
+    bool needOutputs = state.gcKeepOutputs || state.gcKeepDerivations;
+
+    bool ok = retrySQLite<bool>([&]() {
+        auto st(_state.lock());
+        SQLiteTxn txn(st->db);
+
+        pathOf.clear();
+        idOf.clear();
+        deriverOf.clear();
+        narSizeOf.clear();
+        refs.clear();
+        outputsOf.clear();
+
+        int64_t maxId = 0;
+        {
+            SQLiteStmt stmt(st->db, "select max(id) from ValidPaths");
+            auto use(stmt.use());
+            if (use.next() && !use.isNull(0)) maxId = use.getInt(0);
+        }
+        if (maxId >= std::numeric_limits<Id>::max()) return false;
+
+        pathOf.resize(maxId + 1);
+        deriverOf.resize(maxId + 1);
+        narSizeOf.resize(maxId + 1);
+        {
+            SQLiteStmt stmt(st->db, "select id, path, deriver, narSize from ValidPaths");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto id = use.getInt(0);
+                if (id > maxId) continue;
+                pathOf[id] = use.getStr(1);
+                if (!use.isNull(2)) deriverOf[id] = use.getStr(2);
+                if (!use.isNull(3)) narSizeOf[id] = use.getInt(3);
+            }
+        }
+        for (Id id = 0; id < pathOf.size(); id++)
+            if (!pathOf[id].empty()) idOf.emplace(pathOf[id], id);
+
+        refStart.assign(maxId + 2, 0);
+        {
+            SQLiteStmt stmt(st->db, "select referrer, reference from Refs order by referrer");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto referrer = use.getInt(0), reference = use.getInt(1);
+                if (referrer > maxId || reference > maxId) continue;
+                refStart[referrer + 1]++;
+                refs.push_back(reference);
+            }
+        }
+        for (size_t i = 1; i < refStart.size(); i++)
+            refStart[i] += refStart[i - 1];
+
+        if (needOutputs) {
+            SQLiteStmt stmt(st->db, "select drv, path from DerivationOutputs");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto drv = use.getInt(0);
+                if (drv > maxId) continue;
+                auto i = idOf.find(use.getStr(1));
+                if (i != idOf.end())
+                    outputsOf[drv].push_back(i->second);
+            }
+        }
+
+        return true;
+    });
+
+    if (!ok) {
+        printInfo("note: too many store paths to mark in memory, checking paths one by one");
+        return;
+    }
+
+    std::vector<bool> alive(pathOf.size(), false);
+    std::vector<Id> todo;
+
+    auto mark = [&](Id id) {
+        if (!alive[id]) {
+            alive[id] = true;
+            todo.push_back(id);
+        }
+    };
+
+    for (auto & root : state.roots) {
+        auto i = idOf.find(printStorePath(root));
+        if (i != idOf.end()) mark(i->second);
+    }
+
+    while (!todo.empty()) {
+        checkInterrupt();
+        auto id = todo.back();
+        todo.pop_back();
+
+        for (auto i = refStart[id]; i < refStart[id + 1]; i++)
+            mark(refs[i]);
+
+        /* Keep the outputs of live derivations. */
+        if (state.gcKeepOutputs) {
+            auto i = outputsOf.find(id);
+            if (i != outputsOf.end())
+                for (auto output : i->second)
+                    mark(output);
+        }
+
+        /* Keep the deriver of live outputs, if it claims this path as
+           one of its outputs. */
+        if (state.gcKeepDerivations && deriverOf[id]) {
+            auto i = idOf.find(*deriverOf[id]);
+            if (i != idOf.end()) {
+                auto drv = i->second;
+                auto j = outputsOf.find(drv);
+                if (j != outputsOf.end()
+                    && std::find(j->second.begin(), j->second.end(), id) != j->second.end())
+                    mark(drv);
+            }
+        }
+    }
+
+    for (Id id = 0; id < alive.size(); id++) {
+        if (alive[id])
+            state.alive.insert(parseStorePath(pathOf[id]));
+        else if (!pathOf[id].empty())
+            state.unreachableBytes += narSizeOf[id];
+    }
+
+    state.marked = true;
+}
+
+
 void LocalStore::tryToDelete(GCState & state, const Path & path)
 {
     checkInterrupt();
@@ -628,7 +874,7 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
         if (isActiveTempFile(state, path, ".check")) return;
     }
 
-    StorePathSet visited;
+    StorePathHashSet visited;
 
     if (storePath && canReachRoot(state, visited, *storePath)) {
         debug("cannot delete '%s' because it's still reachable", path);
@@ -652,24 +898,25 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
    the link count. */
 void LocalStore::removeUnusedLinks(const GCState & state)
 {
-    AutoCloseDir dir(opendir(linksDir.c_str()));
-    if (!dir) throw SysError("opening directory '%1%'", linksDir);
-
     int64_t actualSize = 0, unsharedSize = 0;
 
-    struct dirent * dirent;
-    while (errno = 0, dirent = readdir(dir.get())) {
-        checkInterrupt();
-        string name = dirent->d_name;
-        if (name == "." || name == "..") continue;
-        Path path = linksDir + "/" + name;
+    /* With optimise-share-extents, a link with a link count of 1 may
+       still share its data with store files, so unlinking it doesn't
+       necessarily free anything. */
+    uint64_t unlinkedCount = 0, unlinkedSize = 0;
 
+    iterateLinks([&](const Path & path, const std::string & hash, ino_t ino) {
         auto st = lstat(path);
 
         if (st.st_nlink != 1) {
             actualSize += st.st_size;
             unsharedSize += (st.st_nlink - 1) * st.st_size;
-            continue;
+
+            /* Move links in the old, flat layout to their shard. */
+            if (path == legacyLinkPathFor(hash))
+                migrateLink(path, linkPathFor(hash));
+
+            return;
         }
 
         printMsg(lvlTalkative, format("deleting unused link '%1%'") % path);
@@ -677,8 +924,16 @@ void LocalStore::removeUnusedLinks(const GCState & state)
         if (unlink(path.c_str()) == -1)
             throw SysError("deleting '%1%'", path);
 
-        state.results.bytesFreed += st.st_size;
-    }
+        if (settings.optimiseShareExtents) {
+            unlinkedCount++;
+            unlinkedSize += st.st_size;
+        } else
+            state.results.bytesFreed += st.st_size;
+    });
+
+    if (unlinkedCount)
+        printInfo("unlinked %d unused links (%s), whose data may still be shared with store files",
+            unlinkedCount, showBytes(unlinkedSize));
 
     struct stat st;
     if (stat(linksDir.c_str(), &st) == -1)
@@ -740,7 +995,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        that is not reachable from `roots' is garbage. */
 
     if (state.shouldDelete) {
-        if (pathExists(trashDir)) deleteGarbage(state, trashDir);
+        deleteTrash(state);
         try {
             createDirs(trashDir);
         } catch (SysError & e) {
@@ -768,6 +1023,16 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     } else if (options.maxFreed > 0) {
 
+        markLivePaths(state);
+
+        /* Let the tests change the database between the mark phase
+           and the deletions. */
+        static auto syncFifo = getEnv("_NIX_TEST_GC_SYNC");
+        if (syncFifo) {
+            writeFile(*syncFifo, "marked\n");
+            readFile(*syncFifo);
+        }
+
         if (state.shouldDelete)
             printInfo("deleting garbage...");
         else
@@ -800,14 +1065,39 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
             dir.reset();
 
-            /* Now delete the unreachable valid paths.  Randomise the
-               order in which we delete entries to make the collector
-               less biased towards deleting paths that come
-               alphabetically first (e.g. /nix/store/000...).  This
-               matters when using --max-freed etc. */
+            /* Now delete the unreachable valid paths.  If we only
+               need to free a limited amount of space (--max-freed,
+               auto-GC), delete the least recently used paths first,
+               since they are the least likely to be needed again.
+               Paths without a recorded use count as used when they
+               were registered.  Otherwise, randomise the order to
+               make the collector less biased towards deleting paths
+               that come alphabetically first (e.g. /nix/store/000...)
+               if it gets interrupted. */
             vector<Path> entries_(entries.begin(), entries.end());
-            std::mt19937 gen(1);
-            std::shuffle(entries_.begin(), entries_.end(), gen);
+            if (options.maxFreed != std::numeric_limits<uint64_t>::max()) {
+                std::unordered_map<std::string, time_t> lastUsed;
+                retrySQLite<void>([&]() {
+                    auto st(_state.lock());
+                    flushPathUsage(*st);
+                    lastUsed.clear();
+                    SQLiteStmt stmt(st->db,
+                        "select v.path, coalesce(u.lastUsed, v.registrationTime) "
+                        "from ValidPaths v left join PathUsage u on u.path = v.id");
+                    auto use(stmt.use());
+                    while (use.next())
+                        lastUsed.emplace(use.getStr(0), use.getInt(1));
+                });
+                auto used = [&](const Path & path) {
+                    auto i = lastUsed.find(path);
+                    return i == lastUsed.end() ? 0 : i->second;
+                };
+                std::stable_sort(entries_.begin(), entries_.end(),
+                    [&](const Path & a, const Path & b) { return used(a) < used(b); });
+            } else {
+                std::mt19937 gen(1);
+                std::shuffle(entries_.begin(), entries_.end(), gen);
+            }
 
             for (auto & i : entries_)
                 tryToDelete(state, i);
@@ -825,6 +1115,8 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     if (state.options.action == GCOptions::gcReturnDead) {
         for (auto & i : state.dead)
             state.results.paths.insert(printStorePath(i));
+        if (state.marked)
+            state.results.bytesFreed = state.unreachableBytes;
         return;
     }
 
@@ -833,8 +1125,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     fds.clear();
 
     /* Delete the trash directory. */
-    printInfo(format("deleting '%1%'") % trashDir);
-    deleteGarbage(state, trashDir);
+    deleteTrash(state);
 
     /* Clean up the links directory. */
     if (options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific) {
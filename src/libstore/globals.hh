@@ -108,6 +108,26 @@ public:
     Setting<bool> keepGoing{this, false, "keep-going",
         "Whether to keep building derivations when another build fails."};
 
+    Setting<bool> buildWhileEvaluating{
+        this, false, "build-while-evaluating",
+        R"(
+          If set to `true`, commands that build several installables
+          (such as `nix build` and `nix-build`), and `nix flake check`,
+          start building derivations as soon as they have been
+          evaluated, while the remaining installables are still being
+          evaluated. Otherwise, all installables are evaluated before
+          any of them is built.
+
+          Derivations are built in batches, one batch at a time, so
+          that `max-jobs` and `cores` apply to all of them together.
+          Derivations evaluated while a batch is building are built in
+          the next one.
+
+          With this setting, a build failure is only reported once
+          evaluation has finished, and an evaluation error waits for
+          the builds that are already in progress.
+        )"};
+
     Setting<bool> tryFallback{
         this, false, "fallback",
         R"(
@@ -137,6 +157,17 @@ public:
         )",
         {"build-max-jobs"}};
 
+    Setting<unsigned int> maxSubstitutionJobs{
+        this, 16, "max-substitution-jobs",
+        R"(
+          This option defines the maximum number of substitution jobs that Nix
+          will try to run in parallel. The default is `16`. The minimum value
+          is `1`. Substitutions have their own job slots, separate from
+          `max-jobs`, so that the inputs of pending derivations are downloaded
+          while other derivations are being built.
+        )",
+        {"substitution-max-jobs"}};
+
     Setting<unsigned int> buildCores{
         this, getDefaultCores(), "cores",
         R"(
@@ -151,6 +182,52 @@ public:
         )",
         {"build-cores"}};
 
+    Setting<unsigned int> jobserverTokens{
+        this, 0, "jobserver-tokens",
+        R"(
+          If set to a non-zero value, Nix acts as a GNU Make jobserver
+          with this many job tokens, shared by all builds run by the
+          same Nix process. Builders of derivations that set
+          `enableParallelBuilding` get the jobserver through
+          `MAKEFLAGS`, so tools that support the jobserver protocol
+          (such as GNU Make, Cargo and recent versions of Ninja) can
+          take tokens when more work is available, instead of each
+          build using a fixed number of cores. Each such build counts
+          as one job towards the limit while it is running. Note that
+          GNU Make ignores the jobserver when it is passed an explicit
+          `-jN` flag.
+        )"};
+
+    Setting<uint64_t> minFreeMemory{
+        this, 0, "min-free-memory",
+        R"(
+          If set to a non-zero value, Nix does not start a local build
+          while less than this many bytes of memory are available (as
+          reported by `MemAvailable` in `/proc/meminfo`) and other
+          builds are still running. This avoids running out of memory
+          when several memory-hungry builds would otherwise start at
+          the same time. Only supported on Linux.
+
+          If `use-cgroups` is enabled and a build of a similar
+          derivation has been seen before, Nix also waits until the
+          peak memory usage of that build is available.
+        )"};
+
+    Setting<bool> useCgroups{
+        this, false, "use-cgroups",
+        R"(
+          If set to `true`, Nix runs each local build in a cgroup of its
+          own below the cgroup of the Nix process, and records its CPU
+          time, peak memory usage and I/O in the build log (as a result
+          of type 109 in the `internal-json` log format) and in its
+          build time history. It also kills any processes left behind by
+          the builder. This requires cgroups v2. Memory and I/O usage
+          are only available if the `memory` and `io` controllers can be
+          enabled for the children of Nix's cgroup, which is not the
+          case if other processes live in that cgroup. Only supported on
+          Linux.
+        )"};
+
     /* Read-only mode.  Don't copy stuff to the store, don't change
        the database. */
     bool readOnlyMode = false;
@@ -223,6 +300,31 @@ public:
           this computer and the remote build host is slow.
         )"};
 
+    Setting<bool> buildersPreferLocality{
+        this, false, "builders-prefer-locality",
+        R"(
+          If set to `true`, Nix asks every suitable remote build machine
+          which of the inputs of a derivation it already has, and
+          prefers the machine with the free build slot that needs the
+          fewest bytes uploaded (before considering load and speed
+          factor). This is useful when the network connection to the
+          build machines is slow compared to the builds themselves.
+        )"};
+
+    Setting<unsigned int> sshControlPersist{
+        this, 0, "ssh-control-persist",
+        R"(
+          If set to a non-zero value, SSH connections to remote stores and
+          build machines are multiplexed over a master connection that is
+          kept open for this many seconds after its last use (see
+          `ControlPersist` in ssh_config(5)). Since every remote build runs
+          in a separate `build-remote` process, this allows consecutive
+          remote builds to reuse a connection rather than performing a
+          new SSH handshake each time. Stores with several connections
+          (`max-connections`) also use this shared master rather than
+          starting one of their own.
+        )"};
+
     Setting<off_t> reservedSize{this, 8 * 1024 * 1024, "gc-reserved-space",
         "Amount of reserved disk space for the garbage collector."};
 
@@ -239,7 +341,16 @@ public:
         "Whether SQLite should use WAL mode."};
 
     Setting<bool> syncBeforeRegistering{this, false, "sync-before-registering",
-        "Whether to call `sync()` before registering a path as valid."};
+        "Whether to flush the file system containing the store (`syncfs()` on Linux, `sync()` elsewhere) before registering a path as valid."};
+
+    Setting<unsigned int> verifyJobs{this, 0, "verify-jobs",
+        R"(
+          The number of store paths that `nix-store --verify
+          --check-contents` hashes in parallel. The default, `0`, uses
+          one thread per CPU core. On stores backed by rotational disks,
+          a small value avoids the seek overhead of many concurrent
+          readers.
+        )"};
 
     Setting<bool> useSubstitutes{
         this, true, "substitute",
@@ -302,11 +413,22 @@ public:
         this, true, "compress-build-log",
         R"(
           If set to `true` (the default), build logs written to
-          `/nix/var/log/nix/drvs` will be compressed on the fly using bzip2.
-          Otherwise, they will not be compressed.
+          `/nix/var/log/nix/drvs` will be compressed on the fly using the
+          method given by `build-log-compression`. Otherwise, they will not
+          be compressed.
         )",
         {"build-compress-log"}};
 
+    Setting<std::string> logCompression{
+        this, "bzip2", "build-log-compression",
+        R"(
+          The compression method used for build logs if
+          `compress-build-log` is enabled. Supported values are `bzip2`
+          (the default), `zstd` and `xz`. `zstd` is much cheaper than
+          `bzip2` for builds that produce a lot of output, but logs
+          compressed with it can only be read by Nix 2.4 and later.
+        )"};
+
     Setting<unsigned long> maxLogSize{
         this, 0, "max-build-log-size",
         R"(
@@ -366,6 +488,19 @@ public:
           duplicate files.
         )"};
 
+    Setting<bool> optimiseShareExtents{
+        this, false, "optimise-share-extents",
+        R"(
+          If set to `true`, store optimisation (`nix-store --optimise` and
+          `auto-optimise-store`) makes identical regular files share their
+          data extents on disk using the `FIDEDUPERANGE` ioctl, rather
+          than replacing them with hard links. Each file keeps its own
+          inode, so the file system's link count limit does not apply.
+          This requires a file system that supports extent sharing, such
+          as Btrfs or XFS; on other file systems, Nix falls back to hard
+          links. Only supported on Linux.
+        )"};
+
     Setting<bool> envKeepDerivations{
         this, false, "keep-env-derivations",
         R"(
@@ -687,6 +822,28 @@ public:
           Note that trusted users are always allowed to connect.
         )"};
 
+    Setting<Strings> daemonUserNiceness{
+        this, {}, "daemon-user-niceness",
+        R"(
+          A list of `user=niceness` entries (separated by whitespace) that
+          set the scheduling priority of the Nix daemon processes serving
+          each user's connections, and thus of the builds and substitutions
+          they run. As with `trusted-users`, groups can be given as
+          `@group` and all users as `*`. The first matching entry applies.
+          For example, `@interactive=0 *=10` lets members of the group
+          `interactive` run ahead of everybody else's builds.
+        )"};
+
+    Setting<Path> daemonMetricsFile{
+        this, "", "daemon-metrics-file",
+        R"(
+          If set, the Nix daemon writes counters and latency histograms of
+          the operations it has performed, the number of connections, and
+          store statistics to this file in the Prometheus text format,
+          e.g. for the textfile collector of the Prometheus node exporter.
+          The file is updated whenever a client disconnects.
+        )"};
+
     Setting<bool> printMissing{this, true, "print-missing",
         "Whether to print what paths need to be built or downloaded."};
 
@@ -938,6 +1095,18 @@ public:
     Setting<bool> warnDirty{this, true, "warn-dirty",
         "Whether to warn about dirty Git/Mercurial trees."};
 
+    Setting<bool> cacheSourceImports{this, false, "cache-source-imports",
+        R"(
+          If set to `true`, remember the store path of every local source
+          tree copied to the store, either by path interpolation (e.g.
+          `"${./src}"`) or as a `path:` flake input, keyed on the name,
+          type, size, inode and modification time of each file in the
+          tree. A later evaluation that finds the same metadata reuses
+          the store path without reading or hashing the file contents.
+          Like Git's index, this can be fooled by changes that preserve
+          all of these attributes.
+        )"};
+
     Setting<size_t> narBufferSize{this, 32 * 1024 * 1024, "nar-buffer-size",
         "Maximum size of NARs before spilling them to disk."};
 
@@ -158,6 +158,30 @@ protected:
         }
     }
 
+    std::optional<std::string> getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length) override
+    {
+        if (!length) return std::string();
+        checkEnabled();
+        auto request(makeRequest(path));
+        request.headers.emplace_back("Range", fmt("bytes=%d-%d", offset, offset + length - 1));
+        try {
+            auto res = getFileTransfer()->download(std::move(request));
+            /* A server that ignores the Range header returns the whole
+               file with status 200 rather than 206. Non-HTTP transfers
+               (e.g. file://) have no status, so only the length can be
+               checked for those. */
+            if (res.httpStatus != 206 && res.httpStatus != 0) return std::nullopt;
+            if (!res.data || res.data->size() != length) return std::nullopt;
+            return *res.data;
+        } catch (FileTransferError & e) {
+            if (e.error == FileTransfer::NotFound || e.error == FileTransfer::Forbidden)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+            maybeDisable();
+            throw;
+        }
+    }
+
     void getFile(const std::string & path,
         Callback<std::shared_ptr<std::string>> callback) noexcept override
     {
@@ -47,13 +47,18 @@ protected:
 
     bool fileExists(const std::string & path) override;
 
+    static Path makeTempPath(const Path & path)
+    {
+        static std::atomic<int> counter{0};
+        return fmt("%s.tmp.%d.%d", path, getpid(), ++counter);
+    }
+
     void upsertFile(const std::string & path,
         std::shared_ptr<std::basic_iostream<char>> istream,
         const std::string & mimeType) override
     {
         auto path2 = binaryCacheDir + "/" + path;
-        static std::atomic<int> counter{0};
-        Path tmp = fmt("%s.tmp.%d.%d", path2, getpid(), ++counter);
+        Path tmp = makeTempPath(path2);
         AutoDelete del(tmp, false);
         StreamToSourceAdapter source(istream);
         writeFile(tmp, source);
@@ -62,6 +67,51 @@ protected:
         del.cancel();
     }
 
+    /* The directory of the temporary files created by
+       createNarTempFile(). */
+    Path tempDir() const
+    {
+        return binaryCacheDir + "/.tmp";
+    }
+
+    std::pair<AutoCloseFD, Path> createNarTempFile() override
+    {
+        /* Create the file inside the cache, so that
+           upsertFileFromPath() can always link it into place. Like the
+           files written by upsertFile(), it is created with 0666 minus
+           the umask. The directory is only created here, since a
+           cache that is only read from may not be writable. */
+        static std::atomic<int> counter{0};
+        createDirs(tempDir());
+        while (true) {
+            Path tmp = fmt("%s/%d.%d", tempDir(), getpid(), ++counter);
+            AutoCloseFD fd = open(tmp.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+            if (fd) return {std::move(fd), tmp};
+            if (errno != EEXIST)
+                throw SysError("creating temporary file '%s'", tmp);
+        }
+    }
+
+    void upsertFileFromPath(const std::string & path,
+        const Path & localPath,
+        const std::string & mimeType) override
+    {
+        /* If the file is on the same file system as the cache, which
+           it is if it came from createNarTempFile(), hard-link it
+           into place rather than copying it. */
+        auto path2 = binaryCacheDir + "/" + path;
+        Path tmp = makeTempPath(path2);
+        if (link(localPath.c_str(), tmp.c_str()) == -1) {
+            debug("cannot link '%s' to '%s' (%s), copying instead", localPath, tmp, strerror(errno));
+            BinaryCacheStore::upsertFileFromPath(path, localPath, mimeType);
+            return;
+        }
+        AutoDelete del(tmp, false);
+        if (rename(tmp.c_str(), path2.c_str()))
+            throw SysError("renaming '%1%' to '%2%'", tmp, path2);
+        del.cancel();
+    }
+
     void getFile(const std::string & path, Sink & sink) override
     {
         try {
@@ -72,6 +122,30 @@ protected:
         }
     }
 
+    std::optional<std::string> getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length) override
+    {
+        auto path2 = binaryCacheDir + "/" + path;
+        AutoCloseFD fd = open(path2.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) {
+            if (errno == ENOENT)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache", path);
+            throw SysError("opening '%s'", path2);
+        }
+        std::string buf(length, 0);
+        size_t done = 0;
+        while (done < length) {
+            auto n = pread(fd.get(), buf.data() + done, length - done, offset + done);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading '%s'", path2);
+            }
+            if (n == 0) throw EndOfFile("unexpected end of '%s'", path2);
+            done += n;
+        }
+        return buf;
+    }
+
     StorePathSet queryAllValidPaths() override
     {
         StorePathSet paths;
@@ -93,6 +167,25 @@ protected:
 void LocalBinaryCacheStore::init()
 {
     createDirs(binaryCacheDir + "/nar");
+
+    /* Remove the temporary files of uploads that were interrupted.
+       The process that created a file may be on another host, so go
+       by age rather than by PID: a file that hasn't been written to
+       for a day no longer belongs to a running upload. The cache may
+       be read-only, in which case there is nothing to remove. */
+    try {
+        if (pathExists(tempDir())) {
+            auto cutoff = time(0) - 24 * 60 * 60;
+            for (auto & entry : readDirectory(tempDir())) {
+                auto path = tempDir() + "/" + entry.name;
+                if (lstat(path).st_mtime < cutoff)
+                    deletePath(path);
+            }
+        }
+    } catch (SysError & e) {
+        debug("cannot remove stale temporary files in '%s': %s", tempDir(), e.msg());
+    }
+
     createDirs(binaryCacheDir + "/" + realisationsPrefix);
     if (writeDebugInfo)
         createDirs(binaryCacheDir + "/debuginfo");
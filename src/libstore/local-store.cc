@@ -8,6 +8,7 @@
 #include "references.hh"
 #include "callback.hh"
 #include "topo-sort.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <algorithm>
@@ -49,7 +50,9 @@ struct LocalStore::State::Stmts {
     SQLiteStmt AddReference;
     SQLiteStmt QueryPathInfo;
     SQLiteStmt QueryReferences;
+    SQLiteStmt QueryReferenceIds;
     SQLiteStmt QueryReferrers;
+    SQLiteStmt QueryReferrerIds;
     SQLiteStmt InvalidatePath;
     SQLiteStmt AddDerivationOutput;
     SQLiteStmt RegisterRealisedOutput;
@@ -62,6 +65,16 @@ struct LocalStore::State::Stmts {
     SQLiteStmt QueryValidPaths;
     SQLiteStmt QueryRealisationReferences;
     SQLiteStmt AddRealisationReference;
+    SQLiteStmt RecordPathUsage;
+};
+
+struct LocalStore::ReadConnection
+{
+    SQLite db;
+    SQLiteStmt QueryPathInfo;
+    SQLiteStmt QueryReferences;
+    SQLiteStmt QueryReferenceIds;
+    SQLiteStmt QueryReferrerIds;
 };
 
 int getSchema(Path schemaPath)
@@ -143,6 +156,7 @@ LocalStore::LocalStore(const Params & params)
     , LocalFSStore(params)
     , dbDir(stateDir + "/db")
     , linksDir(realStoreDir + "/.links")
+    , optimisedPath(dbDir + "/optimised")
     , reservedPath(dbDir + "/reserved")
     , schemaPath(dbDir + "/schema")
     , trashDir(realStoreDir + "/trash")
@@ -313,6 +327,15 @@ LocalStore::LocalStore(const Params & params)
         migrateCASchema(state->db, dbDir + "/ca-schema", globalLock);
     }
 
+    /* The last-use times of store paths, which let the garbage
+       collector delete the least recently used paths first. This is
+       a separate table so that the schema version doesn't change. */
+    state->db.exec(
+        "create table if not exists PathUsage ("
+        "  path     integer primary key not null,"
+        "  lastUsed integer not null,"
+        "  foreign key (path) references ValidPaths(id) on delete cascade)");
+
     /* Prepare SQL statements. */
     state->stmts->RegisterValidPath.create(state->db,
         "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
@@ -324,6 +347,10 @@ LocalStore::LocalStore(const Params & params)
         "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
     state->stmts->QueryReferences.create(state->db,
         "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+    state->stmts->QueryReferenceIds.create(state->db,
+        "select id, path from Refs join ValidPaths on reference = id where referrer = ?;");
+    state->stmts->QueryReferrerIds.create(state->db,
+        "select id, path from Refs join ValidPaths on referrer = id where reference = ?;");
     state->stmts->QueryReferrers.create(state->db,
         "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
     state->stmts->InvalidatePath.create(state->db,
@@ -339,6 +366,8 @@ LocalStore::LocalStore(const Params & params)
     state->stmts->QueryPathFromHashPart.create(state->db,
         "select path from ValidPaths where path >= ? limit 1;");
     state->stmts->QueryValidPaths.create(state->db, "select path from ValidPaths");
+    state->stmts->RecordPathUsage.create(state->db,
+        "insert or replace into PathUsage (path, lastUsed) select id, ? from ValidPaths where path = ?;");
     if (settings.isExperimentalFeatureEnabled("ca-derivations")) {
         state->stmts->RegisterRealisedOutput.create(state->db,
             R"(
@@ -383,6 +412,24 @@ LocalStore::LocalStore(const Params & params)
                     (select id from Realisations where drvPath = ? and outputName = ?));
             )");
     }
+
+    if (settings.useSQLiteWAL)
+        readConnections = std::make_unique<Pool<ReadConnection>>(
+            std::numeric_limits<size_t>::max(),
+            [this]() {
+                auto conn = make_ref<ReadConnection>();
+                conn->db = SQLite(dbDir + "/db.sqlite", false);
+                conn->db.exec("pragma query_only = 1");
+                conn->QueryPathInfo.create(conn->db,
+                    "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
+                conn->QueryReferences.create(conn->db,
+                    "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+                conn->QueryReferenceIds.create(conn->db,
+                    "select id, path from Refs join ValidPaths on reference = id where referrer = ?;");
+                conn->QueryReferrerIds.create(conn->db,
+                    "select id, path from Refs join ValidPaths on referrer = id where reference = ?;");
+                return conn;
+            });
 }
 
 
@@ -403,6 +450,7 @@ LocalStore::~LocalStore()
 
     try {
         auto state(_state.lock());
+        flushPathUsage(*state);
         if (state->fdTempRoots) {
             state->fdTempRoots = -1;
             unlink(fnTempRoots.c_str());
@@ -422,6 +470,25 @@ std::string LocalStore::getUri()
 int LocalStore::getSchema()
 { return nix::getSchema(schemaPath); }
 
+void LocalStore::flushPathUsage(State & state)
+{
+    if (state.usedPaths.empty()) return;
+
+    /* Usage times are only a hint for the garbage collector, so
+       don't fail if the database is busy; try again later. */
+    try {
+        auto now = time(0);
+        SQLiteTxn txn(state.db);
+        for (auto & path : state.usedPaths)
+            state.stmts->RecordPathUsage.use()(now)(printStorePath(path)).exec();
+        txn.commit();
+        state.usedPaths.clear();
+    } catch (SQLiteBusy & e) {
+        debug("cannot record path usage: %s", e.what());
+    }
+}
+
+
 void LocalStore::openDB(State & state, bool create)
 {
     if (access(dbDir.c_str(), R_OK | W_OK))
@@ -549,7 +616,9 @@ void canonicaliseTimestampAndPermissions(const Path & path)
 }
 
 
-static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+/* Canonicalise a single file. Return whether it is a directory whose
+   entries must be canonicalised as well. */
+static bool canonicaliseFile(const Path & path, uid_t fromUid, Sync<InodesSeen *> & inodesSeen)
 {
     checkInterrupt();
 
@@ -599,14 +668,17 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
        ensure that we don't fail on hard links within the same build
        (i.e. "touch $out/foo; ln $out/foo $out/bar"). */
     if (fromUid != (uid_t) -1 && st.st_uid != fromUid) {
-        if (S_ISDIR(st.st_mode) || !inodesSeen.count(Inode(st.st_dev, st.st_ino)))
+        if (S_ISDIR(st.st_mode) || !(*inodesSeen.lock())->count(Inode(st.st_dev, st.st_ino)))
             throw BuildError("invalid ownership on file '%1%'", path);
         mode_t mode = st.st_mode & ~S_IFMT;
         assert(S_ISLNK(st.st_mode) || (st.st_uid == geteuid() && (mode == 0444 || mode == 0555) && st.st_mtime == mtimeStore));
-        return;
+        return false;
     }
 
-    inodesSeen.insert(Inode(st.st_dev, st.st_ino));
+    /* Note: this must happen before the chown below, so that another
+       thread visiting a hard link to this file while it's being
+       canonicalised will find it. */
+    (*inodesSeen.lock())->insert(Inode(st.st_dev, st.st_ino));
 
     canonicaliseTimestampAndPermissions(path, st);
 
@@ -628,11 +700,34 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
                 path, geteuid());
     }
 
-    if (S_ISDIR(st.st_mode)) {
-        DirEntries entries = readDirectory(path);
-        for (auto & i : entries)
-            canonicalisePathMetaData_(path + "/" + i.name, fromUid, inodesSeen);
-    }
+    return S_ISDIR(st.st_mode);
+}
+
+
+static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+{
+    Sync<InodesSeen *> inodesSeen_(&inodesSeen);
+
+    if (!canonicaliseFile(path, fromUid, inodesSeen_)) return;
+
+    /* Outputs can contain hundreds of thousands of files, and
+       canonicalising each one takes several system calls, so walk
+       the tree in parallel, one work item per directory. The pool
+       only starts threads once there is more than one directory
+       pending. */
+    ThreadPool pool;
+
+    std::function<void(const Path & dir)> visitDir;
+    visitDir = [&](const Path & dir) {
+        for (auto & i : readDirectory(dir)) {
+            auto child = dir + "/" + i.name;
+            if (canonicaliseFile(child, fromUid, inodesSeen_))
+                pool.enqueue(std::bind(visitDir, child));
+        }
+    };
+
+    pool.enqueue(std::bind(visitDir, path));
+    pool.process();
 }
 
 
@@ -824,7 +919,7 @@ uint64_t LocalStore::addValidPath(State & state,
     }
 
     {
-        auto state_(Store::state.lock());
+        auto state_(Store::state(info.path.hashPart()).lock());
         state_->pathInfoCache.upsert(std::string(info.path.hashPart()),
             PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
     }
@@ -838,6 +933,10 @@ void LocalStore::queryPathInfoUncached(const StorePath & path,
 {
     try {
         callback(retrySQLite<std::shared_ptr<const ValidPathInfo>>([&]() {
+            if (readConnections) {
+                auto conn(readConnections->get());
+                return queryPathInfoInternal(conn->QueryPathInfo, conn->QueryReferences, path);
+            }
             auto state(_state.lock());
             return queryPathInfoInternal(*state, path);
         }));
@@ -847,9 +946,16 @@ void LocalStore::queryPathInfoUncached(const StorePath & path,
 
 
 std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & state, const StorePath & path)
+{
+    return queryPathInfoInternal(state.stmts->QueryPathInfo, state.stmts->QueryReferences, path);
+}
+
+
+std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(
+    SQLiteStmt & queryPathInfo, SQLiteStmt & queryReferences, const StorePath & path)
 {
     /* Get the path info. */
-    auto useQueryPathInfo(state.stmts->QueryPathInfo.use()(printStorePath(path)));
+    auto useQueryPathInfo(queryPathInfo.use()(printStorePath(path)));
 
     if (!useQueryPathInfo.next())
         return std::shared_ptr<ValidPathInfo>();
@@ -869,7 +975,7 @@ std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & s
 
     info->registrationTime = useQueryPathInfo.getInt(2);
 
-    auto s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 3);
+    auto s = (const char *) sqlite3_column_text(queryPathInfo, 3);
     if (s) info->deriver = parseStorePath(s);
 
     /* Note that narSize = NULL yields 0. */
@@ -877,14 +983,14 @@ std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & s
 
     info->ultimate = useQueryPathInfo.getInt(5) == 1;
 
-    s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 6);
+    s = (const char *) sqlite3_column_text(queryPathInfo, 6);
     if (s) info->sigs = tokenizeString<StringSet>(s, " ");
 
-    s = (const char *) sqlite3_column_text(state.stmts->QueryPathInfo, 7);
+    s = (const char *) sqlite3_column_text(queryPathInfo, 7);
     if (s) info->ca = parseContentAddressOpt(s);
 
     /* Get the references. */
-    auto useQueryReferences(state.stmts->QueryReferences.use()(info->id));
+    auto useQueryReferences(queryReferences.use()(info->id));
 
     while (useQueryReferences.next())
         info->references.insert(parseStorePath(useQueryReferences.getStr(0)));
@@ -893,6 +999,59 @@ std::shared_ptr<const ValidPathInfo> LocalStore::queryPathInfoInternal(State & s
 }
 
 
+void LocalStore::computeFSClosure(const StorePathSet & paths,
+    StorePathSet & out, bool flipDirection,
+    bool includeOutputs, bool includeDerivers)
+{
+    if (includeOutputs || includeDerivers) {
+        Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
+        return;
+    }
+
+    /* Walk the references (or referrers) in the database directly, by
+       row ID, rather than building a ValidPathInfo for every path in
+       the closure. */
+    auto walk = [&](SQLiteStmt & queryPathInfo, SQLiteStmt & queryEdges) {
+        StorePathSet added;
+        std::vector<uint64_t> todo;
+
+        for (auto & path : paths) {
+            auto use(queryPathInfo.use()(printStorePath(path)));
+            if (!use.next())
+                throw InvalidPath("path '%s' is not valid", printStorePath(path));
+            if (!out.count(path) && added.insert(path).second)
+                todo.push_back(use.getInt(0));
+        }
+
+        while (!todo.empty()) {
+            auto id = todo.back();
+            todo.pop_back();
+            auto use(queryEdges.use()(id));
+            while (use.next()) {
+                auto ref = parseStorePath(use.getStr(1));
+                if (!out.count(ref) && added.insert(std::move(ref)).second)
+                    todo.push_back(use.getInt(0));
+            }
+        }
+
+        return added;
+    };
+
+    auto added = retrySQLite<StorePathSet>([&]() {
+        if (readConnections) {
+            auto conn(readConnections->get());
+            return walk(conn->QueryPathInfo,
+                flipDirection ? conn->QueryReferrerIds : conn->QueryReferenceIds);
+        }
+        auto state(_state.lock());
+        return walk(state->stmts->QueryPathInfo,
+            flipDirection ? state->stmts->QueryReferrerIds : state->stmts->QueryReferenceIds);
+    });
+
+    out.insert(added.begin(), added.end());
+}
+
+
 /* Update path info in the database. */
 void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 {
@@ -925,6 +1084,10 @@ bool LocalStore::isValidPath_(State & state, const StorePath & path)
 bool LocalStore::isValidPathUncached(const StorePath & path)
 {
     return retrySQLite<bool>([&]() {
+        if (readConnections) {
+            auto conn(readConnections->get());
+            return conn->QueryPathInfo.use()(printStorePath(path)).next();
+        }
         auto state(_state.lock());
         return isValidPath_(*state, path);
     });
@@ -1075,6 +1238,15 @@ void LocalStore::querySubstitutablePathInfos(const StorePathCAMap & paths, Subst
 {
     if (!settings.useSubstitutes) return;
     for (auto & sub : getDefaultSubstituters()) {
+        /* Fetch the info of all paths concurrently rather than one
+           by one below. */
+        if (paths.size() > 1 && sub->storeDir == storeDir) {
+            StorePathSet subPaths;
+            for (auto & path : paths)
+                subPaths.insert(path.first);
+            sub->prefetchPathInfos(subPaths);
+        }
+
         for (auto & path : paths) {
             auto subPath(path.first);
 
@@ -1126,7 +1298,17 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
        be fsync-ed.  So some may want to fsync them before registering
        the validity, at the expense of some speed of the path
        registering operation. */
-    if (settings.syncBeforeRegistering) sync();
+    if (settings.syncBeforeRegistering) {
+#if __linux__
+        /* Only flush the file system that contains the store, rather
+           than every mounted file system. */
+        AutoCloseFD fd = open(realStoreDir.get().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (!fd || syncfs(fd.get()) != 0)
+            sync();
+#else
+        sync();
+#endif
+    }
 
     return retrySQLite<void>([&]() {
         auto state(_state.lock());
@@ -1134,19 +1316,32 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
         SQLiteTxn txn(state->db);
         StorePathSet paths;
 
+        /* Row IDs of the paths seen so far. Most paths in a batch
+           share references (e.g. to glibc), so this saves looking
+           them up again for every referrer. */
+        std::map<StorePath, uint64_t> ids;
+
+        auto getId = [&](const StorePath & path) {
+            auto i = ids.find(path);
+            if (i != ids.end()) return i->second;
+            auto id = queryValidPathId(*state, path);
+            ids.emplace(path, id);
+            return id;
+        };
+
         for (auto & [_, i] : infos) {
             assert(i.narHash.type == htSHA256);
             if (isValidPath_(*state, i.path))
                 updatePathInfo(*state, i);
             else
-                addValidPath(*state, i, false);
+                ids.emplace(i.path, addValidPath(*state, i, false));
             paths.insert(i.path);
         }
 
         for (auto & [_, i] : infos) {
-            auto referrer = queryValidPathId(*state, i.path);
+            auto referrer = getId(i.path);
             for (auto & j : i.references)
-                state->stmts->AddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
+                state->stmts->AddReference.use()(referrer)(getId(j)).exec();
         }
 
         /* Check that the derivation outputs are correct.  We can't do
@@ -1192,7 +1387,7 @@ void LocalStore::invalidatePath(State & state, const StorePath & path)
        care of deleting the references entries for `path'. */
 
     {
-        auto state_(Store::state.lock());
+        auto state_(Store::state(path.hashPart()).lock());
         state_->pathInfoCache.erase(std::string(path.hashPart()));
     }
 }
@@ -1470,7 +1665,7 @@ Path LocalStore::createTempDirInStore()
            the GC between createTempDir() and addTempRoot(), so repeat
            until `tmpDir' exists. */
         tmpDir = createTempDir(realStoreDir);
-        addTempRoot(parseStorePath(tmpDir));
+        addTempRoot_(parseStorePath(tmpDir));
     } while (!pathExists(tmpDir));
     return tmpDir;
 }
@@ -1521,84 +1716,132 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
     for (auto & i : queryAllValidPaths())
         verifyPath(printStorePath(i), store, done, validPaths, repair, errors);
 
-    /* Optionally, check the content hashes (slow). */
+    /* Optionally, check the content hashes (slow). This is I/O
+       bound, so spread it over a thread pool. Repairs involve
+       substitution or rebuilding, so they are performed sequentially
+       afterwards. */
     if (checkContents) {
 
+        std::atomic<bool> corrupted{false};
+
         printInfo("checking link hashes...");
 
-        for (auto & link : readDirectory(linksDir)) {
-            printMsg(lvlTalkative, "checking contents of '%s'", link.name);
-            Path linkPath = linksDir + "/" + link.name;
-            string hash = hashPath(htSHA256, linkPath).first.to_string(Base32, false);
-            if (hash != link.name) {
-                printError("link '%s' was modified! expected hash '%s', got '%s'",
-                    linkPath, link.name, hash);
-                if (repair) {
-                    if (unlink(linkPath.c_str()) == 0)
-                        printInfo("removed link '%s'", linkPath);
-                    else
-                        throw SysError("removing corrupt link '%s'", linkPath);
-                } else {
-                    errors = true;
-                }
-            }
+        {
+            ThreadPool pool(settings.verifyJobs);
+
+            iterateLinks([&](const Path & linkPath, const std::string & name, ino_t ino) {
+                pool.enqueue([&, linkPath, name]() {
+                    checkInterrupt();
+                    printMsg(lvlTalkative, "checking contents of '%s'", name);
+                    string hash = hashPath(htSHA256, linkPath).first.to_string(Base32, false);
+                    if (hash != name) {
+                        printError("link '%s' was modified! expected hash '%s', got '%s'",
+                            linkPath, name, hash);
+                        if (repair) {
+                            if (unlink(linkPath.c_str()) == 0)
+                                printInfo("removed link '%s'", linkPath);
+                            else
+                                throw SysError("removing corrupt link '%s'", linkPath);
+                        } else {
+                            corrupted = true;
+                        }
+                    }
+                });
+            });
+
+            pool.process();
         }
 
         printInfo("checking store hashes...");
 
         Hash nullHash(htSHA256);
 
-        for (auto & i : validPaths) {
-            try {
-                auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
-
-                /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(i));
+        Sync<StorePathSet> toRepair;
 
-                auto hashSink = HashSink(info->narHash.type);
-
-                dumpPath(Store::toRealPath(i), hashSink);
-                auto current = hashSink.finish();
-
-                if (info->narHash != nullHash && info->narHash != current.first) {
-                    printError("path '%s' was modified! expected hash '%s', got '%s'",
-                        printStorePath(i), info->narHash.to_string(Base32, true), current.first.to_string(Base32, true));
-                    if (repair) repairPath(i); else errors = true;
-                } else {
-
-                    bool update = false;
-
-                    /* Fill in missing hashes. */
-                    if (info->narHash == nullHash) {
-                        printInfo("fixing missing hash on '%s'", printStorePath(i));
-                        info->narHash = current.first;
-                        update = true;
+        {
+            Activity act(*logger, actVerifyPaths);
+
+            std::atomic<size_t> done{0};
+            std::atomic<size_t> failed{0};
+            std::atomic<size_t> active{0};
+
+            auto showProgress = [&]() {
+                act.progress(done, validPaths.size(), active, failed);
+            };
+
+            ThreadPool pool(settings.verifyJobs);
+
+            for (auto & i : validPaths) {
+                pool.enqueue([&, i]() {
+                    checkInterrupt();
+
+                    MaintainCount<std::atomic<size_t>> mcActive(active);
+                    showProgress();
+
+                    try {
+                        auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
+
+                        /* Check the content hash (optionally - slow). */
+                        printMsg(lvlTalkative, "checking contents of '%s'", printStorePath(i));
+
+                        auto hashSink = HashSink(info->narHash.type);
+
+                        dumpPath(Store::toRealPath(i), hashSink);
+                        auto current = hashSink.finish();
+
+                        if (info->narHash != nullHash && info->narHash != current.first) {
+                            printError("path '%s' was modified! expected hash '%s', got '%s'",
+                                printStorePath(i), info->narHash.to_string(Base32, true), current.first.to_string(Base32, true));
+                            if (repair) toRepair.lock()->insert(i); else corrupted = true;
+                            failed++;
+                        } else {
+
+                            bool update = false;
+
+                            /* Fill in missing hashes. */
+                            if (info->narHash == nullHash) {
+                                printInfo("fixing missing hash on '%s'", printStorePath(i));
+                                info->narHash = current.first;
+                                update = true;
+                            }
+
+                            /* Fill in missing narSize fields (from old stores). */
+                            if (info->narSize == 0) {
+                                printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
+                                info->narSize = current.second;
+                                update = true;
+                            }
+
+                            if (update) {
+                                auto state(_state.lock());
+                                updatePathInfo(*state, *info);
+                            }
+
+                        }
+
+                    } catch (Error & e) {
+                        /* It's possible that the path got GC'ed, so ignore
+                           errors on invalid paths. */
+                        if (isValidPath(i))
+                            logError(e.info());
+                        else
+                            warn(e.msg());
+                        corrupted = true;
+                        failed++;
                     }
 
-                    /* Fill in missing narSize fields (from old stores). */
-                    if (info->narSize == 0) {
-                        printInfo("updating size field on '%s' to %s", printStorePath(i), current.second);
-                        info->narSize = current.second;
-                        update = true;
-                    }
+                    done++;
+                    showProgress();
+                });
+            }
 
-                    if (update) {
-                        auto state(_state.lock());
-                        updatePathInfo(*state, *info);
-                    }
+            pool.process();
+        }
 
-                }
+        for (auto & i : *toRepair.lock())
+            repairPath(i);
 
-            } catch (Error & e) {
-                /* It's possible that the path got GC'ed, so ignore
-                   errors on invalid paths. */
-                if (isValidPath(i))
-                    logError(e.info());
-                else
-                    warn(e.msg());
-                errors = true;
-            }
-        }
+        if (corrupted) errors = true;
     }
 
     return errors;
@@ -1839,6 +2082,21 @@ LocalStore::queryRealisation(const DrvOutput & id)
     });
 }
 
+std::map<DrvOutput, Realisation>
+LocalStore::queryRealisations(const std::set<DrvOutput> & ids)
+{
+    return retrySQLite<std::map<DrvOutput, Realisation>>([&]() {
+        auto state(_state.lock());
+        SQLiteTxn txn(state->db);
+        std::map<DrvOutput, Realisation> res;
+        for (auto & id : ids)
+            if (auto realisation = queryRealisation_(*state, id))
+                res.insert_or_assign(id, *realisation);
+        txn.commit();
+        return res;
+    });
+}
+
 FixedOutputHash LocalStore::hashCAPath(
     const FileIngestionMethod & method, const HashType & hashType,
     const StorePath & path)
@@ -6,6 +6,7 @@
 #include "store-api.hh"
 #include "local-fs-store.hh"
 #include "sync.hh"
+#include "pool.hh"
 #include "util.hh"
 
 #include <chrono>
@@ -61,6 +62,9 @@ private:
         /* The file to which we write our temporary roots. */
         AutoCloseFD fdTempRoots;
 
+        /* The temporary roots already written to 'fdTempRoots'. */
+        StorePathSet tempRoots;
+
         /* The last time we checked whether to do an auto-GC, or an
            auto-GC finished. */
         std::chrono::time_point<std::chrono::steady_clock> lastGCCheck;
@@ -77,14 +81,24 @@ private:
         uint64_t availAfterGC = std::numeric_limits<uint64_t>::max();
 
         std::unique_ptr<PublicKeys> publicKeys;
+
+        /* Paths used since the last write to the PathUsage table. */
+        StorePathSet usedPaths;
     };
 
     Sync<State> _state;
 
+    /* Read-only database connections used by queryPathInfo() and
+       isValidPath() in WAL mode. Readers don't block each other or
+       the writer there, so they don't need to take the state lock. */
+    struct ReadConnection;
+    std::unique_ptr<Pool<ReadConnection>> readConnections;
+
 public:
 
     const Path dbDir;
     const Path linksDir;
+    const Path optimisedPath;
     const Path reservedPath;
     const Path schemaPath;
     const Path trashDir;
@@ -112,6 +126,10 @@ public:
 
     bool isValidPathUncached(const StorePath & path) override;
 
+    void computeFSClosure(const StorePathSet & paths,
+        StorePathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
     StorePathSet queryValidPaths(const StorePathSet & paths,
         SubstituteFlag maybeSubstitute = NoSubstitute) override;
 
@@ -206,6 +224,7 @@ public:
     std::optional<const Realisation> queryRealisation_(State & state, const DrvOutput & id);
     std::optional<std::pair<int64_t, Realisation>> queryRealisationCore_(State & state, const DrvOutput & id);
     std::optional<const Realisation> queryRealisation(const DrvOutput&) override;
+    std::map<DrvOutput, Realisation> queryRealisations(const std::set<DrvOutput> & ids) override;
 
 private:
 
@@ -213,6 +232,13 @@ private:
 
     void openDB(State & state, bool create);
 
+    /* Write the last-use times of 'state.usedPaths' to the
+       database. */
+    void flushPathUsage(State & state);
+
+    /* Like addTempRoot(), but doesn't count as a use of 'path'. */
+    void addTempRoot_(const StorePath & path);
+
     void makeStoreWritable();
 
     uint64_t queryValidPathId(State & state, const StorePath & path);
@@ -229,6 +255,9 @@ private:
 
     std::shared_ptr<const ValidPathInfo> queryPathInfoInternal(State & state, const StorePath & path);
 
+    std::shared_ptr<const ValidPathInfo> queryPathInfoInternal(
+        SQLiteStmt & queryPathInfo, SQLiteStmt & queryReferences, const StorePath & path);
+
     void updatePathInfo(State & state, const ValidPathInfo & info);
 
     void upgradeStore6();
@@ -240,9 +269,13 @@ private:
 
     void deleteGarbage(GCState & state, const Path & path);
 
+    void deleteTrash(GCState & state);
+
     void tryToDelete(GCState & state, const Path & path);
 
-    bool canReachRoot(GCState & state, StorePathSet & visited, const StorePath & path);
+    bool canReachRoot(GCState & state, StorePathHashSet & visited, const StorePath & path);
+
+    void markLivePaths(GCState & state);
 
     void deletePathRecursive(GCState & state, const Path & path);
 
@@ -263,11 +296,26 @@ private:
 
     void checkDerivationOutputs(const StorePath & drvPath, const Derivation & drv);
 
+    /* Links are stored in '.links/<first two characters of the
+       hash>/<hash>'. Older versions of Nix put them directly in
+       '.links'; such links are still recognised and are moved to
+       their sharded location when encountered. */
+    Path linkPathFor(std::string_view hash) const;
+    Path legacyLinkPathFor(std::string_view hash) const;
+
+    /* Call 'f' on every link in 'linksDir' (sharded or legacy),
+       reading one directory at a time. */
+    void iterateLinks(std::function<void(const Path & linkPath, const std::string & hash, ino_t ino)> f);
+
+    /* Move a link from its legacy location to its sharded
+       location. */
+    void migrateLink(const Path & legacyPath, const Path & linkPath);
+
     typedef std::unordered_set<ino_t> InodeHash;
 
     InodeHash loadInodeHash();
-    Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
+    Strings readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash);
+    void optimisePath_(Activity * act, Sync<OptimiseStats> & stats, const Path & path, Sync<InodeHash> & inodeHash);
 
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(State & state, const StorePath & path);
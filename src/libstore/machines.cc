@@ -54,6 +54,22 @@ bool Machine::mandatoryMet(const std::set<string> & features) const {
         });
 }
 
+const std::vector<Machine *> & MachineIndex::get(const std::string & system, const std::set<string> & features)
+{
+    auto key = std::make_pair(system, features);
+    auto i = cache.find(key);
+    if (i != cache.end()) return i->second;
+
+    std::vector<Machine *> res;
+    for (auto & m : machines)
+        if (std::find(m.systemTypes.begin(), m.systemTypes.end(), system) != m.systemTypes.end()
+            && m.allSupported(features)
+            && m.mandatoryMet(features))
+            res.push_back(&m);
+
+    return cache.emplace(std::move(key), std::move(res)).first->second;
+}
+
 ref<Store> Machine::openStore() const {
     Store::Params storeParams;
     if (hasPrefix(storeUri, "ssh://")) {
@@ -36,6 +36,24 @@ struct Machine {
 
 typedef std::vector<Machine> Machines;
 
+/* Memoised lookup of the machines that can build a derivation for a
+   given system with a given set of required features. A build hook
+   sees the same few combinations over and over, so this avoids
+   rechecking every machine for every derivation. */
+struct MachineIndex
+{
+    MachineIndex(Machines & machines) : machines(machines) { }
+
+    /* Return the machines that support `system' and `features', in the
+       order in which they are listed. Whether a machine is enabled is
+       not taken into account, since that can change. */
+    const std::vector<Machine *> & get(const std::string & system, const std::set<string> & features);
+
+private:
+    Machines & machines;
+    std::map<std::pair<std::string, std::set<string>>, std::vector<Machine *>> cache;
+};
+
 void parseMachines(const std::string & s, Machines & machines);
 
 Machines getMachines();
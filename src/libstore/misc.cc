@@ -7,6 +7,7 @@
 #include "topo-sort.hh"
 #include "callback.hh"
 #include "closure.hh"
+#include "filetransfer.hh"
 
 namespace nix {
 
@@ -100,7 +101,12 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
 
     downloadSize_ = narSize_ = 0;
 
-    ThreadPool pool;
+    /* Most of the time is spent waiting for substituters to answer
+       narinfo queries, so allow as many of them to be in flight as
+       we have HTTP connections, rather than one per core. */
+    ThreadPool pool(settings.useSubstitutes
+        ? std::max((size_t) std::thread::hardware_concurrency(), fileTransferSettings.httpConnections.get())
+        : 0);
 
     struct State
     {
@@ -122,6 +128,17 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
 
     std::function<void(DerivedPath)> doPath;
 
+    /* Enqueue 'req' unless it was seen before. Checking this here
+       rather than in doPath() keeps duplicates (e.g. references
+       shared by many paths) out of the thread pool's queue. */
+    auto enqueuePath = [&](DerivedPath req) {
+        {
+            auto state(state_.lock());
+            if (!state->done.insert(req.to_string(*this)).second) return;
+        }
+        pool.enqueue([&doPath, req{std::move(req)}]() { doPath(req); });
+    };
+
     auto mustBuildDrv = [&](const StorePath & drvPath, const Derivation & drv) {
         {
             auto state(state_.lock());
@@ -129,7 +146,7 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
         }
 
         for (auto & i : drv.inputDrvs)
-            pool.enqueue(std::bind(doPath, DerivedPath::Built { i.first, i.second }));
+            enqueuePath(DerivedPath::Built { i.first, i.second });
     };
 
     auto checkOutput = [&](
@@ -152,7 +169,7 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
                 drvState->outPaths.insert(outPath);
                 if (!drvState->left) {
                     for (auto & path : drvState->outPaths)
-                        pool.enqueue(std::bind(doPath, DerivedPath::Opaque { path } ));
+                        enqueuePath(DerivedPath::Opaque { path });
                 }
             }
         }
@@ -160,11 +177,6 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
 
     doPath = [&](const DerivedPath & req) {
 
-        {
-            auto state(state_.lock());
-            if (!state->done.insert(req.to_string(*this)).second) return;
-        }
-
         std::visit(overloaded {
           [&](DerivedPath::Built bfd) {
             if (!isValidPath(bfd.drvPath)) {
@@ -194,7 +206,9 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
             if (knownOutputPaths && settings.useSubstitutes && parsedDrv.substitutesAllowed()) {
                 auto drvState = make_ref<Sync<DrvState>>(DrvState(invalid.size()));
                 for (auto & output : invalid)
-                    pool.enqueue(std::bind(checkOutput, bfd.drvPath, drv, output, drvState));
+                    pool.enqueue([&checkOutput, drvPath{bfd.drvPath}, drv, output, drvState]() {
+                        checkOutput(drvPath, drv, output, drvState);
+                    });
             } else
                 mustBuildDrv(bfd.drvPath, *drv);
 
@@ -223,13 +237,13 @@ void Store::queryMissing(const std::vector<DerivedPath> & targets,
             }
 
             for (auto & ref : info->second.references)
-                pool.enqueue(std::bind(doPath, DerivedPath::Opaque { ref }));
+                enqueuePath(DerivedPath::Opaque { ref });
           },
         }, req.raw());
     };
 
     for (auto & path : targets)
-        pool.enqueue(std::bind(doPath, path));
+        enqueuePath(path);
 
     pool.process();
 }
@@ -137,6 +137,8 @@ struct NarAccessor : public FSAccessor
                 member.type = FSAccessor::Type::tRegular;
                 member.size = v["size"];
                 member.isExecutable = v.value("executable", false);
+                if (!v.contains("narOffset"))
+                    throw Error("NAR listing lacks the offset of a file");
                 member.start = v["narOffset"];
             } else if (type == "symlink") {
                 member.type = FSAccessor::Type::tSymlink;
@@ -62,6 +62,17 @@ public:
     /* How often to purge expired entries from the cache. */
     const int purgeInterval = 24 * 3600;
 
+    /* Maximum number and age (in seconds) of NAR info entries that
+       are kept in memory before they are written to the database in
+       a single transaction. There is no timer: the limits are checked
+       whenever NAR info is added or looked up, so entries can stay
+       in memory longer while the cache is idle, and are written at
+       the latest when the cache is destroyed. (A flusher thread
+       would not survive the forks done by the daemon and build
+       helpers.) */
+    const size_t maxPendingNarInfos = 100;
+    const int maxPendingAge = 1;
+
     struct Cache
     {
         int id;
@@ -77,6 +88,11 @@ public:
             queryNAR, insertRealisation, insertMissingRealisation,
             queryRealisation, purgeCache;
         std::map<std::string, Cache> caches;
+
+        /* NAR info entries not written to the database yet, keyed by
+           cache URI and hash part. Lookups check these first. */
+        std::map<std::pair<std::string, std::string>, std::shared_ptr<const ValidPathInfo>> pendingNarInfos;
+        time_t oldestPending = 0;
     };
 
     Sync<State> _state;
@@ -156,6 +172,42 @@ public:
         });
     }
 
+    ~NarInfoDiskCacheImpl()
+    {
+        try {
+            auto state(_state.lock());
+            flushPending(*state);
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    /* Write all pending NAR info entries in one transaction. */
+    void flushPending(State & state)
+    {
+        if (state.pendingNarInfos.empty()) return;
+
+        retrySQLite<void>([&]() {
+            SQLiteTxn txn(state.db);
+
+            for (auto & [key, info] : state.pendingNarInfos)
+                upsertNarInfo(state, getCache(state, key.first), key.second, info);
+
+            txn.commit();
+        });
+
+        state.pendingNarInfos.clear();
+        state.oldestPending = 0;
+    }
+
+    void flushPendingIfDue(State & state, time_t now)
+    {
+        if (!state.pendingNarInfos.empty()
+            && (state.pendingNarInfos.size() >= maxPendingNarInfos
+                || now - state.oldestPending >= maxPendingAge))
+            flushPending(state);
+    }
+
     Cache & getCache(State & state, const std::string & uri)
     {
         auto i = state.caches.find(uri);
@@ -210,6 +262,18 @@ public:
 
             auto now = time(0);
 
+            flushPendingIfDue(*state, now);
+
+            auto i = state->pendingNarInfos.find({uri, hashPart});
+            if (i != state->pendingNarInfos.end()) {
+                if (!i->second)
+                    return {oInvalid, 0};
+                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(i->second);
+                return {oValid, narInfo
+                    ? std::make_shared<NarInfo>(*narInfo)
+                    : std::make_shared<NarInfo>(*i->second)};
+            }
+
             auto queryNAR(state->queryNAR.use()
                 (cache.id)
                 (hashPart)
@@ -280,40 +344,63 @@ public:
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) override
     {
-        retrySQLite<void>([&]() {
-            auto state(_state.lock());
+        auto state(_state.lock());
 
-            auto & cache(getCache(*state, uri));
+        getCache(*state, uri);
 
-            if (info) {
-
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
-
-                //assert(hashPart == storePathToHash(info->path));
-
-                state->insertNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (std::string(info->path.name()))
-                    (narInfo ? narInfo->url : "", narInfo != 0)
-                    (narInfo ? narInfo->compression : "", narInfo != 0)
-                    (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(Base32, true) : "", narInfo && narInfo->fileHash)
-                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
-                    (info->narHash.to_string(Base32, true))
-                    (info->narSize)
-                    (concatStringsSep(" ", info->shortRefs()))
-                    (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
-                    (concatStringsSep(" ", info->sigs))
-                    (renderContentAddress(info->ca))
-                    (time(0)).exec();
-
-            } else {
-                state->insertMissingNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (time(0)).exec();
-            }
-        });
+        auto now = time(0);
+
+        state->pendingNarInfos.insert_or_assign({uri, hashPart}, info);
+        if (!state->oldestPending) state->oldestPending = now;
+
+        flushPendingIfDue(*state, now);
+    }
+
+    void upsertNarInfos(
+        const std::string & uri,
+        const std::map<std::string, std::shared_ptr<const ValidPathInfo>> & infos) override
+    {
+        auto state(_state.lock());
+
+        getCache(*state, uri);
+
+        for (auto & [hashPart, info] : infos)
+            state->pendingNarInfos.insert_or_assign({uri, hashPart}, info);
+
+        flushPending(*state);
+    }
+
+    void upsertNarInfo(State & state, Cache & cache, const std::string & hashPart,
+        std::shared_ptr<const ValidPathInfo> info)
+    {
+        if (info) {
+
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+
+            //assert(hashPart == storePathToHash(info->path));
+
+            state.insertNAR.use()
+                (cache.id)
+                (hashPart)
+                (std::string(info->path.name()))
+                (narInfo ? narInfo->url : "", narInfo != 0)
+                (narInfo ? narInfo->compression : "", narInfo != 0)
+                (narInfo && narInfo->fileHash ? narInfo->fileHash->to_string(Base32, true) : "", narInfo && narInfo->fileHash)
+                (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
+                (info->narHash.to_string(Base32, true))
+                (info->narSize)
+                (concatStringsSep(" ", info->shortRefs()))
+                (info->deriver ? std::string(info->deriver->to_string()) : "", (bool) info->deriver)
+                (concatStringsSep(" ", info->sigs))
+                (renderContentAddress(info->ca))
+                (time(0)).exec();
+
+        } else {
+            state.insertMissingNAR.use()
+                (cache.id)
+                (hashPart)
+                (time(0)).exec();
+        }
     }
 
     void upsertRealisation(
@@ -31,6 +31,12 @@ public:
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) = 0;
 
+    /* Insert many entries, mapping hash parts to path info (or null
+       if the path is known not to exist), in a single transaction. */
+    virtual void upsertNarInfos(
+        const std::string & uri,
+        const std::map<std::string, std::shared_ptr<const ValidPathInfo>> & infos) = 0;
+
     virtual void upsertRealisation(
         const std::string & uri,
         const Realisation & realisation) = 0;
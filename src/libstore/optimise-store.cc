@@ -1,15 +1,25 @@
 #include "util.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "finally.hh"
+#include "thread-pool.hh"
 
 #include <cstdlib>
 #include <cstring>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <regex>
+#include <atomic>
+
+#if __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
 
 namespace nix {
@@ -39,21 +49,174 @@ struct MakeReadOnly
 };
 
 
-LocalStore::InodeHash LocalStore::loadInodeHash()
+#ifdef FIDEDUPERANGE
+enum class ShareResult {
+    Shared,
+    /* The file system doesn't support sharing extents at all. */
+    Unsupported,
+    /* The file system didn't share the extents of this file. */
+    Failed,
+};
+
+/* Make the data extents of 'path' shared with those of 'linkPath',
+   which must have the same contents. */
+static ShareResult shareExtents(const Path & linkPath, const Path & path, off_t size)
 {
-    debug("loading hash inodes in memory");
-    InodeHash inodeHash;
+    AutoCloseFD src = open(linkPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!src) throw SysError("opening '%1%'", linkPath);
+
+    AutoCloseFD dst = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!dst) throw SysError("opening '%1%'", path);
+
+    std::vector<char> buf(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+    auto range = (struct file_dedupe_range *) buf.data();
+
+    off_t offset = 0;
+    while (offset < size) {
+        checkInterrupt();
+
+        memset(buf.data(), 0, buf.size());
+        range->src_offset = offset;
+        range->src_length = size - offset;
+        range->dest_count = 1;
+        range->info[0].dest_fd = dst.get();
+        range->info[0].dest_offset = offset;
+
+        if (ioctl(src.get(), FIDEDUPERANGE, range) == -1) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV)
+                return ShareResult::Unsupported;
+            /* E.g. an immutable file, or a range the file system
+               won't deduplicate. */
+            if (errno == EPERM || errno == EINVAL)
+                return ShareResult::Failed;
+            throw SysError("sharing extents of '%1%' with '%2%'", path, linkPath);
+        }
+
+        auto & info = range->info[0];
+        if (info.status == FILE_DEDUPE_RANGE_DIFFERS)
+            throw Error("'%1%' and '%2%' have different contents", path, linkPath);
+        if (info.status < 0) {
+            errno = -info.status;
+            if (errno == EOPNOTSUPP)
+                return ShareResult::Unsupported;
+            if (errno == EPERM || errno == EINVAL)
+                return ShareResult::Failed;
+            throw SysError("sharing extents of '%1%' with '%2%'", path, linkPath);
+        }
+
+        /* The kernel may process less than the requested range per
+           call, but if it does nothing, the rest isn't shared. */
+        if (info.bytes_deduped == 0)
+            return ShareResult::Failed;
+        offset += info.bytes_deduped;
+    }
+
+    return ShareResult::Shared;
+}
+
+
+/* Whether all data extents of 'path' are shared with another file,
+   e.g. because an earlier run of shareExtents() shared them. */
+static bool extentsShared(const Path & path)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) return false;
+
+    const unsigned int maxExtents = 32;
+    std::vector<char> buf(sizeof(struct fiemap) + maxExtents * sizeof(struct fiemap_extent));
+    auto map = (struct fiemap *) buf.data();
+
+    uint64_t start = 0;
+    while (true) {
+        memset(buf.data(), 0, buf.size());
+        map->fm_start = start;
+        map->fm_length = FIEMAP_MAX_OFFSET - start;
+        map->fm_extent_count = maxExtents;
+
+        if (ioctl(fd.get(), FS_IOC_FIEMAP, map) == -1 || map->fm_mapped_extents == 0)
+            return false;
+
+        for (unsigned int n = 0; n < map->fm_mapped_extents; n++) {
+            auto & extent = map->fm_extents[n];
+            if (!(extent.fe_flags & FIEMAP_EXTENT_SHARED))
+                return false;
+            if (extent.fe_flags & FIEMAP_EXTENT_LAST)
+                return true;
+        }
+
+        auto & last = map->fm_extents[map->fm_mapped_extents - 1];
+        start = last.fe_logical + last.fe_length;
+    }
+}
+#endif
+
+
+Path LocalStore::linkPathFor(std::string_view hash) const
+{
+    return linksDir + "/" + std::string(hash.substr(0, 2)) + "/" + std::string(hash);
+}
+
+
+Path LocalStore::legacyLinkPathFor(std::string_view hash) const
+{
+    return linksDir + "/" + std::string(hash);
+}
+
 
-    AutoCloseDir dir(opendir(linksDir.c_str()));
-    if (!dir) throw SysError("opening directory '%1%'", linksDir);
+static void readLinksDirectory(const Path & dirPath,
+    std::function<void(const std::string & name, ino_t ino)> f)
+{
+    AutoCloseDir dir(opendir(dirPath.c_str()));
+    if (!dir) throw SysError("opening directory '%1%'", dirPath);
 
     struct dirent * dirent;
     while (errno = 0, dirent = readdir(dir.get())) { /* sic */
         checkInterrupt();
-        // We don't care if we hit non-hash files, anything goes
-        inodeHash.insert(dirent->d_ino);
+        std::string name = dirent->d_name;
+        if (name == "." || name == "..") continue;
+        f(name, dirent->d_ino);
     }
-    if (errno) throw SysError("reading directory '%1%'", linksDir);
+    if (errno) throw SysError("reading directory '%1%'", dirPath);
+}
+
+
+void LocalStore::iterateLinks(std::function<void(const Path & linkPath, const std::string & hash, ino_t ino)> f)
+{
+    readLinksDirectory(linksDir, [&](const std::string & name, ino_t ino) {
+        /* Hashes are much longer than two characters, so this is a
+           shard directory. */
+        if (name.size() == 2) {
+            auto shardDir = linksDir + "/" + name;
+            readLinksDirectory(shardDir, [&](const std::string & hash, ino_t ino) {
+                f(shardDir + "/" + hash, hash, ino);
+            });
+        } else
+            f(linksDir + "/" + name, name, ino);
+    });
+}
+
+
+void LocalStore::migrateLink(const Path & legacyPath, const Path & linkPath)
+{
+    if (mkdir(dirOf(linkPath).c_str(), 0755) == -1 && errno != EEXIST)
+        throw SysError("creating directory '%1%'", dirOf(linkPath));
+
+    /* If another process migrated or created it first, the rename
+       still atomically replaces it with an identical file. */
+    if (rename(legacyPath.c_str(), linkPath.c_str()) == -1 && errno != ENOENT)
+        throw SysError("moving '%1%' to '%2%'", legacyPath, linkPath);
+}
+
+
+LocalStore::InodeHash LocalStore::loadInodeHash()
+{
+    debug("loading hash inodes in memory");
+    InodeHash inodeHash;
+
+    // We don't care if we hit non-hash files, anything goes
+    iterateLinks([&](const Path & linkPath, const std::string & hash, ino_t ino) {
+        inodeHash.insert(ino);
+    });
 
     printMsg(lvlTalkative, format("loaded %1% hash inodes") % inodeHash.size());
 
@@ -61,7 +224,7 @@ LocalStore::InodeHash LocalStore::loadInodeHash()
 }
 
 
-Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash)
+Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, Sync<InodeHash> & inodeHash)
 {
     Strings names;
 
@@ -72,7 +235,7 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
     while (errno = 0, dirent = readdir(dir.get())) { /* sic */
         checkInterrupt();
 
-        if (inodeHash.count(dirent->d_ino)) {
+        if (inodeHash.lock()->count(dirent->d_ino)) {
             debug(format("'%1%' is already linked") % dirent->d_name);
             continue;
         }
@@ -87,8 +250,8 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
 }
 
 
-void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash)
+void LocalStore::optimisePath_(Activity * act, Sync<OptimiseStats> & stats,
+    const Path & path, Sync<InodeHash> & inodeHash)
 {
     checkInterrupt();
 
@@ -130,12 +293,26 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         return;
     }
 
-    /* This can still happen on top-level files. */
-    if (st.st_nlink > 1 && inodeHash.count(st.st_ino)) {
-        debug("'%s' is already linked, with %d other file(s)", path, st.st_nlink - 2);
+    /* This can still happen on top-level files. Files whose extents
+       were shared earlier in this run are also in `inodeHash'. */
+    if (inodeHash.lock()->count(st.st_ino)) {
+        debug("'%s' is already linked or shares its extents", path);
         return;
     }
 
+#ifdef FIDEDUPERANGE
+    /* Files whose extents were shared by an earlier run still have a
+       link count of 1, so recognise them by their extents rather than
+       hashing and sharing them again. */
+    if (settings.optimiseShareExtents && S_ISREG(st.st_mode) && st.st_nlink == 1
+        && st.st_size && extentsShared(path))
+    {
+        debug("'%s' already shares its extents", path);
+        inodeHash.lock()->insert(st.st_ino);
+        return;
+    }
+#endif
+
     /* Hash the file.  Note that hashPath() returns the hash over the
        NAR serialisation, which includes the execute bit on the file.
        Thus, executable and non-executable files with the same
@@ -149,17 +326,35 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     debug(format("'%1%' has hash '%2%'") % path % hash.to_string(Base32, true));
 
     /* Check if this is a known hash. */
-    Path linkPath = linksDir + "/" + hash.to_string(Base32, false);
+    auto hashStr = hash.to_string(Base32, false);
+    Path linkPath = linkPathFor(hashStr);
 
  retry:
     if (!pathExists(linkPath)) {
+        /* Pick up a link created by an older version of Nix. */
+        auto legacyPath = legacyLinkPathFor(hashStr);
+        if (pathExists(legacyPath)) {
+            migrateLink(legacyPath, linkPath);
+            goto retry;
+        }
+
         /* Nope, create a hard link in the links directory. */
         if (link(path.c_str(), linkPath.c_str()) == 0) {
-            inodeHash.insert(st.st_ino);
+            inodeHash.lock()->insert(st.st_ino);
             return;
         }
 
         switch (errno) {
+        case ENOENT:
+            /* The shard directory may not exist yet. */
+            if (!pathExists(dirOf(linkPath))) {
+                if (mkdir(dirOf(linkPath).c_str(), 0755) == -1 && errno != EEXIST)
+                    throw SysError("creating directory '%1%'", dirOf(linkPath));
+                goto retry;
+            }
+            errno = ENOENT;
+            throw SysError("cannot link '%1%' to '%2%'", linkPath, path);
+
         case EEXIST:
             /* Fall through if another process created ‘linkPath’ before
                we did. */
@@ -193,6 +388,42 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         goto retry;
     }
 
+#ifdef FIDEDUPERANGE
+    /* Share the data extents instead of hard-linking, if requested.
+       If the file system turns out not to support this, use hard
+       links for the rest of this process. */
+    static std::atomic<bool> shareExtentsUnsupported{false};
+    if (settings.optimiseShareExtents && S_ISREG(st.st_mode) && !shareExtentsUnsupported) {
+        /* Nothing to gain for empty files. */
+        if (st.st_size == 0) return;
+
+        printMsg(lvlTalkative, "sharing extents of '%s' with '%s'", path, linkPath);
+
+        switch (shareExtents(linkPath, path, st.st_size)) {
+        case ShareResult::Shared:
+            inodeHash.lock()->insert(st.st_ino);
+            {
+                auto stats_(stats.lock());
+                stats_->filesLinked++;
+                stats_->bytesFreed += st.st_size;
+                stats_->blocksFreed += st.st_blocks;
+            }
+            if (act)
+                act->result(resFileLinked, st.st_size, st.st_blocks);
+            return;
+
+        case ShareResult::Unsupported:
+            if (!shareExtentsUnsupported.exchange(true))
+                warn("file system does not support sharing extents; using hard links instead");
+            break;
+
+        case ShareResult::Failed:
+            debug("cannot share extents of '%s', hard-linking it instead", path);
+            break;
+        }
+    }
+#endif
+
     printMsg(lvlTalkative, format("linking '%1%' to '%2%'") % path % linkPath);
 
     /* Make the containing directory writable, but only if it's not
@@ -205,8 +436,11 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
        its timestamp back to 0. */
     MakeReadOnly makeReadOnly(mustToggle ? dirOf(path) : "");
 
-    Path tempLink = (format("%1%/.tmp-link-%2%-%3%")
-        % realStoreDir % getpid() % random()).str();
+    /* The counter keeps names unique between the threads of a
+       parallel optimiseStore() run. */
+    static std::atomic<uint64_t> tempLinkCounter{0};
+    Path tempLink = fmt("%s/.tmp-link-%d-%d-%d",
+        realStoreDir, getpid(), tempLinkCounter++, random());
 
     if (link(linkPath.c_str(), tempLink.c_str()) == -1) {
         if (errno == EMLINK) {
@@ -235,9 +469,12 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         throw SysError("cannot rename '%1%' to '%2%'", tempLink, path);
     }
 
-    stats.filesLinked++;
-    stats.bytesFreed += st.st_size;
-    stats.blocksFreed += st.st_blocks;
+    {
+        auto stats_(stats.lock());
+        stats_->filesLinked++;
+        stats_->bytesFreed += st.st_size;
+        stats_->blocksFreed += st.st_blocks;
+    }
 
     if (act)
         act->result(resFileLinked, st.st_size, st.st_blocks);
@@ -248,23 +485,60 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
 {
     Activity act(*logger, actOptimiseStore);
 
-    auto paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+    /* Only look at paths registered after the last complete run.
+       Path IDs are never reused, so anything with a higher ID than
+       the one recorded in 'optimisedPath' has not been optimised yet
+       (unless auto-optimise-store did it already, in which case
+       the files are found in the inode hash and skipped cheaply).
+       Delete that file to force a full pass. */
+    int64_t lastId = 0;
+    if (pathExists(optimisedPath)) {
+        auto s = trim(readFile(optimisedPath));
+        if (auto n = string2Int<int64_t>(s))
+            lastId = *n;
+        else
+            warn("ignoring corrupt file '%s'", optimisedPath);
+    }
+
+    auto paths = retrySQLite<std::vector<std::pair<int64_t, StorePath>>>([&]() {
+        auto state(_state.lock());
+        SQLiteStmt stmt(state->db, "select id, path from ValidPaths where id > ? order by id");
+        auto use(stmt.use()(lastId));
+        std::vector<std::pair<int64_t, StorePath>> res;
+        while (use.next())
+            res.emplace_back(use.getInt(0), parseStorePath(use.getStr(1)));
+        return res;
+    });
+
+    if (paths.empty()) {
+        printMsg(lvlTalkative, "no store paths were added since the last optimisation");
+        return;
+    }
+
+    Sync<InodeHash> inodeHash(loadInodeHash());
+    Sync<OptimiseStats> stats_(stats);
+
+    Finally updateStats([&]() { stats = *stats_.lock(); });
 
     act.progress(0, paths.size());
 
-    uint64_t done = 0;
+    std::atomic<uint64_t> done{0};
 
-    for (auto & i : paths) {
-        addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
-            optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash);
-        }
-        done++;
-        act.progress(done, paths.size());
-    }
+    ThreadPool pool;
+
+    for (auto & i : paths)
+        pool.enqueue([&, path(i.second)]() {
+            addTempRoot_(path);
+            if (isValidPath(path)) { /* otherwise, path was GC'ed, probably */
+                Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(path)));
+                optimisePath_(&act, stats_, realStoreDir + "/" + std::string(path.to_string()), inodeHash);
+            }
+            act.progress(++done, paths.size());
+        });
+
+    pool.process();
+
+    writeFile(optimisedPath, fmt("%d", paths.back().first));
 }
 
 void LocalStore::optimiseStore()
@@ -280,8 +554,8 @@ void LocalStore::optimiseStore()
 
 void LocalStore::optimisePath(const Path & path)
 {
-    OptimiseStats stats;
-    InodeHash inodeHash;
+    Sync<OptimiseStats> stats;
+    Sync<InodeHash> inodeHash;
 
     if (settings.autoOptimiseStore) optimisePath_(nullptr, stats, path, inodeHash);
 }
@@ -43,6 +43,16 @@ StorePath StorePath::dummy("ffffffffffffffffffffffffffffffff-x");
 
 StorePath Store::parseStorePath(std::string_view path) const
 {
+    /* Fast path for paths that are already canonical, which is almost
+       all of them: a store path is the store directory followed by a
+       single component, and that component can't be '.' or '..'
+       since it starts with a hash. */
+    if (path.size() > storeDir.size() + 1
+        && hasPrefix(path, storeDir)
+        && path[storeDir.size()] == '/'
+        && path.find('/', storeDir.size() + 1) == path.npos)
+        return StorePath(path.substr(storeDir.size() + 1));
+
     auto p = canonPath(std::string(path));
     if (dirOf(p) != storeDir)
         throw BadStorePath("path '%s' is not in the Nix store", p);
@@ -72,7 +82,13 @@ StorePathSet Store::parseStorePathSet(const PathSet & paths) const
 
 std::string Store::printStorePath(const StorePath & path) const
 {
-    return (storeDir + "/").append(path.to_string());
+    auto baseName = path.to_string();
+    std::string s;
+    s.reserve(storeDir.size() + 1 + baseName.size());
+    s += storeDir;
+    s += '/';
+    s += baseName;
+    return s;
 }
 
 PathSet Store::printStorePathSet(const StorePathSet & paths) const
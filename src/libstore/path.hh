@@ -3,6 +3,8 @@
 #include "content-address.hh"
 #include "types.hh"
 
+#include <unordered_set>
+
 namespace nix {
 
 class Store;
@@ -81,3 +83,13 @@ template<> struct hash<nix::StorePath> {
 };
 
 }
+
+namespace nix {
+
+/* An unordered set of store paths. Since the hash part of a store
+   path is already random, hashing it is cheaper than the string
+   comparisons of a StorePathSet, so use this for large sets that are
+   only used for membership tests. */
+typedef std::unordered_set<StorePath> StorePathHashSet;
+
+}
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 
@@ -15,13 +16,16 @@ namespace nix {
 
 /* Parse a generation name of the format
    `<profilename>-<number>-link'. */
-static std::optional<GenerationNumber> parseName(const string & profileName, const string & name)
+static std::optional<GenerationNumber> parseName(std::string_view profileName, std::string_view name)
 {
-    if (string(name, 0, profileName.size() + 1) != profileName + "-") return {};
-    string s = string(name, profileName.size() + 1);
-    string::size_type p = s.find("-link");
-    if (p == string::npos) return {};
-    if (auto n = string2Int<unsigned int>(s.substr(0, p)))
+    if (name.size() <= profileName.size()
+        || name.substr(0, profileName.size()) != profileName
+        || name[profileName.size()] != '-')
+        return {};
+    auto s = name.substr(profileName.size() + 1);
+    auto p = s.find("-link");
+    if (p == s.npos) return {};
+    if (auto n = string2Int<unsigned int>(std::string(s.substr(0, p))))
         return *n;
     else
         return {};
@@ -29,20 +33,40 @@ static std::optional<GenerationNumber> parseName(const string & profileName, con
 
 
 
-std::pair<Generations, std::optional<GenerationNumber>> findGenerations(Path profile)
+/* Like the public findGenerations(), but only stat the generation
+   links if their creation time is needed. The deletion functions
+   below don't use it, which saves a system call per generation. */
+static std::pair<Generations, std::optional<GenerationNumber>> findGenerations(
+    const Path & profile, bool withCreationTime)
 {
     Generations gens;
 
     Path profileDir = dirOf(profile);
     auto profileName = std::string(baseNameOf(profile));
 
+    AutoCloseFD dirFd;
+    if (withCreationTime) {
+        dirFd = open(profileDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (!dirFd)
+            throw SysError("opening directory '%1%'", profileDir);
+    }
+
     for (auto & i : readDirectory(profileDir)) {
         if (auto n = parseName(profileName, i.name)) {
             auto path = profileDir + "/" + i.name;
+            time_t creationTime = 0;
+            if (withCreationTime) {
+                /* Stat relative to the directory, to avoid resolving
+                   the full path of every generation. */
+                struct stat st;
+                if (fstatat(dirFd.get(), i.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    throw SysError("getting status of '%1%'", path);
+                creationTime = st.st_mtime;
+            }
             gens.push_back({
                 .number = *n,
-                .path = path,
-                .creationTime = lstat(path).st_mtime
+                .path = std::move(path),
+                .creationTime = creationTime
             });
         }
     }
@@ -61,6 +85,12 @@ std::pair<Generations, std::optional<GenerationNumber>> findGenerations(Path pro
 }
 
 
+std::pair<Generations, std::optional<GenerationNumber>> findGenerations(Path profile)
+{
+    return findGenerations(profile, true);
+}
+
+
 static void makeName(const Path & profile, GenerationNumber num,
     Path & outLink)
 {
@@ -73,7 +103,7 @@ Path createGeneration(ref<LocalFSStore> store, Path profile, StorePath outPath)
 {
     /* The new generation number should be higher than old the
        previous ones. */
-    auto [gens, dummy] = findGenerations(profile);
+    auto [gens, dummy] = findGenerations(profile, false);
 
     GenerationNumber num;
     if (gens.size() > 0) {
@@ -139,7 +169,7 @@ void deleteGenerations(const Path & profile, const std::set<GenerationNumber> &
     PathLocks lock;
     lockProfile(lock, profile);
 
-    auto [gens, curGen] = findGenerations(profile);
+    auto [gens, curGen] = findGenerations(profile, false);
 
     if (gensToDelete.count(*curGen))
         throw Error("cannot delete current generation of profile %1%'", profile);
@@ -156,7 +186,7 @@ void deleteGenerationsGreaterThan(const Path & profile, GenerationNumber max, bo
     lockProfile(lock, profile);
 
     bool fromCurGen = false;
-    auto [gens, curGen] = findGenerations(profile);
+    auto [gens, curGen] = findGenerations(profile, false);
     for (auto i = gens.rbegin(); i != gens.rend(); ++i) {
         if (i->number == curGen) {
             fromCurGen = true;
@@ -178,7 +208,7 @@ void deleteOldGenerations(const Path & profile, bool dryRun)
     PathLocks lock;
     lockProfile(lock, profile);
 
-    auto [gens, curGen] = findGenerations(profile);
+    auto [gens, curGen] = findGenerations(profile, false);
 
     for (auto & i : gens)
         if (i.number != curGen)
@@ -32,13 +32,17 @@ std::set<Realisation> Realisation::closure(Store & store, const std::set<Realisa
 void Realisation::closure(Store & store, const std::set<Realisation> & startOutputs, std::set<Realisation> & res)
 {
     auto getDeps = [&](const Realisation& current) -> std::set<Realisation> {
+        std::set<DrvOutput> deps;
+        for (auto& [currentDep, _] : current.dependentRealisations)
+            deps.insert(currentDep);
+        auto realisations = store.queryRealisations(deps);
         std::set<Realisation> res;
-        for (auto& [currentDep, _] : current.dependentRealisations) {
-            if (auto currentRealisation = store.queryRealisation(currentDep))
-                res.insert(*currentRealisation);
-            else
+        for (auto& currentDep : deps) {
+            auto i = realisations.find(currentDep);
+            if (i == realisations.end())
                 throw Error(
                     "Unrealised derivation '%s'", currentDep.to_string());
+            res.insert(i->second);
         }
         return res;
     };
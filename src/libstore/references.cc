@@ -4,42 +4,50 @@
 #include "archive.hh"
 
 #include <map>
+#include <set>
+#include <array>
 #include <cstdlib>
+#include <cstring>
 
 
 namespace nix {
 
 
-static unsigned int refLength = 32; /* characters */
+static constexpr size_t refLength = 32; /* characters */
+
+
+/* The hashes still being looked for. The transparent comparator
+   allows looking up candidates without copying them into a
+   string. */
+typedef std::set<std::string, std::less<>> HashSet;
 
 
 static void search(const unsigned char * s, size_t len,
-    StringSet & hashes, StringSet & seen)
+    HashSet & hashes, StringSet & seen)
 {
-    static bool initialised = false;
-    static bool isBase32[256];
-    if (!initialised) {
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < base32Chars.size(); ++i)
-            isBase32[(unsigned char) base32Chars[i]] = true;
-        initialised = true;
-    }
-
-    for (size_t i = 0; i + refLength <= len; ) {
+    static const auto isBase32 = []() {
+        std::array<bool, 256> table{};
+        for (auto c : base32Chars)
+            table[(unsigned char) c] = true;
+        return table;
+    }();
+
+    for (size_t i = 0; i + refLength <= len && !hashes.empty(); ) {
         int j;
         bool match = true;
         for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
+            if (!isBase32[s[i + j]]) {
                 i += j + 1;
                 match = false;
                 break;
             }
         if (!match) continue;
-        string ref((const char *) s + i, refLength);
-        if (hashes.erase(ref)) {
+        auto ref = hashes.find(std::string_view((const char *) s + i, refLength));
+        if (ref != hashes.end()) {
             debug(format("found reference to '%1%' at offset '%2%'")
-                  % ref % i);
-            seen.insert(ref);
+                  % *ref % i);
+            seen.insert(*ref);
+            hashes.erase(ref);
         }
         ++i;
     }
@@ -48,7 +56,7 @@ static void search(const unsigned char * s, size_t len,
 
 struct RefScanSink : Sink
 {
-    StringSet hashes;
+    HashSet hashes;
     StringSet seen;
 
     string tail;
@@ -57,17 +65,29 @@ struct RefScanSink : Sink
 
     void operator () (std::string_view data) override
     {
+        /* Nothing left to find. */
+        if (hashes.empty()) return;
+
         /* It's possible that a reference spans the previous and current
            fragment, so search in the concatenation of the tail of the
            previous fragment and the start of the current fragment. */
-        string s = tail + std::string(data, 0, refLength);
-        search((const unsigned char *) s.data(), s.size(), hashes, seen);
+        unsigned char buf[2 * refLength];
+        size_t headLen = std::min(data.size(), refLength);
+        memcpy(buf, tail.data(), tail.size());
+        memcpy(buf + tail.size(), data.data(), headLen);
+        search(buf, tail.size() + headLen, hashes, seen);
 
         search((const unsigned char *) data.data(), data.size(), hashes, seen);
 
-        size_t tailLen = data.size() <= refLength ? data.size() : refLength;
-        tail = std::string(tail, tail.size() < refLength - tailLen ? 0 : tail.size() - (refLength - tailLen));
-        tail.append({data.data() + data.size() - tailLen, tailLen});
+        /* Keep the last 'refLength' bytes seen, reusing the tail's
+           buffer. */
+        if (data.size() >= refLength)
+            tail.assign(data.data() + data.size() - refLength, refLength);
+        else {
+            tail.append(data);
+            if (tail.size() > refLength)
+                tail.erase(0, tail.size() - refLength);
+        }
     }
 };
 
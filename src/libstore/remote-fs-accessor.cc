@@ -1,16 +1,21 @@
 #include "remote-fs-accessor.hh"
 #include "nar-accessor.hh"
+#include "binary-cache-store.hh"
 #include "json.hh"
 
+#include <algorithm>
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 
 namespace nix {
 
-RemoteFSAccessor::RemoteFSAccessor(ref<Store> store, const Path & cacheDir)
+RemoteFSAccessor::RemoteFSAccessor(ref<Store> store, const Path & cacheDir, uint64_t maxCacheSize)
     : store(store)
     , cacheDir(cacheDir)
+    , maxCacheSize(maxCacheSize)
 {
     if (cacheDir != "")
         createDirs(cacheDir);
@@ -29,13 +34,28 @@ void RemoteFSAccessor::addToCache(std::string_view hashPart, const std::string &
 
     if (cacheDir != "") {
         try {
+            /* Write via a temporary file, so that a crash doesn't leave
+               a truncated cache file behind. trimNarCache() skips
+               these. */
+            auto writeCacheFile = [&](const Path & file, std::string_view contents) {
+                static std::atomic<unsigned int> counter{0};
+                auto tmp = fmt("%s.tmp.%d.%d", file, getpid(), counter++);
+                AutoDelete deleteTmp(tmp, false);
+                writeFile(tmp, contents);
+                if (rename(tmp.c_str(), file.c_str()) == -1)
+                    throw SysError("renaming '%s' to '%s'", tmp, file);
+                deleteTmp.cancel();
+            };
+
             std::ostringstream str;
             JSONPlaceholder jsonRoot(str);
             listNar(jsonRoot, narAccessor, "", true);
-            writeFile(makeCacheFile(hashPart, "ls"), str.str());
+            writeCacheFile(makeCacheFile(hashPart, "ls"), str.str());
 
             /* FIXME: do this asynchronously. */
-            writeFile(makeCacheFile(hashPart, "nar"), nar);
+            writeCacheFile(makeCacheFile(hashPart, "nar"), nar);
+
+            trimNarCache(cacheDir, maxCacheSize);
 
         } catch (...) {
             ignoreException();
@@ -61,6 +81,9 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, boo
 
     if (cacheDir != "" && pathExists(cacheFile = makeCacheFile(storePath.hashPart(), "nar"))) {
 
+        /* Record the access for trimNarCache(). */
+        utimes(cacheFile.c_str(), nullptr);
+
         try {
             listing = nix::readFile(makeCacheFile(storePath.hashPart(), "ls"));
 
@@ -83,7 +106,7 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, boo
             nars.emplace(storePath.hashPart(), narAccessor);
             return {narAccessor, restPath};
 
-        } catch (SysError &) { }
+        } catch (Error &) { }
 
         try {
             *sink.s = nix::readFile(cacheFile);
@@ -95,12 +118,82 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_, boo
         } catch (SysError &) { }
     }
 
+    /* If the binary cache has a listing of an uncompressed NAR, read
+       only the files that are needed rather than the whole NAR. */
+    if (auto binaryCache = store.dynamic_pointer_cast<BinaryCacheStore>()) {
+        try {
+            if (auto narAccessor = binaryCache->getNarRangeAccessor(storePath)) {
+                nars.emplace(storePath.hashPart(), ref<FSAccessor>(narAccessor));
+                return {ref<FSAccessor>(narAccessor), restPath};
+            }
+        } catch (Error & e) {
+            debug("cannot read parts of the NAR of '%s': %s", store->printStorePath(storePath), e.what());
+        }
+    }
+
     store->narFromPath(storePath, sink);
     auto narAccessor = makeNarAccessor(sink.s);
     addToCache(storePath.hashPart(), *sink.s, narAccessor);
     return {narAccessor, restPath};
 }
 
+void trimNarCache(const Path & cacheDir, uint64_t maxSize)
+{
+    if (!maxSize) return;
+
+    /* Scanning the cache is expensive, so every process that adds to
+       it does so at most once per minute. The cache can therefore
+       briefly exceed `maxSize'. */
+    auto now = time(nullptr);
+    auto stampFile = cacheDir + "/.last-trim";
+    struct stat st;
+    if (lstat(stampFile.c_str(), &st) == 0 && st.st_mtime + 60 > now) return;
+    writeFile(stampFile, "");
+
+    struct Entry
+    {
+        uint64_t size = 0;
+        time_t lastUsed = 0;
+        Strings files;
+    };
+
+    std::map<std::string, Entry> entries;
+    uint64_t totalSize = 0;
+
+    for (auto & i : readDirectory(cacheDir)) {
+        if (hasPrefix(i.name, ".")) continue;
+        auto file = cacheDir + "/" + i.name;
+        if (lstat(file.c_str(), &st) || !S_ISREG(st.st_mode)) continue;
+        /* Skip files that are still being written, but delete those
+           left behind by a process that was killed. */
+        if (i.name.find(".tmp.") != std::string::npos) {
+            if (st.st_mtime + 24 * 3600 < now && unlink(file.c_str()) == -1 && errno != ENOENT)
+                printError("cannot delete NAR cache file '%s': %s", file, strerror(errno));
+            continue;
+        }
+        auto & entry(entries[i.name.substr(0, i.name.find('.'))]);
+        entry.size += st.st_size;
+        entry.lastUsed = std::max(entry.lastUsed, st.st_mtime);
+        entry.files.push_back(file);
+        totalSize += st.st_size;
+    }
+
+    if (totalSize <= maxSize) return;
+
+    std::vector<Entry *> byAge;
+    for (auto & i : entries) byAge.push_back(&i.second);
+    std::sort(byAge.begin(), byAge.end(),
+        [](const Entry * a, const Entry * b) { return a->lastUsed < b->lastUsed; });
+
+    for (auto entry : byAge) {
+        if (totalSize <= maxSize) break;
+        for (auto & file : entry->files)
+            if (unlink(file.c_str()) == -1 && errno != ENOENT)
+                printError("cannot delete NAR cache file '%s': %s", file, strerror(errno));
+        totalSize -= entry->size;
+    }
+}
+
 FSAccessor::Stat RemoteFSAccessor::stat(const Path & path)
 {
     auto res = fetch(path);
@@ -14,6 +14,8 @@ class RemoteFSAccessor : public FSAccessor
 
     Path cacheDir;
 
+    uint64_t maxCacheSize;
+
     std::pair<ref<FSAccessor>, Path> fetch(const Path & path_, bool requireValidPath = true);
 
     friend class BinaryCacheStore;
@@ -26,7 +28,8 @@ class RemoteFSAccessor : public FSAccessor
 public:
 
     RemoteFSAccessor(ref<Store> store,
-        const /* FIXME: use std::optional */ Path & cacheDir = "");
+        const /* FIXME: use std::optional */ Path & cacheDir = "",
+        uint64_t maxCacheSize = 0);
 
     Stat stat(const Path & path) override;
 
@@ -37,4 +40,11 @@ public:
     std::string readLink(const Path & path) override;
 };
 
+/* Delete the least recently used entries (NARs and their listings)
+   from the NAR cache in `cacheDir' until its total size is at most
+   `maxSize' bytes. 0 means no limit. Does nothing if the cache was
+   trimmed less than a minute ago. Also deletes temporary files
+   that are more than a day old. */
+void trimNarCache(const Path & cacheDir, uint64_t maxSize);
+
 }
@@ -96,6 +96,32 @@ std::optional<StorePath> read(const Store & store, Source & from, Phantom<std::o
     return s == "" ? std::optional<StorePath> {} : store.parseStorePath(s);
 }
 
+ValidPathInfo read(const Store & store, Source & from, Phantom<ValidPathInfo> _)
+{
+    auto path = read(store, from, Phantom<StorePath> {});
+    auto deriver = readString(from);
+    auto narHash = Hash::parseAny(readString(from), htSHA256);
+    ValidPathInfo info { path, narHash };
+    if (deriver != "")
+        info.deriver = store.parseStorePath(deriver);
+    info.references = read(store, from, Phantom<StorePathSet> {});
+    from >> info.registrationTime >> info.narSize >> info.ultimate;
+    info.sigs = readStrings<StringSet>(from);
+    info.ca = parseContentAddressOpt(readString(from));
+    return info;
+}
+
+void write(const Store & store, Sink & out, const ValidPathInfo & info)
+{
+    write(store, out, info.path);
+    out << (info.deriver ? store.printStorePath(*info.deriver) : "")
+        << info.narHash.to_string(Base16, false);
+    write(store, out, info.references);
+    out << info.registrationTime << info.narSize << info.ultimate
+        << info.sigs << renderContentAddress(info.ca);
+}
+
+
 void write(const Store & store, Sink & out, const std::optional<StorePath> & storePathOpt)
 {
     out << (storePathOpt ? store.printStorePath(*storePathOpt) : "");
@@ -158,6 +184,8 @@ ref<RemoteStore::Connection> RemoteStore::openConnectionWrapper()
 
 void RemoteStore::initConnection(Connection & conn)
 {
+    bool optionsSent = false;
+
     /* Send the magic greeting, check for the reply. */
     try {
         conn.to << WORKER_MAGIC_1;
@@ -180,8 +208,17 @@ void RemoteStore::initConnection(Connection & conn)
                 conn.to << 0;
         }
 
+        /* Announce our protocol extensions in the obsolete
+           `reserveSpace' word. A daemon that supports them replies
+           with STDERR_EXTENSIONS, which processStderr() records. */
         if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 11)
-            conn.to << false;
+            conn.to << (WORKER_EXT_MAGIC | WORKER_EXTENSIONS);
+
+        /* Send our settings right away rather than waiting for the
+           daemon to accept the connection first, saving a round
+           trip. If the daemon rejects the connection, it doesn't read
+           them and we get its error below. */
+        optionsSent = setOptions(conn);
 
         auto ex = conn.processStderr();
         if (ex) std::rethrow_exception(ex);
@@ -190,11 +227,14 @@ void RemoteStore::initConnection(Connection & conn)
         throw Error("cannot open connection to remote store '%s': %s", getUri(), e.what());
     }
 
-    setOptions(conn);
+    if (optionsSent) {
+        auto ex = conn.processStderr();
+        if (ex) std::rethrow_exception(ex);
+    }
 }
 
 
-void RemoteStore::setOptions(Connection & conn)
+bool RemoteStore::setOptions(Connection & conn)
 {
     conn.to << wopSetOptions
        << settings.keepFailed
@@ -227,8 +267,7 @@ void RemoteStore::setOptions(Connection & conn)
             conn.to << i.first << i.second.value;
     }
 
-    auto ex = conn.processStderr();
-    if (ex) std::rethrow_exception(ex);
+    return true;
 }
 
 
@@ -275,6 +314,9 @@ struct ConnectionHandle
 
 ConnectionHandle RemoteStore::getConnection()
 {
+    /* Make sure the daemon has any deferred paths before it sees a
+       request that could refer to them. */
+    flushDeferredTexts();
     return ConnectionHandle(connections->get());
 }
 
@@ -430,6 +472,69 @@ void RemoteStore::queryPathInfoUncached(const StorePath & path,
 }
 
 
+std::map<std::string, std::shared_ptr<const ValidPathInfo>>
+RemoteStore::queryPathInfosUncached(const StorePathSet & paths)
+{
+    std::map<std::string, std::shared_ptr<const ValidPathInfo>> infos;
+    {
+        auto conn(getConnection());
+        if (!HAS_WORKER_EXT(conn->daemonExtensions, WORKER_EXT_QUERY_PATH_INFOS))
+            // Don't hold the connection handle in the fallback case:
+            // the fallback needs connections of its own.
+            goto fallback;
+        conn->to << wopQueryPathInfos;
+        worker_proto::write(*this, conn->to, paths);
+        conn.processStderr();
+        size_t count = readNum<size_t>(conn->from);
+        for (size_t n = 0; n < count; n++) {
+            auto path = parseStorePath(readString(conn->from));
+            infos.insert_or_assign(std::string(path.hashPart()), readValidPathInfo(conn, path));
+        }
+    }
+    /* The daemon omits invalid paths. */
+    for (auto & path : paths)
+        infos.emplace(std::string(path.hashPart()), nullptr);
+    return infos;
+
+ fallback:
+    return Store::queryPathInfosUncached(paths);
+}
+
+
+void RemoteStore::computeFSClosure(const StorePathSet & paths,
+    StorePathSet & out, bool flipDirection,
+    bool includeOutputs, bool includeDerivers)
+{
+    if (includeOutputs || includeDerivers)
+        goto fallback;
+
+    {
+        auto conn(getConnection());
+        if (!HAS_WORKER_EXT(conn->daemonExtensions, WORKER_EXT_QUERY_CLOSURE))
+            // Don't hold the connection handle in the fallback case:
+            // the fallback needs connections of its own.
+            goto fallback;
+        conn->to << wopQueryClosure;
+        worker_proto::write(*this, conn->to, paths);
+        conn->to << flipDirection;
+        conn.processStderr();
+        size_t count = readNum<size_t>(conn->from);
+        for (size_t n = 0; n < count; n++) {
+            auto path = parseStorePath(readString(conn->from));
+            auto info = readValidPathInfo(conn, path);
+            auto hashPart = std::string(path.hashPart());
+            state(hashPart).lock()->pathInfoCache.upsert(hashPart,
+                PathInfoCacheValue { .value = info.get_ptr() });
+            out.insert(std::move(path));
+        }
+        return;
+    }
+
+ fallback:
+    Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
+}
+
+
 void RemoteStore::queryReferrers(const StorePath & path,
     StorePathSet & referrers)
 {
@@ -642,6 +747,31 @@ void RemoteStore::addToStore(const ValidPathInfo & info, Source & source,
 }
 
 
+void RemoteStore::addMultipleToStore(PathsSource & pathsToCopy,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    {
+        auto conn(getConnection());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 32)
+            // Don't hold the connection handle in the fallback case:
+            // the fallback needs connections of its own.
+            goto fallback;
+        conn->to << wopAddMultipleToStore << repair << !checkSigs;
+        conn.withFramedSink([&](Sink & sink) {
+            sink << pathsToCopy.size();
+            for (auto & [info, narProducer] : pathsToCopy) {
+                worker_proto::write(*this, sink, info);
+                narProducer(sink);
+            }
+        });
+        return;
+    }
+
+ fallback:
+    Store::addMultipleToStore(pathsToCopy, repair, checkSigs);
+}
+
+
 StorePath RemoteStore::addTextToStore(const string & name, const string & s,
     const StorePathSet & references, RepairFlag repair)
 {
@@ -649,6 +779,76 @@ StorePath RemoteStore::addTextToStore(const string & name, const string & s,
     return addCAToStore(source, name, TextHashMethod{}, references, repair)->path;
 }
 
+/* The number of deferred paths at which they're sent to the daemon
+   anyway. */
+static constexpr size_t maxDeferredTexts = 1024;
+
+
+StorePath RemoteStore::addTextToStoreDeferred(const string & name, const string & s,
+    const StorePathSet & references)
+{
+    /* Text paths are content-addressed, so the path can be computed
+       here, without asking the daemon. */
+    auto textHash = hashString(htSHA256, s);
+    auto path = makeTextPath(name, textHash, references);
+
+    StringSink sink;
+    dumpString(s, sink);
+    ValidPathInfo info { path, hashString(htSHA256, *sink.s) };
+    info.narSize = sink.s->size();
+    info.ca = TextHash { textHash };
+    info.references = references;
+
+    bool full;
+    {
+        auto texts(deferredTexts.lock());
+        texts->push_back({std::move(info), std::move(*sink.s)});
+        full = texts->size() >= maxDeferredTexts;
+    }
+
+    if (full) flushDeferredTexts();
+
+    return path;
+}
+
+
+void RemoteStore::flushDeferredTexts()
+{
+    std::lock_guard<std::recursive_mutex> flushing(flushMutex);
+
+    std::vector<DeferredText> texts;
+    std::swap(texts, *deferredTexts.lock());
+    if (texts.empty()) return;
+
+    debug("adding %d deferred paths to the store", texts.size());
+
+    /* The paths were added in dependency order, so references always
+       precede their referrers. */
+    PathsSource pathsToCopy;
+    for (auto & text : texts)
+        pathsToCopy.emplace_back(text.info, [&](Sink & sink) { sink(text.nar); });
+
+    try {
+        addMultipleToStore(pathsToCopy, NoRepair, CheckSigs);
+    } catch (Error & e) {
+        /* Keep the paths, ahead of any that were deferred in the
+           meantime, so that a later flush can still add them. This
+           may run as part of an unrelated operation, so say what
+           failed. */
+        auto n = texts.size();
+        {
+            auto deferred(deferredTexts.lock());
+            texts.insert(texts.end(),
+                std::make_move_iterator(deferred->begin()),
+                std::make_move_iterator(deferred->end()));
+            *deferred = std::move(texts);
+        }
+        e.addTrace({}, "while adding %d deferred paths to the store", n);
+        throw;
+    }
+}
+
+
 void RemoteStore::registerDrvOutput(const Realisation & info)
 {
     auto conn(getConnection());
@@ -681,6 +881,27 @@ std::optional<const Realisation> RemoteStore::queryRealisation(const DrvOutput &
     }
 }
 
+std::map<DrvOutput, Realisation> RemoteStore::queryRealisations(const std::set<DrvOutput> & ids)
+{
+    std::map<DrvOutput, Realisation> res;
+    {
+        auto conn(getConnection());
+        if (!HAS_WORKER_EXT(conn->daemonExtensions, WORKER_EXT_QUERY_REALISATIONS))
+            // Don't hold the connection handle in the fallback case:
+            // the fallback needs connections of its own.
+            goto fallback;
+        conn->to << wopQueryRealisations;
+        worker_proto::write(*this, conn->to, ids);
+        conn.processStderr();
+        for (auto & realisation : worker_proto::read(*this, conn->from, Phantom<std::set<Realisation>> {}))
+            res.insert_or_assign(realisation.id, realisation);
+    }
+    return res;
+
+ fallback:
+    return Store::queryRealisations(ids);
+}
+
 static void writeDerivedPaths(RemoteStore & store, ConnectionHandle & conn, const std::vector<DerivedPath> & reqs)
 {
     if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 30) {
@@ -741,6 +962,13 @@ BuildResult RemoteStore::buildDerivation(const StorePath & drvPath, const BasicD
         auto builtOutputs = worker_proto::read(*this, conn->from, Phantom<DrvOutputs> {});
         res.builtOutputs = builtOutputs;
     }
+    if (HAS_WORKER_EXT(conn->daemonExtensions, WORKER_EXT_BUILD_TIMINGS)) {
+        auto count = readNum<size_t>(conn->from);
+        for (size_t i = 0; i < count; ++i) {
+            auto phase = readString(conn->from);
+            res.timings[phase] = readNum<uint64_t>(conn->from);
+        }
+    }
     return res;
 }
 
@@ -815,10 +1043,7 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
     results.bytesFreed = readLongLong(conn->from);
     readLongLong(conn->from); // obsolete
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.clear();
-    }
+    clearPathInfoCache();
 }
 
 
@@ -905,6 +1130,7 @@ RemoteStore::Connection::~Connection()
 
 void RemoteStore::narFromPath(const StorePath & path, Sink & sink)
 {
+    flushDeferredTexts();
     auto conn(connections->get());
     conn->to << wopNarFromPath << printStorePath(path);
     conn->processStderr();
@@ -991,6 +1217,9 @@ std::exception_ptr RemoteStore::Connection::processStderr(Sink * sink, Source *
             logger->result(act, type, fields);
         }
 
+        else if (msg == STDERR_EXTENSIONS)
+            daemonExtensions = readInt(from) & WORKER_EXTENSIONS;
+
         else if (msg == STDERR_LAST)
             break;
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <limits>
+#include <mutex>
 #include <string>
 
 #include "store-api.hh"
@@ -49,6 +50,13 @@ public:
     void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override;
 
+    std::map<std::string, std::shared_ptr<const ValidPathInfo>>
+        queryPathInfosUncached(const StorePathSet & paths) override;
+
+    void computeFSClosure(const StorePathSet & paths,
+        StorePathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
     void queryReferrers(const StorePath & path, StorePathSet & referrers) override;
 
     StorePathSet queryValidDerivers(const StorePath & path) override;
@@ -78,13 +86,23 @@ public:
     void addToStore(const ValidPathInfo & info, Source & nar,
         RepairFlag repair, CheckSigsFlag checkSigs) override;
 
+    void addMultipleToStore(PathsSource & pathsToCopy,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
     StorePath addTextToStore(const string & name, const string & s,
         const StorePathSet & references, RepairFlag repair) override;
 
+    StorePath addTextToStoreDeferred(const string & name, const string & s,
+        const StorePathSet & references) override;
+
+    void flushDeferredTexts() override;
+
     void registerDrvOutput(const Realisation & info) override;
 
     std::optional<const Realisation> queryRealisation(const DrvOutput &) override;
 
+    std::map<DrvOutput, Realisation> queryRealisations(const std::set<DrvOutput> & ids) override;
+
     void buildPaths(const std::vector<DerivedPath> & paths, BuildMode buildMode) override;
 
     BuildResult buildDerivation(const StorePath & drvPath, const BasicDerivation & drv,
@@ -124,6 +142,8 @@ public:
         FdSink to;
         FdSource from;
         unsigned int daemonVersion;
+        /* Protocol extensions supported by both sides. */
+        unsigned int daemonExtensions = 0;
         std::chrono::time_point<std::chrono::steady_clock> startTime;
 
         virtual ~Connection();
@@ -141,7 +161,10 @@ protected:
 
     ref<Pool<Connection>> connections;
 
-    virtual void setOptions(Connection & conn);
+    /* Send the client's settings to the daemon. This only writes the
+       wopSetOptions request; the caller must process the reply.
+       Returns false if nothing was sent. */
+    virtual bool setOptions(Connection & conn);
 
     ConnectionHandle getConnection();
 
@@ -157,6 +180,22 @@ private:
 
     std::atomic_bool failed{false};
 
+    /* Paths added by addTextToStoreDeferred() that haven't been sent
+       to the daemon yet, in the order in which they were added. */
+    struct DeferredText
+    {
+        ValidPathInfo info;
+        std::string nar;
+    };
+
+    Sync<std::vector<DeferredText>> deferredTexts;
+
+    /* Held while deferred paths are being sent, so that other threads
+       don't send requests that refer to them in the meantime. It's
+       recursive because sending them gets a connection, which flushes
+       again. */
+    std::recursive_mutex flushMutex;
+
 };
 
 
@@ -193,9 +193,12 @@ struct S3BinaryCacheStoreConfig : virtual BinaryCacheStoreConfig
     const Setting<std::string> lsCompression{(StoreConfig*) this, "", "ls-compression", "compression method for .ls files"};
     const Setting<std::string> logCompression{(StoreConfig*) this, "", "log-compression", "compression method for log/* files"};
     const Setting<bool> multipartUpload{
-        (StoreConfig*) this, false, "multipart-upload", "whether to use multi-part uploads"};
+        (StoreConfig*) this, true, "multipart-upload", "whether to upload files larger than 'buffer-size' in concurrent parts"};
     const Setting<uint64_t> bufferSize{
         (StoreConfig*) this, 5 * 1024 * 1024, "buffer-size", "size (in bytes) of each part in multi-part uploads"};
+    const Setting<uint64_t> bulkQueryThreshold{
+        (StoreConfig*) this, 0, "bulk-query-threshold",
+        "number of paths from which validity queries list the bucket's .narinfo files instead of fetching each one (0 disables listing)"};
 
     const std::string name() override { return "S3 Binary Cache Store"; }
 };
@@ -325,10 +328,9 @@ struct S3BinaryCacheStoreImpl : virtual S3BinaryCacheStoreConfig, public virtual
 
         auto now1 = std::chrono::steady_clock::now();
 
-        if (transferManager) {
-
-            if (contentEncoding != "")
-                throw Error("setting a content encoding is not supported with S3 multi-part uploads");
+        /* Small files don't benefit from being split, and multi-part
+           uploads don't support setting a content encoding. */
+        if (transferManager && contentEncoding == "" && (uint64_t) size > bufferSize) {
 
             std::shared_ptr<TransferHandle> transferHandle =
                 transferManager->UploadFile(
@@ -449,6 +451,26 @@ struct S3BinaryCacheStoreImpl : virtual S3BinaryCacheStoreConfig, public virtual
         return paths;
     }
 
+    StorePathSet queryValidPaths(const StorePathSet & paths,
+        SubstituteFlag maybeSubstitute = NoSubstitute) override
+    {
+        /* Listing the bucket costs one request per 1000 keys at its
+           top level, so it is cheaper than a request per path for
+           large path sets in buckets that aren't much larger. */
+        if (!bulkQueryThreshold || paths.size() < bulkQueryThreshold)
+            return Store::queryValidPaths(paths, maybeSubstitute);
+
+        std::set<std::string> hashParts;
+        for (auto & path : queryAllValidPaths())
+            hashParts.insert(std::string(path.hashPart()));
+
+        StorePathSet res;
+        for (auto & path : paths)
+            if (hashParts.count(std::string(path.hashPart())))
+                res.insert(path);
+        return res;
+    }
+
     static std::set<std::string> uriSchemes() { return {"s3"}; }
 
 };
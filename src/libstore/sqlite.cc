@@ -1,4 +1,5 @@
 #include "sqlite.hh"
+#include "globals.hh"
 #include "util.hh"
 
 #include <sqlite3.h>
@@ -31,8 +32,7 @@ SQLite::SQLite(const Path & path, bool create)
             SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0), 0) != SQLITE_OK)
         throw Error("cannot open SQLite database '%s'", path);
 
-    if (sqlite3_busy_timeout(db, 60 * 60 * 1000) != SQLITE_OK)
-        throwSQLiteError(db, "setting timeout");
+    setBusyTimeout(60 * 60 * 1000);
 
     exec("pragma foreign_keys = 1");
 }
@@ -47,10 +47,21 @@ SQLite::~SQLite()
     }
 }
 
+void SQLite::setBusyTimeout(int ms)
+{
+    if (sqlite3_busy_timeout(db, ms) != SQLITE_OK)
+        throwSQLiteError(db, "setting timeout");
+}
+
 void SQLite::isCache()
 {
     exec("pragma synchronous = off");
-    exec("pragma main.journal_mode = truncate");
+    /* In WAL mode, readers don't block the writer and vice versa, so
+       the many Nix processes sharing a cache don't get SQLITE_BUSY
+       as often. */
+    exec(settings.useSQLiteWAL
+        ? "pragma main.journal_mode = wal"
+        : "pragma main.journal_mode = truncate");
 }
 
 void SQLite::exec(const std::string & stmt)
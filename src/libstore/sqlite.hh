@@ -22,9 +22,14 @@ struct SQLite
     ~SQLite();
     operator sqlite3 * () { return db; }
 
-    /* Disable synchronous mode, set truncate journal mode. */
+    /* Disable synchronous mode, set WAL journal mode (or truncate if
+       `use-sqlite-wal' is disabled). */
     void isCache();
 
+    /* Wait at most `ms' milliseconds for a lock held by another
+       process before failing with SQLiteBusy. */
+    void setBusyTimeout(int ms);
+
     void exec(const std::string & stmt);
 
     uint64_t getLastInsertedRowId();
@@ -65,7 +65,7 @@ private:
 
     SSHMaster master;
 
-    void setOptions(RemoteStore::Connection & conn) override
+    bool setOptions(RemoteStore::Connection & conn) override
     {
         /* TODO Add a way to explicitly ask for some options to be
            forwarded. One option: A way to query the daemon for its
@@ -73,6 +73,7 @@ private:
            forward-cores or forward-overridden-cores that only
            override the requested settings.
         */
+        return false;
     };
 };
 
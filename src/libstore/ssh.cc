@@ -1,4 +1,5 @@
 #include "ssh.hh"
+#include "globals.hh"
 
 namespace nix {
 
@@ -71,6 +72,19 @@ std::unique_ptr<SSHMaster::Connection> SSHMaster::startCommand(const std::string
             addCommonSSHOpts(args);
             if (socketPath != "")
                 args.insert(args.end(), {"-S", socketPath});
+            else if (settings.sshControlPersist) {
+                /* Let ssh share a master connection with other Nix
+                   processes connecting to the same host. The socket
+                   name (%C) is a hash of the host, port and user. */
+                Path controlDir = getCacheDir() + "/nix/ssh";
+                createDirs(controlDir);
+                if (chmod(controlDir.c_str(), 0700) == -1)
+                    throw SysError("setting permissions on '%s'", controlDir);
+                args.insert(args.end(), {
+                    "-oControlMaster=auto",
+                    "-oControlPath=" + controlDir + "/%C",
+                    fmt("-oControlPersist=%d", settings.sshControlPersist)});
+            }
             if (verbosity >= lvlChatty)
                 args.push_back("-v");
         }
@@ -94,7 +108,10 @@ std::unique_ptr<SSHMaster::Connection> SSHMaster::startCommand(const std::string
 
 Path SSHMaster::startMaster()
 {
-    if (!useMaster) return "";
+    /* With ssh-control-persist, startCommand() lets ssh share a
+       master connection with all processes, so a private one would
+       only add another handshake. */
+    if (!useMaster || settings.sshControlPersist) return "";
 
     auto state(state_.lock());
 
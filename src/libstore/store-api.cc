@@ -2,6 +2,8 @@
 #include "fs-accessor.hh"
 #include "globals.hh"
 #include "store-api.hh"
+#include "remote-store.hh"
+#include "binary-cache-store.hh"
 #include "util.hh"
 #include "nar-info-disk-cache.hh"
 #include "thread-pool.hh"
@@ -10,6 +12,7 @@
 #include "archive.hh"
 #include "callback.hh"
 
+#include <algorithm>
 #include <regex>
 
 namespace nix {
@@ -347,8 +350,12 @@ StringSet StoreConfig::getDefaultSystemFeatures()
 
 Store::Store(const Params & params)
     : StoreConfig(params)
-    , state({(size_t) pathInfoCacheSize})
 {
+    /* Round up so that a small non-zero cache size doesn't end up
+       disabling the cache altogether. */
+    size_t shardSize = ((size_t) pathInfoCacheSize + pathInfoCacheShards - 1) / pathInfoCacheShards;
+    for (size_t n = 0; n < pathInfoCacheShards; ++n)
+        states.push_back(std::make_unique<Sync<State>>(State{shardSize}));
 }
 
 
@@ -402,7 +409,7 @@ bool Store::isValidPath(const StorePath & storePath)
     std::string hashPart(storePath.hashPart());
 
     {
-        auto state_(state.lock());
+        auto state_(state(hashPart).lock());
         auto res = state_->pathInfoCache.get(hashPart);
         if (res && res->isKnownNow()) {
             stats.narInfoReadAverted++;
@@ -414,7 +421,7 @@ bool Store::isValidPath(const StorePath & storePath)
         auto res = diskCache->lookupNarInfo(getUri(), hashPart);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
+            auto state_(state(hashPart).lock());
             state_->pathInfoCache.upsert(hashPart,
                 res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue { .value = res.second });
             return res.first == NarInfoDiskCache::oValid;
@@ -478,7 +485,7 @@ void Store::queryPathInfo(const StorePath & storePath,
         hashPart = storePath.hashPart();
 
         {
-            auto res = state.lock()->pathInfoCache.get(hashPart);
+            auto res = state(hashPart).lock()->pathInfoCache.get(hashPart);
             if (res && res->isKnownNow()) {
                 stats.narInfoReadAverted++;
                 if (!res->didExist())
@@ -492,7 +499,7 @@ void Store::queryPathInfo(const StorePath & storePath,
             if (res.first != NarInfoDiskCache::oUnknown) {
                 stats.narInfoReadAverted++;
                 {
-                    auto state_(state.lock());
+                    auto state_(state(hashPart).lock());
                     state_->pathInfoCache.upsert(hashPart,
                         res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
                     if (res.first == NarInfoDiskCache::oInvalid ||
@@ -507,17 +514,21 @@ void Store::queryPathInfo(const StorePath & storePath,
 
     auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
 
+    auto startTime = std::chrono::steady_clock::now();
+
     queryPathInfoUncached(storePath,
-        {[this, storePathS{printStorePath(storePath)}, hashPart, callbackPtr](std::future<std::shared_ptr<const ValidPathInfo>> fut) {
+        {[this, storePathS{printStorePath(storePath)}, hashPart, callbackPtr, startTime](std::future<std::shared_ptr<const ValidPathInfo>> fut) {
 
             try {
                 auto info = fut.get();
 
+                stats.narInfoReadLatency.record(std::chrono::steady_clock::now() - startTime);
+
                 if (diskCache)
                     diskCache->upsertNarInfo(getUri(), hashPart, info);
 
                 {
-                    auto state_(state.lock());
+                    auto state_(state(hashPart).lock());
                     state_->pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = info });
                 }
 
@@ -534,6 +545,105 @@ void Store::queryPathInfo(const StorePath & storePath,
 }
 
 
+void Store::prefetchPathInfos(const StorePathSet & paths)
+{
+    /* There is nowhere to put the results. */
+    if (!pathInfoCacheSize && !diskCache) return;
+
+    StorePathSet missing;
+
+    for (auto & path : paths) {
+        auto hashPart = std::string(path.hashPart());
+        {
+            auto res = state(hashPart).lock()->pathInfoCache.get(hashPart);
+            if (res && res->isKnownNow()) continue;
+        }
+        if (diskCache && diskCache->lookupNarInfo(getUri(), hashPart).first != NarInfoDiskCache::oUnknown)
+            continue;
+        missing.insert(path);
+    }
+
+    if (missing.empty()) return;
+
+    debug("prefetching info about %d paths from '%s'", missing.size(), getUri());
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    auto infos = queryPathInfosUncached(missing);
+
+    /* Account for these lookups like individual ones, sharing the
+       time of the batch between them, so that the histogram's total
+       is the time actually spent. */
+    if (!infos.empty()) {
+        auto duration = (std::chrono::steady_clock::now() - startTime) / infos.size();
+        for (auto & [hashPart, info] : infos) {
+            stats.narInfoReadLatency.record(duration);
+            if (!info) stats.narInfoMissing++;
+        }
+    }
+
+    for (auto & [hashPart, info] : infos)
+        state(hashPart).lock()->pathInfoCache.upsert(hashPart, PathInfoCacheValue { .value = info });
+
+    if (diskCache)
+        diskCache->upsertNarInfos(getUri(), infos);
+}
+
+
+std::map<std::string, std::shared_ptr<const ValidPathInfo>>
+Store::queryPathInfosUncached(const StorePathSet & missing)
+{
+    struct State
+    {
+        size_t left;
+        std::map<std::string, std::shared_ptr<const ValidPathInfo>> infos;
+    };
+
+    Sync<State> state_(State{missing.size(), {}});
+
+    std::condition_variable wakeup;
+
+    for (auto & path : missing) {
+        checkInterrupt();
+        queryPathInfoUncached(path,
+            {[&, hashPart{std::string(path.hashPart())}](std::future<std::shared_ptr<const ValidPathInfo>> fut) {
+                auto state(state_.lock());
+                try {
+                    state->infos.emplace(hashPart, fut.get());
+                } catch (...) {
+                    ignoreException();
+                }
+                assert(state->left);
+                if (!--state->left)
+                    wakeup.notify_one();
+            }});
+    }
+
+    std::map<std::string, std::shared_ptr<const ValidPathInfo>> infos;
+
+    {
+        auto state(state_.lock());
+        while (state->left)
+            state.wait(wakeup);
+        infos = std::move(state->infos);
+    }
+
+    return infos;
+}
+
+
+std::map<DrvOutput, Realisation> Store::queryRealisations(const std::set<DrvOutput> & ids)
+{
+    std::map<DrvOutput, Realisation> res;
+    for (auto & id : ids) {
+        checkInterrupt();
+        if (auto realisation = queryRealisation(id))
+            res.insert_or_assign(id, *realisation);
+    }
+    return res;
+}
+
+
 void Store::substitutePaths(const StorePathSet & paths)
 {
     std::vector<DerivedPath> paths2;
@@ -724,29 +834,106 @@ std::pair<uint64_t, uint64_t> Store::getClosureSize(const StorePath & storePath)
 }
 
 
+void LatencyHistogram::record(std::chrono::steady_clock::duration duration)
+{
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    count++;
+    totalMicros += micros;
+    for (size_t i = 0; i < nrBuckets; i++)
+        if ((uint64_t) micros <= bounds[i]) buckets[i]++;
+}
+
+
+void LatencyHistogram::toJSON(JSONPlaceholder & jsonOut) const
+{
+    auto obj = jsonOut.object();
+    obj.attr("count", (uint64_t) count);
+    obj.attr("totalSeconds", totalMicros / 1e6);
+    auto jsonBuckets = obj.object("buckets");
+    for (size_t i = 0; i < nrBuckets; i++)
+        jsonBuckets.attr(fmt("%g", bounds[i] / 1e6), (uint64_t) buckets[i]);
+}
+
+
+void Store::Stats::toJSON(JSONPlaceholder & jsonOut) const
+{
+    auto obj = jsonOut.object();
+    obj.attr("narInfoRead", (uint64_t) narInfoRead);
+    obj.attr("narInfoReadAverted", (uint64_t) narInfoReadAverted);
+    obj.attr("narInfoMissing", (uint64_t) narInfoMissing);
+    obj.attr("narInfoWrite", (uint64_t) narInfoWrite);
+    obj.attr("pathInfoCacheSize", (uint64_t) pathInfoCacheSize);
+    obj.attr("narRead", (uint64_t) narRead);
+    obj.attr("narReadBytes", (uint64_t) narReadBytes);
+    obj.attr("narReadCompressedBytes", (uint64_t) narReadCompressedBytes);
+    obj.attr("narWrite", (uint64_t) narWrite);
+    obj.attr("narWriteAverted", (uint64_t) narWriteAverted);
+    obj.attr("narWriteBytes", (uint64_t) narWriteBytes);
+    obj.attr("narWriteCompressedBytes", (uint64_t) narWriteCompressedBytes);
+    obj.attr("narWriteCompressionTimeMs", (uint64_t) narWriteCompressionTimeMs);
+
+    if (narInfoReadLatency.count)
+        obj.attr("narInfoHitRatio", (double) (narInfoReadLatency.count - narInfoMissing) / narInfoReadLatency.count);
+    if (narReadLatency.totalMicros)
+        obj.attr("narReadBytesPerSecond", narReadCompressedBytes * 1e6 / narReadLatency.totalMicros);
+    if (narReadCompressedBytes)
+        obj.attr("narReadCompressionRatio", (double) narReadBytes / narReadCompressedBytes);
+    if (narWriteCompressedBytes)
+        obj.attr("narWriteCompressionRatio", (double) narWriteBytes / narWriteCompressedBytes);
+
+    {
+        auto res = obj.placeholder("narInfoReadLatency");
+        narInfoReadLatency.toJSON(res);
+    }
+    {
+        auto res = obj.placeholder("narReadLatency");
+        narReadLatency.toJSON(res);
+    }
+}
+
+
 const Store::Stats & Store::getStats()
 {
     {
-        auto state_(state.lock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
+        stats.pathInfoCacheSize = 0;
+        for (auto & state : states)
+            stats.pathInfoCacheSize += state->lock()->pathInfoCache.size();
     }
     return stats;
 }
 
 
-void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
-    const StorePath & storePath, RepairFlag repair, CheckSigsFlag checkSigs)
+void Store::addMultipleToStore(PathsSource & pathsToCopy,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    for (auto & [info, narProducer] : pathsToCopy) {
+        auto source = sinkToSource(narProducer);
+        addToStore(info, *source, repair, checkSigs);
+    }
+}
+
+
+static std::string copyPathMessage(ref<Store> srcStore, ref<Store> dstStore,
+    const StorePath & storePath)
 {
     auto srcUri = srcStore->getUri();
     auto dstUri = dstStore->getUri();
 
-    Activity act(*logger, lvlInfo, actCopyPath,
+    return
         srcUri == "local" || srcUri == "daemon"
         ? fmt("copying path '%s' to '%s'", srcStore->printStorePath(storePath), dstUri)
           : dstUri == "local" || dstUri == "daemon"
         ? fmt("copying path '%s' from '%s'", srcStore->printStorePath(storePath), srcUri)
-          : fmt("copying path '%s' from '%s' to '%s'", srcStore->printStorePath(storePath), srcUri, dstUri),
-        {srcStore->printStorePath(storePath), srcUri, dstUri});
+          : fmt("copying path '%s' from '%s' to '%s'", srcStore->printStorePath(storePath), srcUri, dstUri);
+}
+
+
+void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
+    const StorePath & storePath, RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    Activity act(*logger, lvlInfo, actCopyPath,
+        copyPathMessage(srcStore, dstStore, storePath),
+        {srcStore->printStorePath(storePath), srcStore->getUri(), dstStore->getUri()});
     PushActivity pact(act.id);
 
     auto info = srcStore->queryPathInfo(storePath);
@@ -804,15 +991,19 @@ std::map<StorePath, StorePath> copyPaths(ref<Store> srcStore, ref<Store> dstStor
         processGraph<Realisation>(
             pool, Realisation::closure(*srcStore, toplevelRealisations),
             [&](const Realisation& current) -> std::set<Realisation> {
+                std::set<DrvOutput> childIds;
+                for (const auto& [drvOutput, _] : current.dependentRealisations)
+                    childIds.insert(drvOutput);
+                auto realisations = srcStore->queryRealisations(childIds);
                 std::set<Realisation> children;
-                for (const auto& [drvOutput, _] : current.dependentRealisations) {
-                    auto currentChild = srcStore->queryRealisation(drvOutput);
-                    if (!currentChild)
+                for (const auto& drvOutput : childIds) {
+                    auto currentChild = realisations.find(drvOutput);
+                    if (currentChild == realisations.end())
                         throw Error(
                             "Incomplete realisation closure: '%s' is a "
                             "dependency of '%s' but isn’t registered",
                             drvOutput.to_string(), current.id.to_string());
-                    children.insert(*currentChild);
+                    children.insert(currentChild->second);
                 }
                 return children;
             },
@@ -845,6 +1036,7 @@ std::map<StorePath, StorePath> copyPaths(ref<Store> srcStore, ref<Store> dstStor
     for (auto & path : storePaths)
         pathsMap.insert_or_assign(path, path);
 
+    srcStore->prefetchPathInfos(missing);
 
     Activity act(*logger, lvlInfo, actCopyPaths, fmt("copying %d paths", missing.size()));
 
@@ -857,6 +1049,194 @@ std::map<StorePath, StorePath> copyPaths(ref<Store> srcStore, ref<Store> dstStor
         act.progress(nrDone, missing.size(), nrRunning, nrFailed);
     };
 
+    /* A daemon connection imports one path at a time anyway, so
+       rather than paying a round trip per path, send them all in a
+       single request. With --keep-going, copy them separately so
+       that one failure doesn't abort the rest. */
+    if (missing.size() > 1 && !settings.keepGoing && dstStore.dynamic_pointer_cast<RemoteStore>()) {
+        Store::PathsSource pathsToCopy;
+        uint64_t totalNarSize = 0;
+
+        auto sorted = srcStore->topoSortPaths(missing);
+        std::reverse(sorted.begin(), sorted.end());
+
+        for (auto & storePath : sorted) {
+            auto info = srcStore->queryPathInfo(storePath);
+            if (!info->narSize) {
+                pathsToCopy.clear();
+                break;
+            }
+
+            ValidPathInfo infoForDst = *info;
+            if (info->ca && info->references.empty()) {
+                infoForDst.path = dstStore->makeFixedOutputPathFromCA(storePath.name(), *info->ca);
+                if (dstStore->storeDir == srcStore->storeDir)
+                    assert(infoForDst.path == storePath);
+            }
+            infoForDst.ultimate = false;
+            pathsMap.insert_or_assign(storePath, infoForDst.path);
+            totalNarSize += info->narSize;
+
+            pathsToCopy.push_back({std::move(infoForDst), [&, storePath, narSize{info->narSize}](Sink & sink) {
+                checkInterrupt();
+                Activity act2(*logger, lvlInfo, actCopyPath,
+                    copyPathMessage(srcStore, dstStore, storePath),
+                    {srcStore->printStorePath(storePath), srcStore->getUri(), dstStore->getUri()});
+                MaintainCount<decltype(nrRunning)> mc(nrRunning);
+                showProgress();
+                uint64_t total = 0;
+                LambdaSink progressSink([&](std::string_view data) {
+                    total += data.size();
+                    act2.progress(total, narSize);
+                });
+                TeeSink tee { sink, progressSink };
+                srcStore->narFromPath(storePath, tee);
+                nrDone++;
+                showProgress();
+            }});
+        }
+
+        if (!pathsToCopy.empty()) {
+            act.setExpected(actCopyPath, totalNarSize);
+            dstStore->addMultipleToStore(pathsToCopy, repair, checkSigs);
+            return pathsMap;
+        }
+    }
+
+    /* When copying to a binary cache, fetching, compressing and
+       uploading a NAR doesn't require its references to be present,
+       only writing its .narinfo does. So upload all NARs
+       concurrently, and write each .narinfo as soon as those of its
+       references have been written. */
+    auto binaryCache = dstStore.dynamic_pointer_cast<BinaryCacheStore>();
+    if (binaryCache && dstStore->storeDir == srcStore->storeDir) {
+        struct State
+        {
+            /* The number of references of each path that haven't
+               been published yet. */
+            std::map<StorePath, size_t> refsLeft;
+            std::map<StorePath, StorePathSet> referrers;
+            std::map<StorePath, ref<NarInfo>> uploaded;
+        };
+
+        Sync<State> state_;
+
+        {
+            auto state(state_.lock());
+            for (auto & storePath : missing) {
+                auto info = srcStore->queryPathInfo(storePath);
+                bytesExpected += info->narSize;
+                size_t refsLeft = 0;
+                for (auto & ref : info->references)
+                    if (ref != storePath && missing.count(ref)) {
+                        refsLeft++;
+                        state->referrers[ref].insert(storePath);
+                    }
+                state->refsLeft.emplace(storePath, refsLeft);
+            }
+        }
+
+        act.setExpected(actCopyPath, bytesExpected);
+
+        ThreadPool pool;
+
+        std::function<void(ref<NarInfo>)> publish;
+
+        publish = [&](ref<NarInfo> narInfo) {
+            checkInterrupt();
+
+            binaryCache->publishNarInfo(narInfo);
+
+            nrDone++;
+            showProgress();
+
+            std::vector<ref<NarInfo>> ready;
+            {
+                auto state(state_.lock());
+                for (auto & referrer : state->referrers[narInfo->path])
+                    if (--state->refsLeft[referrer] == 0) {
+                        auto i = state->uploaded.find(referrer);
+                        if (i != state->uploaded.end())
+                            ready.push_back(i->second);
+                    }
+            }
+
+            for (auto & narInfo2 : ready)
+                pool.enqueue([&publish, narInfo2]() { publish(narInfo2); });
+        };
+
+        auto upload = [&](const StorePath & storePath) {
+            checkInterrupt();
+
+            auto info = srcStore->queryPathInfo(storePath);
+            ValidPathInfo infoForDst = *info;
+            infoForDst.ultimate = false;
+
+            std::shared_ptr<NarInfo> narInfo;
+
+            {
+                Activity act2(*logger, lvlInfo, actCopyPath,
+                    copyPathMessage(srcStore, dstStore, storePath),
+                    {srcStore->printStorePath(storePath), srcStore->getUri(), dstStore->getUri()});
+                MaintainCount<decltype(nrRunning)> mc(nrRunning);
+                showProgress();
+                try {
+                    uint64_t total = 0;
+                    auto source = sinkToSource([&](Sink & sink) {
+                        LambdaSink progressSink([&](std::string_view data) {
+                            total += data.size();
+                            act2.progress(total, info->narSize);
+                        });
+                        TeeSink tee { sink, progressSink };
+                        srcStore->narFromPath(storePath, tee);
+                    }, [&]() {
+                        throw EndOfFile("NAR for '%s' fetched from '%s' is incomplete", srcStore->printStorePath(storePath), srcStore->getUri());
+                    });
+                    narInfo = binaryCache->addToStoreUnpublished(infoForDst, *source, repair);
+                } catch (Error & e) {
+                    nrFailed++;
+                    if (!settings.keepGoing)
+                        throw;
+                    logger->log(lvlError, fmt("could not copy %s: %s", dstStore->printStorePath(storePath), e.what()));
+                    showProgress();
+                    return;
+                }
+            }
+
+            bool ready;
+            {
+                auto state(state_.lock());
+                state->uploaded.insert_or_assign(storePath, ref<NarInfo>(narInfo));
+                ready = state->refsLeft[storePath] == 0;
+            }
+
+            if (ready) publish(ref<NarInfo>(narInfo));
+        };
+
+        /* Start with the paths without references, so that
+           publishing can begin early. */
+        auto sorted = srcStore->topoSortPaths(missing);
+        std::reverse(sorted.begin(), sorted.end());
+
+        for (auto & storePath : sorted)
+            pool.enqueue([&upload, storePath]() { upload(storePath); });
+
+        pool.process();
+
+        /* With --keep-going, paths whose references failed to copy
+           have been uploaded but not published. */
+        auto state(state_.lock());
+        for (auto & [storePath, narInfo] : state->uploaded)
+            if (state->refsLeft[storePath]) {
+                nrFailed++;
+                logger->log(lvlError, fmt("could not copy %s: some of its references could not be copied",
+                        dstStore->printStorePath(storePath)));
+            }
+        showProgress();
+
+        return pathsMap;
+    }
+
     ThreadPool pool;
 
     processGraph<StorePath>(pool,
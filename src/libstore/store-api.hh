@@ -169,6 +169,11 @@ struct BuildResult
        was repeated). */
     time_t startTime = 0, stopTime = 0;
 
+    /* The time spent in each phase of the build (such as
+       `startBuilder' or `registerOutputs'), in microseconds, summed
+       over all rounds. */
+    std::map<std::string, uint64_t> timings;
+
     bool success() {
         return status == Built || status == Substituted || status == AlreadyValid;
     }
@@ -198,12 +203,34 @@ struct StoreConfig : public Config
 
     Setting<bool> wantMassQuery{this, false, "want-mass-query", "whether this substituter can be queried efficiently for path validity"};
 
+    Setting<unsigned int> substitutionJobs{this, 0, "substitution-jobs", "maximum number of paths substituted from this store at the same time (0 means no limit beyond the global 'max-substitution-jobs')"};
+
     Setting<StringSet> systemFeatures{this, getDefaultSystemFeatures(),
         "system-features",
         "Optional features that the system this store builds on implements (like \"kvm\")."};
 
 };
 
+/* A histogram of the latency of some operation. It only consists of
+   atomics, so it can also live in memory shared between processes. */
+struct LatencyHistogram
+{
+    /* Upper bounds of the buckets, in microseconds. */
+    static constexpr uint64_t bounds[] = { 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+    static constexpr size_t nrBuckets = sizeof(bounds) / sizeof(bounds[0]);
+
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> totalMicros{0};
+
+    /* Cumulative, i.e. `buckets[i]' counts the operations that took
+       at most `bounds[i]'. */
+    std::atomic<uint64_t> buckets[nrBuckets]{};
+
+    void record(std::chrono::steady_clock::duration duration);
+
+    void toJSON(JSONPlaceholder & jsonOut) const;
+};
+
 class Store : public std::enable_shared_from_this<Store>, public virtual StoreConfig
 {
 public:
@@ -236,7 +263,18 @@ protected:
         LRUCache<std::string, PathInfoCacheValue> pathInfoCache;
     };
 
-    Sync<State> state;
+    /* The path info cache is split into shards selected by the hash
+       part, each with its own lock, so that threads looking up
+       different paths (e.g. in queryValidPaths() or
+       computeFSClosure()) don't all contend on a single mutex. */
+    static constexpr size_t pathInfoCacheShards = 16;
+
+    std::vector<std::unique_ptr<Sync<State>>> states;
+
+    Sync<State> & state(std::string_view hashPart)
+    {
+        return *states[std::hash<std::string_view>()(hashPart) % states.size()];
+    }
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
@@ -370,6 +408,12 @@ public:
     void queryPathInfo(const StorePath & path,
         Callback<ref<const ValidPathInfo>> callback) noexcept;
 
+    /* Fetch the path info of all the given paths that aren't cached
+       yet, concurrently, and add it to the in-memory and disk caches.
+       The latter is updated in a single transaction. Errors are
+       ignored; later queries will simply miss the cache. */
+    void prefetchPathInfos(const StorePathSet & paths);
+
     /* Check whether the given valid path info is sufficiently attested, by
        either being signed by a trusted public key or content-addressed, in
        order to be included in the given store.
@@ -395,10 +439,24 @@ protected:
     virtual void queryPathInfoUncached(const StorePath & path,
         Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept = 0;
 
+    /* Fetch the path info of several paths, for
+       prefetchPathInfos(). The result is indexed by hash part; a null
+       value means that the path is not valid, and paths that could
+       not be queried are omitted. The default implementation issues
+       concurrent queryPathInfoUncached() calls. */
+    virtual std::map<std::string, std::shared_ptr<const ValidPathInfo>>
+        queryPathInfosUncached(const StorePathSet & paths);
+
 public:
 
     virtual std::optional<const Realisation> queryRealisation(const DrvOutput &) = 0;
 
+    /* Query the realisations of several derivation outputs at once.
+       Outputs that have no realisation are omitted from the result.
+       The default implementation calls queryRealisation() for each
+       output. */
+    virtual std::map<DrvOutput, Realisation> queryRealisations(const std::set<DrvOutput> & ids);
+
     /* Queries the set of incoming FS references for a store path.
        The result is not cleared. */
     virtual void queryReferrers(const StorePath & path, StorePathSet & referrers)
@@ -440,6 +498,18 @@ public:
     virtual void addToStore(const ValidPathInfo & info, Source & narSource,
         RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs) = 0;
 
+    /* Paths to import, each with a function that writes its NAR to
+       the given sink. */
+    typedef std::vector<std::pair<ValidPathInfo, std::function<void(Sink &)>>> PathsSource;
+
+    /* Import several paths into the store, in the given order, which
+       must be topological (references first). The default calls
+       addToStore() for each path; remote stores send them all in a
+       single request. The info of each path must include its NAR
+       size. */
+    virtual void addMultipleToStore(PathsSource & pathsToCopy,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs);
+
     /* Copy the contents of a path to the store and register the
        validity the resulting path.  The resulting path is returned.
        The function object `filter' can be used to exclude files (see
@@ -470,6 +540,19 @@ public:
     virtual StorePath addTextToStore(const string & name, const string & s,
         const StorePathSet & references, RepairFlag repair = NoRepair) = 0;
 
+    /* Like addTextToStore(), but the store may postpone adding the
+       path until the next operation that could observe it, or until
+       flushDeferredTexts() is called. This lets stores batch many
+       small additions, such as the derivations written during
+       evaluation. */
+    virtual StorePath addTextToStoreDeferred(const string & name, const string & s,
+        const StorePathSet & references)
+    { return addTextToStore(name, s, references); }
+
+    /* Add the paths postponed by addTextToStoreDeferred() to the
+       store. */
+    virtual void flushDeferredTexts() { }
+
     /**
      * Add a mapping indicating that `deriver!outputName` maps to the output path
      * `output`.
@@ -693,6 +776,18 @@ public:
         std::atomic<uint64_t> narWriteBytes{0};
         std::atomic<uint64_t> narWriteCompressedBytes{0};
         std::atomic<uint64_t> narWriteCompressionTimeMs{0};
+
+        /* Time taken by NAR info lookups that were not answered from
+           a cache, whether the path exists or not. */
+        LatencyHistogram narInfoReadLatency;
+
+        /* Time taken to fetch (and decompress) NARs. */
+        LatencyHistogram narReadLatency;
+
+        /* Write these statistics, together with the hit ratio of NAR
+           info lookups, the download rate and the compression ratio of
+           NARs. */
+        void toJSON(JSONPlaceholder & jsonOut) const;
     };
 
     const Stats & getStats();
@@ -706,7 +801,8 @@ public:
        occasionally flush their path info cache. */
     void clearPathInfoCache()
     {
-        state.lock()->pathInfoCache.clear();
+        for (auto & state : states)
+            state->lock()->pathInfoCache.clear();
     }
 
     /* Establish a connection to the store, for store types that have
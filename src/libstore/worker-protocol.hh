@@ -9,10 +9,37 @@ namespace nix {
 #define WORKER_MAGIC_1 0x6e697863
 #define WORKER_MAGIC_2 0x6478696f
 
-#define PROTOCOL_VERSION (1 << 8 | 31)
+#define PROTOCOL_VERSION (1 << 8 | 32)
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
+/* Protocol extensions that are not part of the upstream version
+   numbering. The version word of the handshake stays a plain
+   PROTOCOL_VERSION; extensions are negotiated separately:
+
+   - The client announces the extensions it supports in the obsolete
+     `reserveSpace' word, as WORKER_EXT_MAGIC | extensions. Upstream
+     daemons read and ignore that word.
+
+   - A daemon that recognises the announcement replies with
+     STDERR_EXTENSIONS followed by the extensions it supports, ahead
+     of the reply to the handshake. Upstream clients never announce
+     extensions, so they never receive this message.
+
+   An extension is only used if both sides have announced it. */
+#define WORKER_EXT_MAGIC      0x78740000
+#define WORKER_EXT_MAGIC_MASK 0xffff0000
+#define WORKER_EXT_QUERY_PATH_INFOS   (1 << 0)
+#define WORKER_EXT_QUERY_CLOSURE      (1 << 1)
+/* wopQueryRealisations: look up many realisations at once. */
+#define WORKER_EXT_QUERY_REALISATIONS (1 << 2)
+/* Per-phase timings in the result of wopBuildDerivation. */
+#define WORKER_EXT_BUILD_TIMINGS      (1 << 3)
+#define WORKER_EXTENSIONS \
+    (WORKER_EXT_QUERY_PATH_INFOS | WORKER_EXT_QUERY_CLOSURE \
+     | WORKER_EXT_QUERY_REALISATIONS | WORKER_EXT_BUILD_TIMINGS)
+#define HAS_WORKER_EXT(x, ext) (((x) & (ext)) != 0)
+
 
 typedef enum {
     wopIsValidPath = 1,
@@ -55,6 +82,14 @@ typedef enum {
     wopQueryDerivationOutputMap = 41,
     wopRegisterDrvOutput = 42,
     wopQueryRealisation = 43,
+    wopAddMultipleToStore = 44,
+    // 45 and 46 are used upstream (AddBuildLog, BuildPathsWithResults).
+
+    /* Operations of protocol extensions, numbered clear of upstream's
+       operations. */
+    wopQueryPathInfos = 1000, // WORKER_EXT_QUERY_PATH_INFOS
+    wopQueryClosure = 1001, // WORKER_EXT_QUERY_CLOSURE
+    wopQueryRealisations = 1002, // WORKER_EXT_QUERY_REALISATIONS
 } WorkerOp;
 
 
@@ -66,6 +101,7 @@ typedef enum {
 #define STDERR_START_ACTIVITY 0x53545254
 #define STDERR_STOP_ACTIVITY  0x53544f50
 #define STDERR_RESULT         0x52534c54
+#define STDERR_EXTENSIONS     0x45585453 // extensions supported by the daemon
 
 
 class Store;
@@ -89,6 +125,7 @@ MAKE_WORKER_PROTO(, ContentAddress);
 MAKE_WORKER_PROTO(, DerivedPath);
 MAKE_WORKER_PROTO(, Realisation);
 MAKE_WORKER_PROTO(, DrvOutput);
+MAKE_WORKER_PROTO(, ValidPathInfo);
 
 MAKE_WORKER_PROTO(template<typename T>, std::vector<T>);
 MAKE_WORKER_PROTO(template<typename T>, std::set<T>);
@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <atomic>
 
 #include <strings.h> // for strcasecmp
 
@@ -11,9 +12,17 @@
 #include <dirent.h>
 #include <fcntl.h>
 
+#if __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
 #include "archive.hh"
 #include "util.hh"
 #include "config.hh"
+#include "thread-pool.hh"
+#include "finally.hh"
 
 namespace nix {
 
@@ -29,6 +38,9 @@ struct ArchiveSettings : Config
         "Whether to enable a Darwin-specific hack for dealing with file name collisions."};
     Setting<bool> preallocateContents{this, false, "preallocate-contents",
         "Whether to preallocate files when writing objects with known size."};
+    Setting<unsigned int> restoreThreads{this, 4, "restore-threads",
+        "The number of threads used to write small files when unpacking a NAR archive. "
+        "Set to 1 to write all files in the unpacking thread."};
 };
 
 static ArchiveSettings archiveSettings;
@@ -42,17 +54,70 @@ static string caseHackSuffix = "~nix~case~hack~";
 PathFilter defaultPathFilter = [](const Path &) { return true; };
 
 
-static void dumpContents(const Path & path, size_t size,
+/* The number of regular files in a directory that are opened ahead
+   of the one being dumped. */
+static const size_t prefetchFiles = 8;
+
+
+struct DumpState
+{
+    /* The read buffer, shared by all files. */
+    std::vector<char> buf;
+
+    /* Files that were opened ahead of time, so that the kernel reads
+       them in while earlier entries are being dumped. */
+    std::map<Path, AutoCloseFD> prefetched;
+};
+
+
+static void prefetch(DumpState & state, const Path & path)
+{
+    if (state.prefetched.count(path)) return;
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    /* Errors are reported when the file is actually dumped. */
+    if (!fd) return;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd.get(), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    state.prefetched.emplace(path, std::move(fd));
+}
+
+
+static void dumpContents(DumpState & state, const Path & path, size_t size,
     Sink & sink)
 {
     sink << "contents" << size;
 
-    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
-    if (!fd) throw SysError("opening file '%1%'", path);
+    AutoCloseFD fd;
+    if (auto i = state.prefetched.find(path); i != state.prefetched.end()) {
+        fd = std::move(i->second);
+        state.prefetched.erase(i);
+    } else {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) throw SysError("opening file '%1%'", path);
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* Let the kernel read ahead aggressively while we are busy hashing
+       or copying the part that has already been read. */
+    if (size > 65536)
+        posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-    std::vector<char> buf(65536);
     size_t left = size;
 
+    /* If we're writing to a file descriptor (e.g. the daemon sending
+       a NAR to a client), let the kernel copy large files to it
+       directly. */
+    if (auto fdSink = dynamic_cast<FdSink *>(&sink); fdSink && size > 65536)
+        left -= fdSink->sendFile(fd.get(), size);
+
+    /* Most files in a source tree are small, so only grow the shared
+       buffer as far as needed. */
+    auto & buf = state.buf;
+    if (buf.size() < std::min(left, (size_t) 65536))
+        buf.resize(std::min(left, (size_t) 65536));
+
     while (left > 0) {
         auto n = std::min(left, buf.size());
         readFull(fd.get(), buf.data(), n);
@@ -64,7 +129,7 @@ static void dumpContents(const Path & path, size_t size,
 }
 
 
-static void dump(const Path & path, Sink & sink, PathFilter & filter)
+static void dump(DumpState & state, const Path & path, Sink & sink, PathFilter & filter)
 {
     checkInterrupt();
 
@@ -76,7 +141,7 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
         sink << "type" << "regular";
         if (st.st_mode & S_IXUSR)
             sink << "executable" << "";
-        dumpContents(path, (size_t) st.st_size, sink);
+        dumpContents(state, path, (size_t) st.st_size, sink);
     }
 
     else if (S_ISDIR(st.st_mode)) {
@@ -84,7 +149,7 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 
         /* If we're on a case-insensitive system like macOS, undo
            the case hack applied by restorePath(). */
-        std::map<string, string> unhacked;
+        std::map<string, std::pair<string, unsigned char>> unhacked;
         for (auto & i : readDirectory(path))
             if (archiveSettings.useCaseHack) {
                 string name(i.name);
@@ -95,18 +160,27 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
                 }
                 if (unhacked.find(name) != unhacked.end())
                     throw Error("file name collision in between '%1%' and '%2%'",
-                       (path + "/" + unhacked[name]),
+                       (path + "/" + unhacked[name].first),
                        (path + "/" + i.name));
-                unhacked[name] = i.name;
+                unhacked[name] = {i.name, i.type};
             } else
-                unhacked[i.name] = i.name;
+                unhacked[i.name] = {i.name, i.type};
 
+        std::vector<std::pair<string, std::pair<string, unsigned char>>> entries;
         for (auto & i : unhacked)
-            if (filter(path + "/" + i.first)) {
-                sink << "entry" << "(" << "name" << i.first << "node";
-                dump(path + "/" + i.second, sink, filter);
-                sink << ")";
-            }
+            if (filter(path + "/" + i.first))
+                entries.push_back(i);
+
+        for (size_t n = 0; n < entries.size(); ++n) {
+            /* Keep the next few regular files open ahead of time. */
+            for (size_t m = n; m < entries.size() && m < n + prefetchFiles; ++m)
+                if (entries[m].second.second == DT_REG)
+                    prefetch(state, path + "/" + entries[m].second.first);
+
+            sink << "entry" << "(" << "name" << entries[n].first << "node";
+            dump(state, path + "/" + entries[n].second.first, sink, filter);
+            sink << ")";
+        }
     }
 
     else if (S_ISLNK(st.st_mode))
@@ -121,7 +195,8 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 void dumpPath(const Path & path, Sink & sink, PathFilter & filter)
 {
     sink << narVersionMagic1;
-    dump(path, sink, filter);
+    DumpState state;
+    dump(state, path, sink, filter);
 }
 
 
@@ -295,11 +370,63 @@ void parseDump(ParseSink & sink, Source & source)
 }
 
 
+/* Files up to this size are written by the thread pool, if any. */
+static const uint64_t maxPooledFileSize = 1024 * 1024;
+
+/* The maximum number of bytes of pooled file contents held in memory
+   at any time. */
+static const uint64_t maxPooledBytes = 32 * 1024 * 1024;
+
+
 struct RestoreSink : ParseSink
 {
     Path dstPath;
     AutoCloseFD fd;
 
+    struct PooledFile
+    {
+        Path path;
+        bool executable = false;
+        uint64_t size = 0;
+        std::string contents;
+    };
+
+    /* The file being received, if it is going to the pool. */
+    Path curPath;
+    bool curExecutable = false;
+    std::optional<PooledFile> pooled;
+
+    Sync<uint64_t> pooledBytes_{0};
+    std::condition_variable pooledBytesDone;
+    std::atomic<bool> poolFailed{false};
+
+    /* The error of the first write that failed. Once that happens,
+       the pool refuses new work with ThreadPoolShutDown, which must
+       not hide the actual error. */
+    Sync<std::exception_ptr> poolError;
+
+    void rethrowPoolError()
+    {
+        if (auto e = *poolError.lock())
+            std::rethrow_exception(e);
+    }
+
+    /* Writing a file costs several system calls, so for NARs with
+       many small files the unpacking thread spends most of its time
+       waiting for the kernel. Therefore small files are collected in
+       memory and written by a thread pool. Directories and symlinks
+       are still created in order by the unpacking thread, so a
+       file's directory always exists before the file is written.
+       (This is declared last so that its workers are stopped before
+       the state above is destroyed.) */
+    std::unique_ptr<ThreadPool> pool;
+
+    RestoreSink()
+    {
+        if (archiveSettings.restoreThreads > 1)
+            pool = std::make_unique<ThreadPool>(archiveSettings.restoreThreads);
+    }
+
     void createDirectory(const Path & path) override
     {
         Path p = dstPath + path;
@@ -310,21 +437,60 @@ struct RestoreSink : ParseSink
     void createRegularFile(const Path & path) override
     {
         Path p = dstPath + path;
+        if (pool) {
+            /* Defer creating the file until we know its size. */
+            fd = -1;
+            curPath = p;
+            curExecutable = false;
+            return;
+        }
+        openFile(p);
+    }
+
+    void openFile(const Path & p)
+    {
         fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
         if (!fd) throw SysError("creating file '%1%'", p);
     }
 
     void isExecutable() override
+    {
+        if (pool) {
+            curExecutable = true;
+            return;
+        }
+        makeExecutable();
+    }
+
+    void makeExecutable()
+    {
+        makeExecutable(fd.get());
+    }
+
+    static void makeExecutable(int fd)
     {
         struct stat st;
-        if (fstat(fd.get(), &st) == -1)
+        if (fstat(fd, &st) == -1)
             throw SysError("fstat");
-        if (fchmod(fd.get(), st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+        if (fchmod(fd, st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
             throw SysError("fchmod");
     }
 
     void preallocateContents(uint64_t len) override
     {
+        if (pool) {
+            if (len <= maxPooledFileSize) {
+                pooled = PooledFile { .path = curPath, .executable = curExecutable, .size = len };
+                pooled->contents.reserve(len);
+                if (!len) submit();
+                return;
+            }
+            /* Large files are written directly, since the pool
+               wouldn't save much relative to the cost of the data. */
+            openFile(curPath);
+            if (curExecutable) makeExecutable();
+        }
+
         if (!archiveSettings.preallocateContents)
             return;
 
@@ -343,6 +509,11 @@ struct RestoreSink : ParseSink
 
     void receiveContents(std::string_view data) override
     {
+        if (pooled) {
+            pooled->contents.append(data);
+            if (pooled->contents.size() == pooled->size) submit();
+            return;
+        }
         writeFull(fd.get(), data);
     }
 
@@ -351,6 +522,69 @@ struct RestoreSink : ParseSink
         Path p = dstPath + path;
         nix::createSymlink(target, p);
     }
+
+    /* Hand the completely received file to the pool, waiting if too
+       much data is already queued. */
+    void submit()
+    {
+        auto file = std::make_shared<PooledFile>(std::move(*pooled));
+        pooled.reset();
+
+        {
+            auto pooledBytes(pooledBytes_.lock());
+            while (*pooledBytes && *pooledBytes + file->size > maxPooledBytes && !poolFailed)
+                pooledBytes.wait(pooledBytesDone);
+            *pooledBytes += file->size;
+        }
+
+        /* If a write failed, the pool has stopped; rethrow its
+           error. */
+        if (poolFailed) finish();
+
+        try {
+            enqueue(file);
+        } catch (ThreadPoolShutDown &) {
+            rethrowPoolError();
+            throw;
+        }
+    }
+
+    void enqueue(std::shared_ptr<PooledFile> file)
+    {
+        pool->enqueue([this, file]() {
+            Finally release([&]() {
+                *pooledBytes_.lock() -= file->size;
+                pooledBytesDone.notify_one();
+            });
+
+            try {
+                AutoCloseFD fd = open(file->path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+                if (!fd) throw SysError("creating file '%1%'", file->path);
+                if (file->executable) makeExecutable(fd.get());
+                writeFull(fd.get(), file->contents);
+                fd.close();
+            } catch (...) {
+                {
+                    auto poolError_(poolError.lock());
+                    if (!*poolError_) *poolError_ = std::current_exception();
+                }
+                poolFailed = true;
+                throw;
+            }
+        });
+    }
+
+    /* Wait for the pool to write all files. */
+    void finish()
+    {
+        if (!pool) return;
+        try {
+            pool->process();
+        } catch (...) {
+            rethrowPoolError();
+            throw;
+        }
+    }
 };
 
 
@@ -359,6 +593,7 @@ void restorePath(const Path & path, Source & source)
     RestoreSink sink;
     sink.dstPath = path;
     parseDump(sink, source);
+    sink.finish();
 }
 
 
@@ -375,12 +610,77 @@ void copyNAR(Source & source, Sink & sink)
 }
 
 
+FileCopyMethod copyFileContents(int fromFd, int toFd, const Path & from)
+{
+#ifdef FICLONE
+    if (ioctl(toFd, FICLONE, fromFd) == 0) return FileCopyMethod::Clone;
+#endif
+
+#ifdef SYS_copy_file_range
+    while (true) {
+        auto n = syscall(SYS_copy_file_range, fromFd, nullptr, toFd, nullptr, (size_t) 1 << 30, 0);
+        if (n > 0) continue;
+        if (n == 0) return FileCopyMethod::CopyFileRange;
+        if (errno == EINTR) continue;
+        /* Not supported on this kernel or between these file
+           systems. Fall back to copying the rest ourselves (the file
+           offsets have been advanced past what was copied). */
+        if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+            break;
+        throw SysError("copying '%s'", from);
+    }
+#endif
+
+    std::vector<char> buf(65536);
+    while (true) {
+        auto n = read(fromFd, buf.data(), buf.size());
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("reading file '%s'", from);
+        }
+        if (n == 0) return FileCopyMethod::ReadWrite;
+        writeFull(toFd, {buf.data(), (size_t) n});
+    }
+}
+
+
 void copyPath(const Path & from, const Path & to)
 {
-    auto source = sinkToSource([&](Sink & sink) {
-        dumpPath(from, sink);
-    });
-    restorePath(to, *source);
+    /* This is equivalent to restorePath(to, dumpPath(from)), i.e. only
+       file types, contents and the executable bit are preserved. */
+    checkInterrupt();
+
+    auto st = lstat(from);
+
+    if (S_ISDIR(st.st_mode)) {
+        if (mkdir(to.c_str(), 0777) == -1)
+            throw SysError("creating directory '%1%'", to);
+        for (auto & i : readDirectory(from))
+            copyPath(from + "/" + i.name, to + "/" + i.name);
+    }
+
+    else if (S_ISLNK(st.st_mode))
+        createSymlink(readLink(from), to);
+
+    else if (S_ISREG(st.st_mode)) {
+        AutoCloseFD fromFd = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fromFd) throw SysError("opening file '%1%'", from);
+
+        AutoCloseFD toFd = open(to.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+        if (!toFd) throw SysError("creating file '%1%'", to);
+
+        if (st.st_mode & S_IXUSR) {
+            struct stat st2;
+            if (fstat(toFd.get(), &st2) == -1)
+                throw SysError("fstat");
+            if (fchmod(toFd.get(), st2.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+                throw SysError("fchmod");
+        }
+
+        copyFileContents(fromFd.get(), toFd.get(), from);
+    }
+
+    else throw Error("file '%1%' has an unsupported type", from);
 }
 
 
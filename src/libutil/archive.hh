@@ -97,6 +97,13 @@ void copyNAR(Source & source, Sink & sink);
 
 void copyPath(const Path & from, const Path & to);
 
+enum struct FileCopyMethod { Clone, CopyFileRange, ReadWrite };
+
+/* Copy the contents of `fromFd' to `toFd', preferably without going
+   through user space: by sharing the extents (on btrfs, XFS etc.), or
+   else by an in-kernel copy. Returns how the data was copied. */
+FileCopyMethod copyFileContents(int fromFd, int toFd, const Path & from);
+
 
 extern const std::string narVersionMagic1;
 
@@ -0,0 +1,220 @@
+#include "blake3.hh"
+
+#include <cstring>
+#include <algorithm>
+
+namespace nix {
+
+/* This follows the structure of the BLAKE3 reference
+   implementation. */
+
+static const uint32_t blake3IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t msgPermutation[16] = {
+    2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8,
+};
+
+enum : uint32_t {
+    chunkStart = 1 << 0,
+    chunkEnd = 1 << 1,
+    parent = 1 << 2,
+    root = 1 << 3,
+};
+
+
+static inline uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+
+static inline void g(uint32_t * state, int a, int b, int c, int d, uint32_t mx, uint32_t my)
+{
+    state[a] = state[a] + state[b] + mx;
+    state[d] = rotr(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];
+    state[b] = rotr(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + my;
+    state[d] = rotr(state[d] ^ state[a], 8);
+    state[c] = state[c] + state[d];
+    state[b] = rotr(state[b] ^ state[c], 7);
+}
+
+
+static void compress(const uint32_t cv[8], const uint32_t blockWords[16],
+    uint64_t counter, uint32_t blockLen, uint32_t flags, uint32_t out[16])
+{
+    uint32_t state[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        blake3IV[0], blake3IV[1], blake3IV[2], blake3IV[3],
+        (uint32_t) counter, (uint32_t) (counter >> 32), blockLen, flags,
+    };
+
+    uint32_t m[16];
+    memcpy(m, blockWords, sizeof(m));
+
+    for (int round = 0; round < 7; ++round) {
+        g(state, 0, 4, 8, 12, m[0], m[1]);
+        g(state, 1, 5, 9, 13, m[2], m[3]);
+        g(state, 2, 6, 10, 14, m[4], m[5]);
+        g(state, 3, 7, 11, 15, m[6], m[7]);
+        g(state, 0, 5, 10, 15, m[8], m[9]);
+        g(state, 1, 6, 11, 12, m[10], m[11]);
+        g(state, 2, 7, 8, 13, m[12], m[13]);
+        g(state, 3, 4, 9, 14, m[14], m[15]);
+
+        uint32_t permuted[16];
+        for (int i = 0; i < 16; ++i)
+            permuted[i] = m[msgPermutation[i]];
+        memcpy(m, permuted, sizeof(m));
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        out[i] = state[i] ^ state[i + 8];
+        out[i + 8] = state[i + 8] ^ cv[i];
+    }
+}
+
+
+static void wordsFromBytes(const uint8_t * bytes, uint32_t * words, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        words[i] =
+            (uint32_t) bytes[i * 4]
+            | ((uint32_t) bytes[i * 4 + 1] << 8)
+            | ((uint32_t) bytes[i * 4 + 2] << 16)
+            | ((uint32_t) bytes[i * 4 + 3] << 24);
+}
+
+
+/* The inputs of a compression that hasn't been performed yet, either
+   to produce a chaining value or the root output. */
+struct Output
+{
+    uint32_t inputCV[8];
+    uint32_t blockWords[16];
+    uint64_t counter;
+    uint32_t blockLen;
+    uint32_t flags;
+
+    void chainingValue(uint32_t cv[8]) const
+    {
+        uint32_t out[16];
+        compress(inputCV, blockWords, counter, blockLen, flags, out);
+        memcpy(cv, out, 8 * sizeof(uint32_t));
+    }
+
+    void rootBytes(uint8_t * bytes, size_t len) const
+    {
+        uint32_t out[16];
+        compress(inputCV, blockWords, 0, blockLen, flags | root, out);
+        for (size_t i = 0; i < len; ++i)
+            bytes[i] = (uint8_t) (out[i / 4] >> (8 * (i % 4)));
+    }
+};
+
+
+static Output parentOutput(const uint32_t left[8], const uint32_t right[8])
+{
+    Output o;
+    memcpy(o.inputCV, blake3IV, sizeof(o.inputCV));
+    memcpy(o.blockWords, left, 8 * sizeof(uint32_t));
+    memcpy(o.blockWords + 8, right, 8 * sizeof(uint32_t));
+    o.counter = 0;
+    o.blockLen = Blake3Ctx::blockLen;
+    o.flags = parent;
+    return o;
+}
+
+
+static Output chunkOutput(const Blake3Ctx & ctx)
+{
+    Output o;
+    memcpy(o.inputCV, ctx.cv, sizeof(o.inputCV));
+    uint8_t block[Blake3Ctx::blockLen] = {};
+    memcpy(block, ctx.block, ctx.blockLength);
+    wordsFromBytes(block, o.blockWords, 16);
+    o.counter = ctx.chunkCounter;
+    o.blockLen = ctx.blockLength;
+    o.flags = chunkEnd | (ctx.blocksCompressed == 0 ? chunkStart : 0);
+    return o;
+}
+
+
+void Blake3Ctx::init()
+{
+    memcpy(cv, blake3IV, sizeof(cv));
+    chunkCounter = 0;
+    memset(block, 0, sizeof(block));
+    blockLength = 0;
+    blocksCompressed = 0;
+    cvStackLen = 0;
+}
+
+
+void Blake3Ctx::update(std::string_view data)
+{
+    auto input = (const uint8_t *) data.data();
+    size_t len = data.size();
+
+    while (len) {
+        /* If the current chunk is complete, finalise it and merge
+           it into the tree of completed subtrees. A chunk is only
+           finalised once more input arrives, since the last chunk
+           needs the root flag. */
+        if (blocksCompressed * blockLen + blockLength == chunkLen) {
+            uint32_t chunkCV[8];
+            chunkOutput(*this).chainingValue(chunkCV);
+
+            uint64_t totalChunks = chunkCounter + 1;
+            while ((totalChunks & 1) == 0) {
+                uint32_t merged[8];
+                parentOutput(cvStack[--cvStackLen], chunkCV).chainingValue(merged);
+                memcpy(chunkCV, merged, sizeof(chunkCV));
+                totalChunks >>= 1;
+            }
+            memcpy(cvStack[cvStackLen++], chunkCV, sizeof(chunkCV));
+
+            memcpy(cv, blake3IV, sizeof(cv));
+            chunkCounter++;
+            blockLength = 0;
+            blocksCompressed = 0;
+        }
+
+        /* Likewise, only compress a full block once more input
+           arrives. */
+        if (blockLength == blockLen) {
+            uint32_t blockWords[16];
+            wordsFromBytes(block, blockWords, 16);
+            uint32_t out[16];
+            compress(cv, blockWords, chunkCounter, blockLen,
+                blocksCompressed == 0 ? chunkStart : 0, out);
+            memcpy(cv, out, sizeof(cv));
+            blocksCompressed++;
+            blockLength = 0;
+        }
+
+        size_t take = std::min(len, (size_t) blockLen - blockLength);
+        memcpy(block + blockLength, input, take);
+        blockLength += take;
+        input += take;
+        len -= take;
+    }
+}
+
+
+void Blake3Ctx::finish(uint8_t * out)
+{
+    auto output = chunkOutput(*this);
+    for (size_t n = cvStackLen; n > 0; --n) {
+        uint32_t rightCV[8];
+        output.chainingValue(rightCV);
+        output = parentOutput(cvStack[n - 1], rightCV);
+    }
+    output.rootBytes(out, hashSize);
+}
+
+}
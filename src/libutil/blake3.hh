@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace nix {
+
+/* A portable implementation of the BLAKE3 hash function (in its
+   default, unkeyed hashing mode with 32 bytes of output). */
+
+struct Blake3Ctx
+{
+    static constexpr size_t hashSize = 32;
+    static constexpr size_t blockLen = 64;
+    static constexpr size_t chunkLen = 1024;
+
+    /* State of the chunk currently being hashed. */
+    uint32_t cv[8];
+    uint64_t chunkCounter;
+    uint8_t block[blockLen];
+    uint8_t blockLength;
+    uint8_t blocksCompressed;
+
+    /* Chaining values of completed subtrees. 54 entries are enough
+       for 2^64 bytes of input. */
+    uint32_t cvStack[54][8];
+    uint8_t cvStackLen;
+
+    void init();
+    void update(std::string_view data);
+    /* Write 'hashSize' bytes of output to 'out'. */
+    void finish(uint8_t * out);
+};
+
+}
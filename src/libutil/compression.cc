@@ -67,13 +67,22 @@ struct ArchiveCompressionSink : CompressionSink
     Sink & nextSink;
     struct archive * archive;
 
-    ArchiveCompressionSink(Sink & nextSink, std::string format, bool parallel) : nextSink(nextSink) {
+    ArchiveCompressionSink(Sink & nextSink, std::string format, bool parallel, int level = COMPRESSION_LEVEL_DEFAULT) : nextSink(nextSink) {
         archive = archive_write_new();
         if (!archive) throw Error("failed to initialize libarchive");
         check(archive_write_add_filter_by_name(archive, format.c_str()), "couldn't initialize compression (%s)");
         check(archive_write_set_format_raw(archive));
-        if (format == "xz" && parallel) {
-            check(archive_write_set_filter_option(archive, format.c_str(), "threads", "0"));
+        /* Only libarchive's xz and zstd filters can use multiple
+           threads; "0" means one thread per core. libarchive < 3.6
+           doesn't know the option for zstd and returns ARCHIVE_WARN,
+           in which case we compress with one thread. */
+        if ((format == "xz" || format == "zstd") && parallel) {
+            auto err = archive_write_set_filter_option(archive, format.c_str(), "threads", "0");
+            if (err != ARCHIVE_WARN) check(err);
+        }
+        if (level != COMPRESSION_LEVEL_DEFAULT) {
+            check(archive_write_set_filter_option(archive, format.c_str(), "compression-level", std::to_string(level).c_str()),
+                "couldn't set compression level (%s)");
         }
         // disable internal buffering
         check(archive_write_set_bytes_per_block(archive, 0));
@@ -213,11 +222,16 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     BrotliEncoderState * state;
     bool finished = false;
 
-    BrotliCompressionSink(Sink & nextSink) : nextSink(nextSink)
+    BrotliCompressionSink(Sink & nextSink, int level = COMPRESSION_LEVEL_DEFAULT) : nextSink(nextSink)
     {
+        if (level != COMPRESSION_LEVEL_DEFAULT
+            && (level < BROTLI_MIN_QUALITY || level > BROTLI_MAX_QUALITY))
+            throw CompressionError("invalid brotli compression level %d", level);
         state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
         if (!state)
             throw CompressionError("unable to initialise brotli encoder");
+        if (level != COMPRESSION_LEVEL_DEFAULT)
+            BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, level);
     }
 
     ~BrotliCompressionSink()
@@ -259,26 +273,26 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     }
 };
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel)
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel, int level)
 {
     std::vector<std::string> la_supports = {
         "bzip2", "compress", "grzip", "gzip", "lrzip", "lz4", "lzip", "lzma", "lzop", "xz", "zstd"
     };
     if (std::find(la_supports.begin(), la_supports.end(), method) != la_supports.end()) {
-        return make_ref<ArchiveCompressionSink>(nextSink, method, parallel);
+        return make_ref<ArchiveCompressionSink>(nextSink, method, parallel, level);
     }
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
     else if (method == "br")
-        return make_ref<BrotliCompressionSink>(nextSink);
+        return make_ref<BrotliCompressionSink>(nextSink, level);
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
 
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel)
+ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel, int level)
 {
     StringSink ssink;
-    auto sink = makeCompressionSink(method, ssink, parallel);
+    auto sink = makeCompressionSink(method, ssink, parallel, level);
     (*sink)(in);
     sink->finish();
     return ssink.s;
@@ -19,9 +19,12 @@ ref<std::string> decompress(const std::string & method, const std::string & in);
 
 std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
 
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false);
+/* Use the compression method's own default level. */
+const int COMPRESSION_LEVEL_DEFAULT = -1;
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false);
+ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false, int level = COMPRESSION_LEVEL_DEFAULT);
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false, int level = COMPRESSION_LEVEL_DEFAULT);
 
 MakeError(UnknownCompressionMethod, Error);
 
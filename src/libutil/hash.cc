@@ -1,10 +1,12 @@
 #include <iostream>
+#include <array>
 #include <cstring>
 
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 
 #include "args.hh"
+#include "blake3.hh"
 #include "hash.hh"
 #include "archive.hh"
 #include "split.hh"
@@ -23,12 +25,13 @@ static size_t regularHashSize(HashType type) {
     case htSHA1: return sha1HashSize;
     case htSHA256: return sha256HashSize;
     case htSHA512: return sha512HashSize;
+    case htBLAKE3: return blake3HashSize;
     }
     abort();
 }
 
 
-std::set<std::string> hashTypes = { "md5", "sha1", "sha256", "sha512" };
+std::set<std::string> hashTypes = { "md5", "sha1", "sha256", "sha512", "blake3" };
 
 
 Hash::Hash(HashType type) : type(type)
@@ -90,8 +93,10 @@ static string printHash32(const Hash & hash)
     size_t len = hash.base32Len();
     assert(len);
 
-    string s;
-    s.reserve(len);
+    /* Encode into a stack buffer to get a single allocation for the
+       result. */
+    char buf[(Hash::maxHashSize * 8 + 4) / 5];
+    assert(len <= sizeof(buf));
 
     for (int n = (int) len - 1; n >= 0; n--) {
         unsigned int b = n * 5;
@@ -100,10 +105,10 @@ static string printHash32(const Hash & hash)
         unsigned char c =
             (hash.hash[i] >> j)
             | (i >= hash.hashSize - 1 ? 0 : hash.hash[i + 1] << (8 - j));
-        s.push_back(base32Chars[c & 0x1f]);
+        buf[len - 1 - n] = base32Chars[c & 0x1f];
     }
 
-    return s;
+    return string(buf, len);
 }
 
 
@@ -226,11 +231,17 @@ Hash::Hash(std::string_view rest, HashType type, bool isSRI)
 
     else if (!isSRI && rest.size() == base32Len()) {
 
+        static const auto base32Digits = []() {
+            std::array<unsigned char, 256> table;
+            table.fill(0xff);
+            for (unsigned char digit = 0; digit < base32Chars.size(); ++digit)
+                table[(unsigned char) base32Chars[digit]] = digit;
+            return table;
+        }();
+
         for (unsigned int n = 0; n < rest.size(); ++n) {
             char c = rest[rest.size() - n - 1];
-            unsigned char digit;
-            for (digit = 0; digit < base32Chars.size(); ++digit) /* !!! slow */
-                if (base32Chars[digit] == c) break;
+            unsigned char digit = base32Digits[(unsigned char) c];
             if (digit >= 32)
                 throw BadHash("invalid base-32 hash '%s'", rest);
             unsigned int b = n * 5;
@@ -278,6 +289,7 @@ union Ctx
     SHA_CTX sha1;
     SHA256_CTX sha256;
     SHA512_CTX sha512;
+    Blake3Ctx blake3;
 };
 
 
@@ -287,6 +299,7 @@ static void start(HashType ht, Ctx & ctx)
     else if (ht == htSHA1) SHA1_Init(&ctx.sha1);
     else if (ht == htSHA256) SHA256_Init(&ctx.sha256);
     else if (ht == htSHA512) SHA512_Init(&ctx.sha512);
+    else if (ht == htBLAKE3) ctx.blake3.init();
 }
 
 
@@ -297,6 +310,7 @@ static void update(HashType ht, Ctx & ctx,
     else if (ht == htSHA1) SHA1_Update(&ctx.sha1, data.data(), data.size());
     else if (ht == htSHA256) SHA256_Update(&ctx.sha256, data.data(), data.size());
     else if (ht == htSHA512) SHA512_Update(&ctx.sha512, data.data(), data.size());
+    else if (ht == htBLAKE3) ctx.blake3.update(data);
 }
 
 
@@ -306,6 +320,7 @@ static void finish(HashType ht, Ctx & ctx, unsigned char * hash)
     else if (ht == htSHA1) SHA1_Final(hash, &ctx.sha1);
     else if (ht == htSHA256) SHA256_Final(hash, &ctx.sha256);
     else if (ht == htSHA512) SHA512_Final(hash, &ctx.sha512);
+    else if (ht == htBLAKE3) ctx.blake3.finish(hash);
 }
 
 
@@ -390,6 +405,7 @@ std::optional<HashType> parseHashTypeOpt(std::string_view s)
     else if (s == "sha1") return htSHA1;
     else if (s == "sha256") return htSHA256;
     else if (s == "sha512") return htSHA512;
+    else if (s == "blake3") return htBLAKE3;
     else return std::optional<HashType> {};
 }
 
@@ -409,6 +425,7 @@ string printHashType(HashType ht)
     case htSHA1: return "sha1";
     case htSHA256: return "sha256";
     case htSHA512: return "sha512";
+    case htBLAKE3: return "blake3";
     default:
         // illegal hash type enum value internally, as opposed to external input
         // which should be validated with nice error message.
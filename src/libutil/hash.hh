@@ -10,13 +10,14 @@ namespace nix {
 MakeError(BadHash, Error);
 
 
-enum HashType : char { htMD5 = 42, htSHA1, htSHA256, htSHA512 };
+enum HashType : char { htMD5 = 42, htSHA1, htSHA256, htSHA512, htBLAKE3 };
 
 
 const int md5HashSize = 16;
 const int sha1HashSize = 20;
 const int sha256HashSize = 32;
 const int sha512HashSize = 64;
+const int blake3HashSize = 32;
 
 extern std::set<std::string> hashTypes;
 
@@ -1,8 +1,12 @@
 #include "logging.hh"
 #include "util.hh"
 #include "config.hh"
+#include "sync.hh"
 
 #include <atomic>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
 #include <nlohmann/json.hpp>
 #include <iostream>
 
@@ -253,6 +257,168 @@ Logger * makeJSONLogger(Logger & prevLogger)
     return new JSONLogger(prevLogger);
 }
 
+/* A logger that passes everything on to another logger, and writes
+   each activity as a span in the Chrome trace event format (which
+   chrome://tracing and Perfetto can display) to a file. Events are
+   written as soon as their activity stops, so the file is usable even
+   if Nix is interrupted; the trace format allows the closing bracket
+   to be missing. */
+struct TracingLogger : Logger
+{
+    Logger & prevLogger;
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Span
+    {
+        ActivityType type;
+        std::string text;
+        ActivityId parent;
+        Fields fields;
+        Clock::time_point start;
+        uint64_t thread;
+    };
+
+    struct State
+    {
+        AutoCloseFD fd;
+        std::map<ActivityId, Span> spans;
+        std::map<std::thread::id, uint64_t> threads;
+        Clock::time_point epoch;
+    };
+
+    /* The state of a trace file is shared by all tracing loggers
+       writing to it. The logger gets replaced whenever the log format
+       changes, and the new one must append to the trace rather than
+       truncate it. */
+    std::shared_ptr<Sync<State>> state_;
+
+    static std::shared_ptr<Sync<State>> openTraceFile(const Path & traceFile)
+    {
+        static Sync<std::map<Path, std::shared_ptr<Sync<State>>>> traceFiles_;
+
+        auto traceFiles(traceFiles_.lock());
+        auto & res = (*traceFiles)[traceFile];
+        if (!res) {
+            State state;
+            state.fd = open(traceFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (!state.fd)
+                throw SysError("opening trace file '%s'", traceFile);
+            writeFull(state.fd.get(), "[\n");
+            state.epoch = Clock::now();
+            res = std::make_shared<Sync<State>>(std::move(state));
+        }
+        return res;
+    }
+
+    TracingLogger(Logger & prevLogger, const Path & traceFile)
+        : prevLogger(prevLogger)
+        , state_(openTraceFile(traceFile))
+    {
+    }
+
+    bool isVerbose() override
+    {
+        return prevLogger.isVerbose();
+    }
+
+    void stop() override
+    {
+        prevLogger.stop();
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        prevLogger.log(lvl, fs);
+    }
+
+    void logEI(const ErrorInfo & ei) override
+    {
+        prevLogger.logEI(ei);
+    }
+
+    void warn(const std::string & msg) override
+    {
+        prevLogger.warn(msg);
+    }
+
+    void writeToStdout(std::string_view s) override
+    {
+        prevLogger.writeToStdout(s);
+    }
+
+    std::optional<char> ask(std::string_view s) override
+    {
+        return prevLogger.ask(s);
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        {
+            auto state(state_->lock());
+            /* Number the threads in the order in which they start
+               activities, to get small thread IDs in the trace. */
+            auto thread = state->threads.emplace(std::this_thread::get_id(), state->threads.size()).first->second;
+            state->spans.insert_or_assign(act, Span{type, s, parent, fields, Clock::now(), thread});
+        }
+        prevLogger.startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        auto now = Clock::now();
+        prevLogger.stopActivity(act);
+
+        auto state(state_->lock());
+        auto i = state->spans.find(act);
+        if (i == state->spans.end()) return;
+        auto & span = i->second;
+
+        auto micros = [&](Clock::duration d) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        };
+
+        nlohmann::json json;
+        json["ph"] = "X";
+        json["name"] = span.text.empty() ? fmt("activity type %d", span.type) : span.text;
+        json["cat"] = std::to_string(span.type);
+        json["ts"] = micros(span.start - state->epoch);
+        json["dur"] = micros(now - span.start);
+        /* Activity IDs contain the PID of the process that created
+           them, so activities of the daemon show up as a separate
+           process. */
+        json["pid"] = act >> 32;
+        json["tid"] = span.thread;
+        auto & args = json["args"];
+        args["id"] = act;
+        args["parent"] = span.parent;
+        for (auto & f : span.fields)
+            if (f.type == Logger::Field::tInt)
+                args["fields"].push_back(f.i);
+            else
+                args["fields"].push_back(f.s);
+
+        state->spans.erase(i);
+
+        try {
+            writeFull(state->fd.get(), json.dump() + ",\n");
+        } catch (SysError &) {
+            /* Losing the trace shouldn't break Nix. */
+        }
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        prevLogger.result(act, type, fields);
+    }
+};
+
+Logger * makeTracingLogger(Logger & prevLogger, const Path & traceFile)
+{
+    return new TracingLogger(prevLogger, traceFile);
+}
+
 static Logger::Fields getFields(nlohmann::json & json)
 {
     Logger::Fields fields;
@@ -31,6 +31,8 @@ typedef enum {
     resProgress = 105,
     resSetExpected = 106,
     resPostBuildLogLine = 107,
+    resBuildTimings = 108, // pairs of phase name and time in microseconds
+    resBuildResources = 109, // pairs of resource name and usage
 } ResultType;
 
 typedef uint64_t ActivityId;
@@ -166,6 +168,11 @@ Logger * makeSimpleLogger(bool printBuildLogs = true);
 
 Logger * makeJSONLogger(Logger & prevLogger);
 
+/* Return a logger that passes everything on to `prevLogger', and
+   also records the duration of each activity in `traceFile' in the
+   Chrome trace event format. */
+Logger * makeTracingLogger(Logger & prevLogger, const Path & traceFile);
+
 bool handleJSONLogMessage(const std::string & msg,
     const Activity & act, std::map<ActivityId, Activity> & activities,
     bool trusted);
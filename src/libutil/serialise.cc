@@ -7,6 +7,12 @@
 
 #include <boost/coroutine2/coroutine.hpp>
 
+#include <sys/uio.h>
+
+#if __linux__
+#include <sys/sendfile.h>
+#endif
+
 
 namespace nix {
 
@@ -19,8 +25,10 @@ void BufferedSink::operator () (std::string_view data)
         /* Optimisation: bypass the buffer if the data exceeds the
            buffer size. */
         if (bufPos + data.size() >= bufSize) {
-            flush();
-            write(data);
+            flushAndWrite(data);
+            /* The data didn't fit, so this is probably a bulk
+               transfer: use a bigger buffer for what follows. */
+            maybeGrow();
             break;
         }
         /* Otherwise, copy the bytes to the buffer.  Flush the buffer
@@ -42,6 +50,23 @@ void BufferedSink::flush()
 }
 
 
+void BufferedSink::flushAndWrite(std::string_view data)
+{
+    flush();
+    write(data);
+}
+
+
+void BufferedSink::maybeGrow()
+{
+    assert(bufPos == 0);
+    if (bufSize < maxBufSize) {
+        bufSize = std::min(bufSize * 2, maxBufSize);
+        buffer = decltype(buffer)(new char[bufSize]);
+    }
+}
+
+
 FdSink::~FdSink()
 {
     try { flush(); } catch (...) { ignoreException(); }
@@ -75,6 +100,74 @@ void FdSink::write(std::string_view data)
 }
 
 
+void FdSink::flushAndWrite(std::string_view data)
+{
+    if (bufPos == 0) {
+        write(data);
+        return;
+    }
+
+    std::string_view buffered(buffer.get(), bufPos);
+    bufPos = 0;
+
+    written += buffered.size();
+
+    /* Write the buffer and the data using writev(), falling back
+       to write() for whatever is left after a short write. */
+    try {
+        while (!buffered.empty()) {
+            checkInterrupt();
+            struct iovec iov[2] = {
+                { (void *) buffered.data(), buffered.size() },
+                { (void *) data.data(), data.size() },
+            };
+            ssize_t res = ::writev(fd, iov, 2);
+            if (res == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("writing to file");
+            }
+            auto fromBuffer = std::min((size_t) res, buffered.size());
+            buffered.remove_prefix(fromBuffer);
+            res -= fromBuffer;
+            written += res;
+            data.remove_prefix(res);
+        }
+    } catch (SysError & e) {
+        _good = false;
+        throw;
+    }
+
+    if (!data.empty()) write(data);
+}
+
+
+size_t FdSink::sendFile(int from, size_t size)
+{
+#if __linux__
+    flush();
+    size_t sent = 0;
+    while (sent < size) {
+        checkInterrupt();
+        auto n = sendfile(fd, from, nullptr, size - sent);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            /* Not supported for this kind of file descriptor. */
+            if (sent == 0 && (errno == EINVAL || errno == ENOSYS)) break;
+            _good = false;
+            throw SysError("sending file contents");
+        }
+        /* The file got shorter; let the caller deal with it. */
+        if (n == 0) break;
+        sent += n;
+    }
+    written += sent;
+    return sent;
+#else
+    return 0;
+#endif
+}
+
+
 bool FdSink::good()
 {
     return _good;
@@ -116,9 +209,26 @@ std::string Source::drain()
 
 size_t BufferedSource::read(char * data, size_t len)
 {
+    /* Optimisation: bypass the buffer if it's empty and the caller
+       wants at least as much data as it can hold. */
+    if (!bufPosIn && len >= bufSize)
+        return readUnbuffered(data, len);
+
     if (!buffer) buffer = decltype(buffer)(new char[bufSize]);
 
-    if (!bufPosIn) bufPosIn = readUnbuffered(buffer.get(), bufSize);
+    if (!bufPosIn) {
+        bufPosIn = readUnbuffered(buffer.get(), bufSize);
+        /* If there was enough data to fill the buffer, this is
+           probably a bulk transfer, so use a bigger buffer for the
+           next read. */
+        if (bufPosIn == bufSize && bufSize < maxBufSize) {
+            auto newSize = std::min(bufSize * 2, maxBufSize);
+            auto newBuffer = decltype(buffer)(new char[newSize]);
+            memcpy(newBuffer.get(), buffer.get(), bufPosIn);
+            buffer = std::move(newBuffer);
+            bufSize = newSize;
+        }
+    }
 
     /* Copy out the data in the buffer. */
     size_t n = len > bufPosIn - bufPosOut ? bufPosIn - bufPosOut : len;
@@ -256,13 +366,21 @@ std::unique_ptr<FinishSink> sourceToSink(std::function<void(Source &)> fun)
 }
 
 
+/* sinkToSource() collects small writes (such as the integers and
+   strings making up a NAR) into batches of this size, to avoid a
+   context switch for each of them. */
+static constexpr size_t sinkToSourceBatchSize = 64 * 1024;
+
 std::unique_ptr<Source> sinkToSource(
     std::function<void(Sink &)> fun,
     std::function<void()> eof)
 {
     struct SinkToSource : Source
     {
-        typedef boost::coroutines2::coroutine<std::string> coro_t;
+        /* Chunks are passed as views into memory owned by the
+           producer, which stays valid while the producer is
+           suspended. */
+        typedef boost::coroutines2::coroutine<std::string_view> coro_t;
 
         std::function<void(Sink &)> fun;
         std::function<void()> eof;
@@ -273,23 +391,34 @@ std::unique_ptr<Source> sinkToSource(
         {
         }
 
-        std::string cur;
+        std::string_view cur;
         size_t pos = 0;
 
         size_t read(char * data, size_t len) override
         {
             if (!coro)
                 coro = coro_t::pull_type(VirtualStackAllocator{}, [&](coro_t::push_type & yield) {
+                    std::string batch;
                     LambdaSink sink([&](std::string_view data) {
-                        if (!data.empty()) yield(std::string(data));
+                        if (data.empty()) return;
+                        if (batch.size() + data.size() > sinkToSourceBatchSize && !batch.empty()) {
+                            yield(batch);
+                            batch.clear();
+                        }
+                        if (data.size() >= sinkToSourceBatchSize)
+                            yield(data);
+                        else {
+                            if (batch.capacity() < sinkToSourceBatchSize) batch.reserve(sinkToSourceBatchSize);
+                            batch.append(data);
+                        }
                     });
                     fun(sink);
+                    if (!batch.empty()) yield(batch);
                 });
 
-            if (!*coro) { eof(); abort(); }
-
             if (pos == cur.size()) {
                 if (!cur.empty()) (*coro)();
+                if (!*coro) { eof(); abort(); }
                 cur = coro->get();
                 pos = 0;
             }
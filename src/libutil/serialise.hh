@@ -39,6 +39,11 @@ struct BufferedSink : virtual Sink
     size_t bufSize, bufPos;
     std::unique_ptr<char[]> buffer;
 
+    /* The buffer is doubled every time a write doesn't fit in it, up
+       to this size, so that bulk transfers use fewer, larger
+       writes. */
+    size_t maxBufSize = 1024 * 1024;
+
     BufferedSink(size_t bufSize = 32 * 1024)
         : bufSize(bufSize), bufPos(0), buffer(nullptr) { }
 
@@ -47,6 +52,16 @@ struct BufferedSink : virtual Sink
     void flush();
 
     virtual void write(std::string_view data) = 0;
+
+protected:
+    /* Write the contents of the buffer followed by 'data', which is
+       too large to be buffered. Subclasses can override this to do
+       so in a single system call. */
+    virtual void flushAndWrite(std::string_view data);
+
+    /* Double the size of the buffer, which must be empty, up to
+       maxBufSize. */
+    void maybeGrow();
 };
 
 
@@ -80,6 +95,10 @@ struct BufferedSource : Source
     size_t bufSize, bufPosIn, bufPosOut;
     std::unique_ptr<char[]> buffer;
 
+    /* The buffer is doubled every time a read fills it completely,
+       up to this size. */
+    size_t maxBufSize = 1024 * 1024;
+
     BufferedSource(size_t bufSize = 32 * 1024)
         : bufSize(bufSize), bufPosIn(0), bufPosOut(0), buffer(nullptr) { }
 
@@ -118,8 +137,17 @@ struct FdSink : BufferedSink
 
     void write(std::string_view data) override;
 
+    /* Copy up to `size' bytes from the current offset of file
+       descriptor `from' to this sink without going through a
+       userspace buffer, if the OS supports that. Returns the number
+       of bytes copied; the caller must write the rest itself. */
+    size_t sendFile(int from, size_t size);
+
     bool good() override;
 
+protected:
+    void flushAndWrite(std::string_view data) override;
+
 private:
     bool _good = true;
 };
@@ -17,7 +17,7 @@ static ssize_t callback_read(struct archive * archive, void * _self, const void
     *buffer = self->buffer.data();
 
     try {
-        return self->source->read((char *) self->buffer.data(), 4096);
+        return self->source->read((char *) self->buffer.data(), self->buffer.size());
     } catch (EndOfFile &) {
         return 0;
     } catch (std::exception & err) {
@@ -39,7 +39,12 @@ void TarArchive::check(int err, const std::string & reason)
         throw Error(reason, archive_error_string(this->archive));
 }
 
-TarArchive::TarArchive(Source & source, bool raw) : buffer(4096)
+/* Decompressing and extracting large tarballs (such as Nixpkgs) is
+   dominated by per-call overhead with small reads, so feed libarchive
+   in reasonably large blocks. */
+static constexpr size_t readBlockSize = 65536;
+
+TarArchive::TarArchive(Source & source, bool raw) : buffer(readBlockSize)
 {
     this->archive = archive_read_new();
     this->source = &source;
@@ -62,7 +67,7 @@ TarArchive::TarArchive(const Path & path)
 
     archive_read_support_filter_all(archive);
     archive_read_support_format_all(archive);
-    check(archive_read_open_filename(archive, path.c_str(), 16384), "failed to open archive: %s");
+    check(archive_read_open_filename(archive, path.c_str(), readBlockSize), "failed to open archive: %s");
 }
 
 void TarArchive::close()
@@ -0,0 +1,148 @@
+#include "archive.hh"
+#include "util.hh"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * copyPath
+     * --------------------------------------------------------------------------*/
+
+    static std::string narOf(const Path & path) {
+        StringSink sink;
+        dumpPath(path, sink);
+        return *sink.s;
+    }
+
+    TEST(copyPath, copiesTreeLikeDumpAndRestore) {
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        Path from = tmpDir + "/from";
+        createDirs(from + "/sub");
+        writeFile(from + "/file", "hello");
+        writeFile(from + "/sub/script", "#! /bin/sh\n");
+        chmod((from + "/sub/script").c_str(), 0755);
+        writeFile(from + "/empty", "");
+        writeFile(from + "/big", std::string(200000, 'x'));
+        createSymlink("file", from + "/link");
+
+        copyPath(from, tmpDir + "/to");
+
+        ASSERT_EQ(narOf(from), narOf(tmpDir + "/to"));
+    }
+
+    TEST(copyPath, copiesSingleFile) {
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        writeFile(tmpDir + "/from", "contents");
+        copyPath(tmpDir + "/from", tmpDir + "/to");
+
+        ASSERT_EQ(readFile(tmpDir + "/to"), "contents");
+    }
+
+    TEST(copyPath, failsIfTargetExists) {
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        writeFile(tmpDir + "/from", "contents");
+        writeFile(tmpDir + "/to", "");
+
+        ASSERT_THROW(copyPath(tmpDir + "/from", tmpDir + "/to"), SysError);
+    }
+
+#if __linux__ && defined(SYS_copy_file_range)
+    /* Whether copy_file_range() works in 'dir', which depends on the
+       kernel, the file system and any seccomp filter of the host. */
+    static bool copyFileRangeWorks(const Path & dir) {
+        writeFile(dir + "/probe-from", "probe");
+        AutoCloseFD fromFd = open((dir + "/probe-from").c_str(), O_RDONLY | O_CLOEXEC);
+        AutoCloseFD toFd = open((dir + "/probe-to").c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+        if (!fromFd || !toFd) return false;
+        return syscall(SYS_copy_file_range, fromFd.get(), nullptr, toFd.get(), nullptr, (size_t) 5, 0) == 5;
+    }
+
+    TEST(copyFileContents, avoidsUserSpaceCopyOnLinux) {
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        if (!copyFileRangeWorks(tmpDir))
+            GTEST_SKIP() << "copy_file_range() is not supported here";
+
+        auto contents = std::string(200000, 'x');
+        writeFile(tmpDir + "/from", contents);
+
+        AutoCloseFD fromFd = open((tmpDir + "/from").c_str(), O_RDONLY | O_CLOEXEC);
+        AutoCloseFD toFd = open((tmpDir + "/to").c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+        ASSERT_TRUE(fromFd);
+        ASSERT_TRUE(toFd);
+
+        /* Both files are on the same file system, so either a reflink
+           or copy_file_range() must have done the copy. */
+        auto method = copyFileContents(fromFd.get(), toFd.get(), tmpDir + "/from");
+        ASSERT_NE(method, FileCopyMethod::ReadWrite);
+        toFd.close();
+
+        ASSERT_EQ(readFile(tmpDir + "/to"), contents);
+    }
+#endif
+
+    /* ----------------------------------------------------------------------------
+     * dumpPath
+     * --------------------------------------------------------------------------*/
+
+    TEST(dumpPath, fdSinkMatchesStringSink) {
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        Path from = tmpDir + "/from";
+        createDirs(from);
+        writeFile(from + "/small", "hello");
+        writeFile(from + "/big", std::string(1000001, 'x'));
+
+        {
+            AutoCloseFD fd = open((tmpDir + "/nar").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            ASSERT_TRUE(fd);
+            FdSink sink(fd.get());
+            dumpPath(from, sink);
+            sink.flush();
+        }
+
+        ASSERT_EQ(readFile(tmpDir + "/nar"), narOf(from));
+    }
+
+    /* ----------------------------------------------------------------------------
+     * restorePath
+     * --------------------------------------------------------------------------*/
+
+    TEST(restorePath, restoresManyFilesAndLargeFiles) {
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
+
+        /* Enough small files to keep the writer pool busy, plus a file
+           that is too large for it. */
+        Path from = tmpDir + "/from";
+        for (int d = 0; d < 10; ++d) {
+            auto dir = fmt("%s/dir%d/sub", from, d);
+            createDirs(dir);
+            for (int f = 0; f < 50; ++f)
+                writeFile(fmt("%s/file%d", dir, f), fmt("contents %d %d", d, f));
+            chmod((dir + "/file0").c_str(), 0755);
+            writeFile(dir + "/empty", "");
+            createSymlink("file1", dir + "/link");
+        }
+        writeFile(from + "/big", std::string(3 * 1024 * 1024, 'x'));
+        chmod((from + "/big").c_str(), 0755);
+
+        auto nar = narOf(from);
+
+        StringSource source(nar);
+        restorePath(tmpDir + "/to", source);
+
+        ASSERT_EQ(narOf(tmpDir + "/to"), nar);
+    }
+}
@@ -93,4 +93,21 @@ namespace nix {
         ASSERT_STREQ((*strSink.s).c_str(), inputString);
     }
 
+    TEST(makeCompressionSink, compressAndDecompressWithLevel) {
+        StringSink strSink;
+        auto inputString = "slfja;sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;sdjf;lsdfjsadlf";
+        auto decompressionSink = makeDecompressionSink("xz", strSink);
+        auto sink = makeCompressionSink("xz", *decompressionSink, true, 1);
+
+        (*sink)(inputString);
+        sink->finish();
+        decompressionSink->finish();
+
+        ASSERT_STREQ((*strSink.s).c_str(), inputString);
+    }
+
+    TEST(compress, brotliWithInvalidLevelThrows) {
+        ASSERT_THROW(compress("br", "something-to-compress", false, 100), CompressionError);
+    }
+
 }
@@ -72,4 +72,42 @@ namespace nix {
                 "7299aeadb6889018501d289e4900f7e4331b99dec4b5433a"
                 "c7d329eeb6dd26545e96e55b874be909");
     }
+
+    TEST(hashString, testKnownBLAKE3Hashes1) {
+        // values taken from: https://github.com/BLAKE3-team/BLAKE3/blob/master/test_vectors/test_vectors.json
+        auto s = "";
+        auto hash = hashString(HashType::htBLAKE3, s);
+        ASSERT_EQ(hash.to_string(Base::Base16, true),
+                "blake3:af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262");
+    }
+
+    TEST(hashString, testKnownBLAKE3Hashes2) {
+        // values taken from: https://github.com/BLAKE3-team/BLAKE3/blob/master/test_vectors/test_vectors.json
+        // (input spans two chunks, so this exercises the tree)
+        std::string s;
+        for (size_t i = 0; i < 2048; ++i)
+            s += (char) (i % 251);
+        auto hash = hashString(HashType::htBLAKE3, s);
+        ASSERT_EQ(hash.to_string(Base::Base16, true),
+                "blake3:e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a");
+    }
+
+    /* ----------------------------------------------------------------------------
+     * Base32
+     * --------------------------------------------------------------------------*/
+
+    TEST(hashBase32, roundTrips) {
+        for (auto ht : {htMD5, htSHA1, htSHA256, htSHA512}) {
+            auto hash = hashString(ht, "abc");
+            auto s = hash.to_string(Base::Base32, false);
+            ASSERT_EQ(s.size(), hash.base32Len());
+            ASSERT_EQ(Hash::parseAny(s, ht), hash);
+        }
+    }
+
+    TEST(hashBase32, rejectsInvalidDigits) {
+        auto s = hashString(htSHA256, "abc").to_string(Base::Base32, false);
+        s[0] = 'e';
+        ASSERT_THROW(Hash::parseAny(s, htSHA256), BadHash);
+    }
 }
@@ -0,0 +1,50 @@
+#include "serialise.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+    /* ----------------------------------------------------------------------------
+     * BufferedSink
+     * --------------------------------------------------------------------------*/
+
+    struct RecordingSink : BufferedSink
+    {
+        std::string data;
+        size_t writes = 0;
+
+        void write(std::string_view s) override
+        {
+            data.append(s);
+            writes++;
+        }
+    };
+
+    TEST(BufferedSink, growsForBulkWrites) {
+        RecordingSink sink;
+        auto initialSize = sink.bufSize;
+
+        std::string chunk(20000, 'x');
+        for (int i = 0; i < 100; ++i)
+            sink(chunk);
+        sink.flush();
+
+        ASSERT_EQ(sink.data.size(), 100 * chunk.size());
+        ASSERT_GT(sink.bufSize, initialSize);
+        ASSERT_LE(sink.bufSize, sink.maxBufSize);
+        /* With a fixed buffer, every chunk would need a write. */
+        ASSERT_LT(sink.writes, 50);
+    }
+
+    TEST(BufferedSink, keepsSmallBufferForSmallWrites) {
+        RecordingSink sink;
+        auto initialSize = sink.bufSize;
+
+        for (int i = 0; i < 100; ++i)
+            sink("hello");
+        sink.flush();
+
+        ASSERT_EQ(sink.data.size(), 500);
+        ASSERT_EQ(sink.bufSize, initialSize);
+        ASSERT_EQ(sink.writes, 1);
+    }
+}
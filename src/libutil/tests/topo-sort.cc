@@ -0,0 +1,66 @@
+#include "topo-sort.hh"
+#include <gtest/gtest.h>
+
+namespace nix {
+
+using namespace std;
+
+map<string, set<string>> topoGraph = {
+    { "A", { "B", "C" } },
+    { "B", { "D", "X" } }, // X is outside the set and ignored
+    { "C", { "C", "D" } }, // Self reference
+    { "D", {} },
+    { "E", { "A" } },
+};
+
+TEST(topoSort, sortsParentsBeforeChildren) {
+    auto sorted = topoSort<string>(
+        {"A", "B", "C", "D", "E"},
+        {[&](const string & node) { return topoGraph[node]; }},
+        {[&](const string & node, const string & parent) {
+            return Error("cycle from '%s' to '%s'", parent, node);
+        }});
+
+    ASSERT_EQ(sorted, vector<string>({"E", "A", "C", "B", "D"}));
+}
+
+TEST(topoSort, detectsCycles) {
+    map<string, set<string>> graph = {
+        { "A", { "B" } },
+        { "B", { "C" } },
+        { "C", { "A" } },
+    };
+
+    string cycleNode, cycleParent;
+    EXPECT_THROW(
+        topoSort<string>(
+            {"A", "B", "C"},
+            {[&](const string & node) { return graph[node]; }},
+            {[&](const string & node, const string & parent) {
+                cycleNode = node;
+                cycleParent = parent;
+                return Error("cycle");
+            }}),
+        Error);
+    ASSERT_EQ(cycleNode, "A");
+    ASSERT_EQ(cycleParent, "C");
+}
+
+TEST(topoSort, handlesLongChains) {
+    /* Deep enough that a recursive traversal would be at risk of
+       exhausting the stack. */
+    size_t n = 1000000;
+    DenseGraph graph;
+    for (size_t i = 0; i < n; ++i) {
+        if (i + 1 < n) graph.targets.push_back(i + 1);
+        graph.finishNode();
+    }
+
+    auto sorted = topoSort(graph, [](size_t, size_t) { return Error("cycle"); });
+
+    ASSERT_EQ(sorted.size(), n);
+    for (size_t i = 0; i < n; ++i)
+        ASSERT_EQ(sorted[i], i);
+}
+
+}
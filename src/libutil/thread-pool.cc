@@ -42,14 +42,25 @@ void ThreadPool::shutdown()
 
 void ThreadPool::enqueue(const work_t & t)
 {
-    auto state(state_.lock());
-    if (quit)
-        throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
-    state->pending.push(t);
-    /* Note: process() also executes items, so count it as a worker. */
-    if (state->pending.size() > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
-        state->workers.emplace_back(&ThreadPool::doWork, this, false);
-    work.notify_one();
+    enqueue(work_t(t));
+}
+
+void ThreadPool::enqueue(work_t && t)
+{
+    bool wake;
+    {
+        auto state(state_.lock());
+        if (quit)
+            throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
+        state->pending.push(std::move(t));
+        /* Note: process() also executes items, so count it as a worker. */
+        if (state->pending.size() > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
+            state->workers.emplace_back(&ThreadPool::doWork, this, false);
+        /* Only wake up a thread if one is waiting. Busy threads will
+           pick up the item when they finish their current one. */
+        wake = state->idle > 0;
+    }
+    if (wake) work.notify_one();
 }
 
 void ThreadPool::process()
@@ -133,7 +144,9 @@ void ThreadPool::doWork(bool mainThread)
                     return;
                 }
 
+                state->idle++;
                 state.wait(work);
+                state->idle--;
             }
 
             w = std::move(state->pending.front());
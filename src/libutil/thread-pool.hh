@@ -28,6 +28,7 @@ public:
 
     /* Enqueue a function to be executed by the thread pool. */
     void enqueue(const work_t & t);
+    void enqueue(work_t && t);
 
     /* Execute work items until the queue is empty. Note that work
        items are allowed to add new items to the queue; this is
@@ -49,6 +50,8 @@ private:
         std::exception_ptr exception;
         std::vector<std::thread> workers;
         bool draining = false;
+        /* The number of threads waiting for work. */
+        size_t idle = 0;
     };
 
     std::atomic_bool quit{false};
@@ -115,6 +118,7 @@ void processGraph(
 
         /* Enqueue work for all nodes that were waiting on this one
            and have no unprocessed dependencies. */
+        std::vector<T> ready;
         {
             auto graph(graph_.lock());
             for (auto & rref : graph->rrefs[node]) {
@@ -123,16 +127,20 @@ void processGraph(
                 assert(i != refs.end());
                 refs.erase(i);
                 if (refs.empty())
-                    pool.enqueue(std::bind(worker, rref));
+                    ready.push_back(rref);
             }
             graph->left.erase(node);
             graph->refs.erase(node);
             graph->rrefs.erase(node);
         }
+
+        /* Don't hold the graph lock while taking the pool's lock. */
+        for (auto & rref : ready)
+            pool.enqueue([&worker, rref{std::move(rref)}]() { worker(rref); });
     };
 
     for (auto & node : nodes)
-        pool.enqueue(std::bind(worker, std::ref(node)));
+        pool.enqueue([&worker, &node]() { worker(node); });
 
     pool.process();
 
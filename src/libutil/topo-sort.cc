@@ -0,0 +1,51 @@
+#include "topo-sort.hh"
+
+namespace nix {
+
+std::vector<size_t> topoSort(const DenseGraph & graph,
+    std::function<Error(size_t node, size_t parent)> makeCycleError)
+{
+    auto n = graph.size();
+
+    std::vector<size_t> sorted;
+    sorted.reserve(n);
+
+    enum : uint8_t { unvisited, active, finished };
+    std::vector<uint8_t> status(n, unvisited);
+
+    /* The depth-first search is iterative, so that long chains can't
+       overflow the stack. Each entry holds a node and the position of
+       its next child in `graph.targets'. */
+    std::vector<std::pair<size_t, size_t>> stack;
+
+    for (size_t root = 0; root < n; ++root) {
+        if (status[root] != unvisited) continue;
+        status[root] = active;
+        stack.emplace_back(root, graph.offsets[root]);
+
+        while (!stack.empty()) {
+            auto & [node, pos] = stack.back();
+
+            if (pos == graph.offsets[node + 1]) {
+                status[node] = finished;
+                sorted.push_back(node);
+                stack.pop_back();
+                continue;
+            }
+
+            auto child = graph.targets[pos++];
+            if (child == node) continue;
+            if (status[child] == active) throw makeCycleError(child, node);
+            if (status[child] == unvisited) {
+                status[child] = active;
+                stack.emplace_back(child, graph.offsets[child]);
+            }
+        }
+    }
+
+    std::reverse(sorted.begin(), sorted.end());
+
+    return sorted;
+}
+
+}
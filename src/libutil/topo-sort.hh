@@ -2,39 +2,71 @@
 
 #include "error.hh"
 
+#include <algorithm>
+#include <functional>
+#include <set>
+#include <vector>
+
 namespace nix {
 
-template<typename T>
-std::vector<T> topoSort(std::set<T> items,
-        std::function<std::set<T>(const T &)> getChildren,
-        std::function<Error(const T &, const T &)> makeCycleError)
+/* A directed graph on the nodes 0 .. size() - 1 in compressed sparse
+   row form: the children of node i are targets[offsets[i]] up to (but
+   not including) targets[offsets[i + 1]]. Nodes are added in order by
+   appending their children to `targets' and then calling
+   finishNode(). */
+struct DenseGraph
 {
-    std::vector<T> sorted;
-    std::set<T> visited, parents;
+    std::vector<size_t> offsets{0};
+    std::vector<size_t> targets;
 
-    std::function<void(const T & path, const T * parent)> dfsVisit;
+    size_t size() const { return offsets.size() - 1; }
 
-    dfsVisit = [&](const T & path, const T * parent) {
-        if (parents.count(path)) throw makeCycleError(path, *parent);
+    void finishNode() { offsets.push_back(targets.size()); }
+};
 
-        if (!visited.insert(path).second) return;
-        parents.insert(path);
+/* Topologically sort the nodes of `graph', such that every node
+   precedes its children. Nodes are visited in index order, and their
+   children in the order given. Self-references are ignored; other
+   cycles throw the result of makeCycleError(node, parent). */
+std::vector<size_t> topoSort(const DenseGraph & graph,
+    std::function<Error(size_t node, size_t parent)> makeCycleError);
 
-        std::set<T> references = getChildren(path);
+template<typename T>
+std::vector<T> topoSort(const std::set<T> & items,
+        std::function<std::set<T>(const T &)> getChildren,
+        std::function<Error(const T &, const T &)> makeCycleError)
+{
+    /* Number the items in order. This gives the same result as
+       visiting the set directly, but lets the traversal work on
+       vectors rather than sets of items. */
+    std::vector<const T *> nodes;
+    nodes.reserve(items.size());
+    for (auto & i : items)
+        nodes.push_back(&i);
 
-        for (auto & i : references)
-            /* Don't traverse into items that don't exist in our starting set. */
-            if (i != path && items.count(i))
-                dfsVisit(i, &path);
+    auto less = [](const T * a, const T * b) { return *a < *b; };
 
-        sorted.push_back(path);
-        parents.erase(path);
-    };
+    DenseGraph graph;
+    graph.offsets.reserve(nodes.size() + 1);
+    for (auto node : nodes) {
+        for (auto & child : getChildren(*node)) {
+            /* Don't traverse into items that don't exist in our
+               starting set. */
+            auto i = std::lower_bound(nodes.begin(), nodes.end(), &child, less);
+            if (i != nodes.end() && !(child < **i))
+                graph.targets.push_back(i - nodes.begin());
+        }
+        graph.finishNode();
+    }
 
-    for (auto & i : items)
-        dfsVisit(i, nullptr);
+    auto order = topoSort(graph, [&](size_t node, size_t parent) {
+        return makeCycleError(*nodes[node], *nodes[parent]);
+    });
 
-    std::reverse(sorted.begin(), sorted.end());
+    std::vector<T> sorted;
+    sorted.reserve(order.size());
+    for (auto i : order)
+        sorted.push_back(*nodes[i]);
 
     return sorted;
 }
@@ -19,6 +19,7 @@
 #include "common-eval-args.hh"
 #include "attr-path.hh"
 #include "legacy.hh"
+#include "build-queue.hh"
 
 using namespace nix;
 using namespace std::string_literals;
@@ -322,8 +323,7 @@ static void main_nix_build(int argc, char * * argv)
 
     state->printStats();
 
-    auto buildPaths = [&](const std::vector<StorePathWithOutputs> & paths0) {
-        auto paths = toDerivedPaths(paths0);
+    auto buildDerivedPaths = [&](const std::vector<DerivedPath> & paths) {
         /* Note: we do this even when !printMissing to efficiently
            fetch binary cache data. */
         uint64_t downloadSize, narSize;
@@ -338,6 +338,10 @@ static void main_nix_build(int argc, char * * argv)
             store->buildPaths(paths, buildMode);
     };
 
+    auto buildPaths = [&](const std::vector<StorePathWithOutputs> & paths) {
+        buildDerivedPaths(toDerivedPaths(paths));
+    };
+
     if (runEnv) {
         if (drvs.size() != 1)
             throw UsageError("nix-shell requires a single derivation");
@@ -493,6 +497,13 @@ static void main_nix_build(int argc, char * * argv)
 
         std::map<StorePath, std::pair<size_t, StringSet>> drvMap;
 
+        /* Instantiating the derivations is where most of the
+           evaluation happens, so optionally build them as they come
+           in. */
+        std::optional<BuildQueue> queue;
+        if (settings.buildWhileEvaluating && !dryRun && drvs.size() > 1)
+            queue.emplace(buildDerivedPaths);
+
         for (auto & drvInfo : drvs) {
             auto drvPath = store->parseStorePath(drvInfo.queryDrvPath());
 
@@ -503,6 +514,9 @@ static void main_nix_build(int argc, char * * argv)
             pathsToBuild.push_back({drvPath, {outputName}});
             pathsToBuildOrdered.push_back({drvPath, {outputName}});
 
+            if (queue)
+                queue->enqueue(toDerivedPaths({pathsToBuild.back()}));
+
             auto i = drvMap.find(drvPath);
             if (i != drvMap.end())
                 i->second.second.insert(outputName);
@@ -511,7 +525,10 @@ static void main_nix_build(int argc, char * * argv)
             }
         }
 
-        buildPaths(pathsToBuild);
+        if (queue)
+            queue->finish();
+        else
+            buildPaths(pathsToBuild);
 
         if (dryRun) return;
 
@@ -4,6 +4,7 @@
 #include "store-api.hh"
 #include "legacy.hh"
 #include "fetchers.hh"
+#include "thread-pool.hh"
 
 #include <fcntl.h>
 #include <regex>
@@ -83,13 +84,19 @@ static void update(const StringSet & channelNames)
     fd = -1;
     AutoDelete del(unpackChannelPath, false);
 
-    // Download each channel.
-    Strings exprs;
-    for (const auto & channel : channels) {
-        auto name = channel.first;
-        auto url = channel.second;
-        if (!(channelNames.empty() || channelNames.count(name)))
-            continue;
+    // Download each channel. Channels are independent of each other,
+    // so fetch them concurrently; the resulting expressions are kept
+    // in channel order.
+    std::vector<std::pair<string, string>> selected;
+    for (const auto & channel : channels)
+        if (channelNames.empty() || channelNames.count(channel.first))
+            selected.push_back(channel);
+
+    std::vector<string> exprs(selected.size());
+
+    auto fetchChannel = [&](size_t n) {
+        auto name = selected[n].first;
+        auto url = selected[n].second;
 
         // We want to download the url to a file to see if it's a tarball while also checking if we
         // got redirected in the process, so that we can grab the various parts of a nix channel
@@ -126,8 +133,13 @@ static void update(const StringSet & channelNames)
         }
 
         // Regardless of where it came from, add the expression representing this channel to accumulated expression
-        exprs.push_back("f: f { name = \"" + cname + "\"; channelName = \"" + name + "\"; src = builtins.storePath \"" + filename + "\"; " + extraAttrs + " }");
-    }
+        exprs[n] = "f: f { name = \"" + cname + "\"; channelName = \"" + name + "\"; src = builtins.storePath \"" + filename + "\"; " + extraAttrs + " }";
+    };
+
+    ThreadPool pool;
+    for (size_t n = 0; n < selected.size(); ++n)
+        pool.enqueue(std::bind(fetchChannel, n));
+    pool.process();
 
     // Unpack the channel tarballs into the Nix store and install them
     // into the channels profile.
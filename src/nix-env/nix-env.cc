@@ -983,6 +983,20 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     }
 
 
+    /* Compute the derivation paths before printing anything, so that
+       the derivations they refer to are in the store by the time
+       anything reads the output. */
+    if (printDrvPath) {
+        for (auto & i : elems)
+            try {
+                if (!i.hasFailed()) i.queryDrvPath();
+            } catch (AssertionError & e) {
+                /* Reported below. */
+            }
+        globals.state->store->flushDeferredTexts();
+    }
+
+
     /* Print the desired columns, or XML output. */
     if (jsonOutput) {
         queryJSON(globals, elems);
@@ -14,6 +14,7 @@
 
 #include <map>
 #include <iostream>
+#include <sstream>
 
 
 using namespace nix;
@@ -38,6 +39,11 @@ void processExpr(EvalState & state, const Strings & attrPaths,
     Value vRoot;
     state.eval(e, vRoot);
 
+    /* Derivations are written to the store lazily (see
+       Store::addTextToStoreDeferred()), so the output is collected
+       and only printed once they are all in the store. */
+    std::ostringstream out;
+
     for (auto & i : attrPaths) {
         Value & v(*findAlongAttrPath(state, i, autoArgs, vRoot).first);
         state.forceValue(v);
@@ -50,12 +56,12 @@ void processExpr(EvalState & state, const Strings & attrPaths,
             else
                 state.autoCallFunction(autoArgs, v, vRes);
             if (output == okXML)
-                printValueAsXML(state, strict, location, vRes, std::cout, context);
+                printValueAsXML(state, strict, location, vRes, out, context);
             else if (output == okJSON)
-                printValueAsJSON(state, strict, vRes, std::cout, context);
+                printValueAsJSON(state, strict, vRes, out, context);
             else {
                 if (strict) state.forceValueDeep(vRes);
-                std::cout << vRes << std::endl;
+                out << vRes << std::endl;
             }
         } else {
             DrvInfos drvs;
@@ -77,10 +83,13 @@ void processExpr(EvalState & state, const Strings & attrPaths,
                     if (store2)
                         drvPath = store2->addPermRoot(store2->parseStorePath(drvPath), rootName);
                 }
-                std::cout << fmt("%s%s\n", drvPath, (outputName != "out" ? "!" + outputName : ""));
+                out << fmt("%s%s\n", drvPath, (outputName != "out" ? "!" + outputName : ""));
             }
         }
     }
+
+    state.store->flushDeferredTexts();
+    std::cout << out.str();
 }
 
 
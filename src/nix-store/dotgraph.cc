@@ -26,43 +26,43 @@ static string nextColour()
 }
 
 
-static string makeEdge(const string & src, const string & dst)
+static string makeEdge(std::string_view src, std::string_view dst)
 {
-    format f = format("%1% -> %2% [color = %3%];\n")
-        % dotQuote(src) % dotQuote(dst) % dotQuote(nextColour());
-    return f.str();
+    return dotQuote(src) + " -> " + dotQuote(dst)
+        + " [color = " + dotQuote(nextColour()) + "];\n";
 }
 
 
-static string makeNode(const string & id, std::string_view label,
-    const string & colour)
+static string makeNode(std::string_view id, std::string_view label,
+    std::string_view colour)
 {
-    format f = format("%1% [label = %2%, shape = box, "
-        "style = filled, fillcolor = %3%];\n")
-        % dotQuote(id) % dotQuote(label) % dotQuote(colour);
-    return f.str();
+    return dotQuote(id) + " [label = " + dotQuote(label)
+        + ", shape = box, style = filled, fillcolor = " + dotQuote(colour) + "];\n";
 }
 
 
 void printDotGraph(ref<Store> store, StorePathSet && roots)
 {
-    StorePathSet workList(std::move(roots));
-    StorePathSet doneSet;
+    /* Get the closure in one go, which remote stores can answer in a
+       single request, and then print it in batches whose path info
+       is fetched at once. */
+    StorePathSet closure;
+    store->computeFSClosure(roots, closure);
 
     cout << "digraph G {\n";
 
-    while (!workList.empty()) {
-        auto path = std::move(workList.extract(workList.begin()).value());
+    for (auto i = closure.begin(); i != closure.end(); ) {
+        StorePathSet batch;
+        for ( ; i != closure.end() && batch.size() < 1024; ++i)
+            batch.insert(*i);
+        store->prefetchPathInfos(batch);
 
-        if (!doneSet.insert(path).second) continue;
+        for (auto & path : batch) {
+            cout << makeNode(path.to_string(), path.name(), "#ff0000");
 
-        cout << makeNode(std::string(path.to_string()), path.name(), "#ff0000");
-
-        for (auto & p : store->queryPathInfo(path)->references) {
-            if (p != path) {
-                workList.insert(p);
-                cout << makeEdge(std::string(p.to_string()), std::string(path.to_string()));
-            }
+            for (auto & p : store->queryPathInfo(path)->references)
+                if (p != path)
+                    cout << makeEdge(p.to_string(), path.to_string());
         }
     }
 
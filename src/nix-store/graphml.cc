@@ -49,9 +49,10 @@ static string makeNode(const ValidPathInfo & info)
 
 void printGraphML(ref<Store> store, StorePathSet && roots)
 {
-    StorePathSet workList(std::move(roots));
-    StorePathSet doneSet;
-    std::pair<StorePathSet::iterator, bool> ret;
+    /* As in printDotGraph(), get the closure in one go and print it
+       in batches. */
+    StorePathSet closure;
+    store->computeFSClosure(roots, closure);
 
     cout << "<?xml version='1.0' encoding='utf-8'?>\n"
          << "<graphml xmlns='http://graphml.graphdrawing.org/xmlns'\n"
@@ -62,22 +63,20 @@ void printGraphML(ref<Store> store, StorePathSet && roots)
          << "<key id='type' for='node' attr.name='type' attr.type='string'/>"
          << "<graph id='G' edgedefault='directed'>\n";
 
-    while (!workList.empty()) {
-        auto path = std::move(workList.extract(workList.begin()).value());
+    for (auto i = closure.begin(); i != closure.end(); ) {
+        StorePathSet batch;
+        for ( ; i != closure.end() && batch.size() < 1024; ++i)
+            batch.insert(*i);
+        store->prefetchPathInfos(batch);
 
-        ret = doneSet.insert(path);
-        if (ret.second == false) continue;
+        for (auto & path : batch) {
+            auto info = store->queryPathInfo(path);
+            cout << makeNode(*info);
 
-        auto info = store->queryPathInfo(path);
-        cout << makeNode(*info);
-
-        for (auto & p : info->references) {
-            if (p != path) {
-                workList.insert(p);
-                cout << makeEdge(path.to_string(), p.to_string());
-            }
+            for (auto & p : info->references)
+                if (p != path)
+                    cout << makeEdge(path.to_string(), p.to_string());
         }
-
     }
 
     cout << "</graph>\n";
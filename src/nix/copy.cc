@@ -3,12 +3,14 @@
 #include "store-api.hh"
 #include "sync.hh"
 #include "thread-pool.hh"
+#include "common-args.hh"
+#include "json.hh"
 
 #include <atomic>
 
 using namespace nix;
 
-struct CmdCopy : BuiltPathsCommand
+struct CmdCopy : BuiltPathsCommand, MixJSON
 {
     std::string srcUri, dstUri;
 
@@ -91,6 +93,16 @@ struct CmdCopy : BuiltPathsCommand
 
         copyPaths(
             srcStore, dstStore, stuffToCopy, NoRepair, checkSigs, substitute);
+
+        if (json) {
+            JSONObject jsonRoot(std::cout);
+            for (auto & [name, store] : {std::pair{"source", srcStore}, std::pair{"destination", dstStore}}) {
+                auto jsonStore = jsonRoot.object(name);
+                jsonStore.attr("uri", store->getUri());
+                auto jsonStats = jsonStore.placeholder("stats");
+                store->getStats().toJSON(jsonStats);
+            }
+        }
     }
 };
 
@@ -19,6 +19,8 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -97,6 +99,24 @@ bool matchUser(const string & user, const string & group, const Strings & users)
 }
 
 
+/* Return the niceness for `user' from `daemon-user-niceness', if
+   any. */
+static std::optional<int> getUserNiceness(const string & user, const string & group)
+{
+    for (auto & entry : settings.daemonUserNiceness.get()) {
+        auto eq = entry.rfind('=');
+        auto niceness = eq == std::string::npos ? std::nullopt : string2Int<int>(entry.substr(eq + 1));
+        if (!niceness) {
+            warn("ignoring invalid 'daemon-user-niceness' entry '%s'", entry);
+            continue;
+        }
+        if (matchUser(user, group, {entry.substr(0, eq)}))
+            return niceness;
+    }
+    return std::nullopt;
+}
+
+
 struct PeerInfo
 {
     bool pidKnown;
@@ -176,6 +196,18 @@ static void daemonLoop()
         fdSocket = createUnixDomainSocket(settings.nixDaemonSocketFile, 0666);
     }
 
+    /* Set up the metrics shared with the processes that handle the
+       connections. The setting is read here, since clients may
+       change settings in those processes. */
+    Path metricsFile = settings.daemonMetricsFile;
+    if (metricsFile != "") {
+        void * p = mmap(nullptr, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw SysError("allocating shared memory for the daemon metrics");
+        metrics = new (p) Metrics;
+        writeMetrics(metricsFile);
+    }
+
     //  Loop accepting connections.
     while (1) {
 
@@ -216,6 +248,8 @@ static void daemonLoop()
                 % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
                 % (peer.uidKnown ? user : "<unknown>"));
 
+            auto niceness = getUserNiceness(user, group);
+
             //  Fork a child to handle the connection.
             ProcessOptions options;
             options.errorPrefix = "unexpected Nix daemon error: ";
@@ -232,6 +266,9 @@ static void daemonLoop()
                 //  Restore normal handling of SIGCHLD.
                 setSigChldAction(false);
 
+                if (niceness && setpriority(PRIO_PROCESS, 0, *niceness) == -1)
+                    throw SysError("setting the niceness of the connection to %d", *niceness);
+
                 //  For debugging, stuff the pid into argv[1].
                 if (peer.pidKnown && savedArgv[1]) {
                     string processName = std::to_string(peer.pid);
@@ -251,6 +288,14 @@ static void daemonLoop()
                     store.createUser(user, peer.uid);
                 });
 
+                if (metricsFile != "") {
+                    try {
+                        writeMetrics(metricsFile);
+                    } catch (Error & e) {
+                        logError(e.info());
+                    }
+                }
+
                 exit(0);
             }, options);
 
@@ -167,7 +167,7 @@ const static std::string getEnvSh =
    modified derivation with the same dependencies and nearly the same
    initial environment variables, that just writes the resulting
    environment to a file and exits. */
-StorePath getDerivationEnvironment(ref<Store> store, const StorePath & drvPath)
+static StorePath getDerivationEnvironmentUncached(ref<Store> store, const StorePath & drvPath)
 {
     auto drv = store->derivationFromPath(drvPath);
 
@@ -227,6 +227,46 @@ StorePath getDerivationEnvironment(ref<Store> store, const StorePath & drvPath)
     throw Error("get-env.sh failed to produce an environment");
 }
 
+/* Computing the modified derivation requires hashing the derivation
+   and all its inputs, so remember the result for each derivation. */
+StorePath getDerivationEnvironment(ref<Store> store, const StorePath & drvPath)
+{
+    auto cacheFile = getCacheDir() + "/nix/dev-environments/"
+        + hashString(htSHA256,
+            fmt("%s;%s;%s;%d",
+                store->getUri(),
+                store->printStorePath(drvPath),
+                getEnvSh,
+                settings.isExperimentalFeatureEnabled("ca-derivations"))).to_string(Base32, false);
+
+    if (pathExists(cacheFile)) {
+        try {
+            auto outPath = store->parseStorePath(trim(readFile(cacheFile)));
+            /* Keep the garbage collector from deleting the path
+               between the check and its use. */
+            store->addTempRoot(outPath);
+            if (store->isValidPath(outPath) && lstat(store->toRealPath(outPath)).st_size) {
+                debug("using cached environment '%s' for '%s'",
+                    store->printStorePath(outPath), store->printStorePath(drvPath));
+                return outPath;
+            }
+        } catch (Error &) {
+            ignoreException();
+        }
+    }
+
+    auto outPath = getDerivationEnvironmentUncached(store, drvPath);
+
+    try {
+        createDirs(dirOf(cacheFile));
+        writeFile(cacheFile, store->printStorePath(outPath));
+    } catch (Error &) {
+        ignoreException();
+    }
+
+    return outPath;
+}
+
 struct Common : InstallableCommand, MixProfile
 {
     std::set<std::string> ignoreVars{
@@ -4,13 +4,12 @@
 #include "common-args.hh"
 #include "names.hh"
 
-#include <regex>
-
 namespace nix {
 
 struct Info
 {
     std::string outputName;
+    uint64_t narSize;
 };
 
 // name -> version -> store paths
@@ -24,20 +23,30 @@ GroupedPaths getClosureInfo(ref<Store> store, const StorePath & toplevel)
     GroupedPaths groupedPaths;
 
     for (auto & path : closure) {
-        /* Strip the output name. Unfortunately this is ambiguous (we
-           can't distinguish between output names like "bin" and
-           version suffixes like "unstable"). */
-        static std::regex regex("(.*)-([a-z]+|lib32|lib64)");
-        std::smatch match;
+        /* Strip the output name, i.e. a last dash-separated component
+           consisting of lowercase letters, or "lib32"/"lib64".
+           Unfortunately this is ambiguous (we can't distinguish
+           between output names like "bin" and version suffixes like
+           "unstable"). */
         std::string name(path.name());
         std::string outputName;
-        if (std::regex_match(name, match, regex)) {
-            name = match[1];
-            outputName = match[2];
+        auto dash = name.rfind('-');
+        if (dash != std::string::npos) {
+            std::string_view suffix(name.data() + dash + 1, name.size() - dash - 1);
+            if ((!suffix.empty()
+                 && std::all_of(suffix.begin(), suffix.end(), [](char c) { return c >= 'a' && c <= 'z'; }))
+                || suffix == "lib32" || suffix == "lib64")
+            {
+                outputName = suffix;
+                name.resize(dash);
+            }
         }
 
         DrvName drvName(name);
-        groupedPaths[drvName.name][drvName.version].emplace(path, Info { .outputName = outputName });
+        groupedPaths[drvName.name][drvName.version].emplace(path, Info {
+            .outputName = outputName,
+            .narSize = store->queryPathInfo(path)->narSize,
+        });
     }
 
     return groupedPaths;
@@ -52,29 +61,53 @@ std::string showVersions(const std::set<std::string> & versions)
     return concatStringsSep(", ", versions2);
 }
 
+struct ClosureDiffCache::Entry
+{
+    StorePath path;
+    std::shared_ptr<GroupedPaths> closure;
+};
+
 void printClosureDiff(
     ref<Store> store,
     const StorePath & beforePath,
     const StorePath & afterPath,
-    std::string_view indent)
+    std::string_view indent,
+    ClosureDiffCache * cache)
 {
-    auto beforeClosure = getClosureInfo(store, beforePath);
-    auto afterClosure = getClosureInfo(store, afterPath);
+    auto getClosure = [&](const StorePath & path) {
+        if (cache && cache->last && cache->last->path == path)
+            return cache->last->closure;
+        return std::make_shared<GroupedPaths>(getClosureInfo(store, path));
+    };
+
+    auto beforeClosure = getClosure(beforePath);
+    auto afterClosure = getClosure(afterPath);
+    if (cache)
+        cache->last = std::make_shared<ClosureDiffCache::Entry>(
+            ClosureDiffCache::Entry { afterPath, afterClosure });
 
     std::set<std::string> allNames;
-    for (auto & [name, _] : beforeClosure) allNames.insert(name);
-    for (auto & [name, _] : afterClosure) allNames.insert(name);
+    for (auto & [name, _] : *beforeClosure) allNames.insert(name);
+    for (auto & [name, _] : *afterClosure) allNames.insert(name);
+
+    const std::map<std::string, std::map<StorePath, Info>> noVersions;
+
+    auto getVersions = [&](const GroupedPaths & closure, const std::string & name) -> auto &
+    {
+        auto i = closure.find(name);
+        return i == closure.end() ? noVersions : i->second;
+    };
 
     for (auto & name : allNames) {
-        auto & beforeVersions = beforeClosure[name];
-        auto & afterVersions = afterClosure[name];
+        auto & beforeVersions = getVersions(*beforeClosure, name);
+        auto & afterVersions = getVersions(*afterClosure, name);
 
         auto totalSize = [&](const std::map<std::string, std::map<StorePath, Info>> & versions)
         {
             uint64_t sum = 0;
             for (auto & [_, paths] : versions)
-                for (auto & [path, _] : paths)
-                    sum += store->queryPathInfo(path)->narSize;
+                for (auto & [_, info] : paths)
+                    sum += info.narSize;
             return sum;
         };
 
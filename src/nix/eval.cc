@@ -103,20 +103,35 @@ struct CmdEval : MixJSON, InstallableCommand
             };
 
             recurse(*v, pos, *writeTo);
+
+            /* The files may refer to derivations (see
+               Store::addTextToStoreDeferred()). */
+            store->flushDeferredTexts();
         }
 
+        /* In the cases below, make sure that the derivations
+           referred to by the output are in the store before printing
+           it (see Store::addTextToStoreDeferred()). */
         else if (raw) {
+            auto s = state->coerceToString(noPos, *v, context);
+            store->flushDeferredTexts();
             stopProgressBar();
-            std::cout << state->coerceToString(noPos, *v, context);
+            std::cout << s;
         }
 
         else if (json) {
-            JSONPlaceholder jsonOut(std::cout);
-            printValueAsJSON(*state, true, *v, jsonOut, context);
+            std::ostringstream out;
+            {
+                JSONPlaceholder jsonOut(out);
+                printValueAsJSON(*state, true, *v, jsonOut, context);
+            }
+            store->flushDeferredTexts();
+            std::cout << out.str();
         }
 
         else {
             state->forceValueDeep(*v);
+            store->flushDeferredTexts();
             logger->cout("%s", *v);
         }
     }
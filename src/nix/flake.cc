@@ -13,6 +13,7 @@
 #include "registry.hh"
 #include "json.hh"
 #include "eval-cache.hh"
+#include "build-queue.hh"
 
 #include <nlohmann/json.hpp>
 #include <queue>
@@ -312,7 +313,24 @@ struct CmdFlakeCheck : FlakeCommand
             return std::nullopt;
         };
 
+        /* With 'build-while-evaluating', build the checks while the
+           remaining outputs are evaluated. Otherwise build them all at
+           once at the end. */
         std::vector<DerivedPath> drvPaths;
+        std::optional<BuildQueue> buildQueue;
+        if (build && settings.buildWhileEvaluating)
+            buildQueue.emplace([&](const std::vector<DerivedPath> & paths) {
+                Activity act(*logger, lvlInfo, actUnknown, "running flake checks");
+                store->buildPaths(paths);
+            });
+
+        auto queueBuild = [&](const StorePath & drvPath) {
+            if (!build) return;
+            if (buildQueue)
+                buildQueue->enqueue({DerivedPath::Built{drvPath}});
+            else
+                drvPaths.push_back(DerivedPath::Built{drvPath});
+        };
 
         auto checkApp = [&](const std::string & attrPath, Value & v, const Pos & pos) {
             try {
@@ -481,7 +499,7 @@ struct CmdFlakeCheck : FlakeCommand
                                         fmt("%s.%s.%s", name, attr.name, attr2.name),
                                         *attr2.value, *attr2.pos);
                                     if (drvPath && (std::string) attr.name == settings.thisSystem.get())
-                                        drvPaths.push_back(DerivedPath::Built{*drvPath});
+                                        queueBuild(*drvPath);
                                 }
                             }
                         }
@@ -598,10 +616,13 @@ struct CmdFlakeCheck : FlakeCommand
                 });
         }
 
-        if (build && !drvPaths.empty()) {
+        if (buildQueue)
+            buildQueue->finish();
+        else if (!drvPaths.empty()) {
             Activity act(*logger, lvlInfo, actUnknown, "running flake checks");
             store->buildPaths(drvPaths);
         }
+
         if (hasErrors)
             throw Error("Some errors were encountered during the evaluation");
     }
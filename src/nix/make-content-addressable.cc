@@ -3,6 +3,7 @@
 #include "references.hh"
 #include "common-args.hh"
 #include "json.hh"
+#include "thread-pool.hh"
 
 using namespace nix;
 
@@ -27,74 +28,91 @@ struct CmdMakeContentAddressable : StorePathsCommand, MixJSON
 
     void run(ref<Store> store, StorePaths storePaths) override
     {
-        auto paths = store->topoSortPaths(StorePathSet(storePaths.begin(), storePaths.end()));
+        StorePathSet closure(storePaths.begin(), storePaths.end());
+
+        Sync<std::map<StorePath, StorePath>> remappings_;
+
+        /* Rewrite paths in parallel. A path can only be rewritten
+           once all its references have been, since their new paths
+           are substituted into it. */
+        ThreadPool pool;
+
+        processGraph<StorePath>(pool, closure,
+            [&](const StorePath & path) {
+                return store->queryPathInfo(path)->references;
+            },
+            [&](const StorePath & path) {
+                checkInterrupt();
+
+                auto pathS = store->printStorePath(path);
+                auto oldInfo = store->queryPathInfo(path);
+                std::string oldHashPart(path.hashPart());
+
+                StringSink sink;
+                store->narFromPath(path, sink);
+
+                StringMap rewrites;
+
+                StorePathSet references;
+                bool hasSelfReference = false;
+                {
+                    auto remappings(remappings_.lock());
+                    for (auto & ref : oldInfo->references) {
+                        if (ref == path)
+                            hasSelfReference = true;
+                        else {
+                            auto i = remappings->find(ref);
+                            auto replacement = i != remappings->end() ? i->second : ref;
+                            // FIXME: warn about unremapped paths?
+                            if (replacement != ref)
+                                rewrites.insert_or_assign(store->printStorePath(ref), store->printStorePath(replacement));
+                            references.insert(std::move(replacement));
+                        }
+                    }
+                }
 
-        std::reverse(paths.begin(), paths.end());
+                if (!rewrites.empty())
+                    *sink.s = rewriteStrings(*sink.s, rewrites);
 
-        std::map<StorePath, StorePath> remappings;
+                HashModuloSink hashModuloSink(htSHA256, oldHashPart);
+                hashModuloSink(*sink.s);
 
-        auto jsonRoot = json ? std::make_unique<JSONObject>(std::cout) : nullptr;
-        auto jsonRewrites = json ? std::make_unique<JSONObject>(jsonRoot->object("rewrites")) : nullptr;
+                auto narHash = hashModuloSink.finish().first;
 
-        for (auto & path : paths) {
-            auto pathS = store->printStorePath(path);
-            auto oldInfo = store->queryPathInfo(path);
-            std::string oldHashPart(path.hashPart());
+                ValidPathInfo info {
+                    store->makeFixedOutputPath(FileIngestionMethod::Recursive, narHash, path.name(), references, hasSelfReference),
+                    narHash,
+                };
+                info.references = std::move(references);
+                if (hasSelfReference) info.references.insert(info.path);
+                info.narSize = sink.s->size();
+                info.ca = FixedOutputHash {
+                    .method = FileIngestionMethod::Recursive,
+                    .hash = info.narHash,
+                };
 
-            StringSink sink;
-            store->narFromPath(path, sink);
+                if (!json)
+                    notice("rewrote '%s' to '%s'", pathS, store->printStorePath(info.path));
 
-            StringMap rewrites;
+                auto source = sinkToSource([&](Sink & nextSink) {
+                    RewritingSink rsink2(oldHashPart, std::string(info.path.hashPart()), nextSink);
+                    rsink2(*sink.s);
+                    rsink2.flush();
+                });
 
-            StorePathSet references;
-            bool hasSelfReference = false;
-            for (auto & ref : oldInfo->references) {
-                if (ref == path)
-                    hasSelfReference = true;
-                else {
-                    auto i = remappings.find(ref);
-                    auto replacement = i != remappings.end() ? i->second : ref;
-                    // FIXME: warn about unremapped paths?
-                    if (replacement != ref)
-                        rewrites.insert_or_assign(store->printStorePath(ref), store->printStorePath(replacement));
-                    references.insert(std::move(replacement));
-                }
-            }
-
-            *sink.s = rewriteStrings(*sink.s, rewrites);
-
-            HashModuloSink hashModuloSink(htSHA256, oldHashPart);
-            hashModuloSink(*sink.s);
-
-            auto narHash = hashModuloSink.finish().first;
-
-            ValidPathInfo info {
-                store->makeFixedOutputPath(FileIngestionMethod::Recursive, narHash, path.name(), references, hasSelfReference),
-                narHash,
-            };
-            info.references = std::move(references);
-            if (hasSelfReference) info.references.insert(info.path);
-            info.narSize = sink.s->size();
-            info.ca = FixedOutputHash {
-                .method = FileIngestionMethod::Recursive,
-                .hash = info.narHash,
-            };
-
-            if (!json)
-                notice("rewrote '%s' to '%s'", pathS, store->printStorePath(info.path));
-
-            auto source = sinkToSource([&](Sink & nextSink) {
-                RewritingSink rsink2(oldHashPart, std::string(info.path.hashPart()), nextSink);
-                rsink2(*sink.s);
-                rsink2.flush();
-            });
+                store->addToStore(info, *source);
 
-            store->addToStore(info, *source);
-
-            if (json)
-                jsonRewrites->attr(store->printStorePath(path), store->printStorePath(info.path));
+                remappings_.lock()->insert_or_assign(path, std::move(info.path));
+            });
 
-            remappings.insert_or_assign(std::move(path), std::move(info.path));
+        if (json) {
+            JSONObject jsonRoot(std::cout);
+            auto jsonRewrites(jsonRoot.object("rewrites"));
+            auto paths = store->topoSortPaths(closure);
+            std::reverse(paths.begin(), paths.end());
+            auto remappings(remappings_.lock());
+            for (auto & path : paths)
+                jsonRewrites.attr(store->printStorePath(path), store->printStorePath(remappings->at(path)));
         }
     }
 };
@@ -484,6 +484,7 @@ struct CmdProfileDiffClosures : virtual StoreCommand, MixDefaultProfile
 
         std::optional<Generation> prevGen;
         bool first = true;
+        ClosureDiffCache cache;
 
         for (auto & gen : gens) {
             if (prevGen) {
@@ -493,7 +494,8 @@ struct CmdProfileDiffClosures : virtual StoreCommand, MixDefaultProfile
                 printClosureDiff(store,
                     store->followLinksToStorePath(prevGen->path),
                     store->followLinksToStorePath(gen.path),
-                    "  ");
+                    "  ",
+                    &cache);
             }
 
             prevGen = gen;
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <sstream>
 #include <cstdlib>
 #include <cstring>
 #include <climits>
@@ -78,6 +79,7 @@ struct NixRepl
     typedef set<Value *> ValuesSeen;
     std::ostream &  printValue(std::ostream & str, Value & v, unsigned int maxDepth);
     std::ostream &  printValue(std::ostream & str, Value & v, unsigned int maxDepth, ValuesSeen & seen);
+    void printValueFlushed(Value & v, unsigned int maxDepth);
 };
 
 
@@ -96,6 +98,8 @@ NixRepl::NixRepl(const Strings & searchPath, nix::ref<Store> store)
     , historyFile(getDataDir() + "/nix/repl-history")
 {
     curDir = absPath(".");
+    /* Let :reload keep the files that haven't changed. */
+    state->trackFileDependencies = true;
 }
 
 
@@ -386,6 +390,9 @@ StorePath NixRepl::getDerivationPath(Value & v) {
     if (drvPathRaw == "")
         throw Error("expression did not evaluate to a valid derivation (no drv path)");
     StorePath drvPath = state->store->parseStorePath(drvPathRaw);
+    /* The derivation is passed to other processes, so make sure
+       that it's in the store (see Store::addTextToStoreDeferred()). */
+    state->store->flushDeferredTexts();
     if (!state->store->isValidPath(drvPath))
         throw Error("expression did not evaluate to a valid derivation (invalid drv path)");
     return drvPath;
@@ -434,12 +441,12 @@ bool NixRepl::processLine(string line)
     }
 
     else if (command == ":l" || command == ":load") {
-        state->resetFileCache();
+        state->resetChangedFiles();
         loadFile(arg);
     }
 
     else if (command == ":r" || command == ":reload") {
-        state->resetFileCache();
+        state->resetChangedFiles();
         reloadFiles();
     }
 
@@ -467,7 +474,7 @@ bool NixRepl::processLine(string line)
         runProgram(editor, true, args);
 
         // Reload right after exiting the editor
-        state->resetFileCache();
+        state->resetChangedFiles();
         reloadFiles();
     }
 
@@ -514,7 +521,7 @@ bool NixRepl::processLine(string line)
     else if (command == ":p" || command == ":print") {
         Value v;
         evalString(arg, v);
-        printValue(std::cout, v, 1000000000) << std::endl;
+        printValueFlushed(v, 1000000000);
     }
 
     else if (command == ":q" || command == ":quit")
@@ -561,7 +568,7 @@ bool NixRepl::processLine(string line)
         } else {
             Value v;
             evalString(line, v);
-            printValue(std::cout, v, 1) << std::endl;
+            printValueFlushed(v, 1);
         }
     }
 
@@ -651,6 +658,18 @@ std::ostream & NixRepl::printValue(std::ostream & str, Value & v, unsigned int m
 }
 
 
+/* Print a value to stdout, but only once the derivations that
+   printing it instantiated are in the store (see
+   Store::addTextToStoreDeferred()). */
+void NixRepl::printValueFlushed(Value & v, unsigned int maxDepth)
+{
+    std::ostringstream str;
+    printValue(str, v, maxDepth);
+    state->store->flushDeferredTexts();
+    std::cout << str.str() << std::endl;
+}
+
+
 std::ostream & printStringValue(std::ostream & str, const char * string) {
     str << "\"";
     for (const char * i = string; *i; i++)
@@ -9,10 +9,15 @@
 #include "shared.hh"
 #include "eval-cache.hh"
 #include "attr-path.hh"
+#include "installables.hh"
+#include "sqlite.hh"
 
 #include <regex>
 #include <fstream>
 
+#include <sys/stat.h>
+#include <sys/time.h>
+
 using namespace nix;
 
 std::string wrap(std::string prefix, std::string s)
@@ -30,6 +35,105 @@ std::string hilite(const std::string & s, const std::smatch & m, std::string pos
           + std::string(m.suffix());
 }
 
+static const char * searchIndexSchema = R"sql(
+create table if not exists Packages (
+    id          integer primary key autoincrement not null,
+    attrPath    text not null,
+    pname       text not null,
+    version     text not null,
+    description text not null
+);
+create table if not exists Complete (
+    done        integer not null
+);
+)sql";
+
+/* A list of all packages found by a previous search of a locked
+   flake, so that subsequent searches don't need to traverse the
+   evaluation cache. A new index is written to a temporary database
+   that is renamed into place once it is complete, so concurrent
+   searches never see or clobber a partial index. */
+struct SearchIndex
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertPackage;
+        SQLiteStmt queryPackages;
+    };
+
+    std::unique_ptr<State> state;
+    Path path;
+    Path tempPath;
+    bool complete = false;
+
+    SearchIndex(const Hash & key)
+        : state(std::make_unique<State>())
+    {
+        Path cacheDir = getCacheDir() + "/nix/search-cache-v1";
+        createDirs(cacheDir);
+        prune(cacheDir);
+
+        path = cacheDir + "/" + key.to_string(Base16, false) + ".sqlite";
+
+        if (pathExists(path)) {
+            state->db = SQLite(path, false);
+            state->queryPackages.create(state->db,
+                "select attrPath, pname, version, description from Packages order by id");
+            complete = SQLiteStmt(state->db, "select 1 from Complete").use().next();
+
+            /* Record the use for prune(). */
+            utimes(path.c_str(), nullptr);
+        }
+
+        if (!complete) {
+            tempPath = fmt("%s.tmp.%d", path, getpid());
+            unlink(tempPath.c_str());
+            state = std::make_unique<State>();
+            state->db = SQLite(tempPath);
+            state->db.exec("pragma synchronous = off");
+            state->db.exec("pragma main.journal_mode = memory");
+            state->db.exec(searchIndexSchema);
+            state->insertPackage.create(state->db,
+                "insert into Packages(attrPath, pname, version, description) values (?, ?, ?, ?)");
+        }
+    }
+
+    ~SearchIndex()
+    {
+        state.reset();
+        if (tempPath != "") unlink(tempPath.c_str());
+    }
+
+    /* Replace the index with the newly written one. */
+    void install()
+    {
+        SQLiteStmt(state->db, "insert into Complete(done) values (1)").use().exec();
+        state.reset();
+        if (rename(tempPath.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tempPath, path);
+        tempPath = "";
+    }
+
+    /* Delete indexes that haven't been used for a month, and
+       temporary databases left behind by searches that didn't
+       finish. */
+    static void prune(const Path & cacheDir)
+    {
+        auto now = time(nullptr);
+        for (auto & entry : readDirectory(cacheDir)) {
+            auto file = cacheDir + "/" + entry.name;
+            struct stat st;
+            if (lstat(file.c_str(), &st) == -1) continue;
+            auto maxAge = hasSuffix(entry.name, ".sqlite") ? 30 * 24 * 3600 : 24 * 3600;
+            if (st.st_mtime + maxAge < now) {
+                debug("deleting stale search index '%s'", file);
+                unlink(file.c_str());
+            }
+        }
+    }
+};
+
 struct CmdSearch : InstallableCommand, MixJSON
 {
     std::vector<std::string> res;
@@ -75,12 +179,105 @@ struct CmdSearch : InstallableCommand, MixJSON
         for (auto & re : res)
             regexes.push_back(std::regex(re, std::regex::extended | std::regex::icase));
 
+        /* Search terms without regex metacharacters are checked with
+           a plain case-insensitive substring search first, which is
+           much cheaper than std::regex. The regex then only runs on
+           the packages that contain the term. */
+        std::vector<std::optional<std::string>> literals;
+        for (auto & re : res)
+            literals.push_back(
+                re.find_first_of(".[]()|*+?{}^$\\") == std::string::npos
+                ? std::optional(toLower(re))
+                : std::nullopt);
+
         auto state = getEvalState();
 
         auto jsonOut = json ? std::make_unique<JSONObject>(std::cout) : nullptr;
 
         uint64_t results = 0;
 
+        auto showPackage = [&](const std::string & attrPath2, const DrvName & name, const std::string & description)
+        {
+            for (auto & literal : literals) {
+                if (!literal) continue;
+                if (toLower(attrPath2).find(*literal) == std::string::npos
+                    && toLower(name.name).find(*literal) == std::string::npos
+                    && toLower(description).find(*literal) == std::string::npos)
+                    return;
+            }
+
+            size_t found = 0;
+
+            std::smatch attrPathMatch;
+            std::smatch descriptionMatch;
+            std::smatch nameMatch;
+
+            for (auto & regex : regexes) {
+                std::regex_search(attrPath2, attrPathMatch, regex);
+                std::regex_search(name.name, nameMatch, regex);
+                std::regex_search(description, descriptionMatch, regex);
+                if (!attrPathMatch.empty()
+                    || !nameMatch.empty()
+                    || !descriptionMatch.empty())
+                    found++;
+            }
+
+            if (found == res.size()) {
+                results++;
+                if (json) {
+                    auto jsonElem = jsonOut->object(attrPath2);
+                    jsonElem.attr("pname", name.name);
+                    jsonElem.attr("version", name.version);
+                    jsonElem.attr("description", description);
+                } else {
+                    auto name2 = hilite(name.name, nameMatch, "\e[0;2m");
+                    if (results > 1) logger->cout("");
+                    logger->cout(
+                        "* %s%s",
+                        wrap("\e[0;1m", hilite(attrPath2, attrPathMatch, "\e[0;1m")),
+                        name.version != "" ? " (" + name.version + ")" : "");
+                    if (description != "")
+                        logger->cout(
+                            "  %s", hilite(description, descriptionMatch, ANSI_NORMAL));
+                }
+            }
+        };
+
+        /* For locked flakes, keep an index of all packages, keyed on
+           the flake's fingerprint and the attribute paths searched. */
+        std::unique_ptr<SearchIndex> index;
+        if (auto flake = std::dynamic_pointer_cast<InstallableFlake>(installable);
+            flake && evalSettings.useEvalCache && evalSettings.pureEval)
+        {
+            auto key = hashString(htSHA256,
+                fmt("%s;%s",
+                    flake->getLockedFlake()->getFingerprint().to_string(Base16, false),
+                    concatStringsSep(";", flake->getActualAttrPaths())));
+            try {
+                index = std::make_unique<SearchIndex>(key);
+            } catch (SQLiteError &) {
+                ignoreException();
+            }
+        }
+
+        if (index && index->complete) {
+            auto query(index->state->queryPackages.use());
+            while (query.next()) {
+                DrvName name;
+                name.name = query.getStr(1);
+                name.version = query.getStr(2);
+                showPackage(query.getStr(0), name, query.getStr(3));
+            }
+
+            if (!json && !results)
+                throw Error("no results for the given search term(s)!");
+            return;
+        }
+
+        std::unique_ptr<SQLiteTxn> txn;
+        if (index)
+            txn = std::make_unique<SQLiteTxn>(index->state->db);
+
         std::function<void(eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath, bool initialRecurse)> visit;
 
         visit = [&](eval_cache::AttrCursor & cursor, const std::vector<Symbol> & attrPath, bool initialRecurse)
@@ -99,8 +296,6 @@ struct CmdSearch : InstallableCommand, MixJSON
                 };
 
                 if (cursor.isDerivation()) {
-                    size_t found = 0;
-
                     DrvName name(cursor.getAttr("name")->getString());
 
                     auto aMeta = cursor.maybeGetAttr("meta");
@@ -109,39 +304,15 @@ struct CmdSearch : InstallableCommand, MixJSON
                     std::replace(description.begin(), description.end(), '\n', ' ');
                     auto attrPath2 = concatStringsSep(".", attrPath);
 
-                    std::smatch attrPathMatch;
-                    std::smatch descriptionMatch;
-                    std::smatch nameMatch;
-
-                    for (auto & regex : regexes) {
-                        std::regex_search(attrPath2, attrPathMatch, regex);
-                        std::regex_search(name.name, nameMatch, regex);
-                        std::regex_search(description, descriptionMatch, regex);
-                        if (!attrPathMatch.empty()
-                            || !nameMatch.empty()
-                            || !descriptionMatch.empty())
-                            found++;
-                    }
+                    if (index)
+                        index->state->insertPackage.use()
+                            (attrPath2)
+                            (name.name)
+                            (name.version)
+                            (description)
+                            .exec();
 
-                    if (found == res.size()) {
-                        results++;
-                        if (json) {
-                            auto jsonElem = jsonOut->object(attrPath2);
-                            jsonElem.attr("pname", name.name);
-                            jsonElem.attr("version", name.version);
-                            jsonElem.attr("description", description);
-                        } else {
-                            auto name2 = hilite(name.name, nameMatch, "\e[0;2m");
-                            if (results > 1) logger->cout("");
-                            logger->cout(
-                                "* %s%s",
-                                wrap("\e[0;1m", hilite(attrPath2, attrPathMatch, "\e[0;1m")),
-                                name.version != "" ? " (" + name.version + ")" : "");
-                            if (description != "")
-                                logger->cout(
-                                    "  %s", hilite(description, descriptionMatch, ANSI_NORMAL));
-                        }
-                    }
+                    showPackage(attrPath2, name, description);
                 }
 
                 else if (
@@ -168,6 +339,16 @@ struct CmdSearch : InstallableCommand, MixJSON
         for (auto & [cursor, prefix] : installable->getCursors(*state))
             visit(*cursor, parseAttrPath(*state, prefix), true);
 
+        if (txn) {
+            txn->commit();
+            txn.reset();
+            try {
+                index->install();
+            } catch (SysError &) {
+                ignoreException();
+            }
+        }
+
         if (!json && !results)
             throw Error("no results for the given search term(s)!");
     }
@@ -37,6 +37,16 @@ struct CmdStoreGC : StoreCommand, MixDryRun
         GCResults results;
         PrintFreed freed(options.action == GCOptions::gcDeleteDead, results);
         store->collectGarbage(options, results);
+        /* The freed size is only known if the store could mark all
+           live paths up front, so don't claim that nothing would be
+           freed when it couldn't. */
+        if (dryRun) {
+            if (results.bytesFreed || results.paths.empty())
+                notice("%d store paths would be deleted, freeing %s",
+                    results.paths.size(), showBytes(results.bytesFreed));
+            else
+                notice("%d store paths would be deleted", results.paths.size());
+        }
     }
 };
 
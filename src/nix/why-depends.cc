@@ -171,6 +171,13 @@ struct CmdWhyDepends : SourceExprCommand
                 hashes.insert(std::string(node2.path.hashPart()));
             }
 
+            /* Without --all, only the first hit for the closest
+               reference gets printed, so there is no need to look
+               any further once we've found it. */
+            if (!all && !refs.empty())
+                hashes = {std::string(refs.begin()->second->path.hashPart())};
+            bool done = false;
+
             /* For each reference, find the files and symlinks that
                contain the reference. */
             std::map<std::string, Strings> hits;
@@ -178,6 +185,8 @@ struct CmdWhyDepends : SourceExprCommand
             std::function<void(const Path &)> visitPath;
 
             visitPath = [&](const Path & p) {
+                if (done) return;
+
                 auto st = accessor->stat(p);
 
                 auto p2 = p == pathS ? "/" : std::string(p, pathS.size() + 1);
@@ -206,6 +215,7 @@ struct CmdWhyDepends : SourceExprCommand
                                             std::string(contents, pos2, pos - pos2 + hash.size() + margin)),
                                         pos - pos2, StorePath::HashLen,
                                         getColour(hash))));
+                            if (!all) done = true;
                         }
                     }
                 }
@@ -215,9 +225,11 @@ struct CmdWhyDepends : SourceExprCommand
 
                     for (auto & hash : hashes) {
                         auto pos = target.find(hash);
-                        if (pos != std::string::npos)
+                        if (pos != std::string::npos) {
                             hits[hash].emplace_back(fmt("%s -> %s\n", p2,
                                     hilite(target, pos, StorePath::HashLen, getColour(hash))));
+                            if (!all) done = true;
+                        }
                     }
                 }
             };
@@ -0,0 +1,51 @@
+# Evaluator benchmarks, run by ‘make bench’. Each expression in bench/
+# is evaluated $BENCH_RUNS times; we report the fastest CPU time and
+# the evaluator counters from ‘NIX_SHOW_STATS’. Set $NIXPKGS to a
+# pinned Nixpkgs tree to include bench/nixpkgs.nix. If $BENCH_OUT is
+# set, the statistics of each benchmark are written to it as a JSON
+# object, so that runs of different Nix versions can be compared.
+
+source common.sh
+
+export NIX_REMOTE=dummy://
+
+runs=${BENCH_RUNS:-5}
+statsFile=$TEST_ROOT/bench-stats.json
+results=()
+
+set +x
+
+printf '%-16s %10s %12s %12s %12s %12s %10s\n' \
+    benchmark cpuTime thunks calls primOpCalls lookups opUpdates
+
+for i in bench/*.nix; do
+    name=$(basename $i .nix)
+    args=()
+    if [[ $name = nixpkgs ]]; then
+        [[ -n $NIXPKGS ]] || continue
+        args=(--arg nixpkgs "$NIXPKGS")
+    fi
+
+    best=
+    for ((run = 0; run < runs; run++)); do
+        NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$statsFile \
+            nix-instantiate --eval --strict --readonly-mode "${args[@]}" $i > /dev/null
+        cpuTime=$(sed -n 's/.*"cpuTime": *\([^,]*\),.*/\1/p' $statsFile)
+        best=$(awk -v c=$cpuTime -v b="$best" 'BEGIN { print (b == "" || c < b) ? c : b }')
+    done
+
+    # The counters don't depend on the run, so take them from the last one.
+    read thunks calls primOps lookups updates < <(nix-instantiate --eval --strict -E "
+        with builtins.fromJSON (builtins.readFile $statsFile);
+        builtins.concatStringsSep \" \" (map toString
+          [ nrThunks nrFunctionCalls nrPrimOpCalls nrLookups nrOpUpdates ])" | tr -d '"')
+
+    printf '%-16s %10s %12s %12s %12s %12s %10s\n' \
+        $name $best $thunks $calls $primOps $lookups $updates
+
+    results+=("\"$name\": $(sed -e "s/\"cpuTime\": *[^,]*/\"cpuTime\": $best/" $statsFile)")
+done
+
+if [[ -n $BENCH_OUT ]]; then
+    (IFS=,; echo "{${results[*]}}") > $BENCH_OUT
+fi
@@ -0,0 +1,12 @@
+# Repeated attribute selection, including nested paths and `or'
+# defaults for missing attributes.
+let
+  attrs = builtins.listToAttrs (builtins.genList (i: {
+    name = "a${toString i}";
+    value = { x = { y = i; }; };
+  }) 1000);
+  names = builtins.attrNames attrs;
+in
+builtins.foldl' (acc: round:
+  builtins.foldl' (acc: n: acc + attrs.${n}.x.y + (attrs.${n}.z or 0)) acc names
+) 0 (builtins.genList (i: i) 200)
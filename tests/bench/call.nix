@@ -0,0 +1,10 @@
+# Calls to lambdas with plain arguments, attribute set patterns with
+# defaults, and curried functions.
+let
+  plain = x: x + 1;
+  pattern = { a, b ? 2, ... }: a + b;
+  curried = a: b: c: a + b + c;
+in
+builtins.foldl'
+  (acc: i: acc + plain i + pattern { a = i; } + pattern { a = i; b = 1; c = 0; } + curried i 1 2)
+  0 (builtins.genList (i: i) 200000)
@@ -0,0 +1,12 @@
+# Instantiating many derivations that depend on each other.
+let
+  mk = name: deps: derivation {
+    inherit name;
+    system = "x86_64-linux";
+    builder = "/bin/sh";
+    args = [ "-c" "echo ${toString deps} > $out" ];
+  };
+  chain = builtins.foldl' (acc: i: acc ++ [ (mk "drv-${toString i}" (builtins.tail acc)) ])
+    [ (mk "root" []) ] (builtins.genList (i: i) 200);
+in
+map (d: d.drvPath) chain
@@ -0,0 +1,10 @@
+# Parsing a large JSON document, and serialising it back.
+let
+  doc = builtins.toJSON (builtins.genList (i: {
+    id = i;
+    name = "item ${toString i}";
+    tags = [ "a" "b" "c" ];
+    nested = { value = i * 2; flag = i / 2 * 2 == i; };
+  }) 20000);
+in
+builtins.length (builtins.fromJSON doc)
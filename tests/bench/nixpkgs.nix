@@ -0,0 +1,15 @@
+# Instantiating a fixed set of packages from a Nixpkgs tree, passed in
+# as `nixpkgs'. Pin it (e.g. to a git revision) so that results can be
+# compared between Nix versions.
+{ nixpkgs, system ? "x86_64-linux" }:
+let
+  pkgs = import nixpkgs { inherit system; config = {}; overlays = []; };
+in
+map (p: pkgs.${p}.drvPath) [
+  "hello"
+  "coreutils"
+  "git"
+  "python3"
+  "perl"
+  "stdenv"
+]
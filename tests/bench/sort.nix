@@ -0,0 +1,5 @@
+# Sorting with a user-supplied comparator.
+let
+  xs = builtins.genList (i: i * 7919 - i * 7919 / 50021 * 50021) 50000;
+in
+builtins.head (builtins.sort (a: b: a < b) xs)
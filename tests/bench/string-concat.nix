@@ -0,0 +1,11 @@
+# String interpolation and concatenation of strings carrying context.
+let
+  drv = derivation {
+    name = "context";
+    system = "x86_64-linux";
+    builder = "/bin/sh";
+  };
+in
+builtins.stringLength (builtins.foldl'
+  (acc: i: "${acc}${drv}/bin/${toString i}:")
+  "" (builtins.genList (i: i) 5000))
@@ -0,0 +1,10 @@
+# Chains of `//' updates on small and large attribute sets.
+let
+  big = builtins.listToAttrs (builtins.genList (i: {
+    name = "a${toString i}";
+    value = i;
+  }) 5000);
+in
+builtins.length (builtins.attrNames (builtins.foldl'
+  (acc: i: acc // { "b${toString (builtins.div i 2)}" = i; } // big)
+  {} (builtins.genList (i: i) 200)))
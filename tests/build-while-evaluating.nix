@@ -0,0 +1,26 @@
+with import ./config.nix;
+
+rec {
+
+  a = mkDerivation {
+    name = "build-while-evaluating-a";
+    buildCommand = "echo a > $out";
+  };
+
+  b = mkDerivation {
+    name = "build-while-evaluating-b";
+    buildCommand = "echo b > $out";
+  };
+
+  # Depends on a, which may be built in an earlier batch.
+  c = mkDerivation {
+    name = "build-while-evaluating-c";
+    buildCommand = "echo c $(cat ${a}) > $out";
+  };
+
+  fail = mkDerivation {
+    name = "build-while-evaluating-fail";
+    buildCommand = "false";
+  };
+
+}
@@ -0,0 +1,21 @@
+source common.sh
+
+clearStore
+
+# Every installable is built, whichever batch it ends up in.
+nix build --option build-while-evaluating true -f build-while-evaluating.nix a b c --out-link $TEST_ROOT/result
+[[ $(cat $TEST_ROOT/result) = a ]]
+[[ $(cat $TEST_ROOT/result-1) = b ]]
+[[ $(cat $TEST_ROOT/result-2) = "c a" ]]
+
+outPaths=$(nix-build --option build-while-evaluating true build-while-evaluating.nix -A a -A b -A c --no-out-link)
+[[ $(echo "$outPaths" | wc -l) = 3 ]]
+
+clearStore
+
+# A failed build fails the command.
+(! nix build --option build-while-evaluating true -f build-while-evaluating.nix fail a --no-link)
+
+# With --keep-going, the builds after the failed one still happen.
+(! nix build --option build-while-evaluating true --keep-going -f build-while-evaluating.nix fail b --no-link)
+nix path-info -f build-while-evaluating.nix b
@@ -71,3 +71,8 @@ function-trace exited (string):1:1 at
 "
 
 set -e
+
+# Collapsed-stack profile
+nix-instantiate --eval --eval-profile-file $TEST_ROOT/profile \
+    --expr 'let f = x: builtins.add x 1; in f 1' > /dev/null
+grep -q '^f at (string):1:9;add [0-9]*$' $TEST_ROOT/profile || fail "profile doesn't contain the expected stack"
@@ -57,3 +57,28 @@ rm -f "$NIX_STATE_DIR"/gcroots/foo*
 nix-collect-garbage
 (! test -e $outPath1)
 (! test -e $outPath2)
+
+# A path that gets a live referrer after the collector marked the live
+# paths must not be deleted.
+syncFifo=$TEST_ROOT/gc-sync.fifo
+mkfifo "$syncFifo"
+
+echo foo > $TEST_ROOT/gc-reference
+reference=$(nix-store --add $TEST_ROOT/gc-reference)
+echo bar > $TEST_ROOT/gc-referrer
+referrer=$(nix-store --add $TEST_ROOT/gc-referrer)
+ln -s $referrer "$NIX_STATE_DIR"/gcroots/referrer
+
+_NIX_TEST_GC_SYNC=$syncFifo nix-collect-garbage &
+pid=$!
+
+# Wait for the mark phase, then add the reference.
+cat "$syncFifo"
+printf '%s\n\n1\n%s\n' $referrer $reference | nix-store --register-validity --reregister
+echo > "$syncFifo"
+wait $pid
+
+test -e $reference
+[[ $(nix-store -q --references $referrer) = $reference ]]
+
+rm -f "$NIX_STATE_DIR"/gcroots/referrer
@@ -0,0 +1,2 @@
+# Later occurrences of a key override earlier ones.
+builtins.fromJSON ''{ "b": 1, "a": [ 2, { "y": 3, "x": 4, "y": 5 } ], "b": 6 }''
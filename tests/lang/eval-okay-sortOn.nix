@@ -0,0 +1,9 @@
+with builtins;
+
+[ (sortOn (x: x) [ 483 249 526 147 42 77 ])
+  (sortOn (x: -x) [ 483 249 526 147 42 77 ])
+  (sortOn stringLength [ "foo" "bar" "xyzzy" "fnord" "a" ])
+  (sortOn (x: x.key)
+    [ { key = 1; value = "foo"; } { key = 2; value = "bar"; } { key = 1.5; value = "baz"; } { key = 1; value = "fnord"; } ])
+  (sortOn (x: x) [])
+]
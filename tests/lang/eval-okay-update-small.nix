@@ -0,0 +1,5 @@
+# Updating a large set with a small one.
+let
+  big = builtins.listToAttrs (map (n: { name = "a${toString n}"; value = n; }) (builtins.genList (x: x) 40));
+  r = big // { a5 = "five"; b = true; "0" = null; };
+in [ (builtins.attrNames r) r.a5 r.b r."0" r.a4 ]
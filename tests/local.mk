@@ -41,10 +41,12 @@ nix_tests = \
   post-hook.sh \
   ca/post-hook.sh \
   function-trace.sh \
+  repl.sh \
   recursive.sh \
   describe-stores.sh \
   flakes.sh \
   build.sh \
+  build-while-evaluating.sh \
   compute-levels.sh \
   ca/build.sh \
   ca/build-with-garbage-path.sh \
@@ -64,3 +66,9 @@ tests-environment = NIX_REMOTE= $(bash) -e
 clean-files += $(d)/common.sh $(d)/config.nix $(d)/ca/config.nix
 
 test-deps += tests/common.sh tests/config.nix tests/ca/config.nix tests/plugins/libplugintest.$(SO_EXT)
+
+.PHONY: bench
+bench: tests/bench.sh tests/store-bench.sh $(test-deps)
+	@cd tests && env $(tests-environment) init.sh > /dev/null 2>&1
+	@cd tests && env $(tests-environment) bench.sh
+	@cd tests && env $(tests-environment) store-bench.sh
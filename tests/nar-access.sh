@@ -54,3 +54,20 @@ if nix-store --dump $storePath >/dev/full ; then
     echo "dumping to /dev/full should fail"
     exit -1
 fi
+
+# Read a file from an uncompressed binary cache, which uses the file
+# offsets in the NAR listing to read only that file.
+cacheDir=$TEST_ROOT/nar-access-cache
+rm -rf $cacheDir
+nix copy --to "file://$cacheDir?compression=none&write-nar-listing=true" $storePath
+lsFile=$cacheDir/$(basename $storePath | cut -c1-32).ls
+grep -q narOffset $lsFile
+nix store cat --store file://$cacheDir $storePath/foo/data > data.cat-cache
+diff -u data.cat-cache $storePath/foo/data
+
+# A listing without offsets must not be used for partial reads.
+jq 'walk(if type == "object" then del(.narOffset) else . end)' < $lsFile > $lsFile.new
+mv $lsFile.new $lsFile
+(! grep -q narOffset $lsFile)
+nix store cat --store file://$cacheDir $storePath/foo/data > data.cat-cache
+diff -u data.cat-cache $storePath/foo/data
@@ -0,0 +1,58 @@
+source common.sh
+
+# `:reload` must pick up a loaded file that is rewritten in place within
+# the same second, with the same size and inode, and re-evaluate a
+# file whose imports or files read with readFile have changed.
+file=$TEST_ROOT/reload.nix
+echo '{ x = 1; y = import ./reload-dep.nix; z = builtins.readFile ./reload.txt; }' > $file
+echo '10' > $TEST_ROOT/reload-dep.nix
+echo -n '100' > $TEST_ROOT/reload.txt
+
+# The values printed by the repl, without colours, prompts or quotes.
+values() {
+    sed -e 's/\x1b\[[0-9;]*m//g' -e 's/^\(nix-repl> \)*//' -e 's/^"\(.*\)"$/\1/' $TEST_ROOT/repl.out | grep -x '[0-9][0-9]*' || true
+}
+
+# Wait until the repl has printed the given number of values.
+waitForValues() {
+    for ((i = 0; i < 600; i++)); do
+        [[ $(values | wc -l) -ge $1 ]] && return
+        sleep 0.1
+    done
+}
+
+rm -f $TEST_ROOT/repl.in
+mkfifo $TEST_ROOT/repl.in
+nix repl < $TEST_ROOT/repl.in > $TEST_ROOT/repl.out 2>&1 &
+pid=$!
+exec 3> $TEST_ROOT/repl.in
+
+echo ":l $file" >&3
+echo "x" >&3
+echo "y" >&3
+echo "z" >&3
+
+# Only rewrite the file once the repl has printed the first values.
+waitForValues 3
+[[ $(values) = $'1\n10\n100' ]] || fail "expected the repl to print 1, 10 and 100 before the rewrite"
+
+# Truncate and rewrite rather than replace, so the inode is kept.
+echo '{ x = 2; y = import ./reload-dep.nix; z = builtins.readFile ./reload.txt; }' 1<> $file
+echo ":r" >&3
+echo "x" >&3
+echo "y" >&3
+echo "z" >&3
+
+waitForValues 6
+[[ $(values) = $'1\n10\n100\n2\n10\n100' ]] || fail ":reload didn't see the rewritten file"
+
+# Now change only the files that reload.nix depends on.
+echo '20' 1<> $TEST_ROOT/reload-dep.nix
+echo -n '200' 1<> $TEST_ROOT/reload.txt
+echo ":r" >&3
+echo "y" >&3
+echo "z" >&3
+exec 3>&-
+wait $pid
+
+[[ $(values) = $'1\n10\n100\n2\n10\n100\n20\n200' ]] || fail ":reload didn't re-evaluate the file whose dependencies changed"
@@ -0,0 +1,103 @@
+# Store and serialisation benchmarks, run by ‘make bench’. Each
+# benchmark runs a single command on synthetic data of $BENCH_SIZE
+# MiB (default 64) and reports its wall-clock time and throughput.
+# Finally, the startup time of a few trivial commands is measured; if
+# $BENCH_STARTUP_BUDGET is set, the script fails if any of them takes
+# more than that many milliseconds on average.
+
+source common.sh
+
+clearStore
+
+set +x
+
+size=${BENCH_SIZE:-64}
+bytes=$((size * 1024 * 1024))
+
+printf '%-24s %10s %16s\n' benchmark seconds throughput
+
+# Run a command, and print the time it took and the rate at which it
+# processed $2 units of $3.
+bench() {
+    local name=$1 amount=$2 unit=$3
+    shift 3
+    local start=$EPOCHREALTIME
+    "$@" > /dev/null
+    local end=$EPOCHREALTIME
+    awk -v name=$name -v start=$start -v end=$end -v amount=$amount -v unit=$unit \
+        'BEGIN { t = end - start; printf "%-24s %10.3f %11.1f %s/s\n", name, t, amount / t, unit }'
+}
+
+# A tree of files of 64 KiB in directories of 64, and a single file,
+# both of $size MiB.
+tree=$TEST_ROOT/bench-tree
+for ((i = 0; i < size * 16; i++)); do
+    dir=$tree/$((i / 64))
+    mkdir -p $dir
+    head -c 65536 /dev/urandom > $dir/$i
+done
+file=$TEST_ROOT/bench-file
+head -c $bytes /dev/urandom > $file
+
+bench hash-path $size MiB nix hash path $tree
+bench hash-file $size MiB nix hash file $file
+bench dump-path $size MiB nix-store --dump $tree
+nix-store --dump $tree > $TEST_ROOT/bench-tree.nar
+bench restore-path $size MiB nix-store --restore $TEST_ROOT/bench-restored < $TEST_ROOT/bench-tree.nar
+bench add-path $size MiB nix-store --add $tree
+filePath=$(nix-store --add $file)
+
+# Builds scan their outputs for references to their inputs.
+bench scan-references $size MiB nix-build --no-out-link -E "
+  with import ./config.nix;
+  mkDerivation {
+    name = \"bench-scan\";
+    buildCommand = \"cat $filePath > \$out; echo ${filePath} >> \$out\";
+  }"
+
+for method in none xz bzip2 gzip zstd br; do
+    bench compress-$method $size MiB nix copy --to "file://$TEST_ROOT/bench-cache-$method?compression=$method" $filePath
+done
+
+# Writing and parsing derivations.
+drvs=$(nix-instantiate --eval --strict --json bench/derivation.nix)
+lastDrv=$(echo "$drvs" | tr -d '[]"' | tr , '\n' | tail -n1)
+bench parse-derivations 201 drvs nix show-derivation --recursive $lastDrv
+
+# Registering and querying many valid paths.
+nrPaths=10000
+for ((n = 0; n < nrPaths; n++)); do
+    storePath=$NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-bench-$n
+    echo -n > $storePath
+    echo $storePath; echo; echo 1; echo $filePath
+done > $TEST_ROOT/bench-reg-info
+bench register-validity $nrPaths paths nix-store --register-validity < $TEST_ROOT/bench-reg-info
+bench query-path-info $nrPaths paths nix path-info --all
+
+# Startup time of commands that do almost nothing else.
+startupRuns=100
+startupFailed=
+startup() {
+    local name=$1
+    shift
+    local start=$EPOCHREALTIME
+    for ((run = 0; run < startupRuns; run++)); do
+        "$@" > /dev/null
+    done
+    local end=$EPOCHREALTIME
+    local ms=$(awk -v start=$start -v end=$end -v runs=$startupRuns \
+        'BEGIN { printf "%.2f", (end - start) * 1000 / runs }')
+    printf '%-24s %10s %16s\n' startup-$name $ms ms/run
+    if [[ -n $BENCH_STARTUP_BUDGET ]] && awk -v ms=$ms -v budget=$BENCH_STARTUP_BUDGET 'BEGIN { exit !(ms > budget) }'; then
+        echo "startup-$name exceeds the budget of $BENCH_STARTUP_BUDGET ms" >&2
+        startupFailed=1
+    fi
+}
+
+startup version nix --version
+startup path-info nix path-info $filePath
+startup query-references nix-store -q --references $filePath
+startup eval nix-instantiate --eval -E 1
+startup eval-derivation nix-instantiate --eval -E '(derivation { name = "x"; system = "x"; builder = "x"; }).type'
+
+[[ -z $startupFailed ]]